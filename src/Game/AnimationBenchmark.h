@@ -0,0 +1,369 @@
+﻿#pragma once
+
+/*
+* Замер стоимости анимации персонажей на Data/Models/Character.gltf
+* Функции:
+* - последовательное проигрывание (ключи находятся по кешированным курсорам)
+* - случайный доступ по времени (бинарный поиск)
+* - эталон: прежний Animation::Update со строковой картой и линейным поиском ключей
+* - сжатие клипов: память до/после, максимальная ошибка и скорость выборки сжатого клипа
+* - Animator: переходы между клипами, слой с маской и аддитивный слой
+* - вычисление матриц скиннинга одним проходом по скелету
+* - AnimationWorld: от 1 до 1000 персонажей на 1..N потоках
+* - FootIK: постановка ног 100 персонажей на процедурный рельеф
+* - SpringBones: уши 250 персонажей как пружинные цепочки со столкновением с головой
+* Результаты выводятся в консоль.
+*/
+namespace AnimationBenchmarkUtils
+{
+	// the previous per-frame path: a string-keyed result map and a linear key scan from index 0 for every channel
+	inline std::unordered_map<std::string, std::pair<Transform, glm::vec3>> ReferenceUpdate(Animation& animation, float time)
+	{
+		auto timeFraction = [](const std::vector<float>& times, float dt) -> std::pair<size_t, float>
+			{
+				if (times.size() < 2) return { 0, 0.0f };
+				size_t seg = 1;
+				while (seg + 1 < times.size() && dt > times[seg]) seg++;
+				return { seg - 1, std::clamp((dt - times[seg - 1]) / (times[seg] - times[seg - 1]), 0.0f, 1.0f) };
+			};
+		auto sample = [](const auto& values, std::pair<size_t, float> f)
+			{
+				return values.size() > 1 ? glm::mix(values[f.first], values[f.first + 1], f.second) : values[0];
+			};
+
+		std::unordered_map<std::string, std::pair<Transform, glm::vec3>> actions;
+		for (auto& [name, keyframe] : animation.GetKeyframes())
+		{
+			if (keyframe.positions.empty() || keyframe.rotations.empty() || keyframe.scales.empty())
+				continue;
+
+			const glm::vec3 pos = sample(keyframe.positions, timeFraction(keyframe.posStamps, time));
+			const auto rotFraction = timeFraction(keyframe.rotStamps, time);
+			const glm::quat rot = keyframe.rotations.size() > 1
+				? glm::slerp(keyframe.rotations[rotFraction.first], keyframe.rotations[rotFraction.first + 1], rotFraction.second)
+				: keyframe.rotations[0];
+			const glm::vec3 scale = sample(keyframe.scales, timeFraction(keyframe.scaleStamps, time));
+			actions[name] = { Transform(pos, rot), scale };
+		}
+		return actions;
+	}
+
+	inline void PrintResult(const std::string& name, Time elapsed, size_t updates, size_t bones, float checksum)
+	{
+		const double nsPerUpdate = static_cast<double>(elapsed.AsMicroseconds()) * 1000.0 / static_cast<double>(updates);
+		Print("    " + name + ": " + std::to_string(nsPerUpdate) + " ns per character, "
+			+ std::to_string(nsPerUpdate / static_cast<double>(std::max<size_t>(bones, 1))) + " ns per bone (checksum " + std::to_string(checksum) + ")");
+	}
+}
+
+void AnimationBenchmark()
+{
+	Window::Create({});
+	Renderer::Init();
+
+	constexpr size_t characterCount = 256;
+	constexpr size_t frameCount = 600;
+	constexpr float frameTime = 1.0f / 60.0f;
+
+	// uncompressed, the reference path needs the source keyframes
+	ModelRef model{ new Model("Data/Models/Character.gltf", true, false) };
+	const size_t boneCount = model->GetBoneCount();
+	const std::vector<float> boneLengths = model->GetSkeleton().GetBoneLengths();
+
+	std::vector<BonePose> poses(boneCount * characterCount);
+	std::vector<AnimationCursor> cursors(characterCount);
+	std::mt19937 random(42);
+
+	for (auto& animation : model->GetAnimations())
+	{
+		const float duration = animation->GetDuration();
+		const float frameTicks = frameTime * animation->GetTPS();
+		std::uniform_real_distribution<float> randomTime(0.0f, duration);
+		std::vector<float> startTimes(characterCount);
+		for (auto& time : startTimes) time = randomTime(random);
+
+		Print("Animation '" + animation->GetName() + "': " + std::to_string(animation->GetTrackCount()) + " tracks, "
+			+ std::to_string(boneCount) + " bones, " + std::to_string(characterCount) + " characters x " + std::to_string(frameCount) + " frames");
+
+		// forward playback, keys are found through the cursors
+		{
+			float checksum = 0.0f;
+			Clock clock;
+			for (size_t frame = 0; frame < frameCount; frame++)
+			{
+				for (size_t i = 0; i < characterCount; i++)
+				{
+					const float time = std::fmod(startTimes[i] + frame * frameTicks, duration);
+					std::span<BonePose> pose(poses.data() + i * boneCount, boneCount);
+					animation->Sample(time, pose, cursors[i]);
+				}
+				checksum += poses[frame % poses.size()].position.x;
+			}
+			AnimationBenchmarkUtils::PrintResult("sequential", clock.GetElapsedTime(), frameCount * characterCount, boneCount, checksum);
+		}
+
+		// random times, every lookup falls back to the binary search
+		{
+			std::vector<float> times(frameCount * characterCount);
+			for (auto& time : times) time = randomTime(random);
+
+			float checksum = 0.0f;
+			Clock clock;
+			for (size_t frame = 0; frame < frameCount; frame++)
+			{
+				for (size_t i = 0; i < characterCount; i++)
+				{
+					std::span<BonePose> pose(poses.data() + i * boneCount, boneCount);
+					animation->Sample(times[frame * characterCount + i], pose, cursors[i]);
+				}
+				checksum += poses[frame % poses.size()].position.x;
+			}
+			AnimationBenchmarkUtils::PrintResult("random access", clock.GetElapsedTime(), frameCount * characterCount, boneCount, checksum);
+		}
+
+		// the string-map path that was used before the tracks were compiled, run on fewer frames because it is slow
+		{
+			constexpr size_t referenceFrames = frameCount / 10;
+			float checksum = 0.0f;
+			Clock clock;
+			for (size_t frame = 0; frame < referenceFrames; frame++)
+			{
+				for (size_t i = 0; i < characterCount; i++)
+				{
+					const float time = std::fmod(startTimes[i] + frame * frameTicks, duration);
+					auto actions = AnimationBenchmarkUtils::ReferenceUpdate(*animation, time);
+					if (!actions.empty()) checksum += actions.begin()->second.first.GetPosition().x;
+				}
+			}
+			AnimationBenchmarkUtils::PrintResult("reference (string map)", clock.GetElapsedTime(), referenceFrames * characterCount, boneCount, checksum);
+		}
+
+		// the same clip compressed with the default settings
+		{
+			Animation compressed = *animation;
+			compressed.Compress({}, boneLengths);
+			const size_t rawBytes = animation->GetMemoryUsage();
+			const size_t compressedBytes = compressed.GetMemoryUsage();
+			Print("    compressed: " + std::to_string(rawBytes) + " -> " + std::to_string(compressedBytes) + " bytes (x"
+				+ std::to_string(static_cast<double>(rawBytes) / static_cast<double>(std::max<size_t>(compressedBytes, 1))) + ")");
+
+			// local space error against the raw clip, rotations as the angle in degrees
+			std::vector<BonePose> rawPose(boneCount), compressedPose(boneCount);
+			AnimationCursor rawCursor, compressedCursor;
+			float maxPositionError = 0.0f, maxRotationError = 0.0f;
+			for (size_t frame = 0; frame < frameCount; frame++)
+			{
+				const float time = std::fmod(frame * frameTicks, duration);
+				animation->Sample(time, rawPose, rawCursor);
+				compressed.Sample(time, compressedPose, compressedCursor);
+				for (size_t bone = 0; bone < boneCount; bone++)
+				{
+					maxPositionError = std::max(maxPositionError, glm::distance(rawPose[bone].position, compressedPose[bone].position));
+					const float cosHalf = std::min(std::abs(glm::dot(rawPose[bone].orientation, compressedPose[bone].orientation)), 1.0f);
+					maxRotationError = std::max(maxRotationError, glm::degrees(2.0f * std::acos(cosHalf)));
+				}
+			}
+			Print("    compressed error: position " + std::to_string(maxPositionError) + ", rotation " + std::to_string(maxRotationError) + " deg");
+
+			float checksum = 0.0f;
+			Clock clock;
+			for (size_t frame = 0; frame < frameCount; frame++)
+			{
+				for (size_t i = 0; i < characterCount; i++)
+				{
+					const float time = std::fmod(startTimes[i] + frame * frameTicks, duration);
+					std::span<BonePose> pose(poses.data() + i * boneCount, boneCount);
+					compressed.Sample(time, pose, cursors[i]);
+				}
+				checksum += poses[frame % poses.size()].position.x;
+			}
+			AnimationBenchmarkUtils::PrintResult("compressed sequential", clock.GetElapsedTime(), frameCount * characterCount, boneCount, checksum);
+		}
+	}
+
+	// locomotion crossfades on the base layer, an override layer on half of the skeleton and an additive layer on top
+	if (!model->GetAnimations().empty() && boneCount > 0)
+	{
+		const auto& clips = model->GetAnimations();
+		std::vector<AnimatorRef> animators(characterCount);
+		for (auto& animator : animators)
+		{
+			animator = std::make_shared<Animator>(*model);
+			const uint32_t base = animator->AddLayer();
+			for (size_t i = 0; i < clips.size(); i++)
+			{
+				const uint32_t state = animator->AddState(base, clips[i]->GetName(), clips[i]);
+				animator->AddTransition(base, state, static_cast<uint32_t>((i + 1) % clips.size()), 0.25f, "next");
+			}
+			// no bone names are known for this file, the branch in the middle of the skeleton stands in for the upper body
+			BoneMask upperBody;
+			upperBody.SetBranch(model->GetSkeleton(), static_cast<uint32_t>(boneCount / 2), 1.0f);
+			animator->AddState(animator->AddLayer(Animator::LayerMode::Override, upperBody, 0.7f), "upper", clips.back());
+			animator->AddState(animator->AddLayer(Animator::LayerMode::Additive, {}, 0.5f), "additive", clips.front());
+		}
+
+		float checksum = 0.0f;
+		Clock clock;
+		for (size_t frame = 0; frame < frameCount; frame++)
+		{
+			for (size_t i = 0; i < characterCount; i++)
+			{
+				if ((frame + i) % 90 == 0) animators[i]->SetTrigger("next");
+				std::span<BonePose> pose(poses.data() + i * boneCount, boneCount);
+				animators[i]->Update(frameTime, pose);
+			}
+			checksum += poses[frame % poses.size()].position.x;
+		}
+		Print("Animator: 3 layers, " + std::to_string(clips.size()) + " states on the base layer");
+		AnimationBenchmarkUtils::PrintResult("blend", clock.GetElapsedTime(), frameCount * characterCount, boneCount, checksum);
+	}
+
+	// local pose -> model space -> skinning matrices
+	{
+		Skeleton skeleton = model->GetSkeleton();
+		std::vector<glm::mat4> palette(std::max<size_t>(skeleton.GetPaletteSize(), 1));
+
+		float checksum = 0.0f;
+		Clock clock;
+		for (size_t frame = 0; frame < frameCount; frame++)
+		{
+			for (size_t i = 0; i < characterCount; i++)
+			{
+				skeleton.MarkDirty();
+				skeleton.Evaluate(palette.data());
+			}
+			checksum += palette[frame % palette.size()][3].x;
+		}
+		Print("Skeleton: " + std::to_string(skeleton.GetBoneCount()) + " bones" + (NANO_SSE ? " (SSE)" : " (scalar)"));
+		AnimationBenchmarkUtils::PrintResult("evaluate", clock.GetElapsedTime(), frameCount * characterCount, boneCount, checksum);
+	}
+
+	// the whole per-frame update of a crowd (sample + evaluate) with compressed clips, by crowd size and thread count
+	if (!model->GetAnimations().empty())
+	{
+		ModelRef crowdModel{ new Model("Data/Models/Character.gltf") };
+		const size_t clipCount = crowdModel->GetAnimations().size();
+		constexpr size_t sweepFrames = 120;
+		const uint32_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+		std::vector<uint32_t> threadCounts;
+		for (uint32_t threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+		threadCounts.push_back(maxThreads);
+
+		Print("AnimationWorld: " + std::to_string(boneCount) + " bones, " + std::to_string(sweepFrames) + " frames");
+		for (const uint32_t threads : threadCounts)
+		{
+			// the calling thread takes part in ParallelFor, so one thread needs no workers
+			if (threads > 1) JobSystem::Init(threads - 1);
+
+			for (const size_t instanceCount : { 1, 10, 100, 250, 500, 1000 })
+			{
+				std::vector<std::unique_ptr<ModelInstance>> instances;
+				AnimationWorld animationWorld;
+				std::uniform_real_distribution<float> randomStart(0.0f, 1.0f);
+				for (size_t i = 0; i < instanceCount; i++)
+				{
+					auto& instance = instances.emplace_back(std::make_unique<ModelInstance>(*crowdModel));
+					const int clip = static_cast<int>(i % clipCount);
+					instance->SetAnimation(clip, randomStart(random) * crowdModel->GetAnimations()[clip]->GetDuration());
+					animationWorld.Add(*instance);
+				}
+				animationWorld.Update(frameTime);
+
+				float checksum = 0.0f;
+				Clock clock;
+				for (size_t frame = 0; frame < sweepFrames; frame++)
+				{
+					animationWorld.Update(frameTime);
+					const auto palette = animationWorld.GetDrawItems()[frame % instanceCount].palette;
+					if (!palette.empty()) checksum += palette[0][3].x;
+				}
+				const Time elapsed = clock.GetElapsedTime();
+				Print("    " + std::to_string(threads) + " threads, " + std::to_string(instanceCount) + " characters: "
+					+ std::to_string(static_cast<double>(elapsed.AsMicroseconds()) / static_cast<double>(sweepFrames)) + " us per frame");
+				AnimationBenchmarkUtils::PrintResult("    update", elapsed, sweepFrames * instanceCount, boneCount, checksum);
+			}
+			JobSystem::Close();
+		}
+
+		// foot planting of a crowd on rolling ground, the ground query evaluates the height function for every ray
+		FootIK footIK(*crowdModel, "Body", { "UpperLeg.L", "LowerLeg.L", "Foot.L", "PoleTarget.L" }, { "UpperLeg.R", "LowerLeg.R", "Foot.R", "PoleTarget.R" });
+		if (footIK.IsValid())
+		{
+			JobSystem::Init(maxThreads > 1 ? maxThreads - 1 : 0);
+			auto height = [](float x, float z) { return 0.4f * std::sin(x * 0.7f) + 0.3f * std::cos(z * 0.5f); };
+			const GroundQuery ground = [&](std::span<const glm::vec3> origins, float maxDistance, std::span<GroundHit> hits)
+				{
+					for (size_t i = 0; i < origins.size(); i++)
+					{
+						const glm::vec3& origin = origins[i];
+						const float y = height(origin.x, origin.z);
+						const glm::vec3 normal = glm::normalize(glm::vec3(-0.28f * std::cos(origin.x * 0.7f), 1.0f, 0.15f * std::sin(origin.z * 0.5f)));
+						hits[i] = { glm::vec3(origin.x, y, origin.z), normal, origin.y - y >= 0.0f && origin.y - y <= maxDistance };
+					}
+				};
+
+			constexpr size_t plantedCount = 100;
+			std::vector<std::unique_ptr<ModelInstance>> instances;
+			AnimationWorld animationWorld;
+			for (size_t i = 0; i < plantedCount; i++)
+			{
+				auto& instance = instances.emplace_back(std::make_unique<ModelInstance>(*crowdModel));
+				instance->SetAnimation(static_cast<int>(i % clipCount));
+				const float x = static_cast<float>(i % 10) * 3.0f;
+				const float z = static_cast<float>(i / 10) * 3.0f;
+				animationWorld.Add(*instance, glm::translate(glm::mat4(1.0f), glm::vec3(x, height(x, z), z)));
+			}
+
+			int64_t solveMicroseconds = 0;
+			uint32_t solvedLegs = 0;
+			animationWorld.SetPoseStage([&](std::span<const IKCharacter> characters)
+				{
+					Clock solveClock;
+					solvedLegs += footIK.Solve(characters, ground);
+					solveMicroseconds += solveClock.GetElapsedTime().AsMicroseconds();
+				});
+			for (size_t frame = 0; frame < sweepFrames; frame++)
+				animationWorld.Update(frameTime);
+			Print("FootIK: " + std::to_string(plantedCount) + " characters, " + std::to_string(solvedLegs / sweepFrames) + " planted legs, "
+				+ std::to_string(static_cast<double>(solveMicroseconds) / static_cast<double>(sweepFrames)) + " us per frame");
+			JobSystem::Close();
+		}
+
+		// secondary motion of the ears of a crowd, two chains per character that collide with the head
+		SpringBones springBones(*crowdModel);
+		const std::string leftEar[] = { "Ear1.L", "Ear2.L", "Ear3.L" };
+		const std::string rightEar[] = { "Ear1.R", "Ear2.R", "Ear3.R" };
+		if (springBones.AddChain(leftEar) && springBones.AddChain(rightEar) && springBones.AddCapsule("Neck", "Head", 0.15f))
+		{
+			JobSystem::Init(maxThreads > 1 ? maxThreads - 1 : 0);
+			constexpr size_t springCount = 250;
+			std::vector<std::unique_ptr<ModelInstance>> instances;
+			AnimationWorld animationWorld;
+			for (size_t i = 0; i < springCount; i++)
+			{
+				auto& instance = instances.emplace_back(std::make_unique<ModelInstance>(*crowdModel));
+				instance->SetAnimation(static_cast<int>(i % clipCount));
+				animationWorld.Add(*instance, glm::translate(glm::mat4(1.0f), glm::vec3(static_cast<float>(i % 16) * 2.0f, 0.0f, static_cast<float>(i / 16) * 2.0f)));
+			}
+
+			int64_t simulateMicroseconds = 0;
+			uint32_t simulatedChains = 0;
+			animationWorld.SetPoseStage([&](std::span<const IKCharacter> characters)
+				{
+					Clock simulateClock;
+					simulatedChains += springBones.Simulate(characters, frameTime);
+					simulateMicroseconds += simulateClock.GetElapsedTime().AsMicroseconds();
+				});
+			for (size_t frame = 0; frame < sweepFrames; frame++)
+				animationWorld.Update(frameTime);
+			Print("SpringBones: " + std::to_string(springCount) + " characters, " + std::to_string(simulatedChains / sweepFrames) + " chains, "
+				+ std::to_string(static_cast<double>(simulateMicroseconds) / static_cast<double>(sweepFrames)) + " us per frame");
+			JobSystem::Close();
+		}
+	}
+
+	model.reset();
+	Renderer::Close();
+	Window::Destroy();
+}
@@ -9,6 +9,7 @@ void Example00X()
 	Window::Create({});
 	Renderer::Init();
 	IMGUI::Init();
+	JobSystem::Init();
 
 	float lastFrameTime = static_cast<float>(glfwGetTime());
 
@@ -18,6 +19,8 @@ void Example00X()
 	Camera camera;
 	camera.Set({ 0.0f, 0.3f, -1.0f });
 
+	AnimationLODStats animationStats;
+
 	bool enableShadows = true;
 	bool drawPointLights = false;
 	bool showDepthMap = false;
@@ -62,6 +65,11 @@ void Example00X()
 	UtilsExample::PointsLightingPassFB pointsLightingPassFB;
 	pointsLightingPassFB.Create(Window::GetWidth(), Window::GetHeight());
 
+	// fragments per pixel of one pass instead of the lit frame: 0 off, 1 GBuffer, 2 point lights
+	int overdrawPass = 0;
+	int overdrawMaxCount = 8;
+	OverdrawView overdraw(Window::GetWidth(), Window::GetHeight());
+
 	GLVertexArrayRef VAOEmpty{ new GLVertexArray };
 
 	ModelRef model{ new Model("Data/Models/sponza/sponza.obj") };
@@ -70,6 +78,43 @@ void Example00X()
 	ModelRef rabitModel{ new Model("Data/Models/Character.gltf") };
 	rabitModel->DefaultPose();
 
+	World world;
+	auto createModelEntity = [&world](const ModelRef& model, const glm::vec3& position, const glm::vec3& scale)
+		{
+			TransformComponent transform;
+			transform.position = position;
+			transform.scale = scale;
+			BoundsComponent bounds;
+			bounds.local = model->GetBounding();
+			return world.Create(transform, WorldMatrixComponent{}, bounds, VisibilityComponent{}, RenderComponent{ model.get() });
+		};
+	createModelEntity(model, glm::vec3(0.0f), glm::vec3(1.0f));
+	createModelEntity(model2, glm::vec3(0.0f, -2.0f, 0.0f), glm::vec3(0.2f));
+
+	// a crowd sharing one model, each character has its own pose and the whole crowd is one instanced draw per mesh.
+	// Far from the camera the characters play the baked clips instead
+	VertexAnimation rabitBake(*rabitModel);
+	std::vector<std::unique_ptr<ModelInstance>> rabitInstances;
+	for (int x = 0; x < 4; x++)
+	{
+		for (int z = 0; z < 4; z++)
+		{
+			auto& instance = rabitInstances.emplace_back(std::make_unique<ModelInstance>(*rabitModel));
+			instance->SetAnimation(0, static_cast<float>(x * 4 + z) * 3.0f);
+			Entity rabit = createModelEntity(rabitModel, glm::vec3(-10.0f + x * 1.5f, -2.8f, 4.0f + z * 1.5f), glm::vec3(1.02f));
+			world.Get<RenderComponent>(rabit)->instance = instance.get();
+			world.Add(rabit, AnimatorComponent{ rabitModel.get(), instance.get() });
+			world.Add(rabit, VertexAnimationComponent{ &rabitBake, instance.get() });
+		}
+	}
+
+	std::vector<DrawItem> shadowDrawList;
+	std::vector<DrawItem> drawList;
+	DrawBatcher drawBatcher;
+	std::vector<VertexAnimationItem> shadowBakedList;
+	std::vector<VertexAnimationItem> bakedList;
+	VertexAnimationRenderer bakedRenderer;
+
 	auto sphereVao = (*sphereModel)[0]->GetVAO();
 	GLBufferRef instanceBuffer{ new GLBuffer(instanceData) };
 	// TODO
@@ -126,10 +171,12 @@ void Example00X()
 			gbuffer->Resize(Window::GetWidth(), Window::GetHeight());
 			lightingPassFB.Resize(Window::GetWidth(), Window::GetHeight());
 			pointsLightingPassFB.Resize(Window::GetWidth(), Window::GetHeight());
+			overdraw.Resize(Window::GetWidth(), Window::GetHeight());
 		}
 
 		// Update
 		{
+			NANO_PROFILE_ZONE("Update");
 			auto change = Mouse::GetDelta();
 
 			if (Keyboard::IsPressed(GLFW_KEY_W)) camera.Move(Camera::Forward, deltaTime);
@@ -146,6 +193,13 @@ void Example00X()
 			{
 				Mouse::SetCursorMode(Mouse::CursorMode::Normal);
 			}
+
+			Systems::UpdateTransforms(world);
+			Systems::SwitchVertexAnimations(world, { camera.position, 12.0f, 0.1f, currentFrame });
+			// visibility and bounds are from the previous frame, the frustum test runs with the render
+			animationStats = Systems::UpdateAnimations(world, { camera.position, perspective[1][1] });
+			Systems::UpdateAnimatedBounds(world);
+			Systems::UpdateBounds(world);
 		}
 
 #pragma region imgui
@@ -153,12 +207,22 @@ void Example00X()
 		{
 			ImGui::Begin((const char*)u8"Тест");
 			ImGui::Text((const char*)u8"Test/Тест/%s", u8"тест 2");
+			ImGui::Text("Animation: %u full, %u reduced, %u culled, %u bones", animationStats.fullRate, animationStats.reducedRate, animationStats.culled, animationStats.evaluatedBones);
+			ImGui::Text("Baked: %u", bakedRenderer.GetInstanceCount());
+			ImGui::Combo("Overdraw", &overdrawPass, "Off\0GBuffer\0Point lights\0");
+			ImGui::SliderInt("Overdraw max", &overdrawMaxCount, 2, 64);
 			ImGui::End();
+			GPUProfiler::DrawImGui();
+			CPUProfiler::DrawImGui();
+			GLStats::DrawImGui();
+			FlightRecorder::DrawImGui();
 		}
 #pragma endregion
 
 #pragma region render
+		GPUProfiler::BeginFrame();
 		glEnable(GL_DEPTH_TEST);
+		drawBatcher.BeginFrame();
 
 		// SHADOW STAGE
 		// 1. render depth of scene to texture (from light's perspective)
@@ -166,6 +230,8 @@ void Example00X()
 		glm::mat4 lightProjection, lightView;
 		glm::mat4 lightSpaceMatrix;
 		{
+			GPUProfiler::Scope gpuScope("Shadow");
+			NANO_PROFILE_ZONE("Shadow");
 			simpleShadowMapFB.Bind();
 
 			if (enableShadows) 
@@ -182,16 +248,18 @@ void Example00X()
 
 				// DRAW MODEL
 				{
-					simpleShadowMapFB.program->SetVertexUniform(1, glm::mat4(1.0f));
-					model->Draw(simpleShadowMapFB.program);
-
-					glm::mat4 modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
-					glm::mat4 modelScale = glm::scale(modelTranslate, glm::vec3(0.2f));
-					simpleShadowMapFB.program->SetVertexUniform(1, modelScale);
-					model2->Draw(simpleShadowMapFB.program);
-
-					modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.65f, 0.0f));
-					modelScale = glm::scale(modelTranslate, glm::vec3(10.0f));
+					Systems::UpdateVisibility(world, Frustum(lightSpaceMatrix));
+					Systems::SubmitDraws(world, shadowDrawList);
+					drawBatcher.Prepare(shadowDrawList);
+					simpleShadowMapFB.program->SetVertexUniform(2, true);
+					drawBatcher.Draw(simpleShadowMapFB.program);
+					Systems::SubmitVertexAnimations(world, shadowBakedList);
+					bakedRenderer.Prepare(shadowBakedList);
+					bakedRenderer.Draw(simpleShadowMapFB.program, currentFrame);
+					simpleShadowMapFB.program->SetVertexUniform(2, false);
+
+					glm::mat4 modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.65f, 0.0f));
+					glm::mat4 modelScale = glm::scale(modelTranslate, glm::vec3(10.0f));
 					simpleShadowMapFB.program->SetVertexUniform(1, modelScale);
 					quad->Draw();
 
@@ -204,41 +272,42 @@ void Example00X()
 					modelScale = glm::scale(modelTranslate, glm::vec3(1.5f));
 					simpleShadowMapFB.program->SetVertexUniform(1, modelScale);
 					sphere->Draw();
-
-					modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(-10.0f, -2.8f, 4.0f));
-					modelScale = glm::scale(modelTranslate, glm::vec3(1.02f));
-					simpleShadowMapFB.program->SetVertexUniform(1, modelScale);
-					rabitModel->Draw(simpleShadowMapFB.program);
 				}
 			}
 		}
 
 		// 2. geometry pass: render scene's geometry/color data into gbuffer
 		{
+			GPUProfiler::Scope gpuScope("GBuffer");
+			NANO_PROFILE_ZONE("GBuffer");
 			glDisable(GL_BLEND);
 			glEnable(GL_DEPTH_TEST);
 
+			gbuffer->SetDebugFeatures(overdrawPass == 1 ? ShaderFeature::OVERDRAW : ShaderFeature::NONE);
+			if (overdrawPass == 1) overdraw.Begin();
 			gbuffer->BindForWriting();
 			gbuffer->GetProgram()->SetVertexUniform(0, perspective);
 			gbuffer->GetProgram()->SetVertexUniform(1, camera.GetViewMatrix());
-			gbuffer->GetProgram()->SetVertexUniform(2, glm::mat4(1.0f));
 
+			Systems::UpdateVisibility(world, Frustum(perspective * camera.GetViewMatrix()));
+			Systems::SubmitDraws(world, drawList);
+			const glm::vec4 sponzaSpecular = glm::vec4(0.5f, 0.5f, 0.5f, 0.8f);
+			const glm::vec4 modelSpecular = glm::vec4(1.0f, 1.0f, 1.0f, 0.8f);
+			drawBatcher.Prepare(drawList);
+			gbuffer->GetProgram()->SetVertexUniform(3, true);
+			drawBatcher.Draw(gbuffer->GetProgram(), [&](const Model& drawModel)
+				{
+					gbuffer->GetProgram()->SetFragmentUniform(0, &drawModel == model.get() ? sponzaSpecular : modelSpecular);
+				});
+			Systems::SubmitVertexAnimations(world, bakedList);
+			bakedRenderer.Prepare(bakedList);
+			bakedRenderer.Draw(gbuffer->GetProgram(), currentFrame, [&](const Model&)
+				{
+					gbuffer->GetProgram()->SetFragmentUniform(0, modelSpecular);
+				});
 
-			gbuffer->GetProgram()->SetVertexUniform(3, !model->GetBones().empty());
-			glm::vec4 sponzaSpecular = glm::vec4(0.5f, 0.5f, 0.5f, 0.8f);
-			gbuffer->GetProgram()->SetFragmentUniform(0, sponzaSpecular);
-			model->Draw(gbuffer->GetProgram());
-				
-			glm::mat4 modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
-			glm::mat4 modelScale = glm::scale(modelTranslate, glm::vec3(0.2f));
-			gbuffer->GetProgram()->SetVertexUniform(2, modelScale);
-			gbuffer->GetProgram()->SetVertexUniform(3, !model2->GetBones().empty());
-			glm::vec4 modelSpecular = glm::vec4(1.0f, 1.0f, 1.0f, 0.8f);
-			gbuffer->GetProgram()->SetFragmentUniform(0, modelSpecular);
-			model2->Draw(gbuffer->GetProgram());
-
-			modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.65f, 0.0f));
-			modelScale = glm::scale(modelTranslate, glm::vec3(10.0f));
+			glm::mat4 modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.65f, 0.0f));
+			glm::mat4 modelScale = glm::scale(modelTranslate, glm::vec3(10.0f));
 			gbuffer->GetProgram()->SetVertexUniform(2, modelScale);
 			gbuffer->GetProgram()->SetVertexUniform(3, false);
 			quad->Draw();
@@ -254,22 +323,14 @@ void Example00X()
 			gbuffer->GetProgram()->SetVertexUniform(2, modelScale);
 			gbuffer->GetProgram()->SetVertexUniform(3, false);
 			sphere->Draw();
-
-			modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(-10.0f, -2.8f, 4.0f));
-			modelScale = glm::scale(modelTranslate, glm::vec3(1.02f));
-			gbuffer->GetProgram()->SetVertexUniform(2, modelScale);			
-
-			gbuffer->GetProgram()->SetVertexUniform(3, !rabitModel->GetBones().empty());
-			if (!rabitModel->GetPose().empty())
-				gbuffer->GetProgram()->SetVertexUniform(4, rabitModel->GetPose());		
-
-			rabitModel->UpdateAnim();
-			rabitModel->Draw(gbuffer->GetProgram());
+			if (overdrawPass == 1) overdraw.End();
 		}
 
 		// 3. lighting pass: calculate lighting by iterating over a screen filled quad pixel-by-pixel using the gbuffer's content and shadow map
 		//if (gBufferMode == 0) // если цифра, то дебажный режим для вывода выбранной текстуры из gbuffer
 		{
+			GPUProfiler::Scope gpuScope("Lighting");
+			NANO_PROFILE_ZONE("Lighting");
 			glEnable(GL_BLEND);
 			glDisable(GL_DEPTH_TEST);
 			glDepthMask(GL_FALSE);
@@ -298,13 +359,17 @@ void Example00X()
 		// 3.5 lighting pass: render point lights on top of main scene with additive blending and utilizing G-Buffer for lighting.
 		//if (gBufferMode == 0)
 		{
+			GPUProfiler::Scope gpuScope("Point lights");
+			NANO_PROFILE_ZONE("Point lights");
 			glEnable(GL_CULL_FACE);
 			glFrontFace(GL_CW); // TODO: чтобы не рисовало сзади?
 			//glDisable(GL_DEPTH_TEST);
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_ONE, GL_ONE);
 
+			pointsLightingPassFB.SetOverdraw(overdrawPass == 2);
 			pointsLightingPassFB.Bind();
+			if (overdrawPass == 2) overdraw.Begin();
 			Renderer::BlitFrameBuffer(lightingPassFB.fbo, pointsLightingPassFB.fbo,
 				0, 0, Window::GetWidth(), Window::GetHeight(),
 				0, 0, Window::GetWidth(), Window::GetHeight(),
@@ -322,6 +387,7 @@ void Example00X()
 			// draw instances
 			sphereVao->Bind();
 			glDrawElementsInstanced(GL_TRIANGLES, 2280, GL_UNSIGNED_INT, 0, totalLights);
+			if (overdrawPass == 2) overdraw.End();
 
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 			glFrontFace(GL_CCW);
@@ -332,20 +398,29 @@ void Example00X()
 
 		// Main frame
 		{
+			GPUProfiler::Scope gpuScope("Blit");
+			NANO_PROFILE_ZONE("Blit");
 			glDisable(GL_DEPTH_TEST);
 			Renderer::MainFrameBuffer();
 			Renderer::BlitFrameBuffer(pointsLightingPassFB.fbo, nullptr,
 				0, 0, Window::GetWidth(), Window::GetHeight(),
 				0, 0, Window::GetWidth(), Window::GetHeight(),
 				GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			if (overdrawPass != 0)
+				overdraw.Draw(static_cast<uint32_t>(overdrawMaxCount));
 
 
 
 
 		}
 
-		IMGUI::Draw();
+		{
+			GPUProfiler::Scope gpuScope("ImGui");
+			NANO_PROFILE_ZONE("ImGui");
+			IMGUI::Draw();
+		}
 
+		GPUProfiler::EndFrame();
 		Window::Swap();
 #pragma endregion
 	}
@@ -353,6 +428,7 @@ void Example00X()
 	gbuffer.reset();
 	lightingPassFB.Destroy();
 
+	JobSystem::Close();
 	IMGUI::Close();
 	Renderer::Close();
 	Window::Destroy();
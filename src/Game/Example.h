@@ -18,12 +18,14 @@ namespace UtilsExample
 
 
 #pragma region VertexShader
-			const char* vertSource = // vertex shader:
+			const std::string vertSource = // vertex shader:
 				R"(
 #version 460 core
 
 // -----------  Per vertex  -----------
 layout (location = 0) in vec3 aPosition;
+layout (location = 6) in vec4 ids;
+layout (location = 7) in vec4 weights;
 
 // --------- Output Variables ---------
 out gl_PerVertex { vec4 gl_Position; };
@@ -32,10 +34,28 @@ out vec4 position;
 // ------------- Uniform --------------
 layout (location = 0) uniform mat4 uLightSpaceMatrix;
 layout (location = 1) uniform mat4 uWorldMatrix;
+// world matrix and skinning from the DrawInstances buffer instead of uWorldMatrix, see DrawBatcher
+layout (location = 2) uniform bool uInstanced;
 
+)" + std::string(GetDrawInstanceVertexShaderSource()) + R"(
 void main()
-{	
-	gl_Position = uLightSpaceMatrix * uWorldMatrix * vec4(aPosition, 1.0);
+{
+	mat4 world = uWorldMatrix;
+	vec4 pos = vec4(aPosition, 1.0);
+	if (uInstanced)
+	{
+		DrawInstance instance = instances[gl_BaseInstance + gl_InstanceID];
+		world = instance.world;
+		vec3 normal = vec3(0.0);
+		if (uVertexAnimation != 0)
+			vertexAnimation(instance, pos, normal);
+		else if (instance.skinnedBase != 0xFFFFFFFFu)
+			pos = skinned[instance.skinnedBase + uMeshVertexOffset + gl_VertexID].position;
+		else if (instance.boneCount > 0)
+			pos = paletteSkinning(instance.paletteBase) * pos;
+	}
+
+	gl_Position = uLightSpaceMatrix * world * pos;
 	position = gl_Position;
 }
 )";
@@ -92,7 +112,15 @@ void main()
 		void BindForWriting();
 		void BindForReading();
 
+		// the variant with all vertex paths, for DrawBatcher and the simple meshes
 		GLProgramPipelineRef GetProgram();
+		// builds the variants of the meshes of a model while it loads
+		void Prepare(Model& model);
+		// draws every mesh with the variant of its features, setUniforms is called for each variant that is used
+		void Draw(Model& model, const std::function<void(const GLProgramPipelineRef&)>& setUniforms);
+
+		// features added to every variant, e.g. ShaderFeature::OVERDRAW
+		void SetDebugFeatures(ShaderFeatures features);
 
 	private:
 		GLFramebufferRef m_fbo = nullptr;
@@ -103,7 +131,9 @@ void main()
 		GLTexture2DRef m_specular = nullptr;
 		GLTexture2DRef m_depth = nullptr;
 
+		std::unique_ptr<ShaderPermutations> m_permutations;
 		GLProgramPipelineRef m_program = nullptr;
+		ShaderFeatures m_debugFeatures = ShaderFeature::NONE;
 
 		int m_width = 0;
 		int m_height = 0;
@@ -116,8 +146,9 @@ void main()
 		Resize(width, height);
 
 #pragma region VertexShader
-		const char* vertSource = R"(
+		const std::string vertSource = R"(
 #version 460 core
+#pragma features SKINNED
 
 // -----------  Per vertex  -----------
 layout (location = 0) in vec3 aPosition;
@@ -152,28 +183,51 @@ layout (location = 0) uniform mat4 uProjectionMatrix;
 layout (location = 1) uniform mat4 uViewMatrix;
 layout (location = 2) uniform mat4 uWorldMatrix;
 
-layout (location = 3) uniform bool bones;
-layout (location = 4) uniform mat4 pose[64];
-
+// world matrix and skinning from the DrawInstances buffer instead of uWorldMatrix, see DrawBatcher
+layout (location = 3) uniform bool uInstanced;
 
+)" + std::string(GetDrawInstanceVertexShaderSource()) + R"(
 void main()
 {	
 	vec4 pos = vec4(aPosition, 1.0);
+	vec3 normal = aNormal;
+	vec3 tangent = aTangent;
+	mat4 world = uWorldMatrix;
 
-	if(bones)
+	if (uInstanced)
 	{
-		mat4 transform = mat4(0.0);
-		transform += pose[int(ids.x)] * weights.x;
-		pos = transform * pos;
+		DrawInstance instance = instances[gl_BaseInstance + gl_InstanceID];
+		world = instance.world;
+		if (uVertexAnimation != 0)
+		{
+			vertexAnimation(instance, pos, normal);
+		}
+		else if (instance.skinnedBase != 0xFFFFFFFFu)
+		{
+			// skinned once per frame by the compute pass of DrawBatcher
+			SkinnedVertex vertex = skinned[instance.skinnedBase + uMeshVertexOffset + gl_VertexID];
+			pos = vertex.position;
+			normal = vertex.normal.xyz;
+			tangent = vertex.tangent.xyz;
+		}
+#if defined(SKINNED)
+		else if (instance.boneCount > 0)
+		{
+			const mat4 transform = paletteSkinning(instance.paletteBase);
+			pos = transform * pos;
+			normal = mat3(transform) * normal;
+			tangent = mat3(transform) * tangent;
+		}
+#endif
 	}
 
-	vec4 worldPosition = uWorldMatrix * pos;
-	mat3 worldNormal = transpose(inverse(mat3(uWorldMatrix)));
-	vec4 worldTangent = uWorldMatrix * vec4(aTangent, 0.0);
+	vec4 worldPosition = world * pos;
+	mat3 worldNormal = transpose(inverse(mat3(world)));
+	vec4 worldTangent = world * vec4(tangent, 0.0);
 
 	outData.position = worldPosition.xyz;
 	outData.color = aColor;
-	outData.normal = worldNormal * aNormal;
+	outData.normal = worldNormal * normal;
 	outData.texCoords = aTexCoords;
 	outData.tangent = worldTangent.xyz;
 	outData.bitangent = aBitangent;
@@ -186,6 +240,7 @@ void main()
 #pragma region FragmentShader
 		const char* fragSource = R"(
 #version 460 core
+#pragma features NORMAL_MAP ALPHA_TEST OVERDRAW
 
 in DeferredData
 {
@@ -203,22 +258,33 @@ layout (location = 2) out vec4 outDiffuse;
 layout (location = 3) out vec4 outSpecular;
 
 layout(binding = 0) uniform sampler2D DiffuseTexture;
+#if defined(NORMAL_MAP)
+layout(binding = 1) uniform sampler2D NormalTexture;
+#endif
 layout(binding = 2) uniform sampler2D SpecularTexture;
 
 layout (location = 0) uniform vec4 uSpecularCol;
 
-layout (location = 1) uniform bool uHasNormalMap;
+#if defined(OVERDRAW)
+layout (binding = 7, r32ui) uniform uimage2D uOverdraw; // OverdrawView::ImageUnit
+#endif
 
 void main()
 {
+#if defined(OVERDRAW)
+	imageAtomicAdd(uOverdraw, ivec2(gl_FragCoord.xy), 1u);
+#endif
 	vec4 diffuseTex = texture(DiffuseTexture, inData.texCoords);
+#if defined(ALPHA_TEST)
 	if (diffuseTex.a < 0.02) discard;
+#endif
 
 	vec3 normal = normalize(inData.normal);
-	//if(uHasNormalMap)
-	//{
-		// TODO:
-	//}
+#if defined(NORMAL_MAP)
+	const vec3 tangent = normalize(inData.tangent - dot(inData.tangent, normal) * normal);
+	const mat3 tbn = mat3(tangent, cross(normal, tangent), normal);
+	normal = normalize(tbn * (texture(NormalTexture, inData.texCoords).xyz * 2.0 - 1.0));
+#endif
 
 	outPosition = inData.position;
 	outNormal = normal;
@@ -229,12 +295,14 @@ void main()
 )";
 #pragma endregion
 
-		m_program = std::make_shared<GLProgramPipeline>(vertSource, fragSource);
+		m_permutations = std::make_unique<ShaderPermutations>(vertSource, fragSource);
+		m_program = m_permutations->Get(ShaderFeature::SKINNED | ShaderFeature::ALPHA_TEST);
 	}
 
 	GBuffer::~GBuffer()
 	{
 		m_program.reset();
+		m_permutations.reset();
 		m_fbo.reset();
 		m_position.reset();
 		m_normal.reset();
@@ -287,6 +355,26 @@ void main()
 		return m_program;
 	}
 
+	void GBuffer::Prepare(Model& model)
+	{
+		for (size_t i = 0; i < model.GetMeshCount(); i++)
+			m_permutations->Prepare(model[i]->GetShaderFeatures());
+	}
+
+	void GBuffer::Draw(Model& model, const std::function<void(const GLProgramPipelineRef&)>& setUniforms)
+	{
+		model.Draw(*m_permutations, setUniforms, m_debugFeatures);
+		m_program->Bind();
+	}
+
+	void GBuffer::SetDebugFeatures(ShaderFeatures features)
+	{
+		if (features == m_debugFeatures)
+			return;
+		m_debugFeatures = features;
+		m_program = m_permutations->Get(ShaderFeature::SKINNED | ShaderFeature::ALPHA_TEST | m_debugFeatures);
+	}
+
 	// TODO:     - LightingPass
 	class CoreLightingPassFB
 	{
@@ -510,6 +598,7 @@ void main()
 #pragma region FragmentShader
 			const char* fragSource = R"(
 #version 460
+#pragma features OVERDRAW
 
 layout (location = 0) out vec4 outFragColor;
 
@@ -527,8 +616,15 @@ layout (location = 1) uniform float lightIntensity;
 layout (location = 2) uniform vec2 screenSize;
 layout (location = 3) uniform float glossiness;
 
+#if defined(OVERDRAW)
+layout (binding = 7, r32ui) uniform uimage2D uOverdraw; // OverdrawView::ImageUnit
+#endif
+
 void main()
 {
+#if defined(OVERDRAW)
+	imageAtomicAdd(uOverdraw, ivec2(gl_FragCoord.xy), 1u);
+#endif
 	vec2 uvCoords = gl_FragCoord.xy / screenSize;
 	vec3 FragPos = texture(gPosition, uvCoords).rgb;
 	vec3 Normal = texture(gNormal, uvCoords).rgb;
@@ -558,16 +654,24 @@ void main()
 )";
 #pragma endregion
 
-			program = std::make_shared<GLProgramPipeline>(vertSource, fragSource);
+			permutations = std::make_unique<ShaderPermutations>(vertSource, fragSource);
+			program = permutations->Get(ShaderFeature::NONE);
 		}
 		void Destroy()
 		{
 			program.reset();
+			permutations.reset();
 			fbo.reset();
 			color.reset();
 			width = height = 0;
 		}
 
+		// the OVERDRAW variant counts the fragments of the light volumes into the OverdrawView image
+		void SetOverdraw(bool enabled)
+		{
+			program = permutations->Get(enabled ? ShaderFeature::OVERDRAW : ShaderFeature::NONE);
+		}
+
 		void Bind()
 		{
 			constexpr auto depthClearVal = 1.0f;
@@ -593,6 +697,7 @@ void main()
 		GLFramebufferRef fbo = nullptr;
 		GLTexture2DRef color = nullptr;
 
+		std::unique_ptr<ShaderPermutations> permutations;
 		GLProgramPipelineRef program = nullptr;
 
 		int width = 0;
@@ -967,6 +1072,7 @@ void Example004()
 	//ModelRef model{ new Model("Data/Models/holodeck/holodeck.obj") };
 	//ModelRef model{ new Model("Data/Models/lost-empire/lost_empire.obj") };
 	//ModelRef model{ new Model("Data/Models/sibenik/sibenik.obj") };
+	gbuffer->Prepare(*model);
 
 #pragma region lighting info
 	const unsigned int NR_LIGHTS = 64;
@@ -994,6 +1100,22 @@ void Example004()
 		lightColors.push_back(glm::vec3(rColor, gColor, bColor));
 	}
 
+	// resolved once, the names are not built again every frame
+	struct LightUniforms final
+	{
+		GLint position, color, linear, quadratic, radius;
+	};
+	std::vector<LightUniforms> lightUniforms(NR_LIGHTS);
+	for (unsigned int i = 0; i < NR_LIGHTS; i++)
+	{
+		const std::string prefix = "uLights[" + std::to_string(i) + "].";
+		lightUniforms[i].position = lightingPassFB.program->GetFragmentUniform(prefix + "position");
+		lightUniforms[i].color = lightingPassFB.program->GetFragmentUniform(prefix + "color");
+		lightUniforms[i].linear = lightingPassFB.program->GetFragmentUniform(prefix + "linear");
+		lightUniforms[i].quadratic = lightingPassFB.program->GetFragmentUniform(prefix + "quadratic");
+		lightUniforms[i].radius = lightingPassFB.program->GetFragmentUniform(prefix + "radius");
+	}
+
 #pragma endregion
 
 
@@ -1050,10 +1172,12 @@ void Example004()
 		{
 			glEnable(GL_DEPTH_TEST);
 			gbuffer->BindForWriting();
-			gbuffer->GetProgram()->SetVertexUniform(0, perspective);
-			gbuffer->GetProgram()->SetVertexUniform(1, camera.GetViewMatrix());
-			gbuffer->GetProgram()->SetVertexUniform(2, glm::mat4(1.0f));
-			model->Draw(gbuffer->GetProgram());
+			gbuffer->Draw(*model, [&](const GLProgramPipelineRef& program)
+				{
+					program->SetVertexUniform(0, perspective);
+					program->SetVertexUniform(1, camera.GetViewMatrix());
+					program->SetVertexUniform(2, glm::mat4(1.0f));
+				});
 		}
 
 		// Lighting pass framebuffer
@@ -1063,18 +1187,18 @@ void Example004()
 			// send light relevant uniforms
 			for (unsigned int i = 0; i < lightPositions.size(); i++)
 			{
-				lightingPassFB.program->SetFragmentUniform(lightingPassFB.program->GetFragmentUniform("uLights[" + std::to_string(i) + "].position"), lightPositions[i]);
-				lightingPassFB.program->SetFragmentUniform(lightingPassFB.program->GetFragmentUniform("uLights[" + std::to_string(i) + "].color"), lightColors[i]);
+				lightingPassFB.program->SetFragmentUniform(lightUniforms[i].position, lightPositions[i]);
+				lightingPassFB.program->SetFragmentUniform(lightUniforms[i].color, lightColors[i]);
 				// update attenuation parameters and calculate radius
 				const float constant = 1.0f; // note that we don't send this to the shader, we assume it is always 1.0 (in our case)
 				const float linear = 0.7f;
 				const float quadratic = 1.8f;
-				lightingPassFB.program->SetFragmentUniform(lightingPassFB.program->GetFragmentUniform("uLights[" + std::to_string(i) + "].linear"), linear);
-				lightingPassFB.program->SetFragmentUniform(lightingPassFB.program->GetFragmentUniform("uLights[" + std::to_string(i) + "].quadratic"), quadratic);
+				lightingPassFB.program->SetFragmentUniform(lightUniforms[i].linear, linear);
+				lightingPassFB.program->SetFragmentUniform(lightUniforms[i].quadratic, quadratic);
 				// then calculate radius of light volume/sphere
 				const float maxBrightness = std::fmaxf(std::fmaxf(lightColors[i].x, lightColors[i].y), lightColors[i].z);
 				float radius = (-linear + std::sqrt(linear * linear - 4 * quadratic * (constant - (256.0f / 5.0f) * maxBrightness))) / (2.0f * quadratic);
-				lightingPassFB.program->SetFragmentUniform(lightingPassFB.program->GetFragmentUniform("uLights[" + std::to_string(i) + "].radius"), radius);
+				lightingPassFB.program->SetFragmentUniform(lightUniforms[i].radius, radius);
 			}
 
 			gbuffer->BindForReading();
@@ -1169,6 +1293,8 @@ void Example005()
 
 	ModelRef model{ new Model("Data/Models/sponza/sponza.obj") };
 	ModelRef model2{ new Model("Data/Models/Dragon.obj") };
+	gbuffer->Prepare(*model);
+	gbuffer->Prepare(*model2);
 	ModelRef sphereModel{ new Model("Data/Models/Sphere.obj") };
 	auto sphereVao = (*sphereModel)[0]->GetVAO();
 	GLBufferRef instanceBuffer{ new GLBuffer(instanceData) };
@@ -1316,18 +1442,27 @@ void Example005()
 			gbuffer->BindForWriting();
 			gbuffer->GetProgram()->SetVertexUniform(0, perspective);
 			gbuffer->GetProgram()->SetVertexUniform(1, camera.GetViewMatrix());
-			gbuffer->GetProgram()->SetVertexUniform(2, glm::mat4(1.0f));
 
-			glm::vec4 sponzaSpecular = glm::vec4(0.5f, 0.5f, 0.5f, 0.8f);
-			gbuffer->GetProgram()->SetFragmentUniform(0, sponzaSpecular);
-			model->Draw(gbuffer->GetProgram());
+			const glm::vec4 sponzaSpecular = glm::vec4(0.5f, 0.5f, 0.5f, 0.8f);
+			gbuffer->Draw(*model, [&](const GLProgramPipelineRef& program)
+				{
+					program->SetVertexUniform(0, perspective);
+					program->SetVertexUniform(1, camera.GetViewMatrix());
+					program->SetVertexUniform(2, glm::mat4(1.0f));
+					program->SetFragmentUniform(0, sponzaSpecular);
+				});
 
 			glm::mat4 modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.0f, 0.0f));
 			glm::mat4 modelScale = glm::scale(modelTranslate, glm::vec3(0.2f));
-			gbuffer->GetProgram()->SetVertexUniform(2, modelScale);
-			glm::vec4 modelSpecular = glm::vec4(1.0f, 1.0f, 1.0f, 0.8f);
+			const glm::vec4 modelSpecular = glm::vec4(1.0f, 1.0f, 1.0f, 0.8f);
+			gbuffer->Draw(*model2, [&](const GLProgramPipelineRef& program)
+				{
+					program->SetVertexUniform(0, perspective);
+					program->SetVertexUniform(1, camera.GetViewMatrix());
+					program->SetVertexUniform(2, modelScale);
+					program->SetFragmentUniform(0, modelSpecular);
+				});
 			gbuffer->GetProgram()->SetFragmentUniform(0, modelSpecular);
-			model2->Draw(gbuffer->GetProgram());
 
 			modelTranslate = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -2.65f, 0.0f));
 			modelScale = glm::scale(modelTranslate, glm::vec3(10.0f));
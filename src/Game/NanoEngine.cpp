@@ -45,6 +45,8 @@ namespace
 	struct
 	{
 		Renderer::DeviceProperties properties;
+		std::filesystem::path shaderCacheDirectory = "ShaderCache";
+		ShaderCache::Stats shaderCacheStats;
 	} Render;
 
 	struct
@@ -58,6 +60,164 @@ namespace
 	{
 		ImFont* defaultFont = nullptr;
 	} imgui;
+
+	constexpr uint32_t InvalidGPUScope = static_cast<uint32_t>(-1);
+
+	constexpr std::array<std::pair<GLenum, uint64_t GPUProfiler::PipelineStatistics::*>, 6> GPUPipelineStatistics = { {
+		{ GL_VERTICES_SUBMITTED, &GPUProfiler::PipelineStatistics::verticesSubmitted },
+		{ GL_PRIMITIVES_SUBMITTED, &GPUProfiler::PipelineStatistics::primitivesSubmitted },
+		{ GL_VERTEX_SHADER_INVOCATIONS, &GPUProfiler::PipelineStatistics::vertexShaderInvocations },
+		{ GL_CLIPPING_OUTPUT_PRIMITIVES, &GPUProfiler::PipelineStatistics::clippingOutputPrimitives },
+		{ GL_FRAGMENT_SHADER_INVOCATIONS, &GPUProfiler::PipelineStatistics::fragmentShaderInvocations },
+		{ GL_COMPUTE_SHADER_INVOCATIONS, &GPUProfiler::PipelineStatistics::computeShaderInvocations },
+	} };
+
+	struct GPUProfilerScope final
+	{
+		uint32_t pass = 0;
+		uint32_t beginQuery = 0;
+		uint32_t endQuery = 0;
+	};
+
+	struct GPUProfilerFrame final
+	{
+		// GPUProfile.frame the queries were issued in
+		uint64_t index = 0;
+		std::vector<GLuint> queries;
+		uint32_t usedQueries = 0;
+		std::vector<GPUProfilerScope> scopes;
+		// one query per statistic for every stretch of a pass between its children
+		std::array<std::vector<GLuint>, GPUPipelineStatistics.size()> statisticQueries;
+		std::vector<uint32_t> statisticSegments; // the pass of each stretch
+		bool statistics = false;
+		bool segmentOpen = false;
+	};
+
+	struct GPUProfilerPass final
+	{
+		std::string name;
+		uint32_t parent = InvalidGPUScope;
+		uint32_t depth = 0;
+		std::array<float, GPUProfiler::HistorySize> history{};
+		uint32_t count = 0;
+		uint32_t next = 0;
+		float last = 0.0f;
+		GPUProfiler::PipelineStatistics statistics;
+	};
+
+	// the pass times of a frame once they are read back, tagged with the frame they were measured in
+	struct GPUProfilerResult final
+	{
+		uint64_t frame = 0;
+		std::vector<std::pair<uint32_t, float>> passMs;
+	};
+
+	struct
+	{
+		bool enabled = true;
+		bool statistics = false;
+		bool inFrame = false;
+		uint64_t frame = 0;
+		uint64_t dropped = 0;
+		std::array<GPUProfilerFrame, GPUProfiler::FrameLatency> frames;
+		// scopes of the current frame that are open, InvalidGPUScope for those without queries
+		std::vector<uint32_t> stack;
+		std::vector<GPUProfilerPass> passes;
+		// taken by FlightRecorder::NextFrame
+		std::vector<GPUProfilerResult> results;
+	} GPUProfile;
+
+	// An event of the ring as a seqlock: sequence is n + 1 once the event n is complete and 0 while the owner writes the slot.
+	// A reader keeps a copy only if it saw the same sequence before and after, so it never takes a half written event
+	struct CPUProfilerSlot final
+	{
+		std::atomic<uint64_t> sequence = 0;
+		std::atomic<const char*> name = nullptr;
+		std::atomic<uint64_t> begin = 0;
+		std::atomic<uint64_t> end = 0;
+		std::atomic<uint32_t> depth = 0;
+	};
+
+	struct CPUProfilerThread final
+	{
+		std::unique_ptr<CPUProfilerSlot[]> events = std::make_unique<CPUProfilerSlot[]>(CPUProfiler::EventsPerThread);
+		// only the owning thread writes, readers take what is behind head
+		std::atomic<uint64_t> head = 0;
+		uint32_t depth = 0;
+		uint32_t id = 0;
+		std::string name; // guarded by CPUProfile.mutex
+	};
+
+	struct CPUProfilerLane final
+	{
+		uint32_t id = 0;
+		std::string name;
+		std::vector<CPUProfiler::Event> events;
+	};
+
+	struct
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::mutex mutex;
+		// threads stay registered after they exit so their events still end up in a trace
+		std::vector<std::shared_ptr<CPUProfilerThread>> threads;
+		std::array<uint64_t, CPUProfiler::FrameHistory> frames{};
+		std::atomic<uint64_t> frameCount = 0;
+		bool paused = false;
+		uint64_t viewBegin = 0;
+		uint64_t viewEnd = 0;
+		std::vector<CPUProfilerLane> view;
+	} CPUProfile;
+
+	thread_local std::shared_ptr<CPUProfilerThread> CPUProfileThread;
+
+	struct
+	{
+		bool installed = false;
+		bool enabled = true;
+		GLuint drawFramebuffer = 0;
+		GLStats::FrameStats frame;
+		GLStats::FrameStats lastFrame;
+		// groups of the current frame that are open
+		std::vector<uint32_t> stack;
+	} GLCounters;
+
+	struct FlightRecorderFrame final
+	{
+		uint64_t begin = 0; // CPUProfiler::Now
+		uint64_t end = 0;
+		GLStats::Counters counters;
+		// GPUProfile.frame of the frame, 0 when it had none
+		uint64_t gpuFrame = 0;
+		// (pass, ms) of the passes that ran in the frame, filled in once GPUProfiler reads them back FrameLatency frames later
+		std::vector<std::pair<uint32_t, float>> gpuMs;
+	};
+
+	struct
+	{
+		FlightRecorder::Settings settings;
+		std::array<FlightRecorderFrame, FlightRecorder::HistorySize> frames;
+		uint64_t frameCount = 0;
+		uint64_t frameBegin = 0;
+		uint64_t lastGpuFrame = 0;
+		bool started = false;
+		uint64_t hitches = 0;
+		bool dumped = false;
+		uint64_t lastDumpFrame = 0;
+		std::filesystem::path lastDump;
+		// the hitch trace being written, it becomes lastDump once done
+		std::future<bool> writing;
+		std::filesystem::path writingPath;
+	} Recorder;
+
+	struct
+	{
+		std::vector<std::thread> workers;
+		std::queue<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool stop = false;
+	} Jobs;
 }
 
 void ResetGlobalVars()
@@ -119,6 +279,372 @@ inline Time Clock::Reset()
 
 #pragma endregion
 
+#pragma region JobSystem
+
+namespace
+{
+	void jobWorkerLoop(uint32_t index)
+	{
+		NANO_PROFILE_THREAD("Job worker " + std::to_string(index));
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(Jobs.mutex);
+				Jobs.condition.wait(lock, [] { return Jobs.stop || !Jobs.tasks.empty(); });
+				if (Jobs.stop && Jobs.tasks.empty())
+					return;
+				task = std::move(Jobs.tasks.front());
+				Jobs.tasks.pop();
+			}
+			NANO_PROFILE_ZONE("Job");
+			task();
+		}
+	}
+}
+
+void JobSystem::Init(uint32_t threadCount)
+{
+	if (!Jobs.workers.empty())
+	{
+		Warning("JobSystem already initialized");
+		return;
+	}
+
+	if (threadCount == 0)
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+	Jobs.stop = false;
+	Jobs.workers.reserve(threadCount);
+	for (uint32_t i = 0; i < threadCount; i++)
+		Jobs.workers.emplace_back(jobWorkerLoop, i);
+
+	Print("JobSystem: " + std::to_string(threadCount) + " worker threads");
+}
+
+void JobSystem::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(Jobs.mutex);
+		Jobs.stop = true;
+	}
+	Jobs.condition.notify_all();
+	for (auto& worker : Jobs.workers)
+		worker.join();
+	Jobs.workers.clear();
+}
+
+uint32_t JobSystem::GetThreadCount()
+{
+	return static_cast<uint32_t>(Jobs.workers.size()) + 1;
+}
+
+void JobSystem::ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& func)
+{
+	if (count == 0) return;
+
+	grainSize = std::max<size_t>(grainSize, 1);
+	const size_t rangeCount = (count + grainSize - 1) / grainSize;
+	if (Jobs.workers.empty() || rangeCount == 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	struct ParallelForState final
+	{
+		const std::function<void(size_t, size_t)>* func = nullptr;
+		size_t count = 0;
+		size_t grainSize = 0;
+		size_t rangeCount = 0;
+		std::atomic<size_t> nextRange = 0;
+		std::atomic<size_t> doneRanges = 0;
+	};
+
+	// the state outlives this call: a helper may be dequeued after all ranges are taken, it then finds no work and only touches the counters
+	auto state = std::make_shared<ParallelForState>();
+	state->func = &func;
+	state->count = count;
+	state->grainSize = grainSize;
+	state->rangeCount = rangeCount;
+
+	auto runRanges = [](ParallelForState& st)
+		{
+			for (size_t range = st.nextRange++; range < st.rangeCount; range = st.nextRange++)
+			{
+				const size_t begin = range * st.grainSize;
+				(*st.func)(begin, std::min(begin + st.grainSize, st.count));
+				st.doneRanges.fetch_add(1, std::memory_order_release);
+			}
+		};
+
+	const size_t helperCount = std::min(Jobs.workers.size(), rangeCount - 1);
+	{
+		std::lock_guard<std::mutex> lock(Jobs.mutex);
+		for (size_t i = 0; i < helperCount; i++)
+			Jobs.tasks.push([state, runRanges] { runRanges(*state); });
+	}
+	if (helperCount == 1) Jobs.condition.notify_one();
+	else Jobs.condition.notify_all();
+
+	runRanges(*state);
+	NANO_PROFILE_ZONE("ParallelFor wait");
+	while (state->doneRanges.load(std::memory_order_acquire) < rangeCount)
+		std::this_thread::yield();
+}
+
+#pragma endregion
+
+#pragma region CPUProfiler
+
+namespace
+{
+	CPUProfilerThread& cpuProfilerThread()
+	{
+		if (!CPUProfileThread)
+		{
+			auto thread = std::make_shared<CPUProfilerThread>();
+			std::lock_guard<std::mutex> lock(CPUProfile.mutex);
+			thread->id = static_cast<uint32_t>(CPUProfile.threads.size());
+			thread->name = "Thread " + std::to_string(thread->id);
+			CPUProfile.threads.push_back(thread);
+			CPUProfileThread = std::move(thread);
+		}
+		return *CPUProfileThread;
+	}
+
+	// events of every thread that overlap [begin, end)
+	std::vector<CPUProfilerLane> cpuProfilerLanes(uint64_t begin, uint64_t end)
+	{
+		std::vector<CPUProfilerLane> lanes;
+		std::vector<std::shared_ptr<CPUProfilerThread>> threads;
+		{
+			std::lock_guard<std::mutex> lock(CPUProfile.mutex);
+			threads = CPUProfile.threads;
+			for (const auto& thread : threads)
+				lanes.push_back({ thread->id, thread->name, {} });
+		}
+
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			const CPUProfilerThread& thread = *threads[i];
+			const uint64_t head = thread.head.load(std::memory_order_acquire);
+			const uint64_t first = head > CPUProfiler::EventsPerThread ? head - CPUProfiler::EventsPerThread : 0;
+			std::vector<CPUProfiler::Event>& events = lanes[i].events;
+			for (uint64_t n = first; n < head; n++)
+			{
+				// the writer may have wrapped around to this slot while we copy it
+				const CPUProfilerSlot& slot = thread.events[n % CPUProfiler::EventsPerThread];
+				if (slot.sequence.load(std::memory_order_acquire) != n + 1)
+					continue;
+				const CPUProfiler::Event event = { slot.name.load(std::memory_order_relaxed), slot.begin.load(std::memory_order_relaxed),
+					slot.end.load(std::memory_order_relaxed), slot.depth.load(std::memory_order_relaxed) };
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.sequence.load(std::memory_order_relaxed) != n + 1)
+					continue;
+				if (event.end > begin && event.begin < end)
+					events.push_back(event);
+			}
+		}
+		return lanes;
+	}
+
+	std::string cpuProfilerJsonString(std::string_view text)
+	{
+		std::string result = "\"";
+		for (const char c : text)
+		{
+			if (c == '"' || c == '\\') { result += '\\'; result += c; }
+			else if (static_cast<unsigned char>(c) < 0x20) result += ' ';
+			else result += c;
+		}
+		result += '"';
+		return result;
+	}
+
+	std::string cpuProfilerMicroseconds(uint64_t ns)
+	{
+		return std::to_string(ns / 1000) + "." + std::to_string(ns % 1000 + 1000).substr(1);
+	}
+
+	// a file in Chrome trace event format, the event array is closed when it goes out of scope
+	class ChromeTrace final
+	{
+	public:
+		explicit ChromeTrace(const std::filesystem::path& path) : m_file(path)
+		{
+			if (m_file) m_file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		}
+		~ChromeTrace()
+		{
+			if (m_file) m_file << "\n]}\n";
+		}
+		ChromeTrace(const ChromeTrace&) = delete;
+		ChromeTrace& operator=(const ChromeTrace&) = delete;
+
+		[[nodiscard]] bool IsOpen() const { return static_cast<bool>(m_file); }
+		[[nodiscard]] size_t GetEventCount() const noexcept { return m_eventCount; }
+
+		std::ofstream& BeginEvent()
+		{
+			m_file << (m_eventCount++ ? ",\n" : "\n");
+			return m_file;
+		}
+
+		void WriteThreadName(uint32_t tid, std::string_view name)
+		{
+			BeginEvent() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":" << cpuProfilerJsonString(name) << "}}";
+			BeginEvent() << "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"sort_index\":" << tid << "}}";
+		}
+
+		// the zones for which highlight returns true are drawn red
+		void WriteLane(const CPUProfilerLane& lane, const std::function<bool(const CPUProfiler::Event&)>& highlight = nullptr)
+		{
+			WriteThreadName(lane.id, lane.name);
+			for (const CPUProfiler::Event& event : lane.events)
+			{
+				BeginEvent() << "{\"name\":" << cpuProfilerJsonString(event.name) << ",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":" << lane.id
+					<< ",\"ts\":" << cpuProfilerMicroseconds(event.begin) << ",\"dur\":" << cpuProfilerMicroseconds(event.end - event.begin);
+				if (highlight && highlight(event))
+					m_file << ",\"cname\":\"terrible\"";
+				m_file << "}";
+			}
+		}
+
+	private:
+		std::ofstream m_file;
+		size_t m_eventCount = 0;
+	};
+}
+
+uint64_t CPUProfiler::Now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - CPUProfile.start).count());
+}
+
+void CPUProfiler::SetThreadName(std::string_view name)
+{
+	CPUProfilerThread& thread = cpuProfilerThread();
+	std::lock_guard<std::mutex> lock(CPUProfile.mutex);
+	thread.name = name;
+}
+
+void CPUProfiler::MarkFrame()
+{
+	const uint64_t count = CPUProfile.frameCount.load(std::memory_order_relaxed);
+	CPUProfile.frames[count % FrameHistory] = Now();
+	CPUProfile.frameCount.store(count + 1, std::memory_order_release);
+}
+
+uint32_t CPUProfiler::BeginZone()
+{
+	return cpuProfilerThread().depth++;
+}
+
+void CPUProfiler::EndZone(const char* name, uint64_t begin, uint32_t depth)
+{
+	const uint64_t end = Now();
+	CPUProfilerThread& thread = cpuProfilerThread();
+	thread.depth = depth;
+	const uint64_t head = thread.head.load(std::memory_order_relaxed);
+	CPUProfilerSlot& slot = thread.events[head % EventsPerThread];
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.begin.store(begin, std::memory_order_relaxed);
+	slot.end.store(end, std::memory_order_relaxed);
+	slot.depth.store(depth, std::memory_order_relaxed);
+	slot.sequence.store(head + 1, std::memory_order_release);
+	thread.head.store(head + 1, std::memory_order_release);
+}
+
+bool CPUProfiler::ExportChromeTrace(const std::filesystem::path& path)
+{
+	ChromeTrace trace(path);
+	if (!trace.IsOpen())
+	{
+		Error("CPUProfiler: failed to write " + path.string());
+		return false;
+	}
+
+	for (const CPUProfilerLane& lane : cpuProfilerLanes(0, UINT64_MAX))
+		trace.WriteLane(lane);
+
+	const uint64_t frameCount = CPUProfile.frameCount.load(std::memory_order_acquire);
+	for (uint64_t frame = frameCount > FrameHistory ? frameCount - FrameHistory : 0; frame < frameCount; frame++)
+	{
+		trace.BeginEvent() << "{\"name\":\"Frame " << frame << "\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"ts\":"
+			<< cpuProfilerMicroseconds(CPUProfile.frames[frame % FrameHistory]) << "}";
+	}
+
+	Print("CPUProfiler: " + std::to_string(trace.GetEventCount()) + " events written to " + path.string());
+	return true;
+}
+
+void CPUProfiler::DrawImGui(const char* title)
+{
+	ImGui::Begin(title);
+	ImGui::Checkbox("Pause", &CPUProfile.paused);
+	ImGui::SameLine();
+	if (ImGui::Button("Export trace"))
+		ExportChromeTrace("trace.json");
+
+	const uint64_t frameCount = CPUProfile.frameCount.load(std::memory_order_acquire);
+	if (!CPUProfile.paused && frameCount >= 2)
+	{
+		CPUProfile.viewBegin = CPUProfile.frames[(frameCount - 2) % FrameHistory];
+		CPUProfile.viewEnd = CPUProfile.frames[(frameCount - 1) % FrameHistory];
+		CPUProfile.view = cpuProfilerLanes(CPUProfile.viewBegin, CPUProfile.viewEnd);
+	}
+	const uint64_t duration = CPUProfile.viewEnd - CPUProfile.viewBegin;
+	ImGui::Text("Frame %.3f ms", static_cast<double>(duration) * 1e-6);
+	if (duration == 0)
+	{
+		ImGui::End();
+		return;
+	}
+
+	ImDrawList* drawList = ImGui::GetWindowDrawList();
+	const float rowHeight = ImGui::GetTextLineHeightWithSpacing();
+	const float width = std::max(ImGui::GetContentRegionAvail().x, 1.0f);
+	const double scale = static_cast<double>(width) / static_cast<double>(duration);
+	for (const CPUProfilerLane& lane : CPUProfile.view)
+	{
+		if (lane.events.empty()) continue;
+
+		uint32_t depthCount = 0;
+		for (const Event& event : lane.events)
+			depthCount = std::max(depthCount, event.depth + 1);
+
+		ImGui::TextUnformatted(lane.name.c_str());
+		const ImVec2 origin = ImGui::GetCursorScreenPos();
+		ImGui::PushID(static_cast<int>(lane.id));
+		ImGui::InvisibleButton("lane", ImVec2(width, rowHeight * static_cast<float>(depthCount)));
+		ImGui::PopID();
+		const bool hovered = ImGui::IsItemHovered();
+		const ImVec2 mouse = ImGui::GetIO().MousePos;
+
+		for (const Event& event : lane.events)
+		{
+			const uint64_t begin = std::max(event.begin, CPUProfile.viewBegin) - CPUProfile.viewBegin;
+			const uint64_t end = std::min(event.end, CPUProfile.viewEnd) - CPUProfile.viewBegin;
+			const ImVec2 min(origin.x + static_cast<float>(static_cast<double>(begin) * scale), origin.y + rowHeight * static_cast<float>(event.depth));
+			const ImVec2 max(std::max(origin.x + static_cast<float>(static_cast<double>(end) * scale), min.x + 1.0f), min.y + rowHeight - 1.0f);
+
+			const float hue = static_cast<float>(std::hash<std::string_view>{}(event.name) % 360) / 360.0f;
+			drawList->AddRectFilled(min, max, ImColor::HSV(hue, 0.45f, 0.85f));
+			if (max.x - min.x > ImGui::CalcTextSize(event.name).x + 4.0f)
+				drawList->AddText(ImVec2(min.x + 2.0f, min.y), IM_COL32_BLACK, event.name);
+
+			if (hovered && mouse.x >= min.x && mouse.x < max.x && mouse.y >= min.y && mouse.y < max.y)
+				ImGui::SetTooltip("%s\n%.3f ms", event.name, static_cast<double>(event.end - event.begin) * 1e-6);
+		}
+	}
+	ImGui::End();
+}
+
+#pragma endregion
+
 #pragma endregion
 
 //==============================================================================
@@ -149,6 +675,87 @@ void Fatal(const std::string& text)
 //==============================================================================
 #pragma region Math
 
+Frustum::Frustum(const glm::mat4& viewProjection)
+{
+	const glm::mat4& m = viewProjection;
+	const glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+	const glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+	const glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+	const glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+	// left, right, bottom, top, near, far
+	const glm::vec4 equations[6] = { row3 + row0, row3 - row0, row3 + row1, row3 - row1, row3 + row2, row3 - row2 };
+	for (int i = 0; i < 6; i++)
+	{
+		const float invLength = 1.0f / glm::length(glm::vec3(equations[i]));
+		planes[i].n = glm::vec3(equations[i]) * invLength;
+		planes[i].d = equations[i].w * invLength;
+	}
+}
+
+bool Frustum::Intersects(const AABB& aabb) const
+{
+	for (const Plane& plane : planes)
+	{
+		// the box corner furthest along the plane normal
+		const glm::vec3 positive(
+			plane.n.x >= 0.0f ? aabb.max.x : aabb.min.x,
+			plane.n.y >= 0.0f ? aabb.max.y : aabb.min.y,
+			plane.n.z >= 0.0f ? aabb.max.z : aabb.min.z);
+		if (glm::dot(plane.n, positive) + plane.d < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+AABB ComputeSkinnedBounds(std::span<const glm::mat4> palette, std::span<const BoneBounds> bones, const AABB& unskinned)
+{
+	AABB result = unskinned;
+	if (bones.empty())
+		return result;
+
+	// center' = M * center, halfSize' = |M| * halfSize: the box around the transformed box
+#if NANO_SSE
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 minimum = _mm_set1_ps(std::numeric_limits<float>::max());
+	__m128 maximum = _mm_set1_ps(std::numeric_limits<float>::lowest());
+	for (const BoneBounds& bone : bones)
+	{
+		const float* m = glm::value_ptr(palette[bone.paletteIndex]);
+		const __m128 c0 = _mm_loadu_ps(m);
+		const __m128 c1 = _mm_loadu_ps(m + 4);
+		const __m128 c2 = _mm_loadu_ps(m + 8);
+		const __m128 c3 = _mm_loadu_ps(m + 12);
+		const __m128 center = _mm_loadu_ps(&bone.center.x);
+		const __m128 halfSize = _mm_loadu_ps(&bone.halfSize.x);
+
+		__m128 c = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_shuffle_ps(center, center, _MM_SHUFFLE(0, 0, 0, 0))));
+		c = _mm_add_ps(c, _mm_mul_ps(c1, _mm_shuffle_ps(center, center, _MM_SHUFFLE(1, 1, 1, 1))));
+		c = _mm_add_ps(c, _mm_mul_ps(c2, _mm_shuffle_ps(center, center, _MM_SHUFFLE(2, 2, 2, 2))));
+		__m128 h = _mm_mul_ps(_mm_and_ps(c0, absMask), _mm_shuffle_ps(halfSize, halfSize, _MM_SHUFFLE(0, 0, 0, 0)));
+		h = _mm_add_ps(h, _mm_mul_ps(_mm_and_ps(c1, absMask), _mm_shuffle_ps(halfSize, halfSize, _MM_SHUFFLE(1, 1, 1, 1))));
+		h = _mm_add_ps(h, _mm_mul_ps(_mm_and_ps(c2, absMask), _mm_shuffle_ps(halfSize, halfSize, _MM_SHUFFLE(2, 2, 2, 2))));
+
+		minimum = _mm_min_ps(minimum, _mm_sub_ps(c, h));
+		maximum = _mm_max_ps(maximum, _mm_add_ps(c, h));
+	}
+	alignas(16) float lo[4];
+	alignas(16) float hi[4];
+	_mm_store_ps(lo, minimum);
+	_mm_store_ps(hi, maximum);
+	result.Combine(AABB(glm::vec3(lo[0], lo[1], lo[2]), glm::vec3(hi[0], hi[1], hi[2])));
+#else
+	for (const BoneBounds& bone : bones)
+	{
+		const glm::mat4& m = palette[bone.paletteIndex];
+		const glm::vec3 center = glm::vec3(m * glm::vec4(glm::vec3(bone.center), 1.0f));
+		const glm::vec3 halfSize = glm::abs(glm::vec3(m[0])) * bone.halfSize.x + glm::abs(glm::vec3(m[1])) * bone.halfSize.y + glm::abs(glm::vec3(m[2])) * bone.halfSize.z;
+		result.Combine(AABB(center - halfSize, center + halfSize));
+	}
+#endif
+	return result;
+}
+
 #pragma endregion
 
 //==============================================================================
@@ -189,46 +796,150 @@ const std::pair<GLenum, GLenum> STBImageToOpenGLFormat(int comp)
 	}
 }
 
-std::string LoadShaderTextFile(const std::filesystem::path& path)
+namespace
 {
-	if (!std::filesystem::exists(path))
+	struct ShaderFile final
 	{
-		Error("File '" + path.string() + "' does not exist.");
-		return "";
-	}
+		std::filesystem::file_time_type writeTime;
+		std::vector<std::string> lines;
+		std::vector<std::filesystem::path> includes;
+		std::filesystem::path path;
+	};
 
-	const char whitespace = ' ';
-	const std::string includeIdentifier = "#include "; // TODO: проверять что в include используются кавычки или нет
-	const std::string rootFolder = std::filesystem::absolute(path).parent_path().string() + "/";
+	struct
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, ShaderFile> files;
+	} ShaderFiles;
 
-	std::string shaderCode = "";
-	std::ifstream file(path);
-	if (!file.is_open())
+	// the path of an #include line, empty for other lines
+	std::string_view ParseInclude(std::string_view line)
 	{
-		Error("Failed to load shader file " + path.string());
-		return "";
+		const size_t first = line.find_first_not_of(" \t");
+		constexpr std::string_view includeIdentifier = "#include";
+		if (first == line.npos || line.substr(first, includeIdentifier.size()) != includeIdentifier)
+			return {};
+		line.remove_prefix(first + includeIdentifier.size());
+		const size_t begin = line.find_first_not_of(" \t\"<");
+		const size_t end = line.find_last_not_of(" \t\r\">");
+		return begin != line.npos && end != line.npos && end >= begin ? line.substr(begin, end - begin + 1) : std::string_view();
 	}
 
-	std::string lineBuffer;
-	while (std::getline(file, lineBuffer))
+	// reads the file unless the cached copy is current, the caller holds ShaderFiles.mutex
+	const ShaderFile* GetShaderFile(const std::filesystem::path& path)
 	{
-		if (lineBuffer.find(includeIdentifier) != lineBuffer.npos)
+		std::error_code error;
+		const std::filesystem::path absolute = std::filesystem::weakly_canonical(path, error);
+		const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(absolute, error);
+		if (error)
 		{
-			std::size_t index = lineBuffer.find_last_of(whitespace);
-			std::string includeFullPath = rootFolder + lineBuffer.substr(index + 1);
-			shaderCode += LoadShaderTextFile(includeFullPath.c_str());
+			Error("File '" + path.string() + "' does not exist.");
+			return nullptr;
 		}
-		else
+
+		auto [it, inserted] = ShaderFiles.files.try_emplace(absolute.string());
+		ShaderFile& file = it->second;
+		if (inserted)
+			file.path = absolute;
+		else if (file.writeTime == writeTime)
+			return &file;
+
+		std::ifstream stream(absolute);
+		if (!stream.is_open())
+		{
+			Error("Failed to load shader file " + path.string());
+			return nullptr;
+		}
+		file.writeTime = writeTime;
+		file.lines.clear();
+		file.includes.clear();
+		std::string line;
+		while (std::getline(stream, line))
+		{
+			const std::string_view include = ParseInclude(line);
+			if (!include.empty())
+				file.includes.push_back(absolute.parent_path() / include);
+			file.lines.push_back(std::move(line));
+		}
+		return &file;
+	}
+
+	// the source string number of #line is the position of the file in included, counted from 1. 0 is left to text without a file.
+	// The numbers depend on the source alone, so the same source always gives the same text and ShaderCache key
+	void AppendShaderFile(const ShaderFile& file, std::vector<const ShaderFile*>& included, std::string& shaderCode)
+	{
+		included.push_back(&file);
+		const std::string sourceString = ' ' + std::to_string(included.size()) + '\n';
+		size_t include = 0;
+		for (size_t i = 0; i < file.lines.size(); i++)
 		{
-			shaderCode += lineBuffer + '\n';
+			const std::string& line = file.lines[i];
+			if (ParseInclude(line).empty())
+			{
+				// dropped lines stay as empty ones, the line numbers still match
+				if (line.find("#pragma once") == line.npos)
+					shaderCode += line;
+				shaderCode += '\n';
+				// #line may not come before #version
+				if (line.find("#version") != line.npos)
+					shaderCode += "#line " + std::to_string(i + 2) + sourceString;
+				continue;
+			}
+			// every file once per source, like an include guard
+			const ShaderFile* child = GetShaderFile(file.includes[include++]);
+			if (!child || std::find(included.begin(), included.end(), child) != included.end())
+			{
+				shaderCode += '\n';
+				continue;
+			}
+			shaderCode += "#line 1 " + std::to_string(included.size() + 1) + '\n';
+			AppendShaderFile(*child, included, shaderCode);
+			shaderCode += "#line " + std::to_string(i + 2) + sourceString;
 		}
 	}
 
-	file.close();
+	void CollectShaderDependencies(const std::filesystem::path& path, std::vector<std::filesystem::path>& dependencies)
+	{
+		std::error_code error;
+		const std::filesystem::path absolute = std::filesystem::weakly_canonical(path, error);
+		if (std::find(dependencies.begin(), dependencies.end(), absolute) != dependencies.end())
+			return;
+		dependencies.push_back(absolute);
+		auto it = ShaderFiles.files.find(absolute.string());
+		if (it == ShaderFiles.files.end())
+			return;
+		for (const std::filesystem::path& include : it->second.includes)
+			CollectShaderDependencies(include, dependencies);
+	}
+}
 
+std::string LoadShaderTextFile(const std::filesystem::path& path)
+{
+	NANO_PROFILE_FUNCTION();
+	std::lock_guard lock(ShaderFiles.mutex);
+	const ShaderFile* file = GetShaderFile(path);
+	if (!file)
+		return "";
+	std::vector<const ShaderFile*> included;
+	std::string shaderCode;
+	AppendShaderFile(*file, included, shaderCode);
+	// the files behind the source string numbers for the compiler log, relative so that the text does not depend on the install location
+	shaderCode += "// source strings:";
+	const std::filesystem::path directory = file->path.parent_path();
+	for (size_t i = 0; i < included.size(); i++)
+		shaderCode += ' ' + std::to_string(i + 1) + '=' + included[i]->path.lexically_relative(directory).generic_string();
+	shaderCode += '\n';
 	return shaderCode;
 }
 
+std::vector<std::filesystem::path> GetShaderDependencies(const std::filesystem::path& path)
+{
+	std::lock_guard lock(ShaderFiles.mutex);
+	std::vector<std::filesystem::path> dependencies;
+	CollectShaderDependencies(path, dependencies);
+	return dependencies;
+}
+
 #pragma endregion
 
 //==============================================================================
@@ -341,49 +1052,553 @@ void GPUBuffer::updateData(const void* data, GLuint size, GLuint offset)
 
 #pragma endregion
 
-#pragma region GLSeparableShaderProgram
+#pragma region GPURingBuffer
 
-GLSeparableShaderProgram::GLSeparableShaderProgram(GLenum shaderType, std::string_view sourceCode)
+namespace
 {
-	createHandle(shaderType, sourceCode);
+	size_t ringRegionStride(size_t regionSizeBytes)
+	{
+		const auto& limits = Renderer::GetDeviceProperties().limits;
+		const size_t alignment = std::max<size_t>({ 16, static_cast<size_t>(limits.uniformBufferOffsetAlignment), static_cast<size_t>(limits.shaderStorageBufferOffsetAlignment) });
+		return RoundUp(regionSizeBytes, alignment);
+	}
 }
 
-GLSeparableShaderProgram::~GLSeparableShaderProgram()
+GPURingBuffer::GPURingBuffer(size_t regionSizeBytes, uint32_t regionCount, std::string_view name)
+	: m_regionSize(regionSizeBytes)
+	, m_regionStride(ringRegionStride(regionSizeBytes))
+	, m_fences(std::max(regionCount, 1u), nullptr)
+	, m_buffer(m_regionStride * std::max(regionCount, 1u), BufferStorageFlag::DYNAMIC_STORAGE | BufferStorageFlag::MAP_MEMORY, name)
 {
-	destroyHandle();
 }
 
-void GLSeparableShaderProgram::createHandle(GLenum shaderType, std::string_view sourceCode)
+GPURingBuffer::~GPURingBuffer()
 {
-	const auto srcPtr = sourceCode.data();
-	m_handle = glCreateShaderProgramv(shaderType, 1, &srcPtr);
-	glProgramParameteri(m_handle, GL_PROGRAM_SEPARABLE, GL_TRUE);
-	validate(sourceCode);
+	for (GLsync fence : m_fences)
+		if (fence) glDeleteSync(fence);
 }
 
-void GLSeparableShaderProgram::destroyHandle()
+void* GPURingBuffer::NextRegion()
 {
-	if (m_handle != 0)
-		glDeleteProgram(m_handle);
-	m_handle = 0;
-}
+	if (m_fences[m_current]) glDeleteSync(m_fences[m_current]);
+	m_fences[m_current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-void GLSeparableShaderProgram::validate(std::string_view sourceCode)
-{
-	GLint compiled = 0;
-	glGetProgramiv(m_handle, GL_LINK_STATUS, &compiled);
-	if (compiled == GL_FALSE)
+	m_current = (m_current + 1) % static_cast<uint32_t>(m_fences.size());
+	if (GLsync fence = m_fences[m_current])
 	{
-		std::array<char, 1024> compiler_log;
-		glGetProgramInfoLog(m_handle, (GLsizei)compiler_log.size(), nullptr, compiler_log.data());
-		glDeleteShader(m_handle);
-
-		std::ostringstream message;
-		message << "shader contains error(s):\n\n" << sourceCode.data() << "\n\n" << compiler_log.data() << '\n';
-		Error(message.str());
-		glDeleteProgram(m_handle);
-		m_handle = 0;
+		// normally already signaled, the wait only triggers when the CPU runs more than regionCount frames ahead
+		GLenum result = glClientWaitSync(fence, 0, 0);
+		while (result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		if (result == GL_WAIT_FAILED)
+			Error("GPURingBuffer: glClientWaitSync failed");
+		glDeleteSync(fence);
+		m_fences[m_current] = nullptr;
 	}
+	return GetRegion(m_current);
+}
+
+void* GPURingBuffer::GetRegion(uint32_t region)
+{
+	return static_cast<std::byte*>(m_buffer.GetMappedPointer()) + region * m_regionStride;
+}
+
+void GPURingBuffer::BindRange(GLenum target, GLuint index) const
+{
+	glBindBufferRange(target, index, m_buffer, static_cast<GLintptr>(GetRegionOffset()), static_cast<GLsizeiptr>(m_regionSize));
+}
+
+#pragma endregion
+
+#pragma region GLSeparableShaderProgram
+
+// GL_KHR_parallel_shader_compile, not part of the generated loader
+#if !defined(GL_COMPLETION_STATUS_KHR)
+#	define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+namespace
+{
+	constexpr uint32_t ShaderCacheMagic = 0x4250534E; // "NSPB"
+	constexpr uint32_t ShaderCacheVersion = 1;
+
+	struct ShaderCacheHeader final
+	{
+		uint32_t magic = ShaderCacheMagic;
+		uint32_t version = ShaderCacheVersion;
+		uint32_t format = 0;
+		uint32_t size = 0;
+	};
+
+	// FNV-1a 64
+	uint64_t HashBytes(std::string_view bytes, uint64_t hash = 14695981039346656037ull)
+	{
+		for (const char c : bytes)
+		{
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// empty when the cache is off or the driver cannot store binaries
+	std::filesystem::path ShaderCachePath(GLenum shaderType, std::string_view sourceCode)
+	{
+		const Renderer::DeviceProperties& properties = Render.properties;
+		if (Render.shaderCacheDirectory.empty() || properties.vendor.empty())
+			return {};
+		static const bool supported = []()
+			{
+				GLint formatCount = 0;
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+				return formatCount > 0;
+			}();
+		if (!supported)
+			return {};
+
+		uint64_t hash = HashBytes(sourceCode);
+		const uint32_t stage = shaderType;
+		hash = HashBytes(std::string_view(reinterpret_cast<const char*>(&stage), sizeof(stage)), hash);
+		hash = HashBytes(properties.vendor, hash);
+		hash = HashBytes(properties.renderer, hash);
+		hash = HashBytes(properties.version, hash);
+
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+		return Render.shaderCacheDirectory / name;
+	}
+}
+
+void ShaderCache::SetDirectory(const std::filesystem::path& directory)
+{
+	Render.shaderCacheDirectory = directory;
+}
+
+const std::filesystem::path& ShaderCache::GetDirectory()
+{
+	return Render.shaderCacheDirectory;
+}
+
+const ShaderCache::Stats& ShaderCache::GetStats()
+{
+	return Render.shaderCacheStats;
+}
+
+GLSeparableShaderProgram::GLSeparableShaderProgram(GLenum shaderType, std::string_view sourceCode, bool deferred)
+{
+	createHandle(shaderType, sourceCode, deferred);
+}
+
+GLSeparableShaderProgram::GLSeparableShaderProgram(GLenum shaderType, std::span<const uint32_t> spirv, std::span<const SpecializationConstant> constants, const char* entryPoint)
+{
+	createHandle(shaderType, spirv, constants, entryPoint);
+}
+
+GLSeparableShaderProgram::~GLSeparableShaderProgram()
+{
+	destroyHandle();
+}
+
+bool GLSeparableShaderProgram::IsReady()
+{
+	if (!m_pending)
+		return true;
+	if (Render.properties.features.parallelShaderCompile)
+	{
+		GLint completed = GL_FALSE;
+		glGetProgramiv(m_handle, GL_COMPLETION_STATUS_KHR, &completed);
+		if (completed == GL_FALSE)
+			return false;
+	}
+	finish();
+	return true;
+}
+
+void GLSeparableShaderProgram::Wait()
+{
+	if (m_pending)
+		finish();
+}
+
+void GLSeparableShaderProgram::createHandle(GLenum shaderType, std::string_view sourceCode, bool deferred)
+{
+	m_cachePath = ShaderCachePath(shaderType, sourceCode);
+	if (!m_cachePath.empty() && loadBinary(m_cachePath))
+	{
+		Render.shaderCacheStats.loaded++;
+		return;
+	}
+
+	compile(shaderType, sourceCode);
+	if (!deferred)
+		finish();
+}
+
+void GLSeparableShaderProgram::createHandle(GLenum shaderType, std::span<const uint32_t> spirv, std::span<const SpecializationConstant> constants, const char* entryPoint)
+{
+	// nothing is parsed by the driver, so the module does not go to ShaderCache
+	GLuint shader = glCreateShader(shaderType);
+	glShaderBinary(1, &shader, GL_SHADER_BINARY_FORMAT_SPIR_V, spirv.data(), static_cast<GLsizei>(spirv.size_bytes()));
+	std::vector<GLuint> indices(constants.size());
+	std::vector<GLuint> values(constants.size());
+	for (size_t i = 0; i < constants.size(); i++)
+	{
+		indices[i] = constants[i].id;
+		values[i] = constants[i].value;
+	}
+	glSpecializeShader(shader, entryPoint, static_cast<GLuint>(constants.size()), indices.data(), values.data());
+
+	std::string compileLog;
+	GLint specialized = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &specialized);
+	if (specialized == GL_FALSE)
+	{
+		GLint logLength = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+		compileLog.resize(static_cast<size_t>(std::max(logLength, 1)));
+		glGetShaderInfoLog(shader, logLength, nullptr, compileLog.data());
+	}
+
+	m_handle = glCreateProgram();
+	glProgramParameteri(m_handle, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	glAttachShader(m_handle, shader);
+	glLinkProgram(m_handle);
+	glDetachShader(m_handle, shader);
+	glDeleteShader(shader);
+
+	// no reflection: a module without debug info has no names, its uniforms are set by their explicit locations
+	validate("SPIR-V module, entry point " + std::string(entryPoint), compileLog);
+}
+
+void GLSeparableShaderProgram::compile(GLenum shaderType, std::string_view sourceCode)
+{
+	NANO_PROFILE_FUNCTION();
+	// what glCreateShaderProgramv does, except that the program is marked separable and retrievable before it is linked.
+	// No status is queried here, that would wait for the driver
+	m_shader = glCreateShader(shaderType);
+	const GLchar* source = sourceCode.data();
+	const GLint length = static_cast<GLint>(sourceCode.size());
+	glShaderSource(m_shader, 1, &source, &length);
+	glCompileShader(m_shader);
+
+	m_handle = glCreateProgram();
+	glProgramParameteri(m_handle, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	glProgramParameteri(m_handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glAttachShader(m_handle, m_shader);
+	glLinkProgram(m_handle);
+	m_source = sourceCode;
+	m_pending = true;
+}
+
+void GLSeparableShaderProgram::finish()
+{
+	NANO_PROFILE_FUNCTION();
+	std::string compileLog;
+	GLint compiled = 0;
+	glGetShaderiv(m_shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled == GL_FALSE)
+	{
+		GLint logLength = 0;
+		glGetShaderiv(m_shader, GL_INFO_LOG_LENGTH, &logLength);
+		compileLog.resize(static_cast<size_t>(std::max(logLength, 1)));
+		glGetShaderInfoLog(m_shader, logLength, nullptr, compileLog.data());
+	}
+	glDetachShader(m_handle, m_shader);
+	glDeleteShader(m_shader);
+	m_shader = 0;
+
+	validate(m_source, compileLog);
+	Render.shaderCacheStats.compiled++;
+	if (m_handle != 0)
+	{
+		reflect();
+		if (!m_cachePath.empty())
+			storeBinary(m_cachePath);
+	}
+	m_source.clear();
+	m_source.shrink_to_fit();
+	m_pending = false;
+}
+
+bool GLSeparableShaderProgram::loadBinary(const std::filesystem::path& path)
+{
+	NANO_PROFILE_FUNCTION();
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	// the header is checked before the size is trusted, a truncated or foreign file never allocates more than it holds
+	std::error_code error;
+	const uintmax_t fileSize = std::filesystem::file_size(path, error);
+	ShaderCacheHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (error || !file || header.magic != ShaderCacheMagic || header.version != ShaderCacheVersion
+		|| header.size == 0 || header.size > fileSize - sizeof(header))
+	{
+		Render.shaderCacheStats.rejected++;
+		return false;
+	}
+	std::vector<char> binary(header.size);
+	file.read(binary.data(), static_cast<std::streamsize>(binary.size()));
+	if (!file)
+	{
+		Render.shaderCacheStats.rejected++;
+		return false;
+	}
+
+	m_handle = glCreateProgram();
+	glProgramParameteri(m_handle, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	glProgramBinary(m_handle, header.format, binary.data(), static_cast<GLsizei>(binary.size()));
+	GLint linked = 0;
+	glGetProgramiv(m_handle, GL_LINK_STATUS, &linked);
+	if (linked == GL_FALSE)
+	{
+		// a driver update or a different GPU, compiled again and replaced
+		Render.shaderCacheStats.rejected++;
+		destroyHandle();
+		return false;
+	}
+	reflect();
+	return true;
+}
+
+void GLSeparableShaderProgram::storeBinary(const std::filesystem::path& path) const
+{
+	GLint length = 0;
+	glGetProgramiv(m_handle, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	ShaderCacheHeader header;
+	std::vector<char> binary(static_cast<size_t>(length));
+	GLenum format = 0;
+	glGetProgramBinary(m_handle, length, nullptr, &format, binary.data());
+	header.format = format;
+	header.size = static_cast<uint32_t>(binary.size());
+
+	std::error_code error;
+	std::filesystem::create_directories(path.parent_path(), error);
+	// written next to the final name and renamed, another instance of the engine never reads half a file
+	std::filesystem::path temporary = path;
+	temporary += ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(binary.data(), static_cast<std::streamsize>(binary.size()));
+		if (!file)
+		{
+			Warning("ShaderCache: failed to write " + temporary.string());
+			return;
+		}
+	}
+	std::filesystem::rename(temporary, path, error);
+	if (error)
+		Warning("ShaderCache: failed to write " + path.string() + ": " + error.message());
+}
+
+const UniformInfo* GLSeparableShaderProgram::FindUniform(UniformName name) const noexcept
+{
+	if (m_uniformTable.empty())
+		return nullptr;
+	const uint32_t mask = static_cast<uint32_t>(m_uniformTable.size() - 1);
+	for (uint32_t slot = name.GetHash() & mask;; slot = (slot + 1) & mask)
+	{
+		const UniformSlot& entry = m_uniformTable[slot];
+		if (entry.index < 0)
+			return nullptr;
+		const UniformInfo& uniform = m_uniforms[static_cast<size_t>(entry.index)];
+		if (entry.hash == name.GetHash() && std::string_view(uniform.name).substr(0, entry.nameLength) == name.GetName())
+			return &uniform;
+	}
+}
+
+GLint GLSeparableShaderProgram::GetUniformLocation(UniformName name) const noexcept
+{
+	if (const UniformInfo* uniform = FindUniform(name))
+		return uniform->location;
+
+	// only the first element of an array of basic types is reflected, the others follow its location
+	const std::string_view text = name.GetName();
+	const size_t open = text.rfind('[');
+	if (open == text.npos || !text.ends_with(']'))
+		return -1;
+	GLint element = 0;
+	const auto [end, error] = std::from_chars(text.data() + open + 1, text.data() + text.size() - 1, element);
+	if (error != std::errc() || end != text.data() + text.size() - 1)
+		return -1;
+	const UniformInfo* array = FindUniform(UniformName(text.substr(0, open)));
+	return array && array->location >= 0 && element >= 0 && element < array->arraySize ? array->location + element : -1;
+}
+
+void GLSeparableShaderProgram::reflect()
+{
+	m_uniforms.clear();
+	m_uniformTable.clear();
+
+	GLint count = 0;
+	glGetProgramInterfaceiv(m_handle, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+	GLint maxNameLength = 0;
+	glGetProgramInterfaceiv(m_handle, GL_UNIFORM, GL_MAX_NAME_LENGTH, &maxNameLength);
+	if (count <= 0)
+		return;
+
+	constexpr std::array<GLenum, 6> properties = { GL_NAME_LENGTH, GL_LOCATION, GL_TYPE, GL_ARRAY_SIZE, GL_BLOCK_INDEX, GL_OFFSET };
+	std::string name(static_cast<size_t>(std::max(maxNameLength, 1)), '\0');
+	m_uniforms.reserve(static_cast<size_t>(count));
+	for (GLint i = 0; i < count; i++)
+	{
+		std::array<GLint, properties.size()> values{};
+		glGetProgramResourceiv(m_handle, GL_UNIFORM, static_cast<GLuint>(i), static_cast<GLsizei>(properties.size()), properties.data(), static_cast<GLsizei>(values.size()), nullptr, values.data());
+		GLsizei length = 0;
+		glGetProgramResourceName(m_handle, GL_UNIFORM, static_cast<GLuint>(i), static_cast<GLsizei>(name.size()), &length, name.data());
+
+		UniformInfo& uniform = m_uniforms.emplace_back();
+		uniform.name.assign(name.data(), static_cast<size_t>(length));
+		uniform.location = values[1];
+		uniform.type = static_cast<GLenum>(values[2]);
+		uniform.arraySize = values[3];
+		uniform.blockIndex = values[4];
+		uniform.offset = values[4] >= 0 ? values[5] : -1;
+	}
+
+	// arrays are reported as "name[0]", the table also answers to "name"
+	size_t names = m_uniforms.size();
+	for (const UniformInfo& uniform : m_uniforms)
+		if (uniform.name.ends_with("[0]")) names++;
+	size_t capacity = 16;
+	while (capacity < names * 2) capacity *= 2;
+	m_uniformTable.resize(capacity);
+
+	for (size_t i = 0; i < m_uniforms.size(); i++)
+	{
+		const std::string_view uniformName = m_uniforms[i].name;
+		if (uniformName.empty())
+			continue;
+		insertUniform(uniformName, static_cast<uint32_t>(i));
+		if (uniformName.ends_with("[0]"))
+			insertUniform(uniformName.substr(0, uniformName.size() - 3), static_cast<uint32_t>(i));
+	}
+}
+
+void GLSeparableShaderProgram::insertUniform(std::string_view name, uint32_t index)
+{
+	const uint32_t hash = UniformName::Hash(name);
+	const uint32_t mask = static_cast<uint32_t>(m_uniformTable.size() - 1);
+	for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+	{
+		UniformSlot& entry = m_uniformTable[slot];
+		if (entry.index < 0)
+		{
+			entry.hash = hash;
+			entry.index = static_cast<int32_t>(index);
+			entry.nameLength = static_cast<uint32_t>(name.size());
+			return;
+		}
+		// a colliding hash probes on, only the same name is dropped
+		if (entry.hash == hash && std::string_view(m_uniforms[static_cast<size_t>(entry.index)].name).substr(0, entry.nameLength) == name)
+			return;
+	}
+}
+
+void GLSeparableShaderProgram::destroyHandle()
+{
+	if (m_shader != 0)
+		glDeleteShader(m_shader);
+	m_shader = 0;
+	if (m_handle != 0)
+		glDeleteProgram(m_handle);
+	m_handle = 0;
+	m_pending = false;
+	m_uniforms.clear();
+	m_uniformTable.clear();
+}
+
+void GLSeparableShaderProgram::validate(std::string_view sourceCode, std::string_view compileLog)
+{
+	GLint compiled = 0;
+	glGetProgramiv(m_handle, GL_LINK_STATUS, &compiled);
+	if (compiled == GL_FALSE)
+	{
+		std::array<char, 1024> compiler_log;
+		compiler_log[0] = '\0';
+		glGetProgramInfoLog(m_handle, (GLsizei)compiler_log.size(), nullptr, compiler_log.data());
+
+		std::ostringstream message;
+		// the source ends with the file names behind the source string numbers of the log, see LoadShaderTextFile
+		message << "shader contains error(s):\n\n" << sourceCode << "\n\n" << compileLog << compiler_log.data() << '\n';
+		Error(message.str());
+		glDeleteProgram(m_handle);
+		m_handle = 0;
+	}
+}
+
+std::vector<uint32_t> LoadShaderSpirvFile(const std::filesystem::path& path)
+{
+	constexpr uint32_t SpirvMagic = 0x07230203;
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		return {};
+
+	const std::streamoff size = file.tellg();
+	std::vector<uint32_t> module(size > 0 ? static_cast<size_t>(size) / sizeof(uint32_t) : 0);
+	file.seekg(0);
+	if (!module.empty())
+		file.read(reinterpret_cast<char*>(module.data()), static_cast<std::streamsize>(module.size() * sizeof(uint32_t)));
+	if (!file || module.empty() || module[0] != SpirvMagic || size % sizeof(uint32_t) != 0)
+	{
+		Warning("'" + path.string() + "' is not a SPIR-V module");
+		return {};
+	}
+	return module;
+}
+
+namespace
+{
+	// the defines go right after #version, #line keeps the line numbers of the compiler log
+	std::string InjectShaderDefines(std::string_view source, std::string_view defines)
+	{
+		const size_t version = source.find("#version");
+		if (defines.empty() || version == source.npos)
+			return std::string(source);
+
+		size_t insert = source.find('\n', version);
+		insert = insert == source.npos ? source.size() : insert + 1;
+		const size_t line = static_cast<size_t>(std::count(source.begin(), source.begin() + static_cast<ptrdiff_t>(insert), '\n')) + 1;
+
+		std::string result(source.substr(0, insert));
+		if (result.back() != '\n')
+			result += '\n';
+		result += defines;
+		result += "#line " + std::to_string(line) + "\n";
+		result += source.substr(insert);
+		return result;
+	}
+}
+
+GLSeparableShaderProgramRef LoadShaderProgram(GLenum shaderType, const std::filesystem::path& path, std::span<const SpecializationConstant> constants)
+{
+	std::filesystem::path spirvPath = path;
+	spirvPath += ".spv";
+	std::error_code error;
+	const auto spirvTime = std::filesystem::last_write_time(spirvPath, error);
+	if (!error)
+	{
+		const auto sourceTime = std::filesystem::last_write_time(path, error);
+		if (!error && sourceTime > spirvTime)
+			Warning("'" + spirvPath.string() + "' is older than its source, the GLSL text is compiled instead");
+		else if (const std::vector<uint32_t> module = LoadShaderSpirvFile(spirvPath); !module.empty())
+			return std::make_shared<GLSeparableShaderProgram>(shaderType, module, constants);
+	}
+
+	// the GLSL text gets the constants as SPECIALIZATION_CONSTANT_<id>, so it builds the same variant as the module. The value is the bits
+	// as an int literal (a uint one above INT_MAX), a float constant is read with intBitsToFloat
+	std::string defines;
+	for (const SpecializationConstant& constant : constants)
+	{
+		defines += "#define SPECIALIZATION_CONSTANT_" + std::to_string(constant.id) + " " + std::to_string(constant.value)
+			+ (constant.value > static_cast<GLuint>(INT32_MAX) ? "u\n" : "\n");
+	}
+	return std::make_shared<GLSeparableShaderProgram>(shaderType, InjectShaderDefines(LoadShaderTextFile(path), defines));
 }
 
 #pragma endregion
@@ -471,28 +1686,28 @@ void GLProgramPipeline::Bind()
 	glBindProgramPipeline(m_handle);
 }
 
-GLint GLProgramPipeline::GetVertexUniform(const std::string& name) const
+GLint GLProgramPipeline::GetVertexUniform(UniformName name) const noexcept
 {
 	if (!m_vertexShader) return -1;
-	return glGetUniformLocation(*m_vertexShader, name.c_str());
+	return m_vertexShader->GetUniformLocation(name);
 }
 
-GLint GLProgramPipeline::GetGeometryUniform(const std::string& name) const
+GLint GLProgramPipeline::GetGeometryUniform(UniformName name) const noexcept
 {
 	if (!m_geometryShader) return -1;
-	return glGetUniformLocation(*m_geometryShader, name.c_str());
+	return m_geometryShader->GetUniformLocation(name);
 }
 
-GLint GLProgramPipeline::GetFragmentUniform(const std::string& name) const
+GLint GLProgramPipeline::GetFragmentUniform(UniformName name) const noexcept
 {
 	if (!m_fragmentShader) return -1;
-	return glGetUniformLocation(*m_fragmentShader, name.c_str());
+	return m_fragmentShader->GetUniformLocation(name);
 }
 
-GLint GLProgramPipeline::GetComputeUniform(const std::string& name) const
+GLint GLProgramPipeline::GetComputeUniform(UniformName name) const noexcept
 {
 	if (!m_computeShader) return -1;
-	return glGetUniformLocation(*m_computeShader, name.c_str());
+	return m_computeShader->GetUniformLocation(name);
 }
 
 void GLProgramPipeline::createHandle()
@@ -536,77 +1751,249 @@ void GLProgramPipeline::setSeparableShaders(GLSeparableShaderProgramRef vertexSh
 	}
 }
 
-#pragma endregion
-
-#pragma region GLBuffer
+ShaderBuild::ShaderBuild(std::string_view vertexShaderCode, std::string_view fragmentShaderCode)
+{
+	m_stages.push_back(std::make_shared<GLSeparableShaderProgram>((GLenum)GL_VERTEX_SHADER, vertexShaderCode, true));
+	m_stages.push_back(std::make_shared<GLSeparableShaderProgram>((GLenum)GL_FRAGMENT_SHADER, fragmentShaderCode, true));
+}
 
-GLBuffer::~GLBuffer()
+ShaderBuild::ShaderBuild(std::string_view computeShaderCode)
 {
-	destroyHandle();
+	m_stages.push_back(std::make_shared<GLSeparableShaderProgram>((GLenum)GL_COMPUTE_SHADER, computeShaderCode, true));
 }
 
-void* GLBuffer::MapRange(GLintptr offset, GLsizeiptr size, GLbitfield accessFlags)
+ShaderBuildRef ShaderBuild::FromFiles(const std::filesystem::path& vertexPath, const std::filesystem::path& fragmentPath)
 {
-	assert(m_handle);
-	return glMapNamedBufferRange(m_handle, offset, size, accessFlags);
+	auto build = std::make_shared<ShaderBuild>(LoadShaderTextFile(vertexPath), LoadShaderTextFile(fragmentPath));
+	build->watch(vertexPath);
+	build->watch(fragmentPath);
+	return build;
 }
 
-void* GLBuffer::Map(GLbitfield access)
+bool ShaderBuild::IsReady()
 {
-	assert(m_handle);
-	return glMapNamedBuffer(m_handle, access);
+	if (m_finished)
+		return true;
+	for (const GLSeparableShaderProgramRef& stage : m_stages)
+	{
+		if (!stage->IsReady())
+			return false;
+	}
+
+	// the pipeline takes linked programs only
+	m_finished = true;
+	if (std::all_of(m_stages.begin(), m_stages.end(), [](const GLSeparableShaderProgramRef& stage) { return stage->IsValid(); }))
+		m_program = m_stages.size() == 1 ? std::make_shared<GLProgramPipeline>(m_stages[0]) : std::make_shared<GLProgramPipeline>(m_stages[0], m_stages[1]);
+	m_stages.clear();
+	return true;
 }
 
-void GLBuffer::FlushMappedRange(GLintptr offset, GLsizeiptr size)
+GLProgramPipelineRef ShaderBuild::Wait()
 {
-	assert(m_handle);
-	glFlushMappedNamedBufferRange(m_handle, offset, size);
+	for (const GLSeparableShaderProgramRef& stage : m_stages)
+		stage->Wait();
+	(void)IsReady();
+	return m_program;
 }
 
-void GLBuffer::Unmap()
+GLProgramPipelineRef ShaderBuild::GetProgram() const
 {
-	assert(m_handle);
-	glUnmapNamedBuffer(m_handle);
+	return m_program;
 }
 
-void GLBuffer::createHandle()
+bool ShaderBuild::IsOutdated() const
 {
-	glCreateBuffers(1, &m_handle);
+	for (const auto& [path, writeTime] : m_dependencies)
+	{
+		std::error_code error;
+		if (std::filesystem::last_write_time(path, error) != writeTime && !error)
+			return true;
+	}
+	return false;
 }
 
-void GLBuffer::destroyHandle()
+void ShaderBuild::watch(const std::filesystem::path& path)
 {
-	if (m_handle != 0)
-		glDeleteBuffers(1, &m_handle);
-	m_handle = 0;
+	for (const std::filesystem::path& dependency : GetShaderDependencies(path))
+	{
+		std::error_code error;
+		m_dependencies.emplace_back(dependency, std::filesystem::last_write_time(dependency, error));
+	}
 }
 
-#pragma endregion
+namespace
+{
+	constexpr std::array<std::string_view, 4> ShaderFeatureKeywords = { "SKINNED", "NORMAL_MAP", "ALPHA_TEST", "OVERDRAW" };
+	constexpr std::string_view ShaderFeaturesPragma = "#pragma features";
 
-#pragma region GLVertexArray
+	ShaderFeatures ParseShaderFeatures(std::string_view source)
+	{
+		ShaderFeatures features;
+		size_t position = 0;
+		while ((position = source.find(ShaderFeaturesPragma, position)) != source.npos)
+		{
+			position += ShaderFeaturesPragma.size();
+			const size_t end = std::min(source.find('\n', position), source.size());
+			std::istringstream line(std::string(source.substr(position, end - position)));
+			std::string keyword;
+			while (line >> keyword)
+			{
+				const auto it = std::find(ShaderFeatureKeywords.begin(), ShaderFeatureKeywords.end(), keyword);
+				if (it == ShaderFeatureKeywords.end())
+					Warning("Unknown shader feature '" + keyword + "'");
+				else
+					features |= ShaderFeatures(1u << static_cast<uint32_t>(it - ShaderFeatureKeywords.begin()));
+			}
+			position = end;
+		}
+		return features;
+	}
 
-GLVertexArray::GLVertexArray()
-{
-	createHandle();
+	std::string InjectShaderFeatures(std::string_view source, ShaderFeatures features)
+	{
+		std::string defines;
+		for (size_t i = 0; i < ShaderFeatureKeywords.size(); i++)
+		{
+			if (features & ShaderFeatures(1u << i))
+				defines += "#define " + std::string(ShaderFeatureKeywords[i]) + "\n";
+		}
+		return InjectShaderDefines(source, defines);
+	}
 }
 
-GLVertexArray::GLVertexArray(GLBufferRef vbo, const std::vector<AttribFormat>& attribFormats)
-	: GLVertexArray(vbo, nullptr, attribFormats)
+ShaderPermutations::ShaderPermutations(std::string_view vertexShaderCode, std::string_view fragmentShaderCode)
+	: m_vertexSource(vertexShaderCode)
+	, m_fragmentSource(fragmentShaderCode)
+	, m_vertexFeatures(ParseShaderFeatures(vertexShaderCode))
+	, m_fragmentFeatures(ParseShaderFeatures(fragmentShaderCode))
 {
 }
 
-GLVertexArray::GLVertexArray(GLBufferRef vbo, GLBufferRef ibo, const std::vector<AttribFormat>& attribFormats)
+std::string_view ShaderPermutations::GetKeyword(ShaderFeature feature)
 {
-	createHandle();
-	setAttribFormats(attribFormats);
-
-	if (::IsValid(vbo)) setVertexBuffer(vbo);
-	if (::IsValid(ibo)) setIndexBuffer(ibo);
+	for (size_t i = 0; i < ShaderFeatureKeywords.size(); i++)
+	{
+		if (static_cast<uint32_t>(feature) == (1u << i))
+			return ShaderFeatureKeywords[i];
+	}
+	return {};
 }
 
-GLVertexArray::~GLVertexArray()
+ShaderFeatures ShaderPermutations::GetFeatures() const noexcept
 {
-	destroyHandle();
+	return m_vertexFeatures | m_fragmentFeatures;
+}
+
+void ShaderPermutations::Prepare(ShaderFeatures features)
+{
+	if (m_variants.contains(static_cast<uint32_t>(features & GetFeatures())))
+		return;
+	(void)stage(m_vertexStages, GL_VERTEX_SHADER, features & m_vertexFeatures, true);
+	(void)stage(m_fragmentStages, GL_FRAGMENT_SHADER, features & m_fragmentFeatures, true);
+}
+
+GLProgramPipelineRef ShaderPermutations::Get(ShaderFeatures features)
+{
+	const uint32_t key = static_cast<uint32_t>(features & GetFeatures());
+	if (const auto it = m_variants.find(key); it != m_variants.end())
+		return it->second;
+
+	const GLSeparableShaderProgramRef& vertex = stage(m_vertexStages, GL_VERTEX_SHADER, features & m_vertexFeatures, false);
+	const GLSeparableShaderProgramRef& fragment = stage(m_fragmentStages, GL_FRAGMENT_SHADER, features & m_fragmentFeatures, false);
+	vertex->Wait();
+	fragment->Wait();
+	// a failed variant is kept as nullptr and not built again every frame
+	GLProgramPipelineRef program;
+	if (vertex->IsValid() && fragment->IsValid())
+		program = std::make_shared<GLProgramPipeline>(vertex, fragment);
+	m_variants.emplace(key, program);
+	return program;
+}
+
+size_t ShaderPermutations::GetVariantCount() const noexcept
+{
+	return m_variants.size();
+}
+
+const GLSeparableShaderProgramRef& ShaderPermutations::stage(std::unordered_map<uint32_t, GLSeparableShaderProgramRef>& stages, GLenum shaderType, ShaderFeatures features, bool deferred)
+{
+	GLSeparableShaderProgramRef& program = stages[static_cast<uint32_t>(features)];
+	if (!program)
+		program = std::make_shared<GLSeparableShaderProgram>(shaderType, InjectShaderFeatures(shaderType == GL_VERTEX_SHADER ? m_vertexSource : m_fragmentSource, features), deferred);
+	return program;
+}
+
+#pragma endregion
+
+#pragma region GLBuffer
+
+GLBuffer::~GLBuffer()
+{
+	destroyHandle();
+}
+
+void* GLBuffer::MapRange(GLintptr offset, GLsizeiptr size, GLbitfield accessFlags)
+{
+	assert(m_handle);
+	return glMapNamedBufferRange(m_handle, offset, size, accessFlags);
+}
+
+void* GLBuffer::Map(GLbitfield access)
+{
+	assert(m_handle);
+	return glMapNamedBuffer(m_handle, access);
+}
+
+void GLBuffer::FlushMappedRange(GLintptr offset, GLsizeiptr size)
+{
+	assert(m_handle);
+	glFlushMappedNamedBufferRange(m_handle, offset, size);
+}
+
+void GLBuffer::Unmap()
+{
+	assert(m_handle);
+	glUnmapNamedBuffer(m_handle);
+}
+
+void GLBuffer::createHandle()
+{
+	glCreateBuffers(1, &m_handle);
+}
+
+void GLBuffer::destroyHandle()
+{
+	if (m_handle != 0)
+		glDeleteBuffers(1, &m_handle);
+	m_handle = 0;
+}
+
+#pragma endregion
+
+#pragma region GLVertexArray
+
+GLVertexArray::GLVertexArray()
+{
+	createHandle();
+}
+
+GLVertexArray::GLVertexArray(GLBufferRef vbo, const std::vector<AttribFormat>& attribFormats)
+	: GLVertexArray(vbo, nullptr, attribFormats)
+{
+}
+
+GLVertexArray::GLVertexArray(GLBufferRef vbo, GLBufferRef ibo, const std::vector<AttribFormat>& attribFormats)
+{
+	createHandle();
+	setAttribFormats(attribFormats);
+
+	if (::IsValid(vbo)) setVertexBuffer(vbo);
+	if (::IsValid(ibo)) setIndexBuffer(ibo);
+}
+
+GLVertexArray::~GLVertexArray()
+{
+	destroyHandle();
 }
 
 void GLVertexArray::Bind()
@@ -630,6 +2017,22 @@ void GLVertexArray::DrawTriangles()
 	}
 }
 
+void GLVertexArray::DrawTrianglesInstanced(GLsizei instanceCount, GLuint baseInstance)
+{
+	Bind();
+
+	if (!m_ibo)
+	{
+		glDrawArraysInstancedBaseInstance(GL_TRIANGLES, 0, m_vbo->GetElementCount(), instanceCount, baseInstance);
+	}
+	else
+	{
+		const GLenum type = (m_ibo->GetElementSize() == sizeof(uint8_t) ? GL_UNSIGNED_BYTE
+			: (m_ibo->GetElementSize() == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT));
+		glDrawElementsInstancedBaseInstance(GL_TRIANGLES, m_ibo->GetElementCount(), type, nullptr, instanceCount, baseInstance);
+	}
+}
+
 void GLVertexArray::createHandle()
 {
 	glCreateVertexArrays(1, &m_handle);
@@ -719,6 +2122,7 @@ GLTexture2D::GLTexture2D(GLenum internalFormat, GLenum format, GLenum dataType,
 
 GLTexture2D::GLTexture2D(std::string_view filepath, int comp, bool generateMipMaps)
 {
+	NANO_PROFILE_FUNCTION();
 	if (!std::filesystem::exists(filepath))
 	{
 		Error("File '" + std::string(filepath.data()) + "' does not exist.");
@@ -734,6 +2138,12 @@ GLTexture2D::GLTexture2D(std::string_view filepath, int comp, bool generateMipMa
 	}
 
 	const auto [internalFormat, format] = STBImageToOpenGLFormat((comp));
+	if (comp == STBI_rgb_alpha && c == STBI_rgb_alpha)
+	{
+		const size_t texels = static_cast<size_t>(w) * static_cast<size_t>(h);
+		for (size_t i = 0; i < texels && !m_transparent; i++)
+			m_transparent = data[i * 4 + 3] != 255;
+	}
 
 	createHandle();
 	createTexture(internalFormat, format, GL_UNSIGNED_BYTE, w, h, data, GL_LINEAR, GL_REPEAT, glm::vec4(0.0f), generateMipMaps);
@@ -882,6 +2292,7 @@ void GLTexture2DArray::fillSubImage(int level, glm::ivec3 offset, glm::ivec3 siz
 
 GLTextureCube::GLTextureCube(const std::array<std::string_view, 6>& filepath, int comp)
 {
+	NANO_PROFILE_FUNCTION();
 	int x, y, c;
 	std::array<stbi_uc*, 6> faces;
 
@@ -1141,6 +2552,11 @@ void QueryGlDeviceProperties()
 			features.bindlessTextures = true;
 		}
 
+		if (extensionString == "GL_KHR_parallel_shader_compile")
+		{
+			features.parallelShaderCompile = true;
+		}
+
 		if (extensionString == "GL_KHR_shader_subgroup")
 		{
 			features.shaderSubgroup = true;
@@ -1185,11 +2601,37 @@ bool Renderer::Init()
 	Print("    > Version:  " + std::string(Render.properties.version.data()));
 	Print("    > GLSL:     " + std::string(Render.properties.shadingLanguageVersion.data()));
 
+	if (Render.properties.features.parallelShaderCompile)
+	{
+		// as many compiler threads as the driver wants, see ShaderBuild
+		using MaxShaderCompilerThreadsProc = void (GLAD_API_PTR*)(GLuint count);
+		const auto maxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsProc>(glfwGetProcAddress("glMaxShaderCompilerThreadsKHR"));
+		if (maxShaderCompilerThreads)
+			maxShaderCompilerThreads(0xFFFFFFFF);
+		else
+			Render.properties.features.parallelShaderCompile = false;
+	}
+
 	return true;
 }
 
 void Renderer::Close()
 {
+	for (GPUProfilerFrame& frame : GPUProfile.frames)
+	{
+		if (!frame.queries.empty())
+			glDeleteQueries(static_cast<GLsizei>(frame.queries.size()), frame.queries.data());
+		for (const std::vector<GLuint>& queries : frame.statisticQueries)
+		{
+			if (!queries.empty())
+				glDeleteQueries(static_cast<GLsizei>(queries.size()), queries.data());
+		}
+		frame = {};
+	}
+	GPUProfile.passes.clear();
+	GPUProfile.results.clear();
+	GPUProfile.stack.clear();
+	GPUProfile.inFrame = false;
 }
 
 const Renderer::DeviceProperties& Renderer::GetDeviceProperties()
@@ -1241,1137 +2683,5987 @@ void Renderer::SetScissor(GLint x, GLint y, GLsizei width, GLsizei height)
 	glScissor(x, y, width, height);
 }
 
-#pragma endregion
+namespace
+{
+	GPUProfilerFrame& CurrentGPUProfilerFrame()
+	{
+		return GPUProfile.frames[GPUProfile.frame % GPUProfiler::FrameLatency];
+	}
 
-//==============================================================================
-// Graphics
-//==============================================================================
-#pragma region Graphics
+	uint32_t WriteGPUTimestamp(GPUProfilerFrame& frame)
+	{
+		if (frame.usedQueries == frame.queries.size())
+		{
+			const size_t count = std::max<size_t>(frame.queries.size(), 16);
+			frame.queries.resize(frame.queries.size() + count);
+			glCreateQueries(GL_TIMESTAMP, static_cast<GLsizei>(count), frame.queries.data() + frame.usedQueries);
+		}
+		glQueryCounter(frame.queries[frame.usedQueries], GL_TIMESTAMP);
+		return frame.usedQueries++;
+	}
+
+	uint32_t FindGPUProfilerPass(std::string_view name, uint32_t parent)
+	{
+		for (uint32_t i = 0; i < GPUProfile.passes.size(); i++)
+		{
+			if (GPUProfile.passes[i].parent == parent && GPUProfile.passes[i].name == name)
+				return i;
+		}
+		GPUProfilerPass& pass = GPUProfile.passes.emplace_back();
+		pass.name = name;
+		pass.parent = parent;
+		pass.depth = parent == InvalidGPUScope ? 0 : GPUProfile.passes[parent].depth + 1;
+		return static_cast<uint32_t>(GPUProfile.passes.size() - 1);
+	}
 
-constexpr const char* UniformDiffuseColorName = "uDiffuseColor";
-constexpr const char* UniformAmbientColorName = "uAmbientColor";
-constexpr const char* UniformSpecularColorName = "uSpecularColor";
-constexpr const char* UniformShininessName = "uShininess";
-constexpr const char* UniformRefractiName = "uRefracti";
+	void EndGPUStatisticSegment(GPUProfilerFrame& frame)
+	{
+		if (!frame.segmentOpen)
+			return;
+		for (const auto& [target, counter] : GPUPipelineStatistics)
+			glEndQuery(target);
+		frame.segmentOpen = false;
+	}
 
-#pragma region Node
+	void BeginGPUStatisticSegment(GPUProfilerFrame& frame, uint32_t pass)
+	{
+		EndGPUStatisticSegment(frame);
+		const size_t segment = frame.statisticSegments.size();
+		for (size_t i = 0; i < GPUPipelineStatistics.size(); i++)
+		{
+			std::vector<GLuint>& queries = frame.statisticQueries[i];
+			if (segment == queries.size())
+			{
+				const size_t count = std::max<size_t>(queries.size(), 16);
+				queries.resize(queries.size() + count);
+				glCreateQueries(GPUPipelineStatistics[i].first, static_cast<GLsizei>(count), queries.data() + segment);
+			}
+			glBeginQuery(GPUPipelineStatistics[i].first, queries[segment]);
+		}
+		frame.statisticSegments.push_back(pass);
+		frame.segmentOpen = true;
+	}
 
-void Node::SetParent(Node* parent)
-{
-	if (m_parent == parent) m_parent = nullptr;
-	else m_parent = parent;
-}
+	// the results of a frame from FrameLatency frames ago, a frame the GPU has not finished yet is dropped rather than waited for
+	void ResolveGPUProfilerFrame(GPUProfilerFrame& frame)
+	{
+		if (frame.scopes.empty())
+			return;
 
-void Node::SetTransform(const Transform&)
-{
-}
+		bool available = true;
+		for (uint32_t i = 0; i < frame.usedQueries && available; i++)
+		{
+			GLint result = GL_FALSE;
+			glGetQueryObjectiv(frame.queries[i], GL_QUERY_RESULT_AVAILABLE, &result);
+			available = result != GL_FALSE;
+		}
+		for (size_t i = 0; i < frame.statisticSegments.size() && available; i++)
+		{
+			for (const std::vector<GLuint>& queries : frame.statisticQueries)
+			{
+				GLint result = GL_FALSE;
+				glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &result);
+				available = available && result != GL_FALSE;
+			}
+		}
+		if (!available)
+		{
+			GPUProfile.dropped++;
+			return;
+		}
 
-void Node::SetSize(const glm::vec3&)
-{
+		// a flight recorder that does not take them keeps only the newest
+		if (GPUProfile.results.size() >= GPUProfiler::FrameLatency * 4)
+			GPUProfile.results.erase(GPUProfile.results.begin());
+		GPUProfilerResult& result = GPUProfile.results.emplace_back();
+		result.frame = frame.index;
+		for (const GPUProfilerScope& scope : frame.scopes)
+		{
+			if (scope.endQuery == InvalidGPUScope)
+				continue;
+			GLuint64 begin = 0;
+			GLuint64 end = 0;
+			glGetQueryObjectui64v(frame.queries[scope.beginQuery], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(frame.queries[scope.endQuery], GL_QUERY_RESULT, &end);
+
+			GPUProfilerPass& pass = GPUProfile.passes[scope.pass];
+			pass.last = static_cast<float>(end > begin ? end - begin : 0) * 1e-6f;
+			pass.history[pass.next] = pass.last;
+			pass.next = (pass.next + 1) % GPUProfiler::HistorySize;
+			pass.count = std::min(pass.count + 1, GPUProfiler::HistorySize);
+
+			// a pass with several scopes in the frame adds up
+			auto it = std::find_if(result.passMs.begin(), result.passMs.end(), [&](const auto& entry) { return entry.first == scope.pass; });
+			if (it == result.passMs.end())
+				result.passMs.emplace_back(scope.pass, pass.last);
+			else
+				it->second += pass.last;
+		}
+
+		if (!frame.statistics)
+			return;
+		for (GPUProfilerPass& pass : GPUProfile.passes)
+			pass.statistics = {};
+		for (size_t segment = 0; segment < frame.statisticSegments.size(); segment++)
+		{
+			GPUProfilerPass& pass = GPUProfile.passes[frame.statisticSegments[segment]];
+			for (size_t i = 0; i < GPUPipelineStatistics.size(); i++)
+			{
+				GLuint64 value = 0;
+				glGetQueryObjectui64v(frame.statisticQueries[i][segment], GL_QUERY_RESULT, &value);
+				pass.statistics.*GPUPipelineStatistics[i].second += value;
+			}
+		}
+		// a pass comes after its parent, so walking back adds the children before their parent is added to its own
+		for (size_t i = GPUProfile.passes.size(); i-- > 0;)
+		{
+			const GPUProfilerPass& pass = GPUProfile.passes[i];
+			if (pass.parent == InvalidGPUScope)
+				continue;
+			for (const auto& [target, counter] : GPUPipelineStatistics)
+				GPUProfile.passes[pass.parent].statistics.*counter += pass.statistics.*counter;
+		}
+	}
 }
 
-void Node::AddChild(Node* child)
+void GPUProfiler::SetEnabled(bool enabled)
 {
-	auto it = std::find(m_children.begin(), m_children.end(), child);
-	if (it != m_children.end())
-		m_children.erase(it);
-	else
-		m_children.push_back(child);
+	GPUProfile.enabled = enabled;
 }
 
-void Node::Draw()
+bool GPUProfiler::IsEnabled()
 {
-	for (auto i : m_children)
-		i->Draw();
+	return GPUProfile.enabled;
 }
 
-Node* Node::GetParent()
+void GPUProfiler::SetPipelineStatisticsEnabled(bool enabled)
 {
-	return m_parent;
+	GPUProfile.statistics = enabled;
 }
 
-std::vector<Node*> Node::GetChildren()
+bool GPUProfiler::IsPipelineStatisticsEnabled()
 {
-	return m_children;
+	return GPUProfile.statistics;
 }
 
-glm::vec3 Node::GetSize()
+void GPUProfiler::BeginFrame()
 {
-	return glm::vec3(1.0f);
+	GPUProfile.frame++;
+	GPUProfilerFrame& frame = CurrentGPUProfilerFrame();
+	ResolveGPUProfilerFrame(frame);
+	frame.index = GPUProfile.frame;
+	frame.usedQueries = 0;
+	frame.scopes.clear();
+	frame.statisticSegments.clear();
+	frame.statistics = GPUProfile.enabled && GPUProfile.statistics;
+	frame.segmentOpen = false;
+	GPUProfile.stack.clear();
+	GPUProfile.inFrame = true;
+	BeginScope("Frame");
 }
 
-Transform Node::GetFinalTransform(Node* node, Transform tr)
+void GPUProfiler::EndFrame()
 {
-	if (node->GetParent())
-		tr = Node::GetFinalTransform(node->GetParent(), node->GetParent()->GetTransform()) * tr;
-	return tr;
+	// scopes left open by the frame are closed with it
+	while (!GPUProfile.stack.empty())
+		EndScope();
+	GPUProfile.inFrame = false;
 }
 
-#pragma endregion
-
-#pragma region MeshVertex
-
-void MeshVertex::AddBoneData(uint32_t boneID, float weight)
+void GPUProfiler::BeginScope(std::string_view name)
 {
-	for (uint32_t i = 0; i < MAX_NUM_BONES_PER_VERTEX; i++)
+	glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, static_cast<GLsizei>(name.size()), name.data());
+	if (!GPUProfile.enabled || !GPUProfile.inFrame)
 	{
-		if (weights[i] == 0.0f)
-		{
-			boneIDs[i] = boneID;
-			weights[i] = weight;
-			return;
-		}
+		GPUProfile.stack.push_back(InvalidGPUScope);
+		return;
 	}
-	Warning("Vertex has more than " + std::to_string(MAX_NUM_BONES_PER_VERTEX) + " bones!");
-}
-
-#pragma endregion
 
-#pragma region Mesh
+	GPUProfilerFrame& frame = CurrentGPUProfilerFrame();
+	uint32_t parent = InvalidGPUScope;
+	for (auto it = GPUProfile.stack.rbegin(); it != GPUProfile.stack.rend() && parent == InvalidGPUScope; ++it)
+	{
+		if (*it != InvalidGPUScope)
+			parent = frame.scopes[*it].pass;
+	}
 
-Mesh::Mesh(const std::vector<MeshVertex>& vertices, const std::vector<uint32_t>& indices, const std::vector<MaterialTexture>& textures, const MaterialProperties& materialProperties)
-	: m_vertices(vertices)
-	, m_indices(indices)
-	, m_textures(textures)
-	, m_materialProp(materialProperties)
-{
-	init();
+	GPUProfilerScope scope;
+	scope.pass = FindGPUProfilerPass(name, parent);
+	scope.beginQuery = WriteGPUTimestamp(frame);
+	scope.endQuery = InvalidGPUScope;
+	GPUProfile.stack.push_back(static_cast<uint32_t>(frame.scopes.size()));
+	frame.scopes.push_back(scope);
+	if (frame.statistics)
+		BeginGPUStatisticSegment(frame, scope.pass);
 }
 
-AABB Mesh::GetBounding() const
+void GPUProfiler::EndScope()
 {
-	return m_bounding;
+	if (GPUProfile.stack.empty())
+		return;
+	const uint32_t index = GPUProfile.stack.back();
+	GPUProfile.stack.pop_back();
+	if (index != InvalidGPUScope)
+	{
+		GPUProfilerFrame& frame = CurrentGPUProfilerFrame();
+		frame.scopes[index].endQuery = WriteGPUTimestamp(frame);
+		if (frame.statistics)
+		{
+			// the parent measures again until its next child
+			EndGPUStatisticSegment(frame);
+			for (auto it = GPUProfile.stack.rbegin(); it != GPUProfile.stack.rend(); ++it)
+			{
+				if (*it != InvalidGPUScope)
+				{
+					BeginGPUStatisticSegment(frame, frame.scopes[*it].pass);
+					break;
+				}
+			}
+		}
+	}
+	glPopDebugGroup();
 }
 
-std::vector<glm::vec3> Mesh::GetTriangle() const
+std::vector<GPUProfiler::PassStats> GPUProfiler::GetStats()
 {
-	std::vector<glm::vec3> triangles;
-	for (size_t i = 0; i < m_vertices.size(); i++)
-		triangles.push_back(m_vertices[i].position);
-	return triangles;
+	std::vector<PassStats> stats;
+	stats.reserve(GPUProfile.passes.size());
+	std::vector<float> sorted;
+	for (const GPUProfilerPass& pass : GPUProfile.passes)
+	{
+		PassStats& result = stats.emplace_back();
+		result.name = pass.name;
+		result.depth = pass.depth;
+		result.statistics = pass.statistics;
+		if (pass.count == 0)
+			continue;
+
+		sorted.assign(pass.history.begin(), pass.history.begin() + pass.count);
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&](float p) { return sorted[std::min(static_cast<size_t>(p * static_cast<float>(sorted.size())), sorted.size() - 1)]; };
+		result.lastMs = pass.last;
+		result.averageMs = std::accumulate(sorted.begin(), sorted.end(), 0.0f) / static_cast<float>(sorted.size());
+		result.medianMs = percentile(0.5f);
+		result.p95Ms = percentile(0.95f);
+		result.p99Ms = percentile(0.99f);
+		result.maxMs = sorted.back();
+	}
+	return stats;
 }
 
-GLVertexArrayRef Mesh::GetVAO()
+uint64_t GPUProfiler::GetDroppedFrames()
 {
-	return m_vao;
+	return GPUProfile.dropped;
 }
 
-void Mesh::Draw(const GLProgramPipelineRef& program)
+void GPUProfiler::DrawImGui(const char* title)
 {
-	assert(::IsValid(program));
-	assert(::IsValid(m_vao));
-	for (size_t i = 0; i < m_textures.size(); i++)
+	ImGui::Begin(title);
+	ImGui::Text("Last %u frames, %llu dropped", HistorySize, static_cast<unsigned long long>(GPUProfile.dropped));
+	ImGui::Checkbox("Pipeline statistics", &GPUProfile.statistics);
+	const std::vector<PassStats> stats = GetStats();
+	if (ImGui::BeginTable("passes", 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV | ImGuiTableFlags_SizingFixedFit))
 	{
-		if (m_textures[i].texture)
-			m_textures[i].texture->Bind(i);
+		ImGui::TableSetupColumn("Pass", ImGuiTableColumnFlags_WidthStretch);
+		ImGui::TableSetupColumn("ms");
+		ImGui::TableSetupColumn("avg");
+		ImGui::TableSetupColumn("p50");
+		ImGui::TableSetupColumn("p95");
+		ImGui::TableSetupColumn("p99");
+		ImGui::TableHeadersRow();
+		for (const PassStats& pass : stats)
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			// Indent(0) would indent by the default spacing
+			const float indent = static_cast<float>(pass.depth) * 12.0f;
+			if (indent > 0.0f) ImGui::Indent(indent);
+			ImGui::TextUnformatted(pass.name.c_str());
+			if (indent > 0.0f) ImGui::Unindent(indent);
+			for (const float value : { pass.lastMs, pass.averageMs, pass.medianMs, pass.p95Ms, pass.p99Ms })
+			{
+				ImGui::TableNextColumn();
+				ImGui::Text("%.3f", value);
+			}
+		}
+		ImGui::EndTable();
 	}
 
+	if (GPUProfile.statistics && ImGui::BeginTable("statistics", 7, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV | ImGuiTableFlags_SizingFixedFit))
 	{
-		if (m_diffuseColorLoc == -1) m_diffuseColorLoc = glGetUniformLocation(*program->GetFragmentShader(), UniformDiffuseColorName);
-		if (m_ambientColorLoc == -1) m_ambientColorLoc = glGetUniformLocation(*program->GetFragmentShader(), UniformAmbientColorName);
-		if (m_specularColorLoc == -1) m_specularColorLoc = glGetUniformLocation(*program->GetFragmentShader(), UniformSpecularColorName);
-		if (m_shininessLoc == -1) m_shininessLoc = glGetUniformLocation(*program->GetFragmentShader(), UniformShininessName);
-		if (m_refractiLoc == -1) m_refractiLoc = glGetUniformLocation(*program->GetFragmentShader(), UniformRefractiName);
+		ImGui::TableSetupColumn("Pass", ImGuiTableColumnFlags_WidthStretch);
+		ImGui::TableSetupColumn("Vertices");
+		ImGui::TableSetupColumn("Primitives");
+		ImGui::TableSetupColumn("VS");
+		ImGui::TableSetupColumn("Clipped");
+		ImGui::TableSetupColumn("FS");
+		ImGui::TableSetupColumn("CS");
+		ImGui::TableHeadersRow();
+		for (const PassStats& pass : stats)
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			const float indent = static_cast<float>(pass.depth) * 12.0f;
+			if (indent > 0.0f) ImGui::Indent(indent);
+			ImGui::TextUnformatted(pass.name.c_str());
+			if (indent > 0.0f) ImGui::Unindent(indent);
+			for (const auto& [target, counter] : GPUPipelineStatistics)
+			{
+				ImGui::TableNextColumn();
+				ImGui::Text("%llu", static_cast<unsigned long long>(pass.statistics.*counter));
+			}
+		}
+		ImGui::EndTable();
 	}
+	ImGui::End();
+}
 
-	program->SetFragmentUniform(m_diffuseColorLoc, m_materialProp.diffuseColor);
-	program->SetFragmentUniform(m_ambientColorLoc, m_materialProp.ambientColor);
-	program->SetFragmentUniform(m_specularColorLoc, m_materialProp.specularColor);
-	program->SetFragmentUniform(m_shininessLoc, m_materialProp.shininess);
-	program->SetFragmentUniform(m_refractiLoc, m_materialProp.refracti);
+#pragma endregion
 
-	m_vao->DrawTriangles();
-}
+#pragma region GLStats
 
-void Mesh::init()
+#if NANO_GL_STATS
+namespace
 {
-	std::vector<glm::vec3> points;
-	for (size_t i = 0; i < m_vertices.size(); i++)
-		points.push_back(m_vertices[i].position);
-	m_bounding = AABB(points);
+	void glStatsAdd(const GLStats::Counters& delta)
+	{
+		auto add = [&](GLStats::Counters& counters)
+			{
+				counters.drawCalls += delta.drawCalls;
+				counters.dispatchCalls += delta.dispatchCalls;
+				counters.programBinds += delta.programBinds;
+				counters.vertexArrayBinds += delta.vertexArrayBinds;
+				counters.bufferBinds += delta.bufferBinds;
+				counters.textureBinds += delta.textureBinds;
+				counters.imageBinds += delta.imageBinds;
+				counters.samplerBinds += delta.samplerBinds;
+				counters.uniformUpdates += delta.uniformUpdates;
+				counters.framebufferSwitches += delta.framebufferSwitches;
+				counters.bufferBytes += delta.bufferBytes;
+				counters.textureBytes += delta.textureBytes;
+			};
+		add(GLCounters.frame.total);
+		for (const uint32_t group : GLCounters.stack)
+			add(GLCounters.frame.groups[group].counters);
+	}
 
-	m_vao = std::make_shared<GLVertexArray>(m_vertices, m_indices, GetMeshVertexFormat());
-}
+	// Replaces the glad pointer with Call. OnCall is either the counter the call increments or a function that fills the counters from the arguments.
+	template<auto Pointer, auto OnCall>
+	struct GLStatsHook;
 
-#pragma endregion
+	template<typename R, typename... Args, R(GLAD_API_PTR** Pointer)(Args...), auto OnCall>
+	struct GLStatsHook<Pointer, OnCall> final
+	{
+		static inline R(GLAD_API_PTR* original)(Args...) = nullptr;
 
-#pragma region Animation
+		static R GLAD_API_PTR Call(Args... args)
+		{
+			if (GLCounters.enabled)
+			{
+				GLStats::Counters delta;
+				if constexpr (std::is_member_object_pointer_v<decltype(OnCall)>)
+					delta.*OnCall += 1;
+				else
+					OnCall(delta, args...);
+				glStatsAdd(delta);
+			}
+			return original(args...);
+		}
 
-std::pair<int, float> TimeFraction(std::vector<float>& times, float dt)
-{
-	if (times.empty()) return { 1, 1.0 };
+		static void Install()
+		{
+			// functions the driver does not expose stay null
+			if (*Pointer && *Pointer != &Call)
+			{
+				original = *Pointer;
+				*Pointer = &Call;
+			}
+		}
+	};
 
-	int seg = 0;
-	while (dt > times[seg]) seg++;
-	float frac = (dt - times[seg - 1]) / (times[seg] - times[seg - 1]);
+	template<auto OnCall, auto... Pointers>
+	void glStatsHook()
+	{
+		(GLStatsHook<Pointers, OnCall>::Install(), ...);
+	}
 
-	return { seg, frac };
-}
+	uint64_t glStatsPixelSize(GLenum format, GLenum type)
+	{
+		switch (type)
+		{
+		case GL_UNSIGNED_BYTE_3_3_2: case GL_UNSIGNED_BYTE_2_3_3_REV:
+			return 1;
+		case GL_UNSIGNED_SHORT_5_6_5: case GL_UNSIGNED_SHORT_5_6_5_REV: case GL_UNSIGNED_SHORT_4_4_4_4: case GL_UNSIGNED_SHORT_4_4_4_4_REV:
+		case GL_UNSIGNED_SHORT_5_5_5_1: case GL_UNSIGNED_SHORT_1_5_5_5_REV:
+			return 2;
+		case GL_UNSIGNED_INT_8_8_8_8: case GL_UNSIGNED_INT_8_8_8_8_REV: case GL_UNSIGNED_INT_10_10_10_2: case GL_UNSIGNED_INT_2_10_10_10_REV:
+		case GL_UNSIGNED_INT_24_8: case GL_UNSIGNED_INT_10F_11F_11F_REV: case GL_UNSIGNED_INT_5_9_9_9_REV:
+			return 4;
+		case GL_FLOAT_32_UNSIGNED_INT_24_8_REV:
+			return 8;
+		default:
+			break;
+		}
 
-Animation::Animation(const std::string& name)
-	: m_name(name)
-{
-}
+		uint64_t components = 4;
+		switch (format)
+		{
+		case GL_RED: case GL_GREEN: case GL_BLUE: case GL_RED_INTEGER: case GL_GREEN_INTEGER: case GL_BLUE_INTEGER:
+		case GL_DEPTH_COMPONENT: case GL_STENCIL_INDEX:
+			components = 1;
+			break;
+		case GL_RG: case GL_RG_INTEGER:
+			components = 2;
+			break;
+		case GL_RGB: case GL_BGR: case GL_RGB_INTEGER: case GL_BGR_INTEGER:
+			components = 3;
+			break;
+		default:
+			break;
+		}
 
-void Animation::SetName(const std::string& name)
-{
-	m_name = name;
-}
+		switch (type)
+		{
+		case GL_UNSIGNED_SHORT: case GL_SHORT: case GL_HALF_FLOAT:
+			return components * 2;
+		case GL_UNSIGNED_INT: case GL_INT: case GL_FLOAT:
+			return components * 4;
+		default:
+			return components;
+		}
+	}
 
-void Animation::SetTPS(float tps)
-{
-	m_tps = tps;
+	uint64_t glStatsTextureBytes(GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type)
+	{
+		if (width <= 0 || height <= 0 || depth <= 0) return 0;
+		return static_cast<uint64_t>(width) * static_cast<uint64_t>(height) * static_cast<uint64_t>(depth) * glStatsPixelSize(format, type);
+	}
+
+	void glStatsBindFramebuffer(GLStats::Counters& counters, GLenum target, GLuint framebuffer)
+	{
+		if (target == GL_READ_FRAMEBUFFER || framebuffer == GLCounters.drawFramebuffer) return;
+		GLCounters.drawFramebuffer = framebuffer;
+		counters.framebufferSwitches++;
+	}
+
+	void glStatsNamedBufferData(GLStats::Counters& counters, GLuint, GLsizeiptr size, const void* data, GLenum)
+	{
+		if (data) counters.bufferBytes += static_cast<uint64_t>(size);
+	}
+
+	void glStatsNamedBufferStorage(GLStats::Counters& counters, GLuint, GLsizeiptr size, const void* data, GLbitfield)
+	{
+		if (data) counters.bufferBytes += static_cast<uint64_t>(size);
+	}
+
+	void glStatsNamedBufferSubData(GLStats::Counters& counters, GLuint, GLintptr, GLsizeiptr size, const void*)
+	{
+		counters.bufferBytes += static_cast<uint64_t>(size);
+	}
+
+	void glStatsBufferData(GLStats::Counters& counters, GLenum, GLsizeiptr size, const void* data, GLenum)
+	{
+		if (data) counters.bufferBytes += static_cast<uint64_t>(size);
+	}
+
+	void glStatsBufferSubData(GLStats::Counters& counters, GLenum, GLintptr, GLsizeiptr size, const void*)
+	{
+		counters.bufferBytes += static_cast<uint64_t>(size);
+	}
+
+	void glStatsTextureSubImage1D(GLStats::Counters& counters, GLuint, GLint, GLint, GLsizei width, GLenum format, GLenum type, const void*)
+	{
+		counters.textureBytes += glStatsTextureBytes(width, 1, 1, format, type);
+	}
+
+	void glStatsTextureSubImage2D(GLStats::Counters& counters, GLuint, GLint, GLint, GLint, GLsizei width, GLsizei height, GLenum format, GLenum type, const void*)
+	{
+		counters.textureBytes += glStatsTextureBytes(width, height, 1, format, type);
+	}
+
+	void glStatsTextureSubImage3D(GLStats::Counters& counters, GLuint, GLint, GLint, GLint, GLint, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const void*)
+	{
+		counters.textureBytes += glStatsTextureBytes(width, height, depth, format, type);
+	}
+
+	void glStatsCompressedTextureSubImage2D(GLStats::Counters& counters, GLuint, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLsizei imageSize, const void*)
+	{
+		counters.textureBytes += static_cast<uint64_t>(std::max(imageSize, 0));
+	}
+
+	void glStatsCompressedTextureSubImage3D(GLStats::Counters& counters, GLuint, GLint, GLint, GLint, GLint, GLsizei, GLsizei, GLsizei, GLenum, GLsizei imageSize, const void*)
+	{
+		counters.textureBytes += static_cast<uint64_t>(std::max(imageSize, 0));
+	}
+
+	void glStatsTexImage2D(GLStats::Counters& counters, GLenum, GLint, GLint, GLsizei width, GLsizei height, GLint, GLenum format, GLenum type, const void* pixels)
+	{
+		if (pixels) counters.textureBytes += glStatsTextureBytes(width, height, 1, format, type);
+	}
+
+	void glStatsTexSubImage2D(GLStats::Counters& counters, GLenum, GLint, GLint, GLint, GLsizei width, GLsizei height, GLenum format, GLenum type, const void*)
+	{
+		counters.textureBytes += glStatsTextureBytes(width, height, 1, format, type);
+	}
+
+	void glStatsPushDebugGroup(GLStats::Counters&, GLenum, GLuint, GLsizei length, const GLchar* message)
+	{
+		const std::string_view name = length < 0 ? std::string_view(message) : std::string_view(message, static_cast<size_t>(length));
+		const uint32_t parent = GLCounters.stack.empty() ? static_cast<uint32_t>(-1) : GLCounters.stack.back();
+		std::vector<GLStats::GroupStats>& groups = GLCounters.frame.groups;
+
+		uint32_t group = 0;
+		while (group < groups.size() && (groups[group].parent != parent || groups[group].name != name))
+			group++;
+		if (group == groups.size())
+			groups.push_back({ std::string(name), parent, static_cast<uint32_t>(GLCounters.stack.size()), {} });
+		GLCounters.stack.push_back(group);
+	}
+
+	void glStatsPopDebugGroup(GLStats::Counters&)
+	{
+		if (!GLCounters.stack.empty())
+			GLCounters.stack.pop_back();
+	}
 }
+#endif
 
-void Animation::SetDuration(float duration)
-{
-	m_duration = duration;
+bool GLStats::IsAvailable()
+{
+	return NANO_GL_STATS != 0;
+}
+
+void GLStats::Install()
+{
+#if NANO_GL_STATS
+	if (GLCounters.installed) return;
+	GLCounters.installed = true;
+
+	glStatsHook<&Counters::drawCalls,
+		&glad_glDrawArrays, &glad_glDrawArraysInstanced, &glad_glDrawArraysInstancedBaseInstance, &glad_glDrawArraysIndirect,
+		&glad_glMultiDrawArrays, &glad_glMultiDrawArraysIndirect, &glad_glMultiDrawArraysIndirectCount,
+		&glad_glDrawElements, &glad_glDrawElementsInstanced, &glad_glDrawElementsBaseVertex, &glad_glDrawElementsInstancedBaseVertex,
+		&glad_glDrawElementsInstancedBaseInstance, &glad_glDrawElementsInstancedBaseVertexBaseInstance, &glad_glDrawRangeElements,
+		&glad_glDrawRangeElementsBaseVertex, &glad_glDrawElementsIndirect, &glad_glMultiDrawElements, &glad_glMultiDrawElementsBaseVertex,
+		&glad_glMultiDrawElementsIndirect, &glad_glMultiDrawElementsIndirectCount>();
+	glStatsHook<&Counters::dispatchCalls, &glad_glDispatchCompute, &glad_glDispatchComputeIndirect>();
+
+	glStatsHook<&Counters::programBinds, &glad_glUseProgram, &glad_glBindProgramPipeline, &glad_glUseProgramStages>();
+	glStatsHook<&Counters::vertexArrayBinds, &glad_glBindVertexArray>();
+	glStatsHook<&Counters::bufferBinds, &glad_glBindBuffer, &glad_glBindBufferBase, &glad_glBindBufferRange, &glad_glBindBuffersBase,
+		&glad_glBindBuffersRange, &glad_glBindVertexBuffer, &glad_glVertexArrayVertexBuffer>();
+	glStatsHook<&Counters::textureBinds, &glad_glBindTexture, &glad_glBindTextureUnit, &glad_glBindTextures>();
+	glStatsHook<&Counters::imageBinds, &glad_glBindImageTexture, &glad_glBindImageTextures>();
+	glStatsHook<&Counters::samplerBinds, &glad_glBindSampler, &glad_glBindSamplers>();
+	glStatsHook<&glStatsBindFramebuffer, &glad_glBindFramebuffer>();
+
+	glStatsHook<&Counters::uniformUpdates,
+		&glad_glProgramUniform1i, &glad_glProgramUniform1iv, &glad_glProgramUniform1ui, &glad_glProgramUniform1uiv,
+		&glad_glProgramUniform1f, &glad_glProgramUniform1fv, &glad_glProgramUniform1d, &glad_glProgramUniform1dv,
+		&glad_glProgramUniform2i, &glad_glProgramUniform2iv, &glad_glProgramUniform2ui, &glad_glProgramUniform2uiv,
+		&glad_glProgramUniform2f, &glad_glProgramUniform2fv, &glad_glProgramUniform2d, &glad_glProgramUniform2dv,
+		&glad_glProgramUniform3i, &glad_glProgramUniform3iv, &glad_glProgramUniform3ui, &glad_glProgramUniform3uiv,
+		&glad_glProgramUniform3f, &glad_glProgramUniform3fv, &glad_glProgramUniform3d, &glad_glProgramUniform3dv,
+		&glad_glProgramUniform4i, &glad_glProgramUniform4iv, &glad_glProgramUniform4ui, &glad_glProgramUniform4uiv,
+		&glad_glProgramUniform4f, &glad_glProgramUniform4fv, &glad_glProgramUniform4d, &glad_glProgramUniform4dv,
+		&glad_glProgramUniformMatrix2fv, &glad_glProgramUniformMatrix2dv, &glad_glProgramUniformMatrix3fv, &glad_glProgramUniformMatrix3dv,
+		&glad_glProgramUniformMatrix4fv, &glad_glProgramUniformMatrix4dv, &glad_glProgramUniformMatrix2x3fv, &glad_glProgramUniformMatrix2x3dv,
+		&glad_glProgramUniformMatrix3x2fv, &glad_glProgramUniformMatrix3x2dv, &glad_glProgramUniformMatrix2x4fv, &glad_glProgramUniformMatrix2x4dv,
+		&glad_glProgramUniformMatrix4x2fv, &glad_glProgramUniformMatrix4x2dv, &glad_glProgramUniformMatrix3x4fv, &glad_glProgramUniformMatrix3x4dv,
+		&glad_glProgramUniformMatrix4x3fv, &glad_glProgramUniformMatrix4x3dv>();
+
+	glStatsHook<&glStatsNamedBufferData, &glad_glNamedBufferData>();
+	glStatsHook<&glStatsNamedBufferStorage, &glad_glNamedBufferStorage>();
+	glStatsHook<&glStatsNamedBufferSubData, &glad_glNamedBufferSubData>();
+	glStatsHook<&glStatsBufferData, &glad_glBufferData>();
+	glStatsHook<&glStatsBufferSubData, &glad_glBufferSubData>();
+	glStatsHook<&glStatsTextureSubImage1D, &glad_glTextureSubImage1D>();
+	glStatsHook<&glStatsTextureSubImage2D, &glad_glTextureSubImage2D>();
+	glStatsHook<&glStatsTextureSubImage3D, &glad_glTextureSubImage3D>();
+	glStatsHook<&glStatsCompressedTextureSubImage2D, &glad_glCompressedTextureSubImage2D>();
+	glStatsHook<&glStatsCompressedTextureSubImage3D, &glad_glCompressedTextureSubImage3D>();
+	glStatsHook<&glStatsTexImage2D, &glad_glTexImage2D>();
+	glStatsHook<&glStatsTexSubImage2D, &glad_glTexSubImage2D>();
+
+	glStatsHook<&glStatsPushDebugGroup, &glad_glPushDebugGroup>();
+	glStatsHook<&glStatsPopDebugGroup, &glad_glPopDebugGroup>();
+#endif
 }
 
-void Animation::SetIsRepeated(bool repeat)
+void GLStats::SetEnabled(bool enabled)
 {
-	m_repeat = repeat;
+	GLCounters.enabled = enabled;
 }
 
-void Animation::SetIsBlending(bool blending)
+bool GLStats::IsEnabled()
 {
-	m_blending = blending;
+	return GLCounters.enabled;
 }
 
-void Animation::SetLastTime(float lastTime)
+void GLStats::NextFrame()
 {
-	m_lastTime = lastTime;
+	std::swap(GLCounters.lastFrame, GLCounters.frame);
+	GLCounters.frame.total = {};
+	GLCounters.frame.groups.clear();
+	// a group left open at the end of a frame would point into the old list
+	GLCounters.stack.clear();
 }
 
-void Animation::AddKeyframe(const std::string& name, const Keyframe& keyframe)
+const GLStats::FrameStats& GLStats::GetLastFrame()
 {
-	m_keyframes[name] = keyframe;
+	return GLCounters.lastFrame;
 }
 
-void Animation::Play(float time)
+void GLStats::DrawImGui(const char* title)
 {
-	if (m_state != State::Paused)
+	ImGui::Begin(title);
+	if (!IsAvailable())
 	{
-		m_lastTime = time;
-		if (time < 0)
-			m_blending = true;
+		ImGui::TextUnformatted("Built without NANO_GL_STATS");
+		ImGui::End();
+		return;
 	}
 
-	m_state = State::Playing;
-	m_time.Restart();
-}
+	ImGui::Checkbox("Enabled", &GLCounters.enabled);
+	const Counters& total = GLCounters.lastFrame.total;
+	ImGui::Text("Draws %u, dispatches %u, uniforms %u, framebuffer switches %u", total.drawCalls, total.dispatchCalls, total.uniformUpdates, total.framebufferSwitches);
+	ImGui::Text("Binds: program %u, vertex array %u, buffer %u, texture %u, image %u, sampler %u",
+		total.programBinds, total.vertexArrayBinds, total.bufferBinds, total.textureBinds, total.imageBinds, total.samplerBinds);
+	ImGui::Text("Uploaded: buffers %.1f KB, textures %.1f KB", static_cast<double>(total.bufferBytes) / 1024.0, static_cast<double>(total.textureBytes) / 1024.0);
 
-void Animation::Pause()
-{
-	m_state = State::Paused;
-	m_lastTime = GetTime() + m_lastTime;
+	if (ImGui::BeginTable("groups", 8, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV | ImGuiTableFlags_SizingFixedFit))
+	{
+		ImGui::TableSetupColumn("Group", ImGuiTableColumnFlags_WidthStretch);
+		ImGui::TableSetupColumn("Draws");
+		ImGui::TableSetupColumn("Dispatch");
+		ImGui::TableSetupColumn("Binds");
+		ImGui::TableSetupColumn("Uniforms");
+		ImGui::TableSetupColumn("FBO");
+		ImGui::TableSetupColumn("Buffer KB");
+		ImGui::TableSetupColumn("Texture KB");
+		ImGui::TableHeadersRow();
+		for (const GroupStats& group : GLCounters.lastFrame.groups)
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			// Indent(0) would indent by the default spacing
+			const float indent = static_cast<float>(group.depth) * 12.0f;
+			if (indent > 0.0f) ImGui::Indent(indent);
+			ImGui::TextUnformatted(group.name.c_str());
+			if (indent > 0.0f) ImGui::Unindent(indent);
+			for (const uint32_t value : { group.counters.drawCalls, group.counters.dispatchCalls, group.counters.GetBindCount(), group.counters.uniformUpdates, group.counters.framebufferSwitches })
+			{
+				ImGui::TableNextColumn();
+				ImGui::Text("%u", value);
+			}
+			for (const uint64_t bytes : { group.counters.bufferBytes, group.counters.textureBytes })
+			{
+				ImGui::TableNextColumn();
+				ImGui::Text("%.1f", static_cast<double>(bytes) / 1024.0);
+			}
+		}
+		ImGui::EndTable();
+	}
+	ImGui::End();
 }
 
-void Animation::Stop()
-{
-	m_state = State::Stopped;
-	m_lastTime = 0.01;
-}
+#pragma endregion
 
-std::unordered_map<std::string, std::pair<Transform, glm::vec3>> Animation::Update()
+#pragma region FlightRecorder
+
+namespace
 {
-	std::unordered_map<std::string, std::pair<Transform, glm::vec3>> actions;
+	std::string gpuPassPath(uint32_t pass)
+	{
+		std::string path = GPUProfile.passes[pass].name;
+		for (uint32_t parent = GPUProfile.passes[pass].parent; parent != InvalidGPUScope; parent = GPUProfile.passes[parent].parent)
+			path = GPUProfile.passes[parent].name + "/" + path;
+		return path;
+	}
+
+	// what a trace needs of the recorded frames, copied on the frame thread so that the file can be written on another one
+	struct FlightRecord final
+	{
+		uint64_t first = 0;
+		std::vector<FlightRecorderFrame> frames;
+		std::vector<CPUProfilerLane> lanes;
+		std::vector<std::string> passNames;
+		uint64_t budget = 0;
+	};
+
+	// the recorded frames [first, end)
+	FlightRecord captureFlightRecord(uint64_t first, uint64_t end)
+	{
+		FlightRecord record;
+		record.first = first;
+		record.budget = static_cast<uint64_t>(static_cast<double>(Recorder.settings.budgetMs) * 1e6);
+		for (uint64_t i = first; i < end; i++)
+			record.frames.push_back(Recorder.frames[i % FlightRecorder::HistorySize]);
+		record.lanes = cpuProfilerLanes(record.frames.front().begin, record.frames.back().end);
+		for (uint32_t i = 0; i < GPUProfile.passes.size(); i++)
+			record.passNames.push_back(cpuProfilerJsonString(gpuPassPath(i)));
+		return record;
+	}
+
+	bool writeFlightRecord(const std::filesystem::path& path, const FlightRecord& record)
+	{
+		ChromeTrace trace(path);
+		if (!trace.IsOpen())
+		{
+			Error("FlightRecorder: failed to write " + path.string());
+			return false;
+		}
 
-	if (m_state != State::Stopped)
-		for (auto& [name, keyframe] : m_keyframes)
+		const uint64_t budget = record.budget;
+		std::vector<std::pair<uint64_t, uint64_t>> hitches;
+		for (const FlightRecorderFrame& frame : record.frames)
 		{
-			float time = 0;
-			if (m_state == State::Playing)
+			if (frame.end - frame.begin > budget)
+				hitches.emplace_back(frame.begin, frame.end);
+		}
+		auto offending = [&](const CPUProfiler::Event& event)
+			{
+				if ((event.end - event.begin) * 4 < budget)
+					return false;
+				return std::any_of(hitches.begin(), hitches.end(), [&](const auto& hitch) { return event.end > hitch.first && event.begin < hitch.second; });
+			};
+
+		for (const CPUProfilerLane& lane : record.lanes)
+			trace.WriteLane(lane, offending);
+
+		// the frames get a lane of their own after the threads
+		constexpr uint32_t FrameLane = 1000;
+		trace.WriteThreadName(FrameLane, "Frames");
+		for (size_t i = 0; i < record.frames.size(); i++)
+		{
+			const FlightRecorderFrame& frame = record.frames[i];
+			const std::string ts = cpuProfilerMicroseconds(frame.begin);
+			trace.BeginEvent() << "{\"name\":\"Frame " << record.first + i << "\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":" << FrameLane
+				<< ",\"ts\":" << ts << ",\"dur\":" << cpuProfilerMicroseconds(frame.end - frame.begin)
+				<< (frame.end - frame.begin > budget ? ",\"cname\":\"terrible\"}" : "}");
+
+			if (GLStats::IsAvailable())
 			{
-				time = GetTime();
-				if (m_lastTime != 0)
-					time += m_lastTime;
+				const GLStats::Counters& counters = frame.counters;
+				trace.BeginEvent() << "{\"name\":\"GL calls\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts << ",\"args\":{\"draws\":" << counters.drawCalls
+					<< ",\"dispatches\":" << counters.dispatchCalls << ",\"binds\":" << counters.GetBindCount() << ",\"uniforms\":" << counters.uniformUpdates << "}}";
+				trace.BeginEvent() << "{\"name\":\"Uploads KB\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts << ",\"args\":{\"buffers\":" << counters.bufferBytes / 1024
+					<< ",\"textures\":" << counters.textureBytes / 1024 << "}}";
 			}
-			else time = m_lastTime;
 
-			if (m_state == State::Playing && time >= m_duration)
+			if (!frame.gpuMs.empty())
 			{
-				if (m_repeat)
+				std::ofstream& event = trace.BeginEvent();
+				event << "{\"name\":\"GPU ms\",\"ph\":\"C\",\"pid\":1,\"ts\":" << ts << ",\"args\":{";
+				bool first = true;
+				for (const auto& [pass, ms] : frame.gpuMs)
 				{
-					time = m_time.Restart().AsSeconds() * m_tps;
-					m_lastTime = 0;
-				}
-				else
-				{
-					time = m_duration;
-					m_state = State::Paused;
-					m_lastTime = m_duration;
+					if (pass >= record.passNames.size())
+						continue;
+					event << (first ? "" : ",") << record.passNames[pass] << ":" << ms;
+					first = false;
 				}
+				event << "}}";
 			}
-
-			float dt = fmod(time == 0 ? time + 0.01 : (time == m_duration ? time - 0.01 : time), m_duration);
-
-			auto posFraction = TimeFraction(keyframe.posStamps, dt);
-			auto rotFraction = TimeFraction(keyframe.rotStamps, dt);
-			auto scaleFraction = TimeFraction(keyframe.scaleStamps, dt);
-
-			glm::vec3 pos = glm::mix(keyframe.positions[posFraction.first - 1], keyframe.positions[posFraction.first], posFraction.second);
-			glm::quat rot = glm::slerp(keyframe.rotations[rotFraction.first - 1], keyframe.rotations[rotFraction.first], rotFraction.second);
-			glm::vec3 scale = glm::mix(keyframe.scales[scaleFraction.first - 1], keyframe.scales[scaleFraction.first], scaleFraction.second);
-
-			actions[name] = { { { pos.x, pos.y, pos.z }, { rot.x, rot.y, rot.z, rot.w } }, { scale.x, scale.y, scale.z } };
 		}
 
-	return actions;
-}
+		for (const auto& hitch : hitches)
+			trace.BeginEvent() << "{\"name\":\"Hitch\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":" << FrameLane << ",\"ts\":" << cpuProfilerMicroseconds(hitch.second) << "}";
 
-std::unordered_map<std::string, Keyframe>& Animation::GetKeyframes()
-{
-	return m_keyframes;
+		Print("FlightRecorder: " + std::to_string(record.frames.size()) + " frames written to " + path.string());
+		return true;
+	}
 }
 
-std::string Animation::GetName() const
+void FlightRecorder::SetSettings(const Settings& settings)
 {
-	return m_name;
+	Recorder.settings = settings;
 }
 
-bool Animation::IsRepeated() const
+const FlightRecorder::Settings& FlightRecorder::GetSettings()
 {
-	return m_repeat;
+	return Recorder.settings;
 }
 
-bool Animation::IsBlending() const
+void FlightRecorder::NextFrame()
 {
-	return m_blending;
-}
+	const uint64_t now = CPUProfiler::Now();
+	if (Recorder.writing.valid() && Recorder.writing.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		if (Recorder.writing.get())
+			Recorder.lastDump = Recorder.writingPath;
+	}
+	if (!Recorder.started)
+	{
+		Recorder.started = true;
+		Recorder.frameBegin = now;
+		return;
+	}
 
-float Animation::GetTime() const
-{
-	return m_time.GetElapsedTime().AsSeconds() * m_tps;
+	const uint64_t index = Recorder.frameCount++;
+	FlightRecorderFrame& frame = Recorder.frames[index % HistorySize];
+	frame.begin = Recorder.frameBegin;
+	frame.end = now;
+	frame.counters = GLStats::GetLastFrame().total;
+	frame.gpuFrame = GPUProfile.frame != Recorder.lastGpuFrame ? GPUProfile.frame : 0;
+	frame.gpuMs.clear();
+	Recorder.lastGpuFrame = GPUProfile.frame;
+	Recorder.frameBegin = now;
+
+	// the GPU times go to the frame they were measured in, the newest frames of a trace have none yet
+	for (GPUProfilerResult& result : GPUProfile.results)
+	{
+		for (uint64_t i = Recorder.frameCount; i-- > 0 && Recorder.frameCount - i <= HistorySize;)
+		{
+			FlightRecorderFrame& recorded = Recorder.frames[i % HistorySize];
+			if (recorded.gpuFrame == result.frame)
+			{
+				recorded.gpuMs = std::move(result.passMs);
+				break;
+			}
+			if (recorded.gpuFrame != 0 && recorded.gpuFrame < result.frame)
+				break;
+		}
+	}
+	GPUProfile.results.clear();
+
+	const Settings& settings = Recorder.settings;
+	if (!settings.enabled || static_cast<double>(frame.end - frame.begin) * 1e-6 <= static_cast<double>(settings.budgetMs))
+		return;
+	Recorder.hitches++;
+	// one trace at a time, a hitch while the last one is still being written is only counted
+	if ((Recorder.dumped && index - Recorder.lastDumpFrame < settings.cooldownFrames) || Recorder.writing.valid())
+		return;
+
+	Recorder.dumped = true;
+	Recorder.lastDumpFrame = index;
+	const std::filesystem::path directory = settings.directory;
+	Recorder.writingPath = directory / ("hitch_" + std::to_string(index) + ".json");
+	const uint64_t count = std::min<uint64_t>({ static_cast<uint64_t>(settings.framesBefore) + 1, HistorySize, Recorder.frameCount });
+	// only the copy is made on the frame thread, the file is written on its own thread
+	Recorder.writing = std::async(std::launch::async, [directory, path = Recorder.writingPath, record = captureFlightRecord(Recorder.frameCount - count, Recorder.frameCount)]
+		{
+			std::error_code error;
+			std::filesystem::create_directories(directory, error);
+			return writeFlightRecord(path, record);
+		});
 }
 
-float Animation::GetLastTime() const
+uint64_t FlightRecorder::GetHitchCount()
 {
-	return m_lastTime;
+	return Recorder.hitches;
 }
 
-float Animation::GetDuration() const
+const std::filesystem::path& FlightRecorder::GetLastDump()
 {
-	return m_duration;
+	return Recorder.lastDump;
 }
 
-float Animation::GetTPS() const
+bool FlightRecorder::Dump(const std::filesystem::path& path)
 {
-	return m_tps;
+	if (Recorder.frameCount == 0)
+		return false;
+	const uint64_t count = std::min<uint64_t>(HistorySize, Recorder.frameCount);
+	if (!writeFlightRecord(path, captureFlightRecord(Recorder.frameCount - count, Recorder.frameCount)))
+		return false;
+	Recorder.lastDump = path;
+	return true;
 }
 
-Animation::State Animation::GetState() const
+void FlightRecorder::DrawImGui(const char* title)
 {
-	return m_state;
+	ImGui::Begin(title);
+	Settings& settings = Recorder.settings;
+	ImGui::Checkbox("Enabled", &settings.enabled);
+	ImGui::SliderFloat("Budget ms", &settings.budgetMs, 4.0f, 100.0f);
+
+	const uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(HistorySize, Recorder.frameCount));
+	std::array<float, HistorySize> times{};
+	float worst = 0.0f;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const FlightRecorderFrame& frame = Recorder.frames[(Recorder.frameCount - count + i) % HistorySize];
+		times[i] = static_cast<float>(static_cast<double>(frame.end - frame.begin) * 1e-6);
+		worst = std::max(worst, times[i]);
+	}
+	ImGui::Text("Hitches %llu, worst of the last %u frames %.2f ms", static_cast<unsigned long long>(Recorder.hitches), count, worst);
+	ImGui::PlotLines("##frames", times.data(), static_cast<int>(count), 0, nullptr, 0.0f, settings.budgetMs * 2.0f, ImVec2(ImGui::GetContentRegionAvail().x, 60.0f));
+	if (!Recorder.lastDump.empty())
+		ImGui::Text("Last trace: %s", Recorder.lastDump.string().c_str());
+	if (ImGui::Button("Dump now"))
+	{
+		std::error_code error;
+		std::filesystem::create_directories(settings.directory, error);
+		Dump(settings.directory / "flight_record.json");
+	}
+	ImGui::End();
 }
 
 #pragma endregion
 
-#pragma region Bone
+#pragma region OverdrawView
 
-Bone::Bone(int id, const std::string& name, const glm::mat4& offset) : m_id(id), m_name(name)
+namespace
 {
-	m_offset = offset;
-	m_size = glm::vec3(1.0f);
-}
+	constexpr const char* OverdrawVertexSource = R"(
+#version 460
 
-void Bone::SetTransform(const Transform& tr)
-{
-	m_transform = tr;
-}
+out gl_PerVertex { vec4 gl_Position; };
 
-void Bone::SetPosition(const glm::vec3& pos)
+void main()
 {
-	SavePoseAsIdle();
-	m_transform.SetPosition(pos);
+	// one triangle over the whole screen
+	const vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
 }
+)";
 
-void Bone::SetOrientation(const glm::quat& orient)
-{
-	SavePoseAsIdle();
-	m_transform.SetOrientation(orient);
-}
+	constexpr const char* OverdrawFragmentSource = R"(
+#version 460
 
-void Bone::SetSize(const glm::vec3& size)
+layout (location = 0) out vec4 outFragColor;
+
+layout (binding = 0) uniform usampler2D uCounts;
+layout (location = 0) uniform float uMaxCount;
+
+vec3 heat(float t)
 {
-	m_size = size;
+	const vec3 colors[6] = vec3[](vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(1.0));
+	const float x = clamp(t, 0.0, 1.0) * 5.0;
+	const int i = min(int(x), 4);
+	return mix(colors[i], colors[i + 1], x - float(i));
 }
 
-void Bone::Move(const glm::vec3& vec)
+void main()
 {
-	SavePoseAsIdle();
-	m_transform.SetPosition(m_transform.GetPosition() + vec);
+	const uint count = texelFetch(uCounts, ivec2(gl_FragCoord.xy), 0).r;
+	outFragColor = count == 0u ? vec4(0.0, 0.0, 0.0, 1.0) : vec4(heat(float(count - 1u) / max(uMaxCount - 1.0, 1.0)), 1.0);
+}
+)";
 }
 
-void Bone::Rotate(const glm::quat& quat)
+OverdrawView::OverdrawView(int width, int height)
 {
-	SavePoseAsIdle();
-	m_transform.SetOrientation(quat * m_transform.GetOrientation());
+	m_program = std::make_shared<GLProgramPipeline>(OverdrawVertexSource, OverdrawFragmentSource);
+	m_vao = std::make_shared<GLVertexArray>();
+	Resize(width, height);
 }
 
-void Bone::Expand(const glm::vec3& vec)
+void OverdrawView::Resize(int width, int height)
 {
-	m_size += vec;
+	m_width = width;
+	m_height = height;
+	m_counts = std::make_shared<GLTexture2D>(GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, width, height, nullptr, GL_NEAREST, GL_CLAMP_TO_EDGE);
 }
 
-void Bone::SavePoseAsIdle()
+void OverdrawView::Begin()
 {
-	m_idle = m_transform;
+	constexpr GLuint zero = 0;
+	glClearTexImage(*m_counts, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	m_counts->BindImage(ImageUnit, 0, true);
 }
 
-int Bone::GetID()
+void OverdrawView::End()
 {
-	return m_id;
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
 
-std::string Bone::GetName()
+void OverdrawView::Draw(uint32_t maxCount)
 {
-	return m_name;
+	// the passes drawn after the heatmap keep their depth test and blending
+	const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+	const GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	m_program->Bind();
+	m_program->SetFragmentUniform(0, static_cast<float>(maxCount));
+	m_counts->Bind(0);
+	m_vao->Bind();
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	if (depthTest) glEnable(GL_DEPTH_TEST);
+	if (blend) glEnable(GL_BLEND);
 }
 
-glm::vec3 Bone::GetPosition()
+#pragma endregion
+
+//==============================================================================
+// Graphics
+//==============================================================================
+#pragma region Graphics
+
+constexpr UniformName UniformDiffuseColorName = "uDiffuseColor";
+constexpr UniformName UniformAmbientColorName = "uAmbientColor";
+constexpr UniformName UniformSpecularColorName = "uSpecularColor";
+constexpr UniformName UniformShininessName = "uShininess";
+constexpr UniformName UniformRefractiName = "uRefracti";
+
+#pragma region TransformHierarchy
+
+void TransformHierarchy::Reserve(size_t count)
 {
-	return m_transform.GetPosition();
+	m_parents.reserve(count);
+	m_local.reserve(count);
+	m_world.reserve(count);
+	m_dirty.reserve(count);
 }
 
-glm::quat Bone::GetOrientation()
+void TransformHierarchy::Clear()
 {
-	return m_transform.GetOrientation();
+	m_parents.clear();
+	m_local.clear();
+	m_world.clear();
+	m_dirty.clear();
+	m_firstDirty = InvalidIndex;
 }
 
-glm::vec3 Bone::GetSize()
+uint32_t TransformHierarchy::Add(uint32_t parent, const glm::mat4& local)
 {
-	return m_size;
+	const uint32_t index = static_cast<uint32_t>(m_parents.size());
+	if (parent != InvalidIndex && parent >= index)
+	{
+		Error("TransformHierarchy: parent must be added before child");
+		parent = InvalidIndex;
+	}
+	m_parents.push_back(parent);
+	m_local.push_back(local);
+	m_world.push_back(local);
+	m_dirty.push_back(1);
+	m_firstDirty = std::min(m_firstDirty, index);
+	return index;
 }
 
-glm::mat4 Bone::GetOffset()
+void TransformHierarchy::SetLocal(uint32_t index, const glm::mat4& local)
 {
-	return m_offset;
+	m_local[index] = local;
+	m_dirty[index] = 1;
+	m_firstDirty = std::min(m_firstDirty, index);
 }
 
-Transform Bone::GetTransform()
+void TransformHierarchy::SetLocal(uint32_t index, const glm::vec3& position, const glm::quat& orientation, const glm::vec3& scale)
 {
-	return m_transform;
+	SetLocal(index, ComposeTRS(position, orientation, scale));
 }
 
-Transform Bone::GetIdle()
+bool TransformHierarchy::Update()
 {
-	return m_idle;
+	return Update([](uint32_t) {});
 }
 
 #pragma endregion
 
-#pragma region Model
+#pragma region Node
 
-Model::Model(const std::string& modelPath, bool flipUV)
+void Node::SetParent(Node* parent)
 {
-	std::string extension = strrchr(modelPath.c_str(), '.'); // TODO: найти лучшее решение
-	//if (extension == "obj")
-	
-	loadAssimpModel(modelPath, flipUV);
+	if (m_parent == parent) m_parent = nullptr;
+	else m_parent = parent;
 }
 
-void Model::Draw(const GLProgramPipelineRef& program)
+void Node::SetTransform(const Transform&)
 {
-	for (size_t i = 0; i < m_meshes.size(); i++)
-		m_meshes[i]->Draw(program);
 }
 
-AABB Model::GetBounding() const
+void Node::SetSize(const glm::vec3&)
 {
-	return m_bounding;
 }
 
-std::vector<glm::vec3> Model::GetTriangle() const
+void Node::AddChild(Node* child)
 {
-	std::vector<glm::vec3> Triangle;
-	for (size_t i = 0; i < m_meshes.size(); ++i)
-	{
-		std::vector<glm::vec3> temp = m_meshes[i]->GetTriangle();
-		Triangle.insert(Triangle.end(), temp.begin(), temp.end());
-	}
-	return Triangle;
+	auto it = std::find(m_children.begin(), m_children.end(), child);
+	if (it != m_children.end())
+		m_children.erase(it);
+	else
+		m_children.push_back(child);
 }
 
-std::vector<AnimationRef> Model::GetAnimations() const
+void Node::Draw()
 {
-	return m_animations;
+	for (auto i : m_children)
+		i->Draw();
 }
 
-std::vector<BoneRef> Model::GetBones() const
+Node* Node::GetParent()
 {
-	return m_bones;
+	return m_parent;
 }
 
-std::vector<glm::mat4>& Model::GetPose()
+const std::vector<Node*>& Node::GetChildren() const
 {
-	return m_pose;
+	return m_children;
 }
 
-MeshRef Model::operator[](size_t idx)
+glm::vec3 Node::GetSize()
 {
-	assert(idx < m_meshes.size());
-	return m_meshes[idx];
+	return glm::vec3(1.0f);
 }
 
-void Model::SetTransform(const Transform& transform)
+Transform Node::GetFinalTransform(Node* node, Transform tr)
 {
-	m_transform = transform;
+	for (Node* parent = node->GetParent(); parent; parent = parent->GetParent())
+		tr = parent->GetTransform() * tr;
+	return tr;
 }
 
-void Model::SetPosition(const glm::vec3& position)
-{
-	m_transform.SetPosition(position);
-}
+#pragma endregion
 
-void Model::SetOrientation(const glm::quat& orientation)
-{
-	m_transform.SetOrientation(orientation);
-}
+#pragma region MeshVertex
 
-void Model::AddChild(Node* child)
+void MeshVertex::AddBoneData(uint32_t boneID, float weight)
 {
-	for (auto i : m_bones)
-		if (i.get() == child)
+	for (uint32_t i = 0; i < MAX_NUM_BONES_PER_VERTEX; i++)
+	{
+		if (weights[i] == 0.0f)
 		{
-			auto it = std::find(m_children.begin(), m_children.end(), child);
-			if (it != m_children.end())
-			{
-				(*it)->SetParent(nullptr);
-				m_children.erase(it);
-				return;
-			}
-			child->SetParent(this);
-			m_children.push_back(child);
+			boneIDs[i] = boneID;
+			weights[i] = weight;
 			return;
 		}
-
-	auto it = std::find(m_children.begin(), m_children.end(), child);
-	if (it != m_children.end())
-	{
-		m_children.erase(it);
-	}
-	else
-	{
-		m_children.push_back(child);
 	}
+	Warning("Vertex has more than " + std::to_string(MAX_NUM_BONES_PER_VERTEX) + " bones!");
 }
 
-Transform Model::GetTransform()
+#pragma endregion
+
+#pragma region Mesh
+
+Mesh::Mesh(const std::vector<MeshVertex>& vertices, const std::vector<uint32_t>& indices, const std::vector<MaterialTexture>& textures, const MaterialProperties& materialProperties)
+	: m_vertices(vertices)
+	, m_indices(indices)
+	, m_textures(textures)
+	, m_materialProp(materialProperties)
 {
-	return m_transform;
+	init();
 }
 
-glm::vec3 Model::GetPosition()
+AABB Mesh::GetBounding() const
 {
-	return m_transform.GetPosition();
+	return m_bounding;
 }
 
-glm::quat Model::GetOrientation()
+std::vector<glm::vec3> Mesh::GetTriangle() const
 {
-	return m_transform.GetOrientation();
+	std::vector<glm::vec3> triangles;
+	for (size_t i = 0; i < m_vertices.size(); i++)
+		triangles.push_back(m_vertices[i].position);
+	return triangles;
 }
 
-void Model::UpdateAnim()
+ShaderFeatures Mesh::GetShaderFeatures() const
 {
-	for (auto& i : m_bones)
-		calculatePose(i.get());
+	return m_shaderFeatures;
 }
 
-void Model::DefaultPose()
+GLVertexArrayRef Mesh::GetVAO()
 {
-	for (auto& i : m_bones)
-		i->SetTransform(i->GetIdle());
-	for (auto& i : m_bonesChildren)
-		i->SetTransform(i->GetIdle());
+	return m_vao;
 }
 
-void Model::loadAssimpModel(const std::string& modelPath, bool flipUV)
+size_t Mesh::GetVertexCount() const
 {
-	unsigned int flags = aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_CalcTangentSpace | aiProcess_LimitBoneWeights;
-#if defined(GLM_FORCE_LEFT_HANDED)
-	flags |= aiProcess_MakeLeftHanded;
-#endif
-	if (flipUV) flags |= aiProcess_FlipUVs;
+	return m_vertices.size();
+}
 
-	Assimp::Importer modelImporter;
-	modelImporter.SetPropertyInteger(AI_CONFIG_PP_LBW_MAX_WEIGHTS, 1);
-	const aiScene* scene = modelImporter.ReadFile(modelPath, flags);
-	if (!scene || !scene->mRootNode || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE)
-	{
-		Error("Load Model error: " + std::string(modelImporter.GetErrorString()));
-		return;
-	}
-	m_directory = modelPath.substr(0, modelPath.find_last_of('/'));
-	loadAnimations(scene);
-	processNode(scene->mRootNode, scene, glm::mat4(1.0));
-	findBoneNodes(scene->mRootNode, m_bones);
-	computeAABB();
+std::span<const MeshVertex> Mesh::GetVertices() const
+{
+	return m_vertices;
+}
 
-	m_pose.resize(64);
+void Mesh::SetMorphTargets(std::span<const MorphVertex> vertices, std::span<const MorphDelta> deltas)
+{
+	m_morphVertices.reset();
+	m_morphDeltas.reset();
+	m_morphVertexCount = 0;
+	m_morphDeltaCount = 0;
+	if (vertices.empty() || deltas.empty())
+		return;
+	m_morphVertices = std::make_unique<GPUBuffer>(vertices, BufferStorageFlag::NONE, "MorphVertices");
+	m_morphDeltas = std::make_unique<GPUBuffer>(deltas, BufferStorageFlag::NONE, "MorphDeltas");
+	m_morphVertexCount = static_cast<uint32_t>(vertices.size());
+	m_morphDeltaCount = deltas.size();
+}
 
-	Print("Model " + modelPath + " loaded:\n" +
-		"        Meshes: " + std::to_string(m_meshes.size()) + '\n' +
-		"        Bones: " + std::to_string(m_bones.size() + m_bonesChildren.size()) + '\n' +
-		"        Animations: " + std::to_string(m_animations.size()));
+uint32_t Mesh::GetMorphVertexCount() const
+{
+	return m_morphVertexCount;
 }
 
-constexpr glm::vec3 toglm(const aiVector3D& vec) { return glm::vec3(vec.x, vec.y, vec.z); }
-constexpr glm::vec2 toglm(const aiVector2D& vec) { return glm::vec2(vec.x, vec.y); }
-constexpr glm::quat toglm(const aiQuaternion& q) { return glm::quat(q.w, q.x, q.y, q.z); }
+bool Mesh::BindMorphTargets(GLuint vertexBinding, GLuint deltaBinding) const
+{
+	if (m_morphVertexCount == 0)
+		return false;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, vertexBinding, *m_morphVertices);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, deltaBinding, *m_morphDeltas);
+	return true;
+}
 
-constexpr glm::mat4 toglm(const aiMatrix4x4& mat)
+void Mesh::Draw(const GLProgramPipelineRef& program)
 {
-	glm::mat4 ret;
-	for (int i = 0; i < 4; i++)
-		for (int j = 0; j < 4; j++)
-			ret[j][i] = mat[i][j];
-	return ret;
+	bindMaterial(program);
+	m_vao->DrawTriangles();
 }
 
-std::pair<Transform, glm::vec3> To3DTransform(const glm::mat4& tr)
+void Mesh::Draw(const GLProgramPipelineRef& program, GLsizei instanceCount, GLuint baseInstance)
 {
-	Transform ret;
-	glm::vec3 size;
+	bindMaterial(program);
+	m_vao->DrawTrianglesInstanced(instanceCount, baseInstance);
+}
 
-	glm::vec3 pos, scale, skew;
-	glm::vec4 perspective;
-	glm::quat orient;
+void Mesh::bindMaterial(const GLProgramPipelineRef& program)
+{
+	assert(::IsValid(program));
+	assert(::IsValid(m_vao));
+	for (size_t i = 0; i < m_textures.size(); i++)
+	{
+		if (m_textures[i].texture)
+			m_textures[i].texture->Bind(i);
+	}
 
-	glm::decompose(tr, scale, orient, pos, skew, perspective);
-	orient = glm::conjugate(orient);
+	// looked up in the program that draws, the same mesh may be drawn by programs with different locations
+	program->SetFragmentUniform(program->GetFragmentUniform(UniformDiffuseColorName), m_materialProp.diffuseColor);
+	program->SetFragmentUniform(program->GetFragmentUniform(UniformAmbientColorName), m_materialProp.ambientColor);
+	program->SetFragmentUniform(program->GetFragmentUniform(UniformSpecularColorName), m_materialProp.specularColor);
+	program->SetFragmentUniform(program->GetFragmentUniform(UniformShininessName), m_materialProp.shininess);
+	program->SetFragmentUniform(program->GetFragmentUniform(UniformRefractiName), m_materialProp.refracti);
+}
 
-	size = { scale.x, scale.y, scale.z };
+void Mesh::init()
+{
+	std::vector<glm::vec3> points;
+	for (size_t i = 0; i < m_vertices.size(); i++)
+		points.push_back(m_vertices[i].position);
+	m_bounding = AABB(points);
 
-	ret.SetPosition({ pos.x, pos.y, pos.z });
-	ret.SetOrientation({ orient.x, orient.y, orient.z, orient.w });
+	m_vao = std::make_shared<GLVertexArray>(m_vertices, m_indices, GetMeshVertexFormat());
 
-	return { ret, size };
+	// the textures are in the order of Model::processTextures: diffuse, normals, specular...
+	if (std::any_of(m_vertices.begin(), m_vertices.end(), [](const MeshVertex& vertex) { return vertex.weights[0] > 0.0f; }))
+		m_shaderFeatures |= ShaderFeature::SKINNED;
+	if (m_textures.size() > 1 && m_textures[1].texture)
+		m_shaderFeatures |= ShaderFeature::NORMAL_MAP;
+	if (!m_textures.empty() && m_textures[0].texture && m_textures[0].texture->HasTransparency())
+		m_shaderFeatures |= ShaderFeature::ALPHA_TEST;
 }
 
-void Model::loadAnimations(const aiScene* scene)
+#pragma endregion
+
+#pragma region Animation
+
+namespace
 {
-	for (int i = 0; i < scene->mNumAnimations; i++)
+	// Returns the key k with times[k] <= time < times[k + 1], clamped to the first and last segment, count must be at least 2.
+	// The cached key is checked first, so forward playback costs O(1); jumps and loops fall back to a binary search.
+	template<typename T, typename V>
+	uint32_t findKey(const T* times, uint32_t count, V time, uint32_t& cursor)
 	{
-		auto anim = scene->mAnimations[i];
-		auto tmp = std::make_shared<Animation>(anim->mName.C_Str());
-		float tps = anim->mTicksPerSecond;
-		tmp->SetTPS(tps > 0 ? tps : 30.0);
-		tmp->SetDuration(anim->mDuration);
-
-		for (int j = 0; j < anim->mNumChannels; j++)
+		uint32_t key = cursor;
+		if (key + 1 >= count || time < times[key])
+			key = static_cast<uint32_t>(std::upper_bound(times + 1, times + count - 1, time) - times) - 1;
+		else if (time >= times[key + 1])
 		{
-			auto channel = anim->mChannels[j];
-			Keyframe kf;
-			for (int k = 0; k < channel->mNumPositionKeys; k++)
-			{
-				kf.posStamps.push_back(channel->mPositionKeys[k].mTime);
-				kf.positions.push_back(toglm(channel->mPositionKeys[k].mValue));
-			}
-			for (int k = 0; k < channel->mNumRotationKeys; k++)
-			{
-				kf.rotStamps.push_back(channel->mRotationKeys[k].mTime);
-				kf.rotations.push_back(toglm(channel->mRotationKeys[k].mValue));
-			}
-			for (int k = 0; k < channel->mNumScalingKeys; k++)
-			{
-				kf.scaleStamps.push_back(channel->mScalingKeys[k].mTime);
-				kf.scales.push_back(toglm(channel->mScalingKeys[k].mValue));
-			}
-			tmp->AddKeyframe(channel->mNodeName.C_Str(), kf);
+			if (key + 2 < count && time < times[key + 2]) key++;
+			else key = static_cast<uint32_t>(std::upper_bound(times + key + 1, times + count - 1, time) - times) - 1;
 		}
-		m_animations.push_back(tmp);
+		cursor = key;
+		return key;
+	}
+
+	// findKey and the blend factor between the two keys
+	std::pair<uint32_t, float> findKeySegment(const float* times, uint32_t count, float time, uint32_t& cursor)
+	{
+		if (count < 2) return { 0, 0.0f };
+
+		const uint32_t key = findKey(times, count, time, cursor);
+		const float length = times[key + 1] - times[key];
+		const float fraction = length > 0.0f ? (time - times[key]) / length : 0.0f;
+		return { key, std::clamp(fraction, 0.0f, 1.0f) };
 	}
 }
 
-void Model::processNode(aiNode* node, const aiScene* scene, const glm::mat4& parentTransform)
+namespace
 {
-	glm::mat4 nodeTransform = MatrixCast(node->mTransformation);
-	glm::mat4 totalTransform = parentTransform * nodeTransform;
+	// largest value of the three smallest components of a unit quaternion
+	constexpr float SMALLEST_THREE_RANGE = 0.70710678f;
 
-	for (unsigned i = 0; i < node->mNumMeshes; ++i)
+	std::array<uint16_t, 3> quantizeVec3(const glm::vec3& value, const glm::vec3& rangeMin, const glm::vec3& rangeExtent)
 	{
-		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-		m_meshes.push_back(processMesh(mesh, scene, totalTransform));
+		std::array<uint16_t, 3> key;
+		for (int i = 0; i < 3; i++)
+		{
+			const float normalized = rangeExtent[i] > 0.0f ? (value[i] - rangeMin[i]) / rangeExtent[i] : 0.0f;
+			key[i] = static_cast<uint16_t>(std::lround(std::clamp(normalized, 0.0f, 1.0f) * 65535.0f));
+		}
+		return key;
 	}
-	for (unsigned i = 0; i < node->mNumChildren; ++i)
+
+	glm::vec3 dequantizeVec3(const std::array<uint16_t, 3>& key, const glm::vec3& rangeMin, const glm::vec3& rangeExtent)
 	{
-		processNode(node->mChildren[i], scene, totalTransform);
+		return rangeMin + rangeExtent * glm::vec3(key[0], key[1], key[2]) * (1.0f / 65535.0f);
 	}
-}
 
-MeshRef Model::processMesh(const aiMesh* mesh, const aiScene* scene, const glm::mat4& transform)
-{
-	_ASSERT(mesh);
-	std::vector<MeshVertex> vertices;
-	std::vector<uint32_t> indices;
-	std::vector<MaterialTexture> textures;
-	MaterialProperties matProperties;
-	processVertex(mesh, transform, vertices);
-	processIndices(mesh, indices);
-	processBones(mesh, vertices);
-	processTextures(mesh, scene, textures);
-	processMatProperties(mesh, scene, matProperties);
-	return std::make_shared<Mesh>(vertices, indices, textures, matProperties);
-}
+	// Smallest-three: the largest component is dropped and rebuilt from the unit length. Each word stores 15 bits of a component,
+	// the low bits of the first two words hold the index of the dropped one.
+	std::array<uint16_t, 3> quantizeQuat(glm::quat q)
+	{
+		q = glm::normalize(q);
+		int largest = 0;
+		for (int i = 1; i < 4; i++)
+			if (std::abs(q[i]) > std::abs(q[largest])) largest = i;
+		if (q[largest] < 0.0f) q = -q;
+
+		std::array<uint16_t, 3> key;
+		int word = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (i == largest) continue;
+			const float normalized = std::clamp(q[i] / SMALLEST_THREE_RANGE * 0.5f + 0.5f, 0.0f, 1.0f);
+			const uint16_t value = static_cast<uint16_t>(std::lround(normalized * 32767.0f));
+			const uint16_t indexBit = word < 2 ? static_cast<uint16_t>((largest >> word) & 1) : 0;
+			key[word++] = static_cast<uint16_t>((value << 1) | indexBit);
+		}
+		return key;
+	}
 
-void Model::processVertex(const aiMesh* mesh, const glm::mat4& transform, std::vector<MeshVertex>& vertices)
-{
-	for (unsigned i = 0; i < mesh->mNumVertices; ++i)
+	glm::quat dequantizeQuat(const std::array<uint16_t, 3>& key)
 	{
-		auto aiVert = mesh->mVertices;
-		auto aiClr = mesh->mColors[0];
-		auto aiNormals = mesh->mNormals;
-		auto aiTexCoords = mesh->mTextureCoords[0];
-		auto aiTangents = mesh->mTangents;
-		auto aiBitangents = mesh->mBitangents;
-
-		MeshVertex vertex;
-
-		vertex.position = transform * glm::vec4(aiVert[i].x, aiVert[i].y, aiVert[i].z, 1.0f);
+		const int largest = (key[0] & 1) | ((key[1] & 1) << 1);
+		glm::quat q;
+		float lengthSq = 0.0f;
+		int word = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (i == largest) continue;
+			const float value = ((key[word++] >> 1) * (2.0f / 32767.0f) - 1.0f) * SMALLEST_THREE_RANGE;
+			q[i] = value;
+			lengthSq += value * value;
+		}
+		q[largest] = std::sqrt(std::max(0.0f, 1.0f - lengthSq));
+		return q;
+	}
 
-		if (mesh->HasVertexColors(0)) 
-			vertex.color = glm::vec3(aiClr[i].r, aiClr[i].g, aiClr[i].b);
-		else 
-			vertex.color = glm::vec3(1.0f);
+	// source channel evaluated at every time of the time base
+	template<typename T, typename Interpolate>
+	void resampleChannel(const float* times, const T* values, uint32_t count, const std::vector<float>& timeBase, Interpolate interpolate, std::vector<T>& out)
+	{
+		out.resize(timeBase.size());
+		uint32_t cursor = 0;
+		for (size_t i = 0; i < timeBase.size(); i++)
+		{
+			const auto [key, fraction] = findKeySegment(times, count, timeBase[i], cursor);
+			out[i] = count > 1 ? interpolate(values[key], values[key + 1], fraction) : values[0];
+		}
+	}
 
-		if (mesh->HasNormals())
-			vertex.normal = transform * glm::vec4(aiNormals[i].x, aiNormals[i].y, aiNormals[i].z, 0);
-		else
-			vertex.normal = glm::vec3(0.0f);
+	// Keeps the first sample and greedily extends every segment while the interpolation of the decoded keys stays within the tolerance
+	// of all source samples it covers. A constant channel keeps a single key.
+	template<typename T, typename Interpolate, typename Distance>
+	void reduceKeys(const std::vector<float>& timeBase, const std::vector<T>& source, const std::vector<T>& decoded, float tolerance, Interpolate interpolate, Distance distance, std::vector<uint32_t>& kept)
+	{
+		kept.assign(1, 0);
+		const uint32_t count = static_cast<uint32_t>(source.size());
 
-		if (mesh->HasTextureCoords(0))
-			vertex.texCoords = glm::vec2(aiTexCoords[i].x, aiTexCoords[i].y);
-		else
-			vertex.texCoords = glm::vec2(0.0f);
+		bool constant = true;
+		for (uint32_t i = 0; i < count && constant; i++)
+			constant = distance(decoded[0], source[i]) <= tolerance;
+		if (constant) return;
 
-		if (mesh->HasTangentsAndBitangents())
-		{
-			vertex.tangent = glm::vec3(aiTangents[i].x, aiTangents[i].y, aiTangents[i].z);
-			vertex.bitangent = glm::vec3(aiBitangents[i].x, aiBitangents[i].y, aiBitangents[i].z);
-		}
-		else
+		uint32_t first = 0;
+		while (first + 1 < count)
 		{
-			vertex.tangent = glm::vec3(0.0f);
-			vertex.bitangent = glm::vec3(0.0f);
+			uint32_t last = first + 1;
+			while (last + 1 < count)
+			{
+				const uint32_t candidate = last + 1;
+				const float length = timeBase[candidate] - timeBase[first];
+				bool fits = true;
+				for (uint32_t i = first + 1; i < candidate && fits; i++)
+					fits = distance(interpolate(decoded[first], decoded[candidate], (timeBase[i] - timeBase[first]) / length), source[i]) <= tolerance;
+				if (!fits) break;
+				last = candidate;
+			}
+			kept.push_back(last);
+			first = last;
 		}
+	}
+}
 
-		vertices.push_back(vertex);
+Animation::Animation(const std::string& name)
+	: m_name(name)
+{
+}
+
+void Animation::SetName(const std::string& name)
+{
+	m_name = name;
+}
+
+void Animation::SetTPS(float tps)
+{
+	m_tps = tps;
+}
+
+void Animation::SetDuration(float duration)
+{
+	m_duration = duration;
+}
+
+void Animation::SetIsRepeated(bool repeat)
+{
+	m_repeat = repeat;
+}
+
+void Animation::SetIsBlending(bool blending)
+{
+	m_blending = blending;
+}
+
+void Animation::SetLastTime(float lastTime)
+{
+	m_lastTime = lastTime;
+}
+
+void Animation::AddKeyframe(const std::string& name, const Keyframe& keyframe)
+{
+	m_keyframes[name] = keyframe;
+}
+
+void Animation::Play(float time)
+{
+	if (m_state != State::Paused)
+	{
+		m_lastTime = time;
+		if (time < 0)
+			m_blending = true;
 	}
+
+	m_state = State::Playing;
+	m_time.Restart();
 }
 
-void Model::processIndices(const aiMesh* mesh, std::vector<uint32_t>& indices)
+void Animation::Pause()
 {
-	for (unsigned i = 0; i < mesh->mNumFaces; ++i)
+	m_state = State::Paused;
+	m_lastTime = GetTime() + m_lastTime;
+}
+
+void Animation::Stop()
+{
+	m_state = State::Stopped;
+	m_lastTime = 0.01;
+}
+
+void Animation::Compile(const std::unordered_map<std::string, uint32_t>& boneIndices)
+{
+	m_tracks.clear();
+	m_positionTimes.clear();
+	m_positions.clear();
+	m_rotationTimes.clear();
+	m_rotations.clear();
+	m_scaleTimes.clear();
+	m_scales.clear();
+
+	for (const auto& [name, keyframe] : m_keyframes)
 	{
-		auto face = mesh->mFaces[i];
-		for (unsigned k = 0; k < face.mNumIndices; ++k)
-			indices.push_back(face.mIndices[k]);
+		auto it = boneIndices.find(name);
+		if (it == boneIndices.end())
+			continue;
+
+		Track track;
+		track.bone = it->second;
+		track.position = { static_cast<uint32_t>(m_positions.size()), static_cast<uint32_t>(std::min(keyframe.posStamps.size(), keyframe.positions.size())) };
+		m_positionTimes.insert(m_positionTimes.end(), keyframe.posStamps.begin(), keyframe.posStamps.begin() + track.position.count);
+		m_positions.insert(m_positions.end(), keyframe.positions.begin(), keyframe.positions.begin() + track.position.count);
+
+		track.rotation = { static_cast<uint32_t>(m_rotations.size()), static_cast<uint32_t>(std::min(keyframe.rotStamps.size(), keyframe.rotations.size())) };
+		m_rotationTimes.insert(m_rotationTimes.end(), keyframe.rotStamps.begin(), keyframe.rotStamps.begin() + track.rotation.count);
+		m_rotations.insert(m_rotations.end(), keyframe.rotations.begin(), keyframe.rotations.begin() + track.rotation.count);
+
+		track.scale = { static_cast<uint32_t>(m_scales.size()), static_cast<uint32_t>(std::min(keyframe.scaleStamps.size(), keyframe.scales.size())) };
+		m_scaleTimes.insert(m_scaleTimes.end(), keyframe.scaleStamps.begin(), keyframe.scaleStamps.begin() + track.scale.count);
+		m_scales.insert(m_scales.end(), keyframe.scales.begin(), keyframe.scales.begin() + track.scale.count);
+
+		m_tracks.push_back(track);
 	}
+
+	// bone order keeps the pose writes sequential
+	std::sort(m_tracks.begin(), m_tracks.end(), [](const Track& a, const Track& b) { return a.bone < b.bone; });
+	m_cursor.keys.assign(m_tracks.size() * 3, 0);
 }
 
-void Model::processBones(const aiMesh* mesh, std::vector<MeshVertex>& vertices)
+void Animation::Sample(float time, std::span<BonePose> pose, AnimationCursor& cursor) const
 {
-	for (size_t i = 0; i < mesh->mNumBones; i++)
+	if (m_compressed)
 	{
-		auto bone = mesh->mBones[i];
+		sampleCompressed(time, pose, cursor);
+		return;
+	}
 
-		if (m_bonemap.find(bone->mName.C_Str()) == m_bonemap.end())
-			m_bonemap[bone->mName.C_Str()] = { i, toglm(bone->mOffsetMatrix) };
+	if (cursor.keys.size() != m_tracks.size() * 3)
+		cursor.keys.assign(m_tracks.size() * 3, 0);
 
-		std::vector<int> nbones;
-		nbones.resize(mesh->mNumVertices, 0);
-		for (size_t j = 0; j < bone->mNumWeights ? 1 : 0; j++)
+	uint32_t* keys = cursor.keys.data();
+	for (const Track& track : m_tracks)
+	{
+		if (track.bone < pose.size())
 		{
-			int id = bone->mWeights[j].mVertexId;
-			float weight = bone->mWeights[j].mWeight;
-			vertices[id].boneIDs[nbones[id]] = i;
-			vertices[id].weights[nbones[id]] = weight;
-			nbones[id]++;
+			BonePose& bonePose = pose[track.bone];
+			if (track.position.count > 0)
+			{
+				const auto [key, fraction] = findKeySegment(&m_positionTimes[track.position.first], track.position.count, time, keys[0]);
+				const glm::vec3* values = &m_positions[track.position.first];
+				bonePose.position = track.position.count > 1 ? glm::mix(values[key], values[key + 1], fraction) : values[0];
+			}
+			if (track.rotation.count > 0)
+			{
+				const auto [key, fraction] = findKeySegment(&m_rotationTimes[track.rotation.first], track.rotation.count, time, keys[1]);
+				const glm::quat* values = &m_rotations[track.rotation.first];
+				bonePose.orientation = track.rotation.count > 1 ? glm::slerp(values[key], values[key + 1], fraction) : values[0];
+			}
+			if (track.scale.count > 0)
+			{
+				const auto [key, fraction] = findKeySegment(&m_scaleTimes[track.scale.first], track.scale.count, time, keys[2]);
+				const glm::vec3* values = &m_scales[track.scale.first];
+				bonePose.scale = track.scale.count > 1 ? glm::mix(values[key], values[key + 1], fraction) : values[0];
+			}
 		}
+		keys += 3;
 	}
 }
 
-void Model::findBoneNodes(aiNode* node, std::vector<BoneRef>& bones)
+void Animation::Update(std::span<BonePose> pose, std::span<float> morphWeights)
 {
-	BoneRef tmp = nullptr;
-	if (processBone(node, tmp))
+	if (m_state == State::Stopped)
+		return;
+	const float time = advance();
+	Sample(time, pose, m_cursor);
+	SampleMorphWeights(time, morphWeights);
+}
+
+void Animation::AddMorphChannel(uint32_t firstTarget, uint32_t targetCount, std::vector<float> times, std::vector<float> weights)
+{
+	if (targetCount == 0 || times.empty() || weights.size() != times.size() * targetCount)
 	{
-		if (tmp)
+		Warning("Animation '" + m_name + "': invalid morph channel");
+		return;
+	}
+	m_morphChannels.push_back({ firstTarget, targetCount, std::move(times), std::move(weights) });
+}
+
+bool Animation::HasMorphChannels() const
+{
+	return !m_morphChannels.empty();
+}
+
+void Animation::SampleMorphWeights(float time, std::span<float> weights) const
+{
+	for (const MorphChannel& channel : m_morphChannels)
+	{
+		if (channel.firstTarget + channel.targetCount > weights.size())
+			continue;
+		float* destination = weights.data() + channel.firstTarget;
+		// few keys per channel, no cursor needed
+		const size_t next = std::upper_bound(channel.times.begin(), channel.times.end(), time) - channel.times.begin();
+		if (next == 0 || next == channel.times.size())
 		{
-			bones.emplace_back(tmp);
-			AddChild(tmp.get());
+			const float* values = channel.weights.data() + (next == 0 ? 0 : next - 1) * channel.targetCount;
+			std::copy(values, values + channel.targetCount, destination);
+			continue;
 		}
-		return;
+		const float span = channel.times[next] - channel.times[next - 1];
+		const float fraction = span > 0.0f ? (time - channel.times[next - 1]) / span : 0.0f;
+		const float* from = channel.weights.data() + (next - 1) * channel.targetCount;
+		const float* to = from + channel.targetCount;
+		for (uint32_t i = 0; i < channel.targetCount; i++)
+			destination[i] = glm::mix(from[i], to[i], fraction);
 	}
-	for (size_t i = 0; i < node->mNumChildren; i++)
-		findBoneNodes(node->mChildren[i], bones);
 }
 
-bool Model::processBone(aiNode* node, BoneRef& out)
+bool Animation::Compress(const AnimationCompressionSettings& settings, std::span<const float> boneLengths)
 {
-	if (m_bonemap.find(node->mName.C_Str()) != m_bonemap.end())
+	if (m_compressed)
+		return true;
+
+	std::vector<float> timeBase;
+	timeBase.reserve(m_positionTimes.size() + m_rotationTimes.size() + m_scaleTimes.size());
+	timeBase.insert(timeBase.end(), m_positionTimes.begin(), m_positionTimes.end());
+	timeBase.insert(timeBase.end(), m_rotationTimes.begin(), m_rotationTimes.end());
+	timeBase.insert(timeBase.end(), m_scaleTimes.begin(), m_scaleTimes.end());
+	std::sort(timeBase.begin(), timeBase.end());
+	timeBase.erase(std::unique(timeBase.begin(), timeBase.end()), timeBase.end());
+	if (timeBase.empty())
+		timeBase.push_back(0.0f);
+	if (timeBase.size() > std::numeric_limits<uint16_t>::max())
 	{
-		auto it = std::find_if(m_bones.begin(), m_bones.end(), [&](auto& b) { return b->GetName() == std::string(node->mName.C_Str()); });
-		if (it != m_bones.end())
-			return false;
-		out = std::make_shared<Bone>(m_bonemap[node->mName.C_Str()].first, node->mName.C_Str(), m_bonemap[node->mName.C_Str()].second);
-		if (!m_animations.empty())
-			if (m_animations[0]->GetKeyframes().find(out->GetName()) != m_animations[0]->GetKeyframes().end())
+		Warning("Animation '" + m_name + "' has too many key times to compress: " + std::to_string(timeBase.size()));
+		return false;
+	}
+
+	auto mixVec3 = [](const glm::vec3& a, const glm::vec3& b, float t) { return glm::mix(a, b, t); };
+	auto slerpQuat = [](const glm::quat& a, const glm::quat& b, float t) { return glm::slerp(a, b, t); };
+
+	std::vector<CompressedTrack> tracks;
+	std::vector<uint16_t> keyFrames;
+	std::vector<QuantizedKey> keyValues;
+	std::vector<glm::vec3> vec3Source, vec3Decoded;
+	std::vector<glm::quat> quatSource, quatDecoded;
+	std::vector<uint32_t> kept;
+
+	auto emitKeys = [&](const auto& decode, CompressedChannel& channel)
+		{
+			channel.first = static_cast<uint32_t>(keyFrames.size());
+			channel.count = static_cast<uint32_t>(kept.size());
+			for (uint32_t frame : kept)
 			{
-				Keyframe kf = m_animations[0]->GetKeyframes()[out->GetName()];
-				auto pos = kf.positions[0];
-				auto rot = kf.rotations[0];
-				Transform tr;
-				tr.SetPosition({ pos.x, pos.y, pos.z });
-				tr.SetOrientation({ rot.x, rot.y, rot.z, rot.w });
-				out->SetTransform(tr);
+				keyFrames.push_back(static_cast<uint16_t>(frame));
+				keyValues.push_back(decode(frame));
 			}
-			else out->SetTransform(To3DTransform(toglm(node->mTransformation)).first);
-
-		out->SavePoseAsIdle();
+		};
 
-		for (int i = 0; i < node->mNumChildren; i++)
+	// positions and scales: range-quantized, the error is scaled by the bone length for scales
+	auto compressVec3 = [&](const std::vector<float>& times, const std::vector<glm::vec3>& values, const Channel& source, float tolerance, CompressedChannel& channel)
 		{
-			std::shared_ptr<Bone> child = nullptr;
-			if (processBone(node->mChildren[i], child))
+			if (source.count == 0) return;
+			resampleChannel(&times[source.first], &values[source.first], source.count, timeBase, mixVec3, vec3Source);
+
+			glm::vec3 rangeMin = vec3Source[0], rangeMax = vec3Source[0];
+			for (const glm::vec3& value : vec3Source)
 			{
-				m_bonesChildren.push_back(child);
-				child->SetParent(out.get());
-				out->AddChild(child.get());
+				rangeMin = glm::min(rangeMin, value);
+				rangeMax = glm::max(rangeMax, value);
 			}
+			channel.rangeMin = rangeMin;
+			channel.rangeExtent = rangeMax - rangeMin;
+
+			vec3Decoded.resize(vec3Source.size());
+			for (size_t i = 0; i < vec3Source.size(); i++)
+				vec3Decoded[i] = dequantizeVec3(quantizeVec3(vec3Source[i], rangeMin, channel.rangeExtent), rangeMin, channel.rangeExtent);
+
+			reduceKeys(timeBase, vec3Source, vec3Decoded, tolerance, mixVec3, [](const glm::vec3& a, const glm::vec3& b) { return glm::distance(a, b); }, kept);
+			emitKeys([&](uint32_t frame) { return quantizeVec3(vec3Source[frame], rangeMin, channel.rangeExtent); }, channel);
+		};
+
+	for (const Track& track : m_tracks)
+	{
+		const float boneLength = std::max(settings.virtualVertexDistance, track.bone < boneLengths.size() ? boneLengths[track.bone] : 0.0f);
+
+		CompressedTrack compressed;
+		compressed.bone = track.bone;
+		compressVec3(m_positionTimes, m_positions, track.position, settings.tolerance, compressed.position);
+		compressVec3(m_scaleTimes, m_scales, track.scale, settings.tolerance / boneLength, compressed.scale);
+
+		if (track.rotation.count > 0)
+		{
+			resampleChannel(&m_rotationTimes[track.rotation.first], &m_rotations[track.rotation.first], track.rotation.count, timeBase, slerpQuat, quatSource);
+			quatDecoded.resize(quatSource.size());
+			for (size_t i = 0; i < quatSource.size(); i++)
+				quatDecoded[i] = dequantizeQuat(quantizeQuat(quatSource[i]));
+
+			// a rotation by angle a moves the end of the bone by 2 * length * sin(a / 2)
+			auto displacement = [boneLength](const glm::quat& a, const glm::quat& b)
+				{
+					// the vector part of the relative rotation is sin(a / 2), without the cancellation of 1 - cos^2
+					const glm::quat delta = glm::conjugate(glm::normalize(a)) * glm::normalize(b);
+					return 2.0f * boneLength * glm::length(glm::vec3(delta.x, delta.y, delta.z));
+				};
+			reduceKeys(timeBase, quatSource, quatDecoded, settings.tolerance, slerpQuat, displacement, kept);
+			emitKeys([&](uint32_t frame) { return quantizeQuat(quatSource[frame]); }, compressed.rotation);
 		}
-		return true;
+
+		tracks.push_back(compressed);
 	}
-	return false;
+
+	m_compressedTracks = std::move(tracks);
+	m_timeBase = std::move(timeBase);
+	m_keyFrames = std::move(keyFrames);
+	m_keyValues = std::move(keyValues);
+	m_compressed = true;
+
+	m_tracks.clear();
+	m_tracks.shrink_to_fit();
+	for (auto* times : { &m_positionTimes, &m_rotationTimes, &m_scaleTimes })
+	{
+		times->clear();
+		times->shrink_to_fit();
+	}
+	m_positions.clear();
+	m_positions.shrink_to_fit();
+	m_rotations.clear();
+	m_rotations.shrink_to_fit();
+	m_scales.clear();
+	m_scales.shrink_to_fit();
+	if (settings.releaseSource)
+		m_keyframes.clear();
+
+	m_cursor.keys.assign(m_compressedTracks.size() * 3, 0);
+	m_cursor.baseKey = 0;
+	return true;
 }
 
-void Model::processTextures(const aiMesh* mesh, const aiScene* scene, std::vector<MaterialTexture>& textures)
+bool Animation::IsCompressed() const
 {
-	aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-	loadTextureFromMaterial(aiTextureType_DIFFUSE, material, textures);
-	loadTextureFromMaterial(aiTextureType_NORMALS, material, textures);
-	loadTextureFromMaterial(aiTextureType_SPECULAR, material, textures);
-	loadTextureFromMaterial(aiTextureType_HEIGHT, material, textures);
-	loadTextureFromMaterial(aiTextureType_SHININESS, material, textures);
-	loadTextureFromMaterial(aiTextureType_AMBIENT, material, textures);
+	return m_compressed;
 }
 
-void Model::loadTextureFromMaterial(aiTextureType textureType, const aiMaterial* mat, std::vector<MaterialTexture>& textures)
+size_t Animation::GetMemoryUsage() const
 {
-	// TODO: генерировать дефолтную текстуру если нет своей
-	// TODO: кеширование текстур
-
-	_ASSERT(mat);
-	GLint TextureCount = mat->GetTextureCount(textureType);
-	int TextureIndex = -1;
-	if (TextureCount <= 0)
+	size_t bytes = 0;
+	for (const auto& [name, keyframe] : m_keyframes)
 	{
-		MaterialTexture MeshTexture;
-		textures.push_back(MeshTexture); // TODO: зачем и как должно быть
+		bytes += (keyframe.posStamps.size() + keyframe.rotStamps.size() + keyframe.scaleStamps.size()) * sizeof(float);
+		bytes += (keyframe.positions.size() + keyframe.scales.size()) * sizeof(glm::vec3) + keyframe.rotations.size() * sizeof(glm::quat);
 	}
-	for (GLint i = 0; i < TextureCount; ++i)
+	bytes += m_tracks.size() * sizeof(Track);
+	bytes += (m_positionTimes.size() + m_rotationTimes.size() + m_scaleTimes.size()) * sizeof(float);
+	bytes += (m_positions.size() + m_scales.size()) * sizeof(glm::vec3) + m_rotations.size() * sizeof(glm::quat);
+	bytes += m_compressedTracks.size() * sizeof(CompressedTrack) + m_timeBase.size() * sizeof(float);
+	bytes += m_keyFrames.size() * sizeof(uint16_t) + m_keyValues.size() * sizeof(QuantizedKey);
+	for (const MorphChannel& channel : m_morphChannels)
+		bytes += (channel.times.size() + channel.weights.size()) * sizeof(float);
+	return bytes;
+}
+
+size_t Animation::GetTrackCount() const
+{
+	return m_compressed ? m_compressedTracks.size() : m_tracks.size();
+}
+
+float Animation::advance()
+{
+	if (m_state != State::Playing)
+		return m_lastTime;
+
+	float time = GetTime() + m_lastTime;
+	if (time >= m_duration)
 	{
-		aiString Str;
-		mat->GetTexture(textureType, i, &Str);
-		std::string TextureName = Str.C_Str();
-		std::string TexturePath = m_directory + "/" + TextureName;
-		GLboolean Skip = GL_FALSE;
-		GLint LoadedTextureCount = static_cast<int>(m_loadedTextures.size());
-		for (int k = 0; k < LoadedTextureCount; ++k)
+		if (m_repeat && m_duration > 0.0f)
 		{
-			if (TexturePath == m_loadedTextures[k].path)
-			{
-				Skip = GL_TRUE;
-				textures.push_back(m_loadedTextures[k]);
-				break;
-			}
+			time = std::fmod(time, m_duration);
+			m_time.Restart();
+			m_lastTime = time;
 		}
-		if (!Skip)
+		else
 		{
-			MaterialTexture MeshTexture;
-			MeshTexture.texture = std::make_shared<GLTexture2D>(TexturePath, STBI_rgb_alpha, true);
-			MeshTexture.path = TexturePath;
-			textures.push_back(MeshTexture);
-			m_loadedTextures.push_back(MeshTexture);
+			time = m_duration;
+			m_state = State::Paused;
+			m_lastTime = m_duration;
 		}
 	}
+	return time;
+}
+
+void Animation::sampleCompressed(float time, std::span<BonePose> pose, AnimationCursor& cursor) const
+{
+	if (cursor.keys.size() != m_compressedTracks.size() * 3)
+		cursor.keys.assign(m_compressedTracks.size() * 3, 0);
+
+	// the time is located once on the shared time base, channels only compare frame indices
+	const uint32_t baseCount = static_cast<uint32_t>(m_timeBase.size());
+	const auto [baseKey, baseFraction] = findKeySegment(m_timeBase.data(), baseCount, time, cursor.baseKey);
+	const float baseTime = baseCount > 1 ? glm::mix(m_timeBase[baseKey], m_timeBase[baseKey + 1], baseFraction) : m_timeBase[0];
+
+	auto locate = [&](const CompressedChannel& channel, uint32_t& channelCursor) -> std::pair<uint32_t, float>
+		{
+			const uint16_t* frames = &m_keyFrames[channel.first];
+			const uint32_t key = findKey(frames, channel.count, baseKey, channelCursor);
+			const float t0 = m_timeBase[frames[key]];
+			const float length = m_timeBase[frames[key + 1]] - t0;
+			return { channel.first + key, length > 0.0f ? std::clamp((baseTime - t0) / length, 0.0f, 1.0f) : 0.0f };
+		};
+
+	uint32_t* keys = cursor.keys.data();
+	for (const CompressedTrack& track : m_compressedTracks)
+	{
+		if (track.bone < pose.size())
+		{
+			BonePose& bonePose = pose[track.bone];
+			const CompressedChannel& position = track.position;
+			if (position.count == 1)
+				bonePose.position = dequantizeVec3(m_keyValues[position.first], position.rangeMin, position.rangeExtent);
+			else if (position.count > 1)
+			{
+				const auto [key, fraction] = locate(position, keys[0]);
+				bonePose.position = glm::mix(dequantizeVec3(m_keyValues[key], position.rangeMin, position.rangeExtent),
+					dequantizeVec3(m_keyValues[key + 1], position.rangeMin, position.rangeExtent), fraction);
+			}
+
+			const CompressedChannel& rotation = track.rotation;
+			if (rotation.count == 1)
+				bonePose.orientation = dequantizeQuat(m_keyValues[rotation.first]);
+			else if (rotation.count > 1)
+			{
+				const auto [key, fraction] = locate(rotation, keys[1]);
+				bonePose.orientation = glm::slerp(dequantizeQuat(m_keyValues[key]), dequantizeQuat(m_keyValues[key + 1]), fraction);
+			}
+
+			const CompressedChannel& scale = track.scale;
+			if (scale.count == 1)
+				bonePose.scale = dequantizeVec3(m_keyValues[scale.first], scale.rangeMin, scale.rangeExtent);
+			else if (scale.count > 1)
+			{
+				const auto [key, fraction] = locate(scale, keys[2]);
+				bonePose.scale = glm::mix(dequantizeVec3(m_keyValues[key], scale.rangeMin, scale.rangeExtent),
+					dequantizeVec3(m_keyValues[key + 1], scale.rangeMin, scale.rangeExtent), fraction);
+			}
+		}
+		keys += 3;
+	}
+}
+
+std::unordered_map<std::string, Keyframe>& Animation::GetKeyframes()
+{
+	return m_keyframes;
+}
+
+std::string Animation::GetName() const
+{
+	return m_name;
+}
+
+bool Animation::IsRepeated() const
+{
+	return m_repeat;
+}
+
+bool Animation::IsBlending() const
+{
+	return m_blending;
+}
+
+float Animation::GetTime() const
+{
+	return m_time.GetElapsedTime().AsSeconds() * m_tps;
+}
+
+float Animation::GetLastTime() const
+{
+	return m_lastTime;
+}
+
+float Animation::GetDuration() const
+{
+	return m_duration;
+}
+
+float Animation::GetTPS() const
+{
+	return m_tps;
+}
+
+Animation::State Animation::GetState() const
+{
+	return m_state;
+}
+
+#pragma endregion
+
+#pragma region Skeleton
+
+void Skeleton::Reserve(size_t count)
+{
+	m_hierarchy.Reserve(count);
+	m_paletteIndices.reserve(count);
+	m_offsets.reserve(count);
+	m_localPose.reserve(count);
+}
+
+void Skeleton::Clear()
+{
+	m_hierarchy.Clear();
+	m_paletteIndices.clear();
+	m_offsets.clear();
+	m_localPose.clear();
+	m_paletteSize = 0;
+	m_evaluatedPalette = nullptr;
+}
+
+uint32_t Skeleton::AddBone(uint32_t parent, const glm::mat4& offset, uint32_t paletteIndex, const BonePose& pose)
+{
+	if (parent != InvalidIndex && parent >= m_hierarchy.GetSize())
+	{
+		Error("Skeleton: parent bone must be added before its children");
+		parent = InvalidIndex;
+	}
+	const uint32_t index = m_hierarchy.Add(parent, ComposeTRS(pose.position, pose.orientation, glm::vec3(1.0f)));
+	m_paletteIndices.push_back(paletteIndex);
+	m_offsets.push_back(offset);
+	m_localPose.push_back(pose);
+	m_paletteSize = std::max(m_paletteSize, paletteIndex + 1);
+	return index;
+}
+
+std::span<BonePose> Skeleton::GetLocalPose()
+{
+	return m_localPose;
+}
+
+std::span<const BonePose> Skeleton::GetLocalPose() const
+{
+	return m_localPose;
+}
+
+const BonePose& Skeleton::GetLocalPose(uint32_t bone) const
+{
+	return m_localPose[bone];
+}
+
+void Skeleton::SetLocalPose(uint32_t bone, const BonePose& pose)
+{
+	m_localPose[bone] = pose;
+	MarkDirty(bone);
+}
+
+void Skeleton::MarkDirty()
+{
+	for (uint32_t bone = 0; bone < m_localPose.size(); bone++)
+		MarkDirty(bone);
+}
+
+void Skeleton::MarkDirty(uint32_t bone)
+{
+	const BonePose& pose = m_localPose[bone];
+	m_hierarchy.SetLocal(bone, ComposeTRS(pose.position, pose.orientation, glm::vec3(1.0f)));
+}
+
+bool Skeleton::IsDirty() const
+{
+	return m_hierarchy.IsDirty();
+}
+
+void Skeleton::Evaluate(glm::mat4* palette)
+{
+	if (palette != m_evaluatedPalette)
+	{
+		MarkDirty();
+		m_evaluatedPalette = palette;
+	}
+	m_hierarchy.Update([&](uint32_t bone)
+		{
+			// scale * offset only scales the rows of the offset matrix
+			const glm::vec4 scale(m_localPose[bone].scale, 1.0f);
+			const glm::mat4& offset = m_offsets[bone];
+			const glm::mat4 scaledOffset(offset[0] * scale, offset[1] * scale, offset[2] * scale, offset[3] * scale);
+			MatrixMultiply(m_hierarchy.GetWorld(bone), scaledOffset, palette[m_paletteIndices[bone]]);
+		});
+}
+
+void Skeleton::Evaluate(std::span<const BonePose> localPose, std::span<glm::mat4> model, glm::mat4* palette) const
+{
+	const size_t count = m_hierarchy.GetSize();
+	assert(localPose.size() >= count && model.size() >= count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const BonePose& pose = localPose[i];
+		const uint32_t parent = m_hierarchy.GetParent(i);
+
+		// parents are stored first, so model[parent] is already final
+		const glm::mat4 local = ComposeTRS(pose.position, pose.orientation, glm::vec3(1.0f));
+		if (parent != InvalidIndex) MatrixMultiply(model[parent], local, model[i]);
+		else model[i] = local;
+
+		// scale * offset only scales the rows of the offset matrix
+		const glm::vec4 scale(pose.scale, 1.0f);
+		const glm::mat4& offset = m_offsets[i];
+		const glm::mat4 scaledOffset(offset[0] * scale, offset[1] * scale, offset[2] * scale, offset[3] * scale);
+		MatrixMultiply(model[i], scaledOffset, palette[m_paletteIndices[i]]);
+	}
+}
+
+size_t Skeleton::GetBoneCount() const
+{
+	return m_hierarchy.GetSize();
+}
+
+uint32_t Skeleton::GetParent(uint32_t bone) const
+{
+	return m_hierarchy.GetParent(bone);
+}
+
+uint32_t Skeleton::GetPaletteSize() const
+{
+	return m_paletteSize;
+}
+
+const glm::mat4& Skeleton::GetModelMatrix(uint32_t bone) const
+{
+	return m_hierarchy.GetWorld(bone);
+}
+
+BonePose Skeleton::GetModelPose(std::span<const BonePose> localPose, uint32_t bone) const
+{
+	BonePose result;
+	for (uint32_t i = bone; i != InvalidIndex; i = m_hierarchy.GetParent(i))
+	{
+		const BonePose& local = localPose[i];
+		result.position = local.position + local.orientation * result.position;
+		result.orientation = local.orientation * result.orientation;
+	}
+	return result;
+}
+
+std::vector<float> Skeleton::GetBoneLengths() const
+{
+	// children are stored after their parents, so a reverse walk sees every child first
+	std::vector<float> lengths(m_hierarchy.GetSize(), 0.0f);
+	for (size_t i = m_hierarchy.GetSize(); i-- > 0;)
+	{
+		const uint32_t parent = m_hierarchy.GetParent(i);
+		if (parent != InvalidIndex)
+			lengths[parent] = std::max(lengths[parent], glm::length(m_localPose[i].position * m_localPose[parent].scale) + lengths[i]);
+	}
+	return lengths;
+}
+
+#pragma endregion
+
+#pragma region PoseBlending
+
+BoneMask::BoneMask(size_t boneCount, float weight)
+	: m_weights(boneCount, weight)
+{
+}
+
+void BoneMask::SetBranch(const Skeleton& skeleton, uint32_t bone, float weight)
+{
+	const size_t count = skeleton.GetBoneCount();
+	m_weights.resize(count, 0.0f);
+	if (bone >= count)
+		return;
+
+	// parents are stored before their children, one forward pass finds the whole branch
+	std::vector<uint8_t> inBranch(count, 0);
+	inBranch[bone] = 1;
+	m_weights[bone] = weight;
+	for (size_t i = bone + 1; i < count; i++)
+	{
+		const uint32_t parent = skeleton.GetParent(static_cast<uint32_t>(i));
+		if (parent != Skeleton::InvalidIndex && inBranch[parent])
+		{
+			inBranch[i] = 1;
+			m_weights[i] = weight;
+		}
+	}
+}
+
+void BoneMask::SetWeight(uint32_t bone, float weight)
+{
+	if (bone >= m_weights.size())
+		m_weights.resize(bone + 1, 0.0f);
+	m_weights[bone] = weight;
+}
+
+bool BoneMask::IsEmpty() const
+{
+	return m_weights.empty();
+}
+
+std::span<const float> BoneMask::GetWeights() const
+{
+	return m_weights;
+}
+
+void BlendPoses(std::span<const BonePose> a, std::span<const BonePose> b, float weight, std::span<const float> mask, std::span<BonePose> out)
+{
+	const size_t count = std::min({ a.size(), b.size(), out.size() });
+	for (size_t i = 0; i < count; i++)
+	{
+		const float w = mask.empty() ? weight : (i < mask.size() ? weight * mask[i] : 0.0f);
+		if (w <= 0.0f)
+			out[i] = a[i];
+		else if (w >= 1.0f)
+			out[i] = b[i];
+		else
+		{
+			const BonePose& from = a[i];
+			const BonePose& to = b[i];
+			out[i] = { glm::mix(from.position, to.position, w), NLerp(from.orientation, to.orientation, w), glm::mix(from.scale, to.scale, w) };
+		}
+	}
+}
+
+void MakeAdditivePose(std::span<const BonePose> pose, std::span<const BonePose> reference, std::span<BonePose> out)
+{
+	const size_t count = std::min({ pose.size(), reference.size(), out.size() });
+	for (size_t i = 0; i < count; i++)
+	{
+		const BonePose& ref = reference[i];
+		const BonePose& current = pose[i];
+		out[i] = { current.position - ref.position, glm::conjugate(ref.orientation) * current.orientation, current.scale / ref.scale };
+	}
+}
+
+void AddPose(std::span<BonePose> base, std::span<const BonePose> additive, float weight, std::span<const float> mask)
+{
+	const glm::quat identity = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	const size_t count = std::min(base.size(), additive.size());
+	for (size_t i = 0; i < count; i++)
+	{
+		const float w = mask.empty() ? weight : (i < mask.size() ? weight * mask[i] : 0.0f);
+		if (w <= 0.0f)
+			continue;
+
+		BonePose& pose = base[i];
+		const BonePose& delta = additive[i];
+		pose.position += delta.position * w;
+		pose.orientation = glm::normalize(pose.orientation * (w >= 1.0f ? delta.orientation : NLerp(identity, delta.orientation, w)));
+		pose.scale *= glm::mix(glm::vec3(1.0f), delta.scale, w);
+	}
+}
+
+#pragma endregion
+
+#pragma region Bone
+
+Bone::Bone(int id, const std::string& name, const glm::mat4& offset) : m_id(id), m_name(name)
+{
+	m_offset = offset;
+}
+
+void Bone::SetTransform(const Transform& tr)
+{
+	pose().position = tr.GetPosition();
+	pose().orientation = tr.GetOrientation();
+	markDirty();
+}
+
+void Bone::SetPosition(const glm::vec3& pos)
+{
+	SavePoseAsIdle();
+	pose().position = pos;
+	markDirty();
+}
+
+void Bone::SetOrientation(const glm::quat& orient)
+{
+	SavePoseAsIdle();
+	pose().orientation = orient;
+	markDirty();
+}
+
+void Bone::SetSize(const glm::vec3& size)
+{
+	pose().scale = size;
+	markDirty();
+}
+
+void Bone::Move(const glm::vec3& vec)
+{
+	SavePoseAsIdle();
+	pose().position += vec;
+	markDirty();
+}
+
+void Bone::Rotate(const glm::quat& quat)
+{
+	SavePoseAsIdle();
+	pose().orientation = quat * pose().orientation;
+	markDirty();
+}
+
+void Bone::Expand(const glm::vec3& vec)
+{
+	pose().scale += vec;
+	markDirty();
+}
+
+void Bone::SavePoseAsIdle()
+{
+	m_idle = GetTransform();
+}
+
+int Bone::GetID()
+{
+	return m_id;
+}
+
+std::string Bone::GetName()
+{
+	return m_name;
+}
+
+glm::vec3 Bone::GetPosition()
+{
+	return pose().position;
+}
+
+glm::quat Bone::GetOrientation()
+{
+	return pose().orientation;
+}
+
+glm::vec3 Bone::GetSize()
+{
+	return pose().scale;
+}
+
+glm::mat4 Bone::GetOffset()
+{
+	return m_offset;
+}
+
+Transform Bone::GetTransform()
+{
+	return Transform(pose().position, pose().orientation);
+}
+
+Transform Bone::GetIdle()
+{
+	return m_idle;
+}
+
+void Bone::SetPose(const BonePose& newPose)
+{
+	pose() = newPose;
+	markDirty();
+}
+
+BonePose Bone::GetPose() const
+{
+	return pose();
+}
+
+BonePose Bone::GetIdlePose() const
+{
+	return { m_idle.GetPosition(), m_idle.GetOrientation(), pose().scale };
+}
+
+void Bone::AttachToSkeleton(Skeleton* skeleton, uint32_t index)
+{
+	if (skeleton) skeleton->SetLocalPose(index, m_pose);
+	m_skeleton = skeleton;
+	m_skeletonIndex = index;
+}
+
+uint32_t Bone::GetSkeletonIndex() const
+{
+	return m_skeletonIndex;
+}
+
+BonePose& Bone::pose()
+{
+	return m_skeleton ? m_skeleton->GetLocalPose()[m_skeletonIndex] : m_pose;
+}
+
+const BonePose& Bone::pose() const
+{
+	return m_skeleton ? m_skeleton->GetLocalPose(m_skeletonIndex) : m_pose;
+}
+
+void Bone::markDirty()
+{
+	if (m_skeleton) m_skeleton->MarkDirty(m_skeletonIndex);
+}
+
+#pragma endregion
+
+#pragma region Model
+
+Model::Model(const std::string& modelPath, bool flipUV, bool compressAnimations)
+	: m_compressAnimations(compressAnimations)
+{
+	std::string extension = strrchr(modelPath.c_str(), '.'); // TODO: найти лучшее решение
+	//if (extension == "obj")
+	
+	loadAssimpModel(modelPath, flipUV);
+}
+
+void Model::Draw(const GLProgramPipelineRef& program)
+{
+	for (size_t i = 0; i < m_meshes.size(); i++)
+		m_meshes[i]->Draw(program);
+}
+
+void Model::Draw(ShaderPermutations& permutations, const std::function<void(const GLProgramPipelineRef&)>& bindVariant, ShaderFeatures features)
+{
+	const GLProgramPipeline* bound = nullptr;
+	for (size_t i = 0; i < m_meshes.size(); i++)
+	{
+		const GLProgramPipelineRef program = permutations.Get(m_meshes[i]->GetShaderFeatures() | features);
+		if (!program)
+			continue;
+		if (program.get() != bound)
+		{
+			program->Bind();
+			if (bindVariant)
+				bindVariant(program);
+			bound = program.get();
+		}
+		m_meshes[i]->Draw(program);
+	}
+}
+
+void Model::DrawInstanced(const GLProgramPipelineRef& program, GLsizei instanceCount, GLuint baseInstance, GLint meshVertexOffsetLocation)
+{
+	uint32_t vertexOffset = 0;
+	for (size_t i = 0; i < m_meshes.size(); i++)
+	{
+		program->SetVertexUniform(meshVertexOffsetLocation, vertexOffset);
+		m_meshes[i]->Draw(program, instanceCount, baseInstance);
+		vertexOffset += static_cast<uint32_t>(m_meshes[i]->GetVertexCount());
+	}
+}
+
+AABB Model::GetBounding() const
+{
+	return m_bounding;
+}
+
+AABB Model::GetAnimatedBounding() const
+{
+	return m_animatedBounding;
+}
+
+AABB Model::ComputeBounding(std::span<const glm::mat4> palette) const
+{
+	if (m_boneBounds.empty() || palette.size() < m_skeleton.GetPaletteSize())
+		return m_bounding;
+	return ComputeSkinnedBounds(palette, m_boneBounds, m_unskinnedBounding);
+}
+
+std::vector<glm::vec3> Model::GetTriangle() const
+{
+	std::vector<glm::vec3> Triangle;
+	for (size_t i = 0; i < m_meshes.size(); ++i)
+	{
+		std::vector<glm::vec3> temp = m_meshes[i]->GetTriangle();
+		Triangle.insert(Triangle.end(), temp.begin(), temp.end());
+	}
+	return Triangle;
+}
+
+std::vector<AnimationRef> Model::GetAnimations() const
+{
+	return m_animations;
+}
+
+std::vector<BoneRef> Model::GetBones() const
+{
+	return m_bones;
+}
+
+const Skeleton& Model::GetSkeleton() const
+{
+	return m_skeleton;
+}
+
+std::span<const glm::mat4> Model::GetPalette() const
+{
+	return m_palette;
+}
+
+std::span<const glm::mat4> Model::GetPreviousPalette() const
+{
+	return m_previousPalette;
+}
+
+size_t Model::GetMeshCount() const
+{
+	return m_meshes.size();
+}
+
+size_t Model::GetVertexCount() const
+{
+	size_t count = 0;
+	for (const auto& mesh : m_meshes)
+		count += mesh->GetVertexCount();
+	return count;
+}
+
+MeshRef Model::operator[](size_t idx)
+{
+	assert(idx < m_meshes.size());
+	return m_meshes[idx];
+}
+
+void Model::SetTransform(const Transform& transform)
+{
+	m_transform = transform;
+}
+
+void Model::SetPosition(const glm::vec3& position)
+{
+	m_transform.SetPosition(position);
+}
+
+void Model::SetOrientation(const glm::quat& orientation)
+{
+	m_transform.SetOrientation(orientation);
+}
+
+void Model::AddChild(Node* child)
+{
+	for (auto i : m_bones)
+		if (i.get() == child)
+		{
+			auto it = std::find(m_children.begin(), m_children.end(), child);
+			if (it != m_children.end())
+			{
+				(*it)->SetParent(nullptr);
+				m_children.erase(it);
+				return;
+			}
+			child->SetParent(this);
+			m_children.push_back(child);
+			return;
+		}
+
+	auto it = std::find(m_children.begin(), m_children.end(), child);
+	if (it != m_children.end())
+	{
+		m_children.erase(it);
+	}
+	else
+	{
+		m_children.push_back(child);
+	}
+}
+
+Transform Model::GetTransform()
+{
+	return m_transform;
+}
+
+glm::vec3 Model::GetPosition()
+{
+	return m_transform.GetPosition();
+}
+
+glm::quat Model::GetOrientation()
+{
+	return m_transform.GetOrientation();
+}
+
+const std::vector<Bone*>& Model::GetOrderedBones() const
+{
+	return m_orderedBones;
+}
+
+size_t Model::GetBoneCount() const
+{
+	return m_orderedBones.size();
+}
+
+uint32_t Model::FindBone(const std::string& name) const
+{
+	for (size_t i = 0; i < m_orderedBones.size(); i++)
+	{
+		if (m_orderedBones[i]->GetName() == name)
+			return static_cast<uint32_t>(i);
+	}
+	return Skeleton::InvalidIndex;
+}
+
+size_t Model::GetMorphTargetCount() const
+{
+	return m_morphTargetNames.size();
+}
+
+const std::string& Model::GetMorphTargetName(uint32_t target) const
+{
+	assert(target < m_morphTargetNames.size());
+	return m_morphTargetNames[target];
+}
+
+uint32_t Model::FindMorphTarget(const std::string& name) const
+{
+	for (size_t i = 0; i < m_morphTargetNames.size(); i++)
+	{
+		if (m_morphTargetNames[i] == name)
+			return static_cast<uint32_t>(i);
+	}
+	return InvalidMorphTarget;
+}
+
+void Model::SetMorphWeight(uint32_t target, float weight)
+{
+	if (target < m_morphWeights.size())
+		m_morphWeights[target] = weight;
+}
+
+std::span<const float> Model::GetMorphWeights() const
+{
+	return m_morphWeights;
+}
+
+void Model::SetAnimation(int index)
+{
+	m_currentAnimation = (index >= 0 && index < static_cast<int>(m_animations.size())) ? m_animations[index] : nullptr;
+	// bones without a track in the new clip keep their idle pose
+	for (size_t i = 0; i < m_orderedBones.size(); i++)
+		m_orderedBones[i]->SetPose(m_orderedBones[i]->GetIdlePose());
+}
+
+AnimationRef Model::GetCurrentAnimation() const
+{
+	return m_currentAnimation;
+}
+
+void Model::SetAnimator(const AnimatorRef& animator)
+{
+	m_animator = animator;
+}
+
+AnimatorRef Model::GetAnimator() const
+{
+	return m_animator;
+}
+
+void Model::UpdateAnim()
+{
+	if (m_animator)
+	{
+		m_animator->Update(m_skeleton.GetLocalPose());
+		m_skeleton.MarkDirty();
+	}
+	else if (m_currentAnimation && m_currentAnimation->GetState() != Animation::State::Stopped)
+	{
+		m_currentAnimation->Update(m_skeleton.GetLocalPose(), m_morphWeights);
+		m_skeleton.MarkDirty();
+	}
+
+	// copied every frame, a pose that stops changing has no motion
+	std::copy(m_palette.begin(), m_palette.end(), m_previousPalette.begin());
+	if (!m_palette.empty() && m_skeleton.IsDirty())
+	{
+		m_skeleton.Evaluate(m_palette.data());
+		m_animatedBounding = ComputeBounding(m_palette);
+	}
+}
+
+void Model::DefaultPose()
+{
+	for (auto& i : m_bones)
+		i->SetTransform(i->GetIdle());
+	for (auto& i : m_bonesChildren)
+		i->SetTransform(i->GetIdle());
+}
+
+void Model::loadAssimpModel(const std::string& modelPath, bool flipUV)
+{
+	NANO_PROFILE_FUNCTION();
+	unsigned int flags = aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_CalcTangentSpace | aiProcess_LimitBoneWeights;
+#if defined(GLM_FORCE_LEFT_HANDED)
+	flags |= aiProcess_MakeLeftHanded;
+#endif
+	if (flipUV) flags |= aiProcess_FlipUVs;
+
+	Assimp::Importer modelImporter;
+	modelImporter.SetPropertyInteger(AI_CONFIG_PP_LBW_MAX_WEIGHTS, 1);
+	const aiScene* scene = modelImporter.ReadFile(modelPath, flags);
+	if (!scene || !scene->mRootNode || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE)
+	{
+		Error("Load Model error: " + std::string(modelImporter.GetErrorString()));
+		return;
+	}
+	m_directory = modelPath.substr(0, modelPath.find_last_of('/'));
+	loadAnimations(scene);
+	processNode(scene->mRootNode, scene, glm::mat4(1.0));
+	loadMorphAnimations(scene);
+	findBoneNodes(scene->mRootNode, m_bones);
+	buildBoneHierarchy();
+	computeAABB();
+	computeBoneBounds();
+
+	size_t animationBytes = 0;
+	for (const auto& animation : m_animations)
+		animationBytes += animation->GetMemoryUsage();
+
+	Print("Model " + modelPath + " loaded:\n" +
+		"        Meshes: " + std::to_string(m_meshes.size()) + '\n' +
+		"        Bones: " + std::to_string(m_bones.size() + m_bonesChildren.size()) + '\n' +
+		"        Morph targets: " + std::to_string(m_morphTargetNames.size()) + '\n' +
+		"        Animations: " + std::to_string(m_animations.size()) + " (" + std::to_string(animationBytes / 1024) + " KB)");
+}
+
+constexpr glm::vec3 toglm(const aiVector3D& vec) { return glm::vec3(vec.x, vec.y, vec.z); }
+constexpr glm::vec2 toglm(const aiVector2D& vec) { return glm::vec2(vec.x, vec.y); }
+constexpr glm::quat toglm(const aiQuaternion& q) { return glm::quat(q.w, q.x, q.y, q.z); }
+
+constexpr glm::mat4 toglm(const aiMatrix4x4& mat)
+{
+	glm::mat4 ret;
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			ret[j][i] = mat[i][j];
+	return ret;
+}
+
+std::pair<Transform, glm::vec3> To3DTransform(const glm::mat4& tr)
+{
+	Transform ret;
+	glm::vec3 size;
+
+	glm::vec3 pos, scale, skew;
+	glm::vec4 perspective;
+	glm::quat orient;
+
+	glm::decompose(tr, scale, orient, pos, skew, perspective);
+	orient = glm::conjugate(orient);
+
+	size = { scale.x, scale.y, scale.z };
+
+	ret.SetPosition({ pos.x, pos.y, pos.z });
+	ret.SetOrientation({ orient.x, orient.y, orient.z, orient.w });
+
+	return { ret, size };
+}
+
+void Model::loadAnimations(const aiScene* scene)
+{
+	for (int i = 0; i < scene->mNumAnimations; i++)
+	{
+		auto anim = scene->mAnimations[i];
+		auto tmp = std::make_shared<Animation>(anim->mName.C_Str());
+		float tps = anim->mTicksPerSecond;
+		tmp->SetTPS(tps > 0 ? tps : 30.0);
+		tmp->SetDuration(anim->mDuration);
+
+		for (int j = 0; j < anim->mNumChannels; j++)
+		{
+			auto channel = anim->mChannels[j];
+			Keyframe kf;
+			for (int k = 0; k < channel->mNumPositionKeys; k++)
+			{
+				kf.posStamps.push_back(channel->mPositionKeys[k].mTime);
+				kf.positions.push_back(toglm(channel->mPositionKeys[k].mValue));
+			}
+			for (int k = 0; k < channel->mNumRotationKeys; k++)
+			{
+				kf.rotStamps.push_back(channel->mRotationKeys[k].mTime);
+				kf.rotations.push_back(toglm(channel->mRotationKeys[k].mValue));
+			}
+			for (int k = 0; k < channel->mNumScalingKeys; k++)
+			{
+				kf.scaleStamps.push_back(channel->mScalingKeys[k].mTime);
+				kf.scales.push_back(toglm(channel->mScalingKeys[k].mValue));
+			}
+			tmp->AddKeyframe(channel->mNodeName.C_Str(), kf);
+		}
+		m_animations.push_back(tmp);
+	}
+}
+
+void Model::loadMorphAnimations(const aiScene* scene)
+{
+	for (unsigned i = 0; i < scene->mNumAnimations && i < m_animations.size(); i++)
+	{
+		const aiAnimation* anim = scene->mAnimations[i];
+		for (unsigned j = 0; j < anim->mNumMorphMeshChannels; j++)
+		{
+			const aiMeshMorphAnim* channel = anim->mMorphMeshChannels[j];
+			// glTF names the channel after the node, some importers append "*<mesh index>"
+			std::string nodeName = channel->mName.C_Str();
+			auto node = m_morphNodes.find(nodeName);
+			if (node == m_morphNodes.end())
+				node = m_morphNodes.find(nodeName.substr(0, nodeName.find('*')));
+			if (node == m_morphNodes.end() || channel->mNumKeys == 0)
+				continue;
+
+			const uint32_t firstTarget = node->second;
+			uint32_t targetCount = 0;
+			for (unsigned k = 0; k < channel->mNumKeys; k++)
+				for (unsigned v = 0; v < channel->mKeys[k].mNumValuesAndWeights; v++)
+					targetCount = std::max(targetCount, channel->mKeys[k].mValues[v] + 1);
+			targetCount = std::min(targetCount, static_cast<uint32_t>(m_morphTargetNames.size()) - firstTarget);
+			if (targetCount == 0)
+				continue;
+
+			// keys list only the targets they drive, the others are zero
+			std::vector<float> times(channel->mNumKeys);
+			std::vector<float> weights(channel->mNumKeys * targetCount, 0.0f);
+			for (unsigned k = 0; k < channel->mNumKeys; k++)
+			{
+				const aiMeshMorphKey& key = channel->mKeys[k];
+				times[k] = static_cast<float>(key.mTime);
+				for (unsigned v = 0; v < key.mNumValuesAndWeights; v++)
+				{
+					if (key.mValues[v] < targetCount)
+						weights[k * targetCount + key.mValues[v]] = static_cast<float>(key.mWeights[v]);
+				}
+			}
+			m_animations[i]->AddMorphChannel(firstTarget, targetCount, std::move(times), std::move(weights));
+		}
+	}
+}
+
+void Model::processNode(aiNode* node, const aiScene* scene, const glm::mat4& parentTransform)
+{
+	glm::mat4 nodeTransform = MatrixCast(node->mTransformation);
+	glm::mat4 totalTransform = parentTransform * nodeTransform;
+
+	// the meshes of a node are the primitives of one glTF mesh and share its morph targets
+	const uint32_t morphBase = static_cast<uint32_t>(m_morphTargetNames.size());
+	for (unsigned i = 0; i < node->mNumMeshes; ++i)
+	{
+		const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+		for (unsigned k = static_cast<unsigned>(m_morphTargetNames.size()) - morphBase; k < mesh->mNumAnimMeshes; k++)
+		{
+			const std::string name = mesh->mAnimMeshes[k]->mName.C_Str();
+			m_morphTargetNames.push_back(!name.empty() ? name : std::string(node->mName.C_Str()) + "." + std::to_string(k));
+			m_morphWeights.push_back(mesh->mAnimMeshes[k]->mWeight);
+		}
+	}
+	if (m_morphTargetNames.size() > morphBase)
+		m_morphNodes.emplace(node->mName.C_Str(), morphBase);
+
+	for (unsigned i = 0; i < node->mNumMeshes; ++i)
+	{
+		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+		m_meshes.push_back(processMesh(mesh, scene, totalTransform, morphBase));
+	}
+	for (unsigned i = 0; i < node->mNumChildren; ++i)
+	{
+		processNode(node->mChildren[i], scene, totalTransform);
+	}
+}
+
+MeshRef Model::processMesh(const aiMesh* mesh, const aiScene* scene, const glm::mat4& transform, uint32_t morphBase)
+{
+	assert(mesh);
+	std::vector<MeshVertex> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<MaterialTexture> textures;
+	MaterialProperties matProperties;
+	processVertex(mesh, transform, vertices);
+	processIndices(mesh, indices);
+	processBones(mesh, vertices);
+	processTextures(mesh, scene, textures);
+	processMatProperties(mesh, scene, matProperties);
+	MeshRef result = std::make_shared<Mesh>(vertices, indices, textures, matProperties);
+	processMorphTargets(mesh, transform, morphBase, *result);
+	return result;
+}
+
+void Model::processMorphTargets(const aiMesh* mesh, const glm::mat4& transform, uint32_t morphBase, Mesh& target)
+{
+	if (mesh->mNumAnimMeshes == 0)
+		return;
+
+	// assimp stores every target as a full copy of the mesh, only the vertices it moves are kept
+	constexpr float epsilon = 1e-6f;
+	std::vector<MorphVertex> morphVertices;
+	std::vector<MorphDelta> deltas;
+	for (unsigned i = 0; i < mesh->mNumVertices; i++)
+	{
+		const glm::vec3 position = toglm(mesh->mVertices[i]);
+		const glm::vec3 normal = mesh->HasNormals() ? toglm(mesh->mNormals[i]) : glm::vec3(0.0f);
+		const uint32_t firstDelta = static_cast<uint32_t>(deltas.size());
+		for (unsigned k = 0; k < mesh->mNumAnimMeshes; k++)
+		{
+			const aiAnimMesh* animMesh = mesh->mAnimMeshes[k];
+			if (animMesh->mNumVertices != mesh->mNumVertices)
+				continue;
+			MorphDelta delta;
+			delta.target = morphBase + k;
+			if (animMesh->HasPositions())
+				delta.position = transform * glm::vec4(toglm(animMesh->mVertices[i]) - position, 0.0f);
+			if (animMesh->HasNormals() && mesh->HasNormals())
+				delta.normal = transform * glm::vec4(toglm(animMesh->mNormals[i]) - normal, 0.0f);
+			if (glm::dot(delta.position, delta.position) > epsilon * epsilon || glm::dot(delta.normal, delta.normal) > epsilon * epsilon)
+				deltas.push_back(delta);
+		}
+		if (deltas.size() > firstDelta)
+			morphVertices.push_back({ i, firstDelta, static_cast<uint32_t>(deltas.size()) - firstDelta });
+	}
+	target.SetMorphTargets(morphVertices, deltas);
+}
+
+void Model::processVertex(const aiMesh* mesh, const glm::mat4& transform, std::vector<MeshVertex>& vertices)
+{
+	for (unsigned i = 0; i < mesh->mNumVertices; ++i)
+	{
+		auto aiVert = mesh->mVertices;
+		auto aiClr = mesh->mColors[0];
+		auto aiNormals = mesh->mNormals;
+		auto aiTexCoords = mesh->mTextureCoords[0];
+		auto aiTangents = mesh->mTangents;
+		auto aiBitangents = mesh->mBitangents;
+
+		MeshVertex vertex;
+
+		vertex.position = transform * glm::vec4(aiVert[i].x, aiVert[i].y, aiVert[i].z, 1.0f);
+
+		if (mesh->HasVertexColors(0)) 
+			vertex.color = glm::vec3(aiClr[i].r, aiClr[i].g, aiClr[i].b);
+		else 
+			vertex.color = glm::vec3(1.0f);
+
+		if (mesh->HasNormals())
+			vertex.normal = transform * glm::vec4(aiNormals[i].x, aiNormals[i].y, aiNormals[i].z, 0);
+		else
+			vertex.normal = glm::vec3(0.0f);
+
+		if (mesh->HasTextureCoords(0))
+			vertex.texCoords = glm::vec2(aiTexCoords[i].x, aiTexCoords[i].y);
+		else
+			vertex.texCoords = glm::vec2(0.0f);
+
+		if (mesh->HasTangentsAndBitangents())
+		{
+			vertex.tangent = glm::vec3(aiTangents[i].x, aiTangents[i].y, aiTangents[i].z);
+			vertex.bitangent = glm::vec3(aiBitangents[i].x, aiBitangents[i].y, aiBitangents[i].z);
+		}
+		else
+		{
+			vertex.tangent = glm::vec3(0.0f);
+			vertex.bitangent = glm::vec3(0.0f);
+		}
+
+		vertices.push_back(vertex);
+	}
+}
+
+void Model::processIndices(const aiMesh* mesh, std::vector<uint32_t>& indices)
+{
+	for (unsigned i = 0; i < mesh->mNumFaces; ++i)
+	{
+		auto face = mesh->mFaces[i];
+		for (unsigned k = 0; k < face.mNumIndices; ++k)
+			indices.push_back(face.mIndices[k]);
+	}
+}
+
+void Model::processBones(const aiMesh* mesh, std::vector<MeshVertex>& vertices)
+{
+	for (size_t i = 0; i < mesh->mNumBones; i++)
+	{
+		auto bone = mesh->mBones[i];
+
+		if (m_bonemap.find(bone->mName.C_Str()) == m_bonemap.end())
+			m_bonemap[bone->mName.C_Str()] = { i, toglm(bone->mOffsetMatrix) };
+
+		std::vector<int> nbones;
+		nbones.resize(mesh->mNumVertices, 0);
+		for (size_t j = 0; j < bone->mNumWeights ? 1 : 0; j++)
+		{
+			int id = bone->mWeights[j].mVertexId;
+			float weight = bone->mWeights[j].mWeight;
+			vertices[id].boneIDs[nbones[id]] = i;
+			vertices[id].weights[nbones[id]] = weight;
+			nbones[id]++;
+		}
+	}
+}
+
+void Model::findBoneNodes(aiNode* node, std::vector<BoneRef>& bones)
+{
+	BoneRef tmp = nullptr;
+	if (processBone(node, tmp))
+	{
+		if (tmp)
+		{
+			bones.emplace_back(tmp);
+			AddChild(tmp.get());
+		}
+		return;
+	}
+	for (size_t i = 0; i < node->mNumChildren; i++)
+		findBoneNodes(node->mChildren[i], bones);
+}
+
+bool Model::processBone(aiNode* node, BoneRef& out)
+{
+	if (m_bonemap.find(node->mName.C_Str()) != m_bonemap.end())
+	{
+		auto it = std::find_if(m_bones.begin(), m_bones.end(), [&](auto& b) { return b->GetName() == std::string(node->mName.C_Str()); });
+		if (it != m_bones.end())
+			return false;
+		out = std::make_shared<Bone>(m_bonemap[node->mName.C_Str()].first, node->mName.C_Str(), m_bonemap[node->mName.C_Str()].second);
+		if (!m_animations.empty())
+			if (m_animations[0]->GetKeyframes().find(out->GetName()) != m_animations[0]->GetKeyframes().end())
+			{
+				Keyframe kf = m_animations[0]->GetKeyframes()[out->GetName()];
+				auto pos = kf.positions[0];
+				auto rot = kf.rotations[0];
+				Transform tr;
+				tr.SetPosition({ pos.x, pos.y, pos.z });
+				tr.SetOrientation({ rot.x, rot.y, rot.z, rot.w });
+				out->SetTransform(tr);
+			}
+			else out->SetTransform(To3DTransform(toglm(node->mTransformation)).first);
+
+		out->SavePoseAsIdle();
+
+		for (int i = 0; i < node->mNumChildren; i++)
+		{
+			std::shared_ptr<Bone> child = nullptr;
+			if (processBone(node->mChildren[i], child))
+			{
+				m_bonesChildren.push_back(child);
+				child->SetParent(out.get());
+				out->AddChild(child.get());
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+void Model::processTextures(const aiMesh* mesh, const aiScene* scene, std::vector<MaterialTexture>& textures)
+{
+	aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+	loadTextureFromMaterial(aiTextureType_DIFFUSE, material, textures);
+	loadTextureFromMaterial(aiTextureType_NORMALS, material, textures);
+	loadTextureFromMaterial(aiTextureType_SPECULAR, material, textures);
+	loadTextureFromMaterial(aiTextureType_HEIGHT, material, textures);
+	loadTextureFromMaterial(aiTextureType_SHININESS, material, textures);
+	loadTextureFromMaterial(aiTextureType_AMBIENT, material, textures);
+}
+
+void Model::loadTextureFromMaterial(aiTextureType textureType, const aiMaterial* mat, std::vector<MaterialTexture>& textures)
+{
+	// TODO: генерировать дефолтную текстуру если нет своей
+	// TODO: кеширование текстур
+
+	assert(mat);
+	GLint TextureCount = mat->GetTextureCount(textureType);
+	int TextureIndex = -1;
+	if (TextureCount <= 0)
+	{
+		MaterialTexture MeshTexture;
+		textures.push_back(MeshTexture); // TODO: зачем и как должно быть
+	}
+	for (GLint i = 0; i < TextureCount; ++i)
+	{
+		aiString Str;
+		mat->GetTexture(textureType, i, &Str);
+		std::string TextureName = Str.C_Str();
+		std::string TexturePath = m_directory + "/" + TextureName;
+		GLboolean Skip = GL_FALSE;
+		GLint LoadedTextureCount = static_cast<int>(m_loadedTextures.size());
+		for (int k = 0; k < LoadedTextureCount; ++k)
+		{
+			if (TexturePath == m_loadedTextures[k].path)
+			{
+				Skip = GL_TRUE;
+				textures.push_back(m_loadedTextures[k]);
+				break;
+			}
+		}
+		if (!Skip)
+		{
+			MaterialTexture MeshTexture;
+			MeshTexture.texture = std::make_shared<GLTexture2D>(TexturePath, STBI_rgb_alpha, true);
+			MeshTexture.path = TexturePath;
+			textures.push_back(MeshTexture);
+			m_loadedTextures.push_back(MeshTexture);
+		}
+	}
+}
+
+void Model::processMatProperties(const aiMesh* mesh, const aiScene* scene, MaterialProperties& meshMatProperties)
+{
+	aiMaterial* pAiMat = scene->mMaterials[mesh->mMaterialIndex];
+	aiColor3D AmbientColor, DiffuseColor, SpecularColor;
+	float Shininess = 0.0f, Refracti = 0.0f;
+	pAiMat->Get(AI_MATKEY_COLOR_AMBIENT, AmbientColor);
+	pAiMat->Get(AI_MATKEY_COLOR_DIFFUSE, DiffuseColor);
+	pAiMat->Get(AI_MATKEY_COLOR_SPECULAR, SpecularColor);
+	pAiMat->Get(AI_MATKEY_SHININESS, Shininess);
+	pAiMat->Get(AI_MATKEY_REFRACTI, Refracti);
+	meshMatProperties.diffuseColor = { DiffuseColor.r, DiffuseColor.g, DiffuseColor.b };
+	meshMatProperties.ambientColor = { AmbientColor.r, AmbientColor.g, AmbientColor.b };
+	meshMatProperties.specularColor = { SpecularColor.r, SpecularColor.g, SpecularColor.b };
+	meshMatProperties.shininess = Shininess;
+	meshMatProperties.refracti = Refracti;
+}
+
+void Model::computeAABB()
+{
+	for (size_t i = 0; i < m_meshes.size(); ++i)
+		m_bounding.Combine(m_meshes[i]->GetBounding());
+}
+
+void Model::computeBoneBounds()
+{
+	m_boneBounds.clear();
+	m_unskinnedBounding = AABB();
+	m_animatedBounding = m_bounding;
+	const uint32_t paletteSize = m_skeleton.GetPaletteSize();
+	if (paletteSize == 0)
+		return;
+
+	std::vector<AABB> boxes(paletteSize);
+	for (const MeshRef& mesh : m_meshes)
+	{
+		for (const MeshVertex& vertex : mesh->GetVertices())
+		{
+			bool skinned = false;
+			for (size_t i = 0; i < MAX_NUM_BONES_PER_VERTEX; i++)
+			{
+				if (vertex.weights[i] <= 0.0f || vertex.boneIDs[i] >= paletteSize)
+					continue;
+				boxes[vertex.boneIDs[i]].Combine(vertex.position);
+				skinned = true;
+			}
+			if (!skinned)
+				m_unskinnedBounding.Combine(vertex.position);
+		}
+	}
+
+	for (uint32_t i = 0; i < paletteSize; i++)
+	{
+		if (boxes[i].min.x > boxes[i].max.x)
+			continue;
+		m_boneBounds.push_back({ glm::vec4(boxes[i].GetCenter(), 1.0f), glm::vec4(boxes[i].GetHalfSize(), 0.0f), i });
+	}
+	m_animatedBounding = ComputeBounding(m_palette);
+}
+
+void Model::buildBoneHierarchy()
+{
+	m_skeleton.Clear();
+	m_orderedBones.clear();
+	m_skeleton.Reserve(m_bones.size() + m_bonesChildren.size());
+	m_orderedBones.reserve(m_bones.size() + m_bonesChildren.size());
+
+	// pre-order walk so that every bone is stored after its parent
+	std::vector<std::pair<Bone*, uint32_t>> stack;
+	for (auto it = m_bones.rbegin(); it != m_bones.rend(); ++it)
+		stack.emplace_back(it->get(), Skeleton::InvalidIndex);
+
+	while (!stack.empty())
+	{
+		auto [bone, parent] = stack.back();
+		stack.pop_back();
+
+		const uint32_t index = m_skeleton.AddBone(parent, bone->GetOffset(), static_cast<uint32_t>(bone->GetID()), bone->GetPose());
+		m_orderedBones.push_back(bone);
+		bone->AttachToSkeleton(&m_skeleton, index);
+
+		const auto& children = bone->GetChildren();
+		for (auto it = children.rbegin(); it != children.rend(); ++it)
+			stack.emplace_back(static_cast<Bone*>(*it), index);
+	}
+
+	std::unordered_map<std::string, uint32_t> boneIndices;
+	for (size_t i = 0; i < m_orderedBones.size(); i++)
+		boneIndices[m_orderedBones[i]->GetName()] = static_cast<uint32_t>(i);
+	for (auto& animation : m_animations)
+		animation->Compile(boneIndices);
+
+	if (m_compressAnimations)
+	{
+		const std::vector<float> boneLengths = m_skeleton.GetBoneLengths();
+		for (auto& animation : m_animations)
+			animation->Compress({}, boneLengths);
+	}
+
+	if (m_skeleton.GetBoneCount() == 0)
+		return;
+
+	// palette slots without a bone node are never written and stay identity
+	m_palette.assign(m_skeleton.GetPaletteSize(), glm::mat4(1.0f));
+	m_skeleton.Evaluate(m_palette.data());
+	m_previousPalette = m_palette;
+}
+
+#pragma endregion
+
+#pragma region Animator
+
+Animator::Animator(const Model& model)
+	: m_skeleton(model.GetSkeleton())
+{
+	const auto& bones = model.GetOrderedBones();
+	m_boneNames.reserve(bones.size());
+	m_restPose.reserve(bones.size());
+	for (Bone* bone : bones)
+	{
+		m_boneNames.push_back(bone->GetName());
+		m_restPose.push_back(bone->GetIdlePose());
+	}
+	m_triggers.reserve(8);
+}
+
+uint32_t Animator::AddLayer(LayerMode mode, const BoneMask& mask, float weight)
+{
+	Layer& layer = m_layers.emplace_back();
+	layer.mode = mode;
+	layer.mask = mask;
+	layer.weight = weight;
+	layer.currentPose = m_restPose;
+	layer.previousPose = m_restPose;
+	layer.result = m_restPose;
+	return static_cast<uint32_t>(m_layers.size() - 1);
+}
+
+void Animator::SetLayerWeight(uint32_t layer, float weight)
+{
+	if (layer < m_layers.size())
+		m_layers[layer].weight = weight;
+}
+
+uint32_t Animator::AddState(uint32_t layer, const std::string& name, const AnimationRef& clip, float speed, bool loop)
+{
+	if (layer >= m_layers.size())
+	{
+		Error("Animator layer " + std::to_string(layer) + " does not exist");
+		return AnyState;
+	}
+
+	Layer& target = m_layers[layer];
+	State& state = target.states.emplace_back();
+	state.name = name;
+	state.clip = clip;
+	state.speed = speed;
+	state.loop = loop;
+	if (target.mode == LayerMode::Additive)
+	{
+		state.reference = m_restPose;
+		AnimationCursor cursor;
+		if (clip) clip->Sample(0.0f, state.reference, cursor);
+	}
+
+	const uint32_t index = static_cast<uint32_t>(target.states.size() - 1);
+	if (target.current == AnyState)
+		startTransition(target, index, 0.0f);
+	return index;
+}
+
+void Animator::AddTransition(uint32_t layer, uint32_t from, uint32_t to, float fadeDuration, const std::string& trigger)
+{
+	if (layer >= m_layers.size() || to >= m_layers[layer].states.size())
+	{
+		Error("Animator transition to a state that does not exist");
+		return;
+	}
+	m_layers[layer].transitions.push_back({ from, to, fadeDuration, trigger });
+}
+
+void Animator::SetTrigger(const std::string& trigger)
+{
+	m_triggers.push_back(trigger);
+}
+
+void Animator::Play(uint32_t layer, uint32_t state, float fadeDuration)
+{
+	if (layer < m_layers.size() && state < m_layers[layer].states.size())
+		startTransition(m_layers[layer], state, fadeDuration);
+}
+
+void Animator::Update(std::span<BonePose> pose)
+{
+	Update(m_clock.Restart().AsSeconds(), pose);
+}
+
+void Animator::Update(float deltaSeconds, std::span<BonePose> pose)
+{
+	std::copy_n(m_restPose.begin(), std::min(pose.size(), m_restPose.size()), pose.begin());
+
+	for (Layer& layer : m_layers)
+	{
+		updateLayer(layer, deltaSeconds);
+		if (layer.weight <= 0.0f || layer.current == AnyState)
+			continue;
+
+		if (layer.mode == LayerMode::Override)
+			BlendPoses(pose, layer.result, layer.weight, layer.mask.GetWeights(), pose);
+		else
+			AddPose(pose, layer.result, layer.weight, layer.mask.GetWeights());
+	}
+	m_triggers.clear();
+}
+
+BoneMask Animator::CreateMask(const std::string& branchRoot, bool exclude) const
+{
+	BoneMask mask(m_boneNames.size(), exclude ? 1.0f : 0.0f);
+	auto it = std::find(m_boneNames.begin(), m_boneNames.end(), branchRoot);
+	if (it == m_boneNames.end())
+		Warning("Animator mask: bone '" + branchRoot + "' not found");
+	else
+		mask.SetBranch(m_skeleton, static_cast<uint32_t>(it - m_boneNames.begin()), exclude ? 0.0f : 1.0f);
+	return mask;
+}
+
+uint32_t Animator::FindState(uint32_t layer, const std::string& name) const
+{
+	if (layer >= m_layers.size())
+		return AnyState;
+	const auto& states = m_layers[layer].states;
+	for (size_t i = 0; i < states.size(); i++)
+		if (states[i].name == name) return static_cast<uint32_t>(i);
+	return AnyState;
+}
+
+uint32_t Animator::GetCurrentState(uint32_t layer) const
+{
+	return layer < m_layers.size() ? m_layers[layer].current : AnyState;
+}
+
+size_t Animator::GetLayerCount() const
+{
+	return m_layers.size();
+}
+
+void Animator::startTransition(Layer& layer, uint32_t state, float fadeDuration)
+{
+	if (fadeDuration <= 0.0f || layer.current == AnyState)
+	{
+		layer.previous = AnyState;
+		layer.fadeDuration = 0.0f;
+	}
+	else if (layer.fadeDuration > 0.0f)
+	{
+		// interrupted crossfade: fade out of the blended pose as it is now
+		std::copy(layer.result.begin(), layer.result.end(), layer.previousPose.begin());
+		layer.previous = AnyState;
+		layer.fadeDuration = fadeDuration;
+	}
+	else
+	{
+		layer.previous = layer.current;
+		layer.previousTime = layer.currentTime;
+		std::swap(layer.previousCursor, layer.currentCursor);
+		layer.fadeDuration = fadeDuration;
+	}
+	layer.current = state;
+	layer.currentTime = 0.0f;
+	layer.fadeTime = 0.0f;
+}
+
+void Animator::advance(const Layer& layer, uint32_t state, float deltaSeconds, float& time) const
+{
+	const State& target = layer.states[state];
+	if (!target.clip)
+		return;
+
+	const float duration = target.clip->GetDuration();
+	time += deltaSeconds * target.clip->GetTPS() * target.speed;
+	if (target.loop && duration > 0.0f)
+	{
+		time = std::fmod(time, duration);
+		if (time < 0.0f) time += duration;
+	}
+	else
+		time = std::clamp(time, 0.0f, duration);
+}
+
+bool Animator::sampleState(Layer& layer, uint32_t state, float time, AnimationCursor& cursor, std::vector<BonePose>& pose)
+{
+	const State& target = layer.states[state];
+	// bones without a track keep the rest pose, or no difference on additive layers
+	const std::vector<BonePose>& base = layer.mode == LayerMode::Additive ? target.reference : m_restPose;
+	std::copy(base.begin(), base.end(), pose.begin());
+	if (!target.clip)
+		return false;
+
+	target.clip->Sample(time, pose, cursor);
+	if (layer.mode == LayerMode::Additive)
+		MakeAdditivePose(pose, target.reference, pose);
+	return true;
+}
+
+void Animator::updateLayer(Layer& layer, float deltaSeconds)
+{
+	if (layer.current == AnyState)
+		return;
+
+	const State& current = layer.states[layer.current];
+	const bool finished = !current.loop && current.clip && layer.currentTime >= current.clip->GetDuration();
+	for (const Transition& transition : layer.transitions)
+	{
+		if ((transition.from != layer.current && transition.from != AnyState) || transition.to == layer.current)
+			continue;
+		const bool triggered = transition.trigger.empty()
+			? finished
+			: std::find(m_triggers.begin(), m_triggers.end(), transition.trigger) != m_triggers.end();
+		if (triggered)
+		{
+			startTransition(layer, transition.to, transition.fadeDuration);
+			break;
+		}
+	}
+
+	advance(layer, layer.current, deltaSeconds, layer.currentTime);
+	sampleState(layer, layer.current, layer.currentTime, layer.currentCursor, layer.currentPose);
+
+	if (layer.fadeDuration > 0.0f)
+	{
+		layer.fadeTime += deltaSeconds;
+		if (layer.fadeTime < layer.fadeDuration)
+		{
+			if (layer.previous != AnyState)
+			{
+				advance(layer, layer.previous, deltaSeconds, layer.previousTime);
+				sampleState(layer, layer.previous, layer.previousTime, layer.previousCursor, layer.previousPose);
+			}
+			BlendPoses(layer.previousPose, layer.currentPose, layer.fadeTime / layer.fadeDuration, {}, layer.result);
+			return;
+		}
+		layer.fadeDuration = 0.0f;
+		layer.previous = AnyState;
+	}
+	std::copy(layer.currentPose.begin(), layer.currentPose.end(), layer.result.begin());
+}
+
+#pragma endregion
+
+#pragma region ModelInstance
+
+ModelInstance::ModelInstance(Model& model)
+	: m_model(&model)
+{
+	const Skeleton& skeleton = model.GetSkeleton();
+	const auto localPose = skeleton.GetLocalPose();
+	m_localPose.assign(localPose.begin(), localPose.end());
+	m_palette.assign(skeleton.GetPaletteSize(), glm::mat4(1.0f));
+	m_previousPalette = m_palette;
+	m_bounding = model.GetBounding();
+	Evaluate();
+	m_previousPalette = m_palette;
+
+	m_fromPose = m_localPose;
+	m_toPose = m_localPose;
+	const auto morphWeights = model.GetMorphWeights();
+	m_morphWeights.assign(morphWeights.begin(), morphWeights.end());
+	// spreads the reduced rate samples of a crowd over the frames, consecutive instances get consecutive phases
+	static std::atomic<uint32_t> createdCount = 0;
+	m_phase = createdCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ModelInstance::SetAnimator(const AnimatorRef& animator)
+{
+	m_animator = animator;
+}
+
+void ModelInstance::SetAnimation(int index, float startTime)
+{
+	const auto& animations = m_model->GetAnimations();
+	m_animation = (index >= 0 && index < static_cast<int>(animations.size())) ? animations[index] : nullptr;
+	m_time = startTime;
+}
+
+uint32_t ModelInstance::Update(uint32_t interval)
+{
+	return Update(m_clock.Restart().AsSeconds(), interval);
+}
+
+uint32_t ModelInstance::Update(float deltaSeconds, uint32_t interval)
+{
+	if (!Advance(deltaSeconds, interval))
+		return 0;
+	return Evaluate();
+}
+
+bool ModelInstance::Advance(float deltaSeconds, uint32_t interval)
+{
+	// time not yet sampled, negative while the target pose is ahead of the clock
+	m_pendingTime += deltaSeconds;
+	if (interval == 0)
+	{
+		m_stale = true;
+		return false;
+	}
+
+	// m_localPose may hold corrections of the previous frame (IK), so every pose is built from m_fromPose and m_toPose
+	if (interval == 1 || m_stale)
+	{
+		// full rate, or one jump to the current time after being culled
+		if (sample(m_pendingTime, m_toPose))
+			std::copy(m_toPose.begin(), m_toPose.end(), m_localPose.begin());
+		m_pendingTime = 0.0f;
+		m_stale = false;
+		m_interval = interval;
+		m_segmentStep = m_segmentLength = 0;
+		return true;
+	}
+
+	if (interval != m_interval || m_segmentStep >= m_segmentLength)
+	{
+		// The target is sampled at the end of the segment, the displayed pose catches up with it frame by frame.
+		// After a rate change the first segment is shortened so that the segments line up with the phase of the instance.
+		const uint32_t length = interval != m_interval ? interval - m_phase % interval : interval;
+		if (m_segmentStep < m_segmentLength)
+			BlendPoses(m_fromPose, m_toPose, static_cast<float>(m_segmentStep) / static_cast<float>(m_segmentLength), {}, m_fromPose);
+		else
+			std::copy(m_toPose.begin(), m_toPose.end(), m_fromPose.begin());
+		const float ahead = m_pendingTime + deltaSeconds * static_cast<float>(length - 1);
+		sample(ahead, m_toPose);
+		m_pendingTime -= ahead;
+		m_interval = interval;
+		m_segmentLength = length;
+		m_segmentStep = 0;
+	}
+	m_segmentStep++;
+	BlendPoses(m_fromPose, m_toPose, static_cast<float>(m_segmentStep) / static_cast<float>(m_segmentLength), {}, m_localPose);
+	m_dirty = true;
+	return true;
+}
+
+const AnimationRef& ModelInstance::GetAnimation() const
+{
+	return m_animation;
+}
+
+float ModelInstance::GetAnimationTime() const
+{
+	return m_time;
+}
+
+void ModelInstance::SetAnimationTime(float time)
+{
+	m_time = time;
+	m_pendingTime = 0.0f;
+	m_stale = true;
+}
+
+Model& ModelInstance::GetModel() const
+{
+	return *m_model;
+}
+
+std::span<BonePose> ModelInstance::GetLocalPose()
+{
+	m_dirty = true;
+	return m_localPose;
+}
+
+std::span<const glm::mat4> ModelInstance::GetPalette() const
+{
+	return m_palette;
+}
+
+std::span<const glm::mat4> ModelInstance::GetPreviousPalette() const
+{
+	return m_previousPalette;
+}
+
+AABB ModelInstance::GetBounding() const
+{
+	return m_bounding;
+}
+
+void ModelInstance::SetMorphWeight(uint32_t target, float weight)
+{
+	if (target < m_morphWeights.size())
+		m_morphWeights[target] = weight;
+}
+
+std::span<const float> ModelInstance::GetMorphWeights() const
+{
+	return m_morphWeights;
+}
+
+bool ModelInstance::sample(float deltaSeconds, std::span<BonePose> pose)
+{
+	if (m_animator)
+	{
+		m_animator->Update(deltaSeconds, pose);
+	}
+	else if (m_animation)
+	{
+		const float duration = m_animation->GetDuration();
+		m_time += deltaSeconds * m_animation->GetTPS();
+		if (duration > 0.0f) m_time = std::fmod(m_time, duration);
+		m_animation->Sample(m_time, pose, m_cursor);
+		m_animation->SampleMorphWeights(m_time, m_morphWeights);
+	}
+	else
+		return false;
+	m_dirty = true;
+	return true;
+}
+
+uint32_t ModelInstance::Evaluate()
+{
+	std::copy(m_palette.begin(), m_palette.end(), m_previousPalette.begin());
+	if (m_palette.empty() || !m_dirty)
+		return 0;
+
+	// the model space matrices are only needed during the walk, one buffer per thread serves every instance
+	thread_local std::vector<glm::mat4> modelScratch;
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	if (modelScratch.size() < skeleton.GetBoneCount())
+		modelScratch.resize(skeleton.GetBoneCount());
+	skeleton.Evaluate(m_localPose, modelScratch, m_palette.data());
+	m_bounding = m_model->ComputeBounding(m_palette);
+	m_dirty = false;
+	return static_cast<uint32_t>(skeleton.GetBoneCount());
+}
+
+#pragma endregion
+
+#pragma region VertexAnimation
+
+VertexAnimation::VertexAnimation(Model& model, std::span<const int> clips, Format format, float framesPerSecond)
+	: m_model(&model)
+	, m_format(format)
+{
+	const Skeleton& skeleton = model.GetSkeleton();
+	const auto& animations = model.GetAnimations();
+	const uint32_t paletteSize = skeleton.GetPaletteSize();
+	if (paletteSize == 0 || animations.empty())
+	{
+		Error("VertexAnimation: the model has no bones or no animations");
+		return;
+	}
+
+	std::vector<int> selected(clips.begin(), clips.end());
+	if (selected.empty())
+		for (size_t i = 0; i < animations.size(); i++) selected.push_back(static_cast<int>(i));
+
+	// a whole number of frames per loop, so the last frame blends into the first one
+	uint32_t frameTotal = 0;
+	for (const int index : selected)
+	{
+		if (index < 0 || index >= static_cast<int>(animations.size()))
+		{
+			Warning("VertexAnimation: no animation " + std::to_string(index));
+			continue;
+		}
+		const AnimationRef& animation = animations[index];
+		const float duration = animation->GetTPS() > 0.0f ? animation->GetDuration() / animation->GetTPS() : 0.0f;
+		Clip clip;
+		clip.frameCount = std::max(static_cast<uint32_t>(std::round(duration * framesPerSecond)), 1u);
+		clip.framesPerSecond = duration > 0.0f ? static_cast<float>(clip.frameCount) / duration : 1.0f;
+		m_clips.push_back(clip);
+		m_animations.push_back(animation);
+		frameTotal += clip.frameCount;
+	}
+	if (m_clips.empty())
+		return;
+
+	size_t vertexCount = 0;
+	for (size_t i = 0; i < model.GetMeshCount(); i++)
+		vertexCount += model[i]->GetVertexCount();
+
+	uint32_t width = paletteSize * 3;
+	if (format == Format::Vertices)
+	{
+		width = static_cast<uint32_t>(std::min<size_t>(std::max<size_t>(vertexCount, 1), MaxRowWidth));
+		m_rowsPerFrame = static_cast<uint32_t>((vertexCount + width - 1) / width);
+	}
+	const uint32_t height = frameTotal * m_rowsPerFrame;
+	const uint32_t maxSize = static_cast<uint32_t>(Renderer::GetDeviceProperties().limits.maxTextureSize);
+	if (width > maxSize || height > maxSize)
+	{
+		Error("VertexAnimation: " + std::to_string(width) + "x" + std::to_string(height) + " exceeds the texture size limit, bake fewer clips or frames");
+		m_clips.clear();
+		m_animations.clear();
+		return;
+	}
+
+	std::vector<glm::vec4> data(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+	std::vector<glm::vec4> normals(format == Format::Vertices ? data.size() : 0, glm::vec4(0.0f));
+	const auto restPose = skeleton.GetLocalPose();
+	std::vector<BonePose> pose(restPose.begin(), restPose.end());
+	std::vector<glm::mat4> modelScratch(skeleton.GetBoneCount());
+	std::vector<glm::mat4> palette(paletteSize, glm::mat4(1.0f));
+
+	uint32_t row = 0;
+	for (size_t c = 0; c < m_clips.size(); c++)
+	{
+		Clip& clip = m_clips[c];
+		const Animation& animation = *m_animations[c];
+		clip.firstRow = row;
+		AABB& clipBounds = m_clipBounds.emplace_back();
+		AnimationCursor cursor;
+		for (uint32_t frame = 0; frame < clip.frameCount; frame++, row += m_rowsPerFrame)
+		{
+			std::copy(restPose.begin(), restPose.end(), pose.begin());
+			animation.Sample(animation.GetDuration() * static_cast<float>(frame) / static_cast<float>(clip.frameCount), pose, cursor);
+			skeleton.Evaluate(pose, modelScratch, palette.data());
+			clipBounds.Combine(model.ComputeBounding(palette));
+
+			glm::vec4* destination = data.data() + static_cast<size_t>(row) * width;
+			if (format == Format::Bones)
+			{
+				// the rows of the affine part, the shader rebuilds the matrix with a transpose
+				for (uint32_t bone = 0; bone < paletteSize; bone++)
+					for (int r = 0; r < 3; r++)
+						destination[bone * 3 + r] = glm::vec4(palette[bone][0][r], palette[bone][1][r], palette[bone][2][r], palette[bone][3][r]);
+				continue;
+			}
+
+			glm::vec4* normalDestination = normals.data() + static_cast<size_t>(row) * width;
+			size_t vertexIndex = 0;
+			for (size_t m = 0; m < model.GetMeshCount(); m++)
+			{
+				for (const MeshVertex& vertex : model[m]->GetVertices())
+				{
+					// the same blend as the skinning pass of DrawBatcher
+					glm::mat4 transform(0.0f);
+					float totalWeight = 0.0f;
+					for (size_t i = 0; i < MAX_NUM_BONES_PER_VERTEX; i++)
+					{
+						if (vertex.weights[i] <= 0.0f || vertex.boneIDs[i] >= paletteSize)
+							continue;
+						transform += palette[vertex.boneIDs[i]] * vertex.weights[i];
+						totalWeight += vertex.weights[i];
+					}
+					if (totalWeight <= 0.0f)
+						transform = glm::mat4(1.0f);
+					destination[vertexIndex] = transform * glm::vec4(vertex.position, 1.0f);
+					normalDestination[vertexIndex] = glm::vec4(glm::normalize(glm::mat3(transform) * vertex.normal), 0.0f);
+					vertexIndex++;
+				}
+			}
+		}
+	}
+
+	m_data = std::make_shared<GLTexture2D>(GL_RGBA32F, GL_RGBA, GL_FLOAT, width, height, data.data(), GL_NEAREST, GL_CLAMP_TO_EDGE);
+	m_memoryUsage = data.size() * sizeof(glm::vec4);
+	if (format == Format::Vertices)
+	{
+		// normals do not need full precision
+		m_normals = std::make_shared<GLTexture2D>(GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height, normals.data(), GL_NEAREST, GL_CLAMP_TO_EDGE);
+		m_memoryUsage += normals.size() * 4 * sizeof(uint16_t);
+	}
+	m_clipBuffer = std::make_unique<GPUBuffer>(std::span<const Clip>(m_clips), BufferStorageFlag::NONE, "VertexAnimationClips");
+
+	Print("VertexAnimation: " + std::to_string(m_clips.size()) + " clips, " + std::to_string(frameTotal) + " frames, "
+		+ std::to_string(m_memoryUsage / 1024) + " KB (" + (format == Format::Bones ? "bones" : "vertices") + ")");
+}
+
+void VertexAnimation::Bind() const
+{
+	if (!IsValid())
+		return;
+	m_data->Bind(VERTEX_ANIMATION_TEXTURE_UNIT);
+	if (m_normals) m_normals->Bind(VERTEX_ANIMATION_TEXTURE_UNIT + 1);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_ANIMATION_CLIP_BINDING, *m_clipBuffer);
+}
+
+bool VertexAnimation::IsValid() const
+{
+	return m_data != nullptr;
+}
+
+Model& VertexAnimation::GetModel() const
+{
+	return *m_model;
+}
+
+VertexAnimation::Format VertexAnimation::GetFormat() const
+{
+	return m_format;
+}
+
+uint32_t VertexAnimation::GetRowsPerFrame() const
+{
+	return m_rowsPerFrame;
+}
+
+uint32_t VertexAnimation::GetClipCount() const
+{
+	return static_cast<uint32_t>(m_clips.size());
+}
+
+uint32_t VertexAnimation::FindClip(const Animation* animation) const
+{
+	for (size_t i = 0; i < m_animations.size(); i++)
+		if (m_animations[i].get() == animation) return static_cast<uint32_t>(i);
+	return InvalidClip;
+}
+
+const AnimationRef& VertexAnimation::GetAnimation(uint32_t clip) const
+{
+	return m_animations[clip];
+}
+
+float VertexAnimation::GetClipDuration(uint32_t clip) const
+{
+	return static_cast<float>(m_clips[clip].frameCount) / m_clips[clip].framesPerSecond;
+}
+
+AABB VertexAnimation::GetClipBounding(uint32_t clip) const
+{
+	return m_clipBounds[clip];
+}
+
+size_t VertexAnimation::GetMemoryUsage() const
+{
+	return m_memoryUsage;
+}
+
+#pragma endregion
+
+#pragma region IK
+
+namespace
+{
+	// Four values of one quantity, one per job. The solvers are written once against these helpers and run on SSE or on plain floats
+#if NANO_SSE
+	struct Lanes final
+	{
+		Lanes() = default;
+		Lanes(__m128 value) : v(value) {}
+		Lanes(float value) : v(_mm_set1_ps(value)) {}
+		__m128 v;
+	};
+
+	inline Lanes operator+(Lanes a, Lanes b) { return _mm_add_ps(a.v, b.v); }
+	inline Lanes operator-(Lanes a, Lanes b) { return _mm_sub_ps(a.v, b.v); }
+	inline Lanes operator*(Lanes a, Lanes b) { return _mm_mul_ps(a.v, b.v); }
+	inline Lanes operator/(Lanes a, Lanes b) { return _mm_div_ps(a.v, b.v); }
+	inline Lanes Min(Lanes a, Lanes b) { return _mm_min_ps(a.v, b.v); }
+	inline Lanes Max(Lanes a, Lanes b) { return _mm_max_ps(a.v, b.v); }
+	inline Lanes Sqrt(Lanes a) { return _mm_sqrt_ps(a.v); }
+	// a < b ? x : y in every lane
+	inline Lanes SelectLess(Lanes a, Lanes b, Lanes x, Lanes y)
+	{
+		const __m128 mask = _mm_cmplt_ps(a.v, b.v);
+		return _mm_or_ps(_mm_and_ps(mask, x.v), _mm_andnot_ps(mask, y.v));
+	}
+	inline bool AllLess(Lanes a, Lanes b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)) == 0xF; }
+	inline Lanes LoadLanes(const float* values) { return _mm_loadu_ps(values); }
+	inline void StoreLanes(Lanes a, float* values) { _mm_storeu_ps(values, a.v); }
+#else
+	struct Lanes final
+	{
+		Lanes() = default;
+		Lanes(float value) : v{ value, value, value, value } {}
+		float v[4];
+	};
+
+	template<typename Func>
+	inline Lanes PerLane(Lanes a, Lanes b, Func func)
+	{
+		Lanes r;
+		for (int i = 0; i < 4; i++) r.v[i] = func(a.v[i], b.v[i]);
+		return r;
+	}
+	inline Lanes operator+(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return x + y; }); }
+	inline Lanes operator-(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return x - y; }); }
+	inline Lanes operator*(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return x * y; }); }
+	inline Lanes operator/(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return x / y; }); }
+	inline Lanes Min(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return std::min(x, y); }); }
+	inline Lanes Max(Lanes a, Lanes b) { return PerLane(a, b, [](float x, float y) { return std::max(x, y); }); }
+	inline Lanes Sqrt(Lanes a) { return PerLane(a, a, [](float x, float) { return std::sqrt(x); }); }
+	inline Lanes SelectLess(Lanes a, Lanes b, Lanes x, Lanes y)
+	{
+		Lanes r;
+		for (int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? x.v[i] : y.v[i];
+		return r;
+	}
+	inline bool AllLess(Lanes a, Lanes b)
+	{
+		for (int i = 0; i < 4; i++)
+			if (!(a.v[i] < b.v[i])) return false;
+		return true;
+	}
+	inline Lanes LoadLanes(const float* values) { Lanes r; std::memcpy(r.v, values, sizeof(r.v)); return r; }
+	inline void StoreLanes(Lanes a, float* values) { std::memcpy(values, a.v, sizeof(a.v)); }
+#endif
+
+	inline Lanes operator-(Lanes a) { return Lanes(0.0f) - a; }
+	inline Lanes Clamp(Lanes a, Lanes low, Lanes high) { return Min(Max(a, low), high); }
+	inline Lanes Abs(Lanes a) { return Max(a, -a); }
+
+	// acos with an error below 1e-4 radians (Abramowitz and Stegun 4.4.45)
+	inline Lanes Acos(Lanes x)
+	{
+		const Lanes a = Abs(x);
+		const Lanes poly = ((Lanes(-0.0187293f) * a + Lanes(0.0742610f)) * a - Lanes(0.2121144f)) * a + Lanes(1.5707288f);
+		const Lanes r = Sqrt(Max(Lanes(1.0f) - a, Lanes(0.0f))) * poly;
+		return SelectLess(x, Lanes(0.0f), Lanes(glm::pi<float>()) - r, r);
+	}
+
+	// sine and cosine of angles in [0, pi/2] by their Taylor series, the error stays below 1e-5
+	inline void SinCos(Lanes x, Lanes& sine, Lanes& cosine)
+	{
+		const Lanes x2 = x * x;
+		sine = x * (Lanes(1.0f) - x2 * (Lanes(1.0f / 6.0f) - x2 * (Lanes(1.0f / 120.0f) - x2 * (Lanes(1.0f / 5040.0f) - x2 * Lanes(1.0f / 362880.0f)))));
+		cosine = Lanes(1.0f) - x2 * (Lanes(0.5f) - x2 * (Lanes(1.0f / 24.0f) - x2 * (Lanes(1.0f / 720.0f) - x2 * (Lanes(1.0f / 40320.0f) - x2 * Lanes(1.0f / 3628800.0f)))));
+	}
+
+	struct Lanes3 final
+	{
+		Lanes x, y, z;
+	};
+
+	inline Lanes3 operator+(const Lanes3& a, const Lanes3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	inline Lanes3 operator-(const Lanes3& a, const Lanes3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	inline Lanes3 operator*(const Lanes3& a, Lanes s) { return { a.x * s, a.y * s, a.z * s }; }
+	inline Lanes Dot(const Lanes3& a, const Lanes3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	inline Lanes3 Cross(const Lanes3& a, const Lanes3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+	inline Lanes Length(const Lanes3& a) { return Sqrt(Dot(a, a)); }
+	// zero vectors stay zero
+	inline Lanes3 Normalize(const Lanes3& a) { return a * (Lanes(1.0f) / Max(Length(a), Lanes(1e-12f))); }
+	inline Lanes3 SelectLess(Lanes a, Lanes b, const Lanes3& x, const Lanes3& y)
+	{
+		return { SelectLess(a, b, x.x, y.x), SelectLess(a, b, x.y, y.y), SelectLess(a, b, x.z, y.z) };
+	}
+	// unnormalized, for unit vectors only
+	inline Lanes3 Perpendicular(const Lanes3& a)
+	{
+		const Lanes3 alongZ = { a.y, -a.x, Lanes(0.0f) };
+		const Lanes3 alongX = { Lanes(0.0f), a.z, -a.y };
+		return SelectLess(Abs(a.z), Lanes(0.9f), alongZ, alongX);
+	}
+
+	struct LanesQuat final
+	{
+		Lanes x, y, z, w;
+	};
+
+	inline LanesQuat Multiply(const LanesQuat& a, const LanesQuat& b)
+	{
+		return {
+			a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+			a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+			a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+			a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z };
+	}
+	inline Lanes3 Rotate(const LanesQuat& q, const Lanes3& v)
+	{
+		const Lanes3 axis = { q.x, q.y, q.z };
+		const Lanes3 t = Cross(axis, v) * Lanes(2.0f);
+		return v + t * q.w + Cross(axis, t);
+	}
+	inline LanesQuat Normalize(const LanesQuat& q)
+	{
+		const Lanes scale = Lanes(1.0f) / Max(Sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w), Lanes(1e-12f));
+		return { q.x * scale, q.y * scale, q.z * scale, q.w * scale };
+	}
+	// nlerp from the identity, t = 1 is the full rotation
+	inline LanesQuat ScaleRotation(const LanesQuat& q, Lanes t)
+	{
+		return Normalize(LanesQuat{ q.x * t, q.y * t, q.z * t, Lanes(1.0f) - t + q.w * t });
+	}
+	// shortest rotation from the unit vector u to the unit vector v, about the unit fallback axis when they are opposite
+	inline LanesQuat RotationBetween(const Lanes3& u, const Lanes3& v, const Lanes3& fallback)
+	{
+		const Lanes w = Lanes(1.0f) + Dot(u, v);
+		const Lanes3 axis = SelectLess(w, Lanes(1e-6f), fallback, Cross(u, v));
+		return Normalize(LanesQuat{ axis.x, axis.y, axis.z, Max(w, Lanes(0.0f)) });
+	}
+	// Rotation about a unit axis by the angle from acos(cos0) to acos(cos1), both angles in [0, pi].
+	// Works on the cosines with the half angle identities, no trigonometry needed
+	inline LanesQuat AngleChange(const Lanes3& axis, Lanes cos0, Lanes cos1)
+	{
+		const Lanes zero(0.0f), one(1.0f), half(0.5f);
+		const Lanes sin0 = Sqrt(Max(one - cos0 * cos0, zero));
+		const Lanes sin1 = Sqrt(Max(one - cos1 * cos1, zero));
+		const Lanes cosDelta = cos1 * cos0 + sin1 * sin0;
+		const Lanes sinDelta = sin1 * cos0 - cos1 * sin0;
+		const Lanes w = Sqrt(Max((one + cosDelta) * half, zero));
+		const Lanes s = Sqrt(Max((one - cosDelta) * half, zero));
+		const Lanes signedS = SelectLess(sinDelta, zero, -s, s);
+		return { axis.x * signedS, axis.y * signedS, axis.z * signedS, w };
+	}
+
+	// lanes past count repeat the first job, their results are dropped
+	template<typename Job>
+	inline Lanes Gather(const Job* jobs, size_t count, float Job::* member)
+	{
+		alignas(16) float values[4];
+		for (size_t i = 0; i < 4; i++) values[i] = jobs[i < count ? i : 0].*member;
+		return LoadLanes(values);
+	}
+	template<typename Job>
+	inline Lanes3 Gather(const Job* jobs, size_t count, glm::vec3 Job::* member)
+	{
+		alignas(16) float values[3][4];
+		for (size_t i = 0; i < 4; i++)
+		{
+			const glm::vec3& v = jobs[i < count ? i : 0].*member;
+			values[0][i] = v.x;
+			values[1][i] = v.y;
+			values[2][i] = v.z;
+		}
+		return { LoadLanes(values[0]), LoadLanes(values[1]), LoadLanes(values[2]) };
+	}
+	template<typename Job>
+	inline void Scatter(const LanesQuat& q, Job* jobs, size_t count, glm::quat Job::* member)
+	{
+		alignas(16) float values[4][4];
+		StoreLanes(q.x, values[0]);
+		StoreLanes(q.y, values[1]);
+		StoreLanes(q.z, values[2]);
+		StoreLanes(q.w, values[3]);
+		for (size_t i = 0; i < count; i++)
+			jobs[i].*member = glm::quat::wxyz(values[3][i], values[0][i], values[1][i], values[2][i]);
+	}
+
+	[[nodiscard]] inline BonePose ChildModelPose(const BonePose& parent, const BonePose& local)
+	{
+		return { parent.position + parent.orientation * local.position, parent.orientation * local.orientation };
+	}
+
+	// turns a bone about its joint by a model space rotation, orientation is the model space orientation of the bone before the turn
+	inline void RotateBone(BonePose& local, const glm::quat& orientation, const glm::quat& rotation)
+	{
+		local.orientation = glm::normalize(local.orientation * (glm::conjugate(orientation) * rotation * orientation));
+	}
+}
+
+void SolveTwoBoneIK(std::span<TwoBoneIKJob> jobs)
+{
+	const Lanes one(1.0f), epsilon(1e-6f);
+	for (size_t first = 0; first < jobs.size(); first += 4)
+	{
+		TwoBoneIKJob* group = jobs.data() + first;
+		const size_t count = std::min<size_t>(jobs.size() - first, 4);
+		const Lanes3 a = Gather(group, count, &TwoBoneIKJob::root);
+		const Lanes3 b = Gather(group, count, &TwoBoneIKJob::middle);
+		const Lanes3 c = Gather(group, count, &TwoBoneIKJob::end);
+		const Lanes3 t = c + (Gather(group, count, &TwoBoneIKJob::target) - c) * Gather(group, count, &TwoBoneIKJob::weight);
+		const Lanes3 pole = Gather(group, count, &TwoBoneIKJob::pole) - a;
+
+		const Lanes3 ab = b - a;
+		const Lanes3 bc = c - b;
+		const Lanes3 ac = c - a;
+		const Lanes3 at = t - a;
+		const Lanes lab = Length(ab);
+		const Lanes lbc = Length(bc);
+		const Lanes lac = Length(ac);
+		// just short of the straight limb
+		const Lanes lat = Clamp(Length(at), epsilon, (lab + lbc) * Lanes(0.9999f));
+
+		// angle between ac and ab at the root and between ba and bc at the middle joint, now and with the end at the target distance (law of cosines)
+		const Lanes rootCos0 = Clamp(Dot(ac, ab) / Max(lac * lab, epsilon), -one, one);
+		const Lanes middleCos0 = Clamp(-Dot(ab, bc) / Max(lab * lbc, epsilon), -one, one);
+		const Lanes rootCos1 = Clamp((lab * lab + lat * lat - lbc * lbc) / Max(Lanes(2.0f) * lab * lat, epsilon), -one, one);
+		const Lanes middleCos1 = Clamp((lab * lab + lbc * lbc - lat * lat) / Max(Lanes(2.0f) * lab * lbc, epsilon), -one, one);
+
+		// both joints bend in the plane of the limb, a straight limb bends towards the pole
+		const Lanes3 acDirection = Normalize(ac);
+		const Lanes3 bendAxis = Cross(ac, ab);
+		const Lanes3 poleAxis = Cross(ac, pole);
+		const Lanes3 fallbackAxis = Perpendicular(acDirection);
+		const Lanes straight = lac * lab * Lanes(1e-3f);
+		const Lanes polePlanar = lac * Length(pole) * Lanes(1e-3f);
+		const Lanes3 axis = Normalize(SelectLess(Length(bendAxis), straight, SelectLess(Length(poleAxis), polePlanar, fallbackAxis, poleAxis), bendAxis));
+		const LanesQuat rootBend = AngleChange(axis, rootCos0, rootCos1);
+		const LanesQuat middleBend = AngleChange(axis, middleCos0, middleCos1);
+
+		// the bends keep the end on its line from the root, turn that line onto the target
+		const Lanes3 atDirection = Normalize(at);
+		LanesQuat rootRotation = Multiply(RotationBetween(acDirection, atDirection, axis), rootBend);
+
+		// twist about the line to the target until the middle joint faces the pole
+		const Lanes3 knee = Rotate(rootRotation, ab);
+		const Lanes3 kneeSide = knee - atDirection * Dot(knee, atDirection);
+		const Lanes3 poleSide = pole - atDirection * Dot(pole, atDirection);
+		const LanesQuat twist = RotationBetween(Normalize(kneeSide), Normalize(poleSide), atDirection);
+		rootRotation = Normalize(Multiply(ScaleRotation(twist, Gather(group, count, &TwoBoneIKJob::poleWeight)), rootRotation));
+
+		Scatter(rootRotation, group, count, &TwoBoneIKJob::rootRotation);
+		Scatter(Normalize(middleBend), group, count, &TwoBoneIKJob::middleRotation);
+	}
+}
+
+void SolveLookAtIK(std::span<LookAtIKJob> jobs)
+{
+	const Lanes zero(0.0f), epsilon(1e-6f);
+	for (size_t first = 0; first < jobs.size(); first += 4)
+	{
+		LookAtIKJob* group = jobs.data() + first;
+		const size_t count = std::min<size_t>(jobs.size() - first, 4);
+		const Lanes3 forward = Normalize(Gather(group, count, &LookAtIKJob::forward));
+		const Lanes3 toTarget = Gather(group, count, &LookAtIKJob::target) - Gather(group, count, &LookAtIKJob::position);
+		const Lanes3 direction = Normalize(toTarget);
+
+		const Lanes3 cross = Cross(forward, direction);
+		const Lanes3 axis = Normalize(SelectLess(Length(cross), epsilon, Perpendicular(forward), cross));
+		// the part of the angle allowed by the weight and the limit, none for a target at the joint
+		Lanes angle = Acos(Clamp(Dot(forward, direction), Lanes(-1.0f), Lanes(1.0f))) * Gather(group, count, &LookAtIKJob::weight);
+		angle = Clamp(Min(angle, Gather(group, count, &LookAtIKJob::maxAngle)), zero, Lanes(glm::pi<float>()));
+		angle = SelectLess(Length(toTarget), epsilon, zero, angle);
+		Lanes sine, cosine;
+		SinCos(angle * Lanes(0.5f), sine, cosine);
+		Scatter(Normalize(LanesQuat{ axis.x * sine, axis.y * sine, axis.z * sine, cosine }), group, count, &LookAtIKJob::rotation);
+	}
+}
+
+void SolveFABRIK(std::span<FABRIKJob> jobs, uint32_t iterations, float tolerance)
+{
+	thread_local std::vector<Lanes3> joints;
+	thread_local std::vector<Lanes> lengths;
+	const Lanes toleranceSquared(tolerance * tolerance);
+	for (size_t first = 0; first < jobs.size();)
+	{
+		FABRIKJob* group = jobs.data() + first;
+		const size_t jointCount = group[0].joints.size();
+		size_t count = 1;
+		while (count < 4 && first + count < jobs.size() && group[count].joints.size() == jointCount)
+			count++;
+		first += count;
+		if (jointCount < 2)
+			continue;
+
+		joints.resize(jointCount);
+		lengths.resize(jointCount - 1);
+		for (size_t j = 0; j < jointCount; j++)
+		{
+			alignas(16) float values[3][4];
+			for (size_t i = 0; i < 4; i++)
+			{
+				const glm::vec3& v = group[i < count ? i : 0].joints[j];
+				values[0][i] = v.x;
+				values[1][i] = v.y;
+				values[2][i] = v.z;
+			}
+			joints[j] = { LoadLanes(values[0]), LoadLanes(values[1]), LoadLanes(values[2]) };
+			if (j > 0) lengths[j - 1] = Length(joints[j] - joints[j - 1]);
+		}
+		const Lanes3 root = joints[0];
+		const Lanes3 end = joints[jointCount - 1];
+		const Lanes3 target = end + (Gather(group, count, &FABRIKJob::target) - end) * Gather(group, count, &FABRIKJob::weight);
+
+		for (uint32_t iteration = 0; iteration < iterations; iteration++)
+		{
+			const Lanes3 error = joints[jointCount - 1] - target;
+			if (AllLess(Dot(error, error), toleranceSquared))
+				break;
+			// backward from the target, then forward from the root
+			joints[jointCount - 1] = target;
+			for (size_t j = jointCount - 1; j-- > 0;)
+				joints[j] = joints[j + 1] + Normalize(joints[j] - joints[j + 1]) * lengths[j];
+			joints[0] = root;
+			for (size_t j = 0; j + 1 < jointCount; j++)
+				joints[j + 1] = joints[j] + Normalize(joints[j + 1] - joints[j]) * lengths[j];
+		}
+
+		for (size_t j = 0; j < jointCount; j++)
+		{
+			alignas(16) float values[3][4];
+			StoreLanes(joints[j].x, values[0]);
+			StoreLanes(joints[j].y, values[1]);
+			StoreLanes(joints[j].z, values[2]);
+			for (size_t i = 0; i < count; i++)
+				group[i].joints[j] = glm::vec3(values[0][i], values[1][i], values[2][i]);
+		}
+	}
+}
+
+TwoBoneIKJob MakeTwoBoneIKJob(const Skeleton& skeleton, std::span<const BonePose> pose, const TwoBoneIKChain& chain, const glm::vec3& target, float weight)
+{
+	assert(skeleton.GetParent(chain.middle) == chain.root);
+	const BonePose root = skeleton.GetModelPose(pose, chain.root);
+	const BonePose middle = ChildModelPose(root, pose[chain.middle]);
+	const BonePose end = skeleton.GetParent(chain.end) == chain.middle ? ChildModelPose(middle, pose[chain.end]) : skeleton.GetModelPose(pose, chain.end);
+
+	TwoBoneIKJob job;
+	job.root = root.position;
+	job.middle = middle.position;
+	job.end = end.position;
+	job.target = target;
+	job.pole = middle.position;
+	job.weight = weight;
+	job.rootOrientation = root.orientation;
+	job.middleOrientation = middle.orientation;
+	job.endOrientation = end.orientation;
+	return job;
+}
+
+void ApplyTwoBoneIK(const Skeleton& skeleton, std::span<BonePose> pose, const TwoBoneIKChain& chain, const TwoBoneIKJob& job, const glm::quat& endOrientation)
+{
+	RotateBone(pose[chain.root], job.rootOrientation, job.rootRotation);
+	RotateBone(pose[chain.middle], job.middleOrientation, job.middleRotation);
+
+	// the end joint keeps its place relative to the middle bone
+	const BonePose middle = { job.root + job.rootRotation * (job.middle - job.root), job.rootRotation * job.middleRotation * job.middleOrientation };
+	const glm::vec3 endPosition = middle.position + job.rootRotation * job.middleRotation * (job.end - job.middle);
+	const uint32_t parent = skeleton.GetParent(chain.end);
+	const BonePose parentPose = parent == chain.middle ? middle : (parent != Skeleton::InvalidIndex ? skeleton.GetModelPose(pose, parent) : BonePose{});
+	const glm::quat inverseParent = glm::conjugate(parentPose.orientation);
+	BonePose& end = pose[chain.end];
+	end.position = inverseParent * (endPosition - parentPose.position);
+	end.orientation = glm::normalize(inverseParent * endOrientation);
+}
+
+LookAtIKJob MakeLookAtIKJob(const Skeleton& skeleton, std::span<const BonePose> pose, uint32_t bone, const glm::vec3& axis, const glm::vec3& target, float weight, float maxAngle)
+{
+	const BonePose model = skeleton.GetModelPose(pose, bone);
+	LookAtIKJob job;
+	job.position = model.position;
+	job.forward = model.orientation * axis;
+	job.target = target;
+	job.weight = weight;
+	job.maxAngle = maxAngle;
+	job.orientation = model.orientation;
+	return job;
+}
+
+void ApplyLookAtIK(std::span<BonePose> pose, uint32_t bone, const LookAtIKJob& job)
+{
+	RotateBone(pose[bone], job.orientation, job.rotation);
+}
+
+void GetChainModelPoses(const Skeleton& skeleton, std::span<const BonePose> pose, std::span<const uint32_t> bones, std::span<BonePose> modelPoses, std::span<glm::vec3> joints)
+{
+	assert(modelPoses.size() >= bones.size() && joints.size() >= bones.size());
+	for (size_t i = 0; i < bones.size(); i++)
+	{
+		assert(i == 0 || skeleton.GetParent(bones[i]) == bones[i - 1]);
+		modelPoses[i] = i == 0 ? skeleton.GetModelPose(pose, bones[0]) : ChildModelPose(modelPoses[i - 1], pose[bones[i]]);
+		joints[i] = modelPoses[i].position;
+	}
+}
+
+void ApplyFABRIK(std::span<BonePose> pose, std::span<const uint32_t> bones, std::span<const BonePose> modelPoses, std::span<const glm::vec3> joints)
+{
+	// every bone turns its child joint onto the solved one, the turns of the parents carry over to the children
+	glm::quat carried = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	for (size_t i = 0; i + 1 < bones.size(); i++)
+	{
+		const glm::vec3 current = carried * (modelPoses[i + 1].position - modelPoses[i].position);
+		const glm::vec3 wanted = joints[i + 1] - joints[i];
+		if (glm::dot(current, current) < 1e-12f || glm::dot(wanted, wanted) < 1e-12f)
+			continue;
+		const glm::quat turn = glm::rotation(glm::normalize(current), glm::normalize(wanted));
+		RotateBone(pose[bones[i]], carried * modelPoses[i].orientation, turn);
+		carried = turn * carried;
+	}
+}
+
+#pragma endregion
+
+#pragma region FootIK
+
+FootIK::FootIK(const Model& model, const std::string& pelvis, const Leg& left, const Leg& right)
+	: m_model(&model)
+{
+	m_pelvis = model.FindBone(pelvis);
+	if (m_pelvis == Skeleton::InvalidIndex)
+	{
+		Error("FootIK: no pelvis bone " + pelvis);
+		return;
+	}
+	if (!findLeg(left, m_legs[0]) || !findLeg(right, m_legs[1]))
+		return;
+	m_valid = true;
+}
+
+void FootIK::SetSettings(const FootIKSettings& settings)
+{
+	m_settings = settings;
+}
+
+const FootIKSettings& FootIK::GetSettings() const
+{
+	return m_settings;
+}
+
+bool FootIK::IsValid() const
+{
+	return m_valid;
+}
+
+uint32_t FootIK::Solve(std::span<const IKCharacter> characters, const GroundQuery& query)
+{
+	if (!m_valid || !query)
+		return 0;
+
+	m_states.clear();
+	for (size_t i = 0; i < characters.size(); i++)
+	{
+		const IKCharacter& character = characters[i];
+		if (character.instance && &character.instance->GetModel() == m_model && character.weight > 0.0f)
+		{
+			CharacterState& state = m_states.emplace_back();
+			state.character = i;
+		}
+	}
+	if (m_states.empty())
+		return 0;
+
+	constexpr size_t grainSize = 16;
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	const glm::vec3 up(0.0f, 1.0f, 0.0f);
+
+	// model space legs of the animated pose and a ray down from above every foot
+	m_origins.resize(m_states.size() * 2);
+	m_hits.assign(m_states.size() * 2, GroundHit{});
+	JobSystem::ParallelFor(m_states.size(), grainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				CharacterState& state = m_states[i];
+				const IKCharacter& character = characters[state.character];
+				const std::span<const BonePose> pose = character.instance->GetLocalPose();
+				state.inverseWorld = glm::inverse(glm::mat3(character.world));
+				state.weight = std::min(character.weight, 1.0f);
+				for (size_t leg = 0; leg < 2; leg++)
+				{
+					const LegBones& bones = m_legs[leg];
+					TwoBoneIKJob& job = state.legs[leg] = MakeTwoBoneIKJob(skeleton, pose, bones.chain, glm::vec3(0.0f), state.weight);
+					if (bones.pole != Skeleton::InvalidIndex)
+					{
+						job.pole = skeleton.GetModelPose(pose, bones.pole).position;
+						job.poleWeight = 1.0f;
+					}
+					m_origins[i * 2 + leg] = glm::vec3(character.world * glm::vec4(job.end, 1.0f)) + up * m_settings.rayHeight;
+				}
+			}
+		});
+
+	query(m_origins, m_settings.rayHeight + m_settings.maxDrop, m_hits);
+
+	std::atomic<uint32_t> solved = 0;
+	JobSystem::ParallelFor(m_states.size(), grainSize, [&](size_t begin, size_t end)
+		{
+			thread_local std::vector<TwoBoneIKJob> jobs;
+			jobs.clear();
+			uint32_t hits = 0;
+			for (size_t i = begin; i < end; i++)
+			{
+				const CharacterState& state = m_states[i];
+				const IKCharacter& character = characters[state.character];
+				const std::span<BonePose> pose = character.instance->GetLocalPose();
+
+				// the animation stands on the ground through the origin, a foot moves by the height of the ground below it relative to that
+				float offsets[2] = { 0.0f, 0.0f };
+				for (size_t leg = 0; leg < 2; leg++)
+				{
+					const GroundHit& hit = m_hits[i * 2 + leg];
+					if (hit.hit)
+						offsets[leg] = std::clamp(hit.position.y - character.world[3].y, -m_settings.maxDrop, m_settings.maxRaise);
+				}
+
+				// the pelvis drops for the lower foot so that its leg can reach the ground
+				const glm::vec3 modelUp = state.inverseWorld * up;
+				const glm::vec3 shift = modelUp * (std::min({ offsets[0], offsets[1], 0.0f }) * state.weight);
+				if (shift != glm::vec3(0.0f))
+				{
+					const uint32_t parent = skeleton.GetParent(m_pelvis);
+					const glm::quat parentOrientation = parent != Skeleton::InvalidIndex ? skeleton.GetModelPose(pose, parent).orientation : glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+					pose[m_pelvis].position += glm::conjugate(parentOrientation) * shift;
+				}
+
+				for (size_t leg = 0; leg < 2; leg++)
+				{
+					const LegBones& bones = m_legs[leg];
+					TwoBoneIKJob& job = jobs.emplace_back(state.legs[leg]);
+					job.target = job.end + modelUp * offsets[leg];
+					if (bones.rootFollowsPelvis)
+					{
+						job.root += shift;
+						job.middle += shift;
+					}
+					if (bones.endFollowsPelvis) job.end += shift;
+					if (bones.poleFollowsPelvis) job.pole += shift;
+				}
+			}
+
+			SolveTwoBoneIK(jobs);
+
+			for (size_t i = begin; i < end; i++)
+			{
+				const CharacterState& state = m_states[i];
+				const std::span<BonePose> pose = characters[state.character].instance->GetLocalPose();
+				for (size_t leg = 0; leg < 2; leg++)
+				{
+					const TwoBoneIKJob& job = jobs[(i - begin) * 2 + leg];
+					const GroundHit& hit = m_hits[i * 2 + leg];
+					glm::quat endOrientation = job.endOrientation;
+					if (m_settings.alignToGround && hit.hit)
+					{
+						const glm::quat align = glm::rotation(glm::normalize(state.inverseWorld * up), glm::normalize(state.inverseWorld * hit.normal));
+						endOrientation = NLerp(glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f), align, state.weight) * endOrientation;
+					}
+					ApplyTwoBoneIK(skeleton, pose, m_legs[leg].chain, job, endOrientation);
+					hits += hit.hit ? 1 : 0;
+				}
+			}
+			solved += hits;
+		});
+	return solved;
+}
+
+bool FootIK::findLeg(const Leg& names, LegBones& leg) const
+{
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	leg.chain = { m_model->FindBone(names.upper), m_model->FindBone(names.lower), m_model->FindBone(names.foot) };
+	if (leg.chain.root == Skeleton::InvalidIndex || leg.chain.middle == Skeleton::InvalidIndex || leg.chain.end == Skeleton::InvalidIndex)
+	{
+		Error("FootIK: missing leg bones " + names.upper + ", " + names.lower + ", " + names.foot);
+		return false;
+	}
+	if (skeleton.GetParent(leg.chain.middle) != leg.chain.root)
+	{
+		Error("FootIK: " + names.lower + " is not a child of " + names.upper);
+		return false;
+	}
+	if (!names.pole.empty())
+	{
+		leg.pole = m_model->FindBone(names.pole);
+		if (leg.pole == Skeleton::InvalidIndex)
+			Warning("FootIK: no pole bone " + names.pole);
+	}
+	leg.rootFollowsPelvis = isDescendant(leg.chain.root, m_pelvis);
+	leg.endFollowsPelvis = isDescendant(leg.chain.end, m_pelvis);
+	leg.poleFollowsPelvis = leg.pole != Skeleton::InvalidIndex && isDescendant(leg.pole, m_pelvis);
+	return true;
+}
+
+bool FootIK::isDescendant(uint32_t bone, uint32_t ancestor) const
+{
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	for (uint32_t i = bone; i != Skeleton::InvalidIndex; i = skeleton.GetParent(i))
+	{
+		if (i == ancestor)
+			return true;
+	}
+	return false;
+}
+
+#pragma endregion
+
+#pragma region SpringBones
+
+namespace
+{
+	inline Lanes3 LoadLanes3(const float* values)
+	{
+		return { LoadLanes(values), LoadLanes(values + 4), LoadLanes(values + 8) };
+	}
+
+	inline void StoreLanes3(const Lanes3& a, float* values)
+	{
+		StoreLanes(a.x, values);
+		StoreLanes(a.y, values + 4);
+		StoreLanes(a.z, values + 8);
+	}
+
+	// moves the points that are closer than radius to the segment from a to b onto the surface of the capsule
+	inline Lanes3 PushOutOfCapsule(const Lanes3& point, const Lanes3& a, const Lanes3& b, Lanes radius)
+	{
+		const Lanes3 axis = b - a;
+		const Lanes t = Clamp(Dot(point - a, axis) / Max(Dot(axis, axis), Lanes(1e-12f)), Lanes(0.0f), Lanes(1.0f));
+		const Lanes3 offset = point - (a + axis * t);
+		const Lanes distance = Length(offset);
+		const Lanes3 pushed = point + offset * ((radius - distance) / Max(distance, Lanes(1e-12f)));
+		return SelectLess(distance, radius, pushed, point);
+	}
+}
+
+SpringBones::SpringBones(const Model& model)
+	: m_model(&model)
+{
+}
+
+bool SpringBones::AddChain(std::span<const std::string> bones, const SpringChainSettings& settings)
+{
+	if (bones.size() < 2)
+	{
+		Error("SpringBones: a chain needs at least two bones");
+		return false;
+	}
+
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	Chain chain;
+	chain.settings = settings;
+	for (const std::string& name : bones)
+	{
+		const uint32_t bone = m_model->FindBone(name);
+		if (bone == Skeleton::InvalidIndex)
+		{
+			Error("SpringBones: no bone " + name);
+			return false;
+		}
+		if (!chain.bones.empty() && skeleton.GetParent(bone) != chain.bones.back())
+		{
+			Error("SpringBones: " + name + " is not a child of the previous bone of the chain");
+			return false;
+		}
+		if (overlaps(bone))
+		{
+			Error("SpringBones: " + name + " is already part of a chain");
+			return false;
+		}
+		chain.bones.push_back(bone);
+	}
+
+	// the layout of the state changes
+	Clear();
+	chain.offset = m_groupStride;
+	m_groupStride += chain.bones.size() * JointStride;
+	m_chains.push_back(std::move(chain));
+	return true;
+}
+
+bool SpringBones::AddCapsule(const std::string& bone, const std::string& end, float radius)
+{
+	Capsule capsule;
+	capsule.bone = m_model->FindBone(bone);
+	capsule.end = end.empty() ? capsule.bone : m_model->FindBone(end);
+	capsule.radius = radius;
+	if (capsule.bone == Skeleton::InvalidIndex || capsule.end == Skeleton::InvalidIndex)
+	{
+		Error("SpringBones: missing capsule bones " + bone + ", " + end);
+		return false;
+	}
+	m_capsules.push_back(capsule);
+	return true;
+}
+
+size_t SpringBones::GetChainCount() const
+{
+	return m_chains.size();
+}
+
+uint32_t SpringBones::Simulate(std::span<const IKCharacter> characters, float deltaSeconds)
+{
+	if (m_chains.empty() || deltaSeconds <= 0.0f)
+		return 0;
+
+	m_step++;
+	for (Slot& slot : m_slots)
+		slot.active = false;
+	m_groups.clear();
+	for (size_t i = 0; i < characters.size(); i++)
+	{
+		const IKCharacter& character = characters[i];
+		if (!character.instance || &character.instance->GetModel() != m_model || character.weight <= 0.0f)
+			continue;
+
+		auto [it, inserted] = m_slotIndices.try_emplace(character.instance, 0);
+		if (inserted)
+		{
+			if (!m_freeSlots.empty())
+			{
+				it->second = m_freeSlots.back();
+				m_freeSlots.pop_back();
+			}
+			else
+			{
+				it->second = static_cast<uint32_t>(m_slots.size());
+				m_slots.emplace_back();
+			}
+			m_slots[it->second].restart = true;
+		}
+		Slot& slot = m_slots[it->second];
+		slot.restart |= slot.lastStep + 1 != m_step;
+		slot.lastStep = m_step;
+		slot.character = i;
+		slot.active = true;
+		m_groups.push_back(it->second / LaneCount);
+	}
+	if (m_groups.empty())
+		return 0;
+	std::sort(m_groups.begin(), m_groups.end());
+	m_groups.erase(std::unique(m_groups.begin(), m_groups.end()), m_groups.end());
+	const size_t groupCount = (m_slots.size() + LaneCount - 1) / LaneCount;
+	if (m_state.size() < groupCount * m_groupStride)
+		m_state.resize(groupCount * m_groupStride, 0.0f);
+
+	// Verlet integration with a changing step: the velocity is the last move scaled to the new step
+	const float velocityScale = m_previousDelta > 0.0f ? std::min(deltaSeconds / m_previousDelta, 2.0f) : 1.0f;
+	m_previousDelta = deltaSeconds;
+
+	const Skeleton& skeleton = m_model->GetSkeleton();
+	std::atomic<uint32_t> simulated = 0;
+	JobSystem::ParallelFor(m_groups.size(), 4, [&](size_t begin, size_t end)
+		{
+			thread_local std::vector<float> capsules;
+			thread_local std::vector<float> animated;
+			thread_local std::vector<BonePose> modelPoses;
+			thread_local std::vector<glm::vec3> joints;
+			uint32_t chainCount = 0;
+			for (size_t g = begin; g < end; g++)
+			{
+				const uint32_t group = m_groups[g];
+				float* state = m_state.data() + group * m_groupStride;
+
+				Slot* lanes[LaneCount] = {};
+				glm::mat4 inverseWorld[LaneCount];
+				for (size_t lane = 0; lane < LaneCount; lane++)
+				{
+					const size_t slot = group * LaneCount + lane;
+					if (slot < m_slots.size() && m_slots[slot].active)
+					{
+						lanes[lane] = &m_slots[slot];
+						inverseWorld[lane] = glm::inverse(characters[m_slots[slot].character].world);
+					}
+				}
+
+				// world space capsules of the animated pose, before any chain moves
+				capsules.assign(m_capsules.size() * 6 * LaneCount, 0.0f);
+				for (size_t lane = 0; lane < LaneCount; lane++)
+				{
+					if (!lanes[lane])
+						continue;
+					const IKCharacter& character = characters[lanes[lane]->character];
+					const std::span<const BonePose> pose = character.instance->GetLocalPose();
+					for (size_t c = 0; c < m_capsules.size(); c++)
+					{
+						const glm::vec3 a = character.world * glm::vec4(skeleton.GetModelPose(pose, m_capsules[c].bone).position, 1.0f);
+						const glm::vec3 b = m_capsules[c].end != m_capsules[c].bone
+							? glm::vec3(character.world * glm::vec4(skeleton.GetModelPose(pose, m_capsules[c].end).position, 1.0f)) : a;
+						float* values = &capsules[c * 6 * LaneCount];
+						for (int axis = 0; axis < 3; axis++)
+						{
+							values[axis * LaneCount + lane] = a[axis];
+							values[(axis + 3) * LaneCount + lane] = b[axis];
+						}
+					}
+				}
+
+				for (const Chain& chain : m_chains)
+				{
+					const size_t jointCount = chain.bones.size();
+					float* chainState = state + chain.offset;
+					modelPoses.resize(jointCount * LaneCount);
+					joints.resize(jointCount);
+					animated.assign(jointCount * 3 * LaneCount, 0.0f);
+					for (size_t lane = 0; lane < LaneCount; lane++)
+					{
+						if (!lanes[lane])
+							continue;
+						const IKCharacter& character = characters[lanes[lane]->character];
+						GetChainModelPoses(skeleton, character.instance->GetLocalPose(), chain.bones, std::span(modelPoses).subspan(lane * jointCount, jointCount), joints);
+						for (size_t j = 0; j < jointCount; j++)
+						{
+							const glm::vec3 world = character.world * glm::vec4(joints[j], 1.0f);
+							float* joint = chainState + j * JointStride;
+							for (int axis = 0; axis < 3; axis++)
+							{
+								animated[(j * 3 + axis) * LaneCount + lane] = world[axis];
+								if (lanes[lane]->restart)
+									joint[axis * LaneCount + lane] = joint[(axis + 3) * LaneCount + lane] = world[axis];
+							}
+						}
+					}
+
+					// joint by joint from the root, every joint of the four lanes at once
+					const SpringChainSettings& settings = chain.settings;
+					const Lanes stiffness(settings.stiffness);
+					const Lanes keep((1.0f - settings.damping) * velocityScale);
+					const Lanes3 gravity = { Lanes(settings.gravity.x * deltaSeconds * deltaSeconds), Lanes(settings.gravity.y * deltaSeconds * deltaSeconds), Lanes(settings.gravity.z * deltaSeconds * deltaSeconds) };
+					Lanes3 parentAnimated = LoadLanes3(animated.data());
+					Lanes3 parent = parentAnimated;
+					StoreLanes3(parent, chainState);
+					StoreLanes3(parent, chainState + 3 * LaneCount);
+					for (size_t j = 1; j < jointCount; j++)
+					{
+						float* joint = chainState + j * JointStride;
+						const Lanes3 position = LoadLanes3(joint);
+						const Lanes3 previous = LoadLanes3(joint + 3 * LaneCount);
+						const Lanes3 jointAnimated = LoadLanes3(animated.data() + j * 3 * LaneCount);
+						const Lanes3 bone = jointAnimated - parentAnimated;
+
+						// the spring pulls towards the animated bone hanging from the simulated parent
+						Lanes3 next = position + (position - previous) * keep + (parent + bone - position) * stiffness + gravity;
+						for (size_t c = 0; c < m_capsules.size(); c++)
+						{
+							const float* values = &capsules[c * 6 * LaneCount];
+							next = PushOutOfCapsule(next, LoadLanes3(values), LoadLanes3(values + 3 * LaneCount), Lanes(m_capsules[c].radius + settings.radius));
+						}
+						next = parent + Normalize(next - parent) * Length(bone);
+
+						StoreLanes3(position, joint + 3 * LaneCount);
+						StoreLanes3(next, joint);
+						parent = next;
+						parentAnimated = jointAnimated;
+					}
+
+					for (size_t lane = 0; lane < LaneCount; lane++)
+					{
+						if (!lanes[lane])
+							continue;
+						const IKCharacter& character = characters[lanes[lane]->character];
+						const float weight = std::min(character.weight, 1.0f);
+						for (size_t j = 0; j < jointCount; j++)
+						{
+							const float* joint = chainState + j * JointStride;
+							glm::vec3 world;
+							for (int axis = 0; axis < 3; axis++)
+								world[axis] = glm::mix(animated[(j * 3 + axis) * LaneCount + lane], joint[axis * LaneCount + lane], weight);
+							joints[j] = inverseWorld[lane] * glm::vec4(world, 1.0f);
+						}
+						ApplyFABRIK(character.instance->GetLocalPose(), chain.bones, std::span(modelPoses).subspan(lane * jointCount, jointCount), joints);
+						chainCount++;
+					}
+				}
+
+				for (Slot* slot : lanes)
+				{
+					if (slot) slot->restart = false;
+				}
+			}
+			simulated += chainCount;
+		});
+	return simulated;
+}
+
+void SpringBones::Reset(const ModelInstance& instance)
+{
+	auto it = m_slotIndices.find(&instance);
+	if (it == m_slotIndices.end())
+		return;
+	m_slots[it->second].active = false;
+	m_freeSlots.push_back(it->second);
+	m_slotIndices.erase(it);
+}
+
+void SpringBones::Clear()
+{
+	m_state.clear();
+	m_slotIndices.clear();
+	m_slots.clear();
+	m_freeSlots.clear();
+	m_groups.clear();
+	m_previousDelta = 0.0f;
+}
+
+bool SpringBones::overlaps(uint32_t bone) const
+{
+	for (const Chain& chain : m_chains)
+	{
+		if (std::find(chain.bones.begin(), chain.bones.end(), bone) != chain.bones.end())
+			return true;
+	}
+	return false;
+}
+
+#pragma endregion
+
+#pragma endregion
+
+//==============================================================================
+// Scene
+//==============================================================================
+#pragma region Scene
+
+#pragma region QuadShape
+
+QuadShape::QuadShape()
+{
+	m_vao = std::make_shared<GLVertexArray>(getData(), GetMeshVertexFormat());
+}
+
+void QuadShape::Draw()
+{
+	m_vao->DrawTriangles();
+}
+
+std::vector<MeshVertex> QuadShape::getData()
+{
+	// TODO: указать правильный Tangent
+	return
+	{
+		// Positions            // Color            // Normals          // Texcoords  // Tangent
+		{ {1.0f,  0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
+		{ {-1.0f, 0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
+		{ {-1.0f, 0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 1.0f}, {0.0f, 0.0f, 0.0f} },
+		{ {1.0f,  0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
+		{ {-1.0f, 0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 1.0f}, {0.0f, 0.0f, 0.0f} },
+		{ {1.0f,  0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 0.0f, 0.0f} }
+	};
+}
+
+#pragma endregion
+
+#pragma region CubeShape
+
+CubeShape::CubeShape()
+{
+	m_vao = std::make_shared<GLVertexArray>(getData(), GetMeshVertexFormat());
+}
+
+void CubeShape::Draw()
+{
+	m_vao->DrawTriangles();
+}
+
+std::vector<MeshVertex> CubeShape::getData()
+{
+
+
+
+
+	// TODO: указать правильный Tangent
+	return
+	{
+		// Positions              // Color            // Normals              // Texcoords   // Tangent
+		// Back face
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 0.0f} }, // bottom-left
+		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 1.0f} }, // top-right
+		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 0.0f} }, // bottom-right
+		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 1.0f} }, // top-right
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 0.0f} }, // bottom-left
+		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 1.0f} }, // top-left
+		// Front face
+		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 0.0f} }, // bottom-left
+		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 0.0f} }, // bottom-right
+		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 1.0f} }, // top-right
+		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 1.0f} }, // top-right
+		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 1.0f} }, // top-left
+		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 0.0f} }, // bottom-left
+		// Left face
+		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-right
+		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 1.0f} }, // top-left
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-left
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-left
+		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-right
+		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-right
+		// Right face
+		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-left
+		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-right
+		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 1.0f} }, // top-right
+		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-right
+		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-left
+		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-left
+		// Bottom face
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-right
+		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 1.0f} }, // top-left
+		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-left
+		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-left
+		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-right
+		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-right
+		// Top face
+		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-left
+		{ { 1.0f,  1.0f , 1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-right
+		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 1.0f} }, // top-right
+		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-right
+		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-left
+		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 0.0f} }  // bottom-left
+	};
+}
+
+#pragma endregion
+
+#pragma region SphereShape
+
+SphereShape::SphereShape()
+{
+	std::vector<MeshVertex> vertices;
+	std::vector<uint16_t> indices;
+
+	constexpr unsigned int X_SEGMENTS = 64;
+	constexpr unsigned int Y_SEGMENTS = 64;
+	const float PI = glm::pi<float>();
+	for (unsigned int x = 0; x <= X_SEGMENTS; ++x)
+	{
+		for (unsigned int y = 0; y <= Y_SEGMENTS; ++y)
+		{
+			float xSegment = (float)x / (float)X_SEGMENTS;
+			float ySegment = (float)y / (float)Y_SEGMENTS;
+			float xPos = std::cos(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
+			float yPos = std::cos(ySegment * PI);
+			float zPos = std::sin(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
+
+			MeshVertex vertex;
+			vertex.position = glm::vec3(xPos, yPos, zPos);
+			vertex.color = glm::vec3(1.0f, 1.0f, 1.0f);
+			vertex.normal = glm::vec3(xPos, yPos, zPos);
+			vertex.texCoords = glm::vec2(xSegment, ySegment);
+			vertex.tangent = glm::vec3(0.0f); // TODO: исправить правильный tangent
+			vertices.emplace_back(vertex);
+		}
+	}
+
+	bool oddRow = false;
+	for (unsigned int y = 0; y < Y_SEGMENTS; ++y)
+	{
+		if (!oddRow) // even rows: y == 0, y == 2; and so on
+		{
+			for (unsigned int x = 0; x <= X_SEGMENTS; ++x)
+			{
+				indices.push_back(y * (X_SEGMENTS + 1) + x);
+				indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
+			}
+		}
+		else
+		{
+			for (int x = X_SEGMENTS; x >= 0; --x)
+			{
+				indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
+				indices.push_back(y * (X_SEGMENTS + 1) + x);
+			}
+		}
+		oddRow = !oddRow;
+	}
+
+	m_vao = std::make_shared<GLVertexArray>(vertices, indices, GetMeshVertexFormat());
+}
+
+void SphereShape::Draw()
+{
+	m_vao->DrawTriangles();
+}
+
+#pragma endregion
+
+#pragma region Camera
+
+void Camera::Set(glm::vec3 Position, glm::vec3 Up, float Yaw, float Pitch)
+{
+	position = Position;
+	front = CAMERA_FRONT;
+	up = CAMERA_UP;
+	right = CAMERA_RIGHT;
+	worldUp = Up;
+	yaw = Yaw;
+	pitch = Pitch;
+	update();
+}
+
+void Camera::Move(MovementDir direction, float deltaTime)
+{
+	const float velocity = movementSpeed * deltaTime;
+	if (direction == Forward) position += front * velocity;
+	else if (direction == Backward) position -= front * velocity;
+	else if (direction == Left) position -= right * velocity;
+	else if (direction == Right) position += right * velocity;
+	update();
+}
+
+void Camera::Rotate(float xOffset, float yOffset)
+{
+	xOffset *= mouseSensitivity;
+	yOffset *= mouseSensitivity;
+
+	yaw += xOffset;
+	pitch += yOffset;
+
+	if (pitch > 89.0f) pitch = 89.0f;
+	else if (pitch < -89.0f) pitch = -89.0f;
+	update();
+}
+
+const glm::mat4& Camera::GetViewMatrix() const
+{
+	return m_view;
+}
+
+void Camera::update()
+{
+	front = glm::normalize(
+		glm::vec3
+		(
+			cos(glm::radians(yaw)) * cos(glm::radians(pitch)), // x
+			sin(glm::radians(pitch)), // y
+			sin(glm::radians(yaw)) * cos(glm::radians(pitch)) // z
+		)
+	);
+
+	right = glm::normalize(glm::cross(front, worldUp));
+	up = glm::normalize(glm::cross(right, front));
+
+	m_view = glm::lookAt(position, position + front, up);
+}
+
+#pragma endregion
+
+#pragma endregion
+
+//==============================================================================
+// ECS
+//==============================================================================
+#pragma region ECS
+
+namespace
+{
+	// written once per type under the mutex, the id is published only after its info is stored
+	std::mutex componentTypesMutex;
+	std::array<ComponentTypeInfo, ECS_MAX_COMPONENT_TYPES> componentTypes;
+	uint32_t componentTypeCount = 0;
+}
+
+ComponentTypeId RegisterComponentType(size_t size, size_t alignment)
+{
+	std::lock_guard<std::mutex> lock(componentTypesMutex);
+	if (componentTypeCount >= ECS_MAX_COMPONENT_TYPES)
+	{
+		Fatal("ECS: too many component types (max " + std::to_string(ECS_MAX_COMPONENT_TYPES) + ")");
+		return ECS_MAX_COMPONENT_TYPES - 1;
+	}
+	if (alignment > 64)
+		Error("ECS: component alignment " + std::to_string(alignment) + " is larger than the chunk alignment");
+
+	componentTypes[componentTypeCount] = { size, alignment };
+	return componentTypeCount++;
+}
+
+const ComponentTypeInfo& GetComponentTypeInfo(ComponentTypeId type)
+{
+	return componentTypes[type];
+}
+
+#pragma region Archetype
+
+Archetype::Archetype(ComponentMask mask) : m_mask(mask)
+{
+	size_t rowSize = sizeof(Entity);
+	for (ComponentMask bits = mask; bits; bits &= bits - 1)
+		rowSize += GetComponentTypeInfo(static_cast<ComponentTypeId>(std::countr_zero(bits))).size;
+
+	// shrink the capacity until every array fits into the chunk together with its alignment padding
+	for (m_capacity = static_cast<uint32_t>(ECS_CHUNK_SIZE / rowSize); m_capacity > 0; m_capacity--)
+	{
+		size_t offset = sizeof(Entity) * m_capacity;
+		for (ComponentMask bits = mask; bits; bits &= bits - 1)
+		{
+			const ComponentTypeId type = static_cast<ComponentTypeId>(std::countr_zero(bits));
+			const ComponentTypeInfo& info = GetComponentTypeInfo(type);
+			offset = RoundUp(offset, info.alignment);
+			m_offsets[type] = static_cast<uint32_t>(offset);
+			offset += info.size * m_capacity;
+		}
+		if (offset <= ECS_CHUNK_SIZE)
+			break;
+	}
+
+	if (m_capacity == 0)
+	{
+		Fatal("ECS: archetype components do not fit into a " + std::to_string(ECS_CHUNK_SIZE) + " byte chunk");
+		m_capacity = 1;
+	}
+}
+
+std::pair<uint32_t, uint32_t> Archetype::Allocate(Entity entity)
+{
+	const uint32_t chunk = static_cast<uint32_t>(m_entityCount / m_capacity);
+	const uint32_t row = static_cast<uint32_t>(m_entityCount % m_capacity);
+	// empty chunks are kept after Free and reused here
+	if (chunk == m_chunks.size())
+		m_chunks.push_back(std::make_unique<ChunkStorage>());
+
+	GetEntities(chunk)[row] = entity;
+	m_entityCount++;
+	return { chunk, row };
+}
+
+Entity Archetype::Free(uint32_t chunk, uint32_t row)
+{
+	assert(m_entityCount > 0);
+	m_entityCount--;
+	const uint32_t lastChunk = static_cast<uint32_t>(m_entityCount / m_capacity);
+	const uint32_t lastRow = static_cast<uint32_t>(m_entityCount % m_capacity);
+	if (chunk == lastChunk && row == lastRow)
+		return Entity{};
+
+	const Entity moved = GetEntities(lastChunk)[lastRow];
+	GetEntities(chunk)[row] = moved;
+	for (ComponentMask bits = m_mask; bits; bits &= bits - 1)
+	{
+		const ComponentTypeId type = static_cast<ComponentTypeId>(std::countr_zero(bits));
+		const size_t size = GetComponentTypeInfo(type).size;
+		std::memcpy(
+			static_cast<std::byte*>(GetComponents(chunk, type)) + size * row,
+			static_cast<std::byte*>(GetComponents(lastChunk, type)) + size * lastRow,
+			size);
+	}
+	return moved;
+}
+
+#pragma endregion
+
+#pragma region World
+
+Entity World::Create()
+{
+	uint32_t index = 0;
+	if (!m_freeIndices.empty())
+	{
+		index = m_freeIndices.back();
+		m_freeIndices.pop_back();
+	}
+	else
+	{
+		index = static_cast<uint32_t>(m_entities.size());
+		m_entities.emplace_back();
+	}
+
+	Archetype* archetype = getOrCreateArchetype(0);
+	EntityRecord& record = m_entities[index];
+	const Entity entity{ index, record.generation };
+	record.archetype = archetype;
+	std::tie(record.chunk, record.row) = archetype->Allocate(entity);
+	m_aliveCount++;
+	return entity;
+}
+
+void World::Destroy(Entity entity)
+{
+	if (!IsAlive(entity)) return;
+
+	EntityRecord& record = m_entities[entity.index];
+	const Entity moved = record.archetype->Free(record.chunk, record.row);
+	if (moved != Entity{})
+	{
+		m_entities[moved.index].chunk = record.chunk;
+		m_entities[moved.index].row = record.row;
+	}
+	record.archetype = nullptr;
+	record.generation++;
+	m_freeIndices.push_back(entity.index);
+	m_aliveCount--;
+}
+
+bool World::IsAlive(Entity entity) const
+{
+	return entity.index < m_entities.size()
+		&& m_entities[entity.index].archetype
+		&& m_entities[entity.index].generation == entity.generation;
+}
+
+size_t World::GetEntityCount() const
+{
+	return m_aliveCount;
+}
+
+Archetype* World::getOrCreateArchetype(ComponentMask mask)
+{
+	auto it = m_archetypes.find(mask);
+	if (it != m_archetypes.end())
+		return it->second.get();
+
+	Archetype* archetype = new Archetype(mask);
+	m_archetypes.emplace(mask, std::unique_ptr<Archetype>(archetype));
+	m_archetypeList.push_back(archetype);
+	return archetype;
+}
+
+void World::moveEntity(Entity entity, ComponentMask newMask)
+{
+	Archetype* target = getOrCreateArchetype(newMask);
+	EntityRecord& record = m_entities[entity.index];
+	Archetype* source = record.archetype;
+	if (source == target) return;
+
+	const auto [chunk, row] = target->Allocate(entity);
+	for (ComponentMask bits = source->GetMask() & newMask; bits; bits &= bits - 1)
+	{
+		const ComponentTypeId type = static_cast<ComponentTypeId>(std::countr_zero(bits));
+		const size_t size = GetComponentTypeInfo(type).size;
+		std::memcpy(
+			static_cast<std::byte*>(target->GetComponents(chunk, type)) + size * row,
+			static_cast<std::byte*>(source->GetComponents(record.chunk, type)) + size * record.row,
+			size);
+	}
+
+	const Entity moved = source->Free(record.chunk, record.row);
+	if (moved != Entity{})
+	{
+		m_entities[moved.index].chunk = record.chunk;
+		m_entities[moved.index].row = record.row;
+	}
+	record.archetype = target;
+	record.chunk = chunk;
+	record.row = row;
+}
+
+void* World::getComponent(Entity entity, ComponentTypeId type)
+{
+	if (!IsAlive(entity)) return nullptr;
+
+	const EntityRecord& record = m_entities[entity.index];
+	if (!(record.archetype->GetMask() & (ComponentMask(1) << type)))
+		return nullptr;
+	return static_cast<std::byte*>(record.archetype->GetComponents(record.chunk, type)) + GetComponentTypeInfo(type).size * record.row;
+}
+
+const std::vector<Archetype*>& World::query(ComponentMask mask)
+{
+	// archetypes are never removed, so the cache only has to look at the ones created since the last query
+	QueryCache& cache = m_queries[mask];
+	for (; cache.archetypeCount < m_archetypeList.size(); cache.archetypeCount++)
+	{
+		Archetype* archetype = m_archetypeList[cache.archetypeCount];
+		if ((archetype->GetMask() & mask) == mask)
+			cache.archetypes.push_back(archetype);
+	}
+	return cache.archetypes;
+}
+
+#pragma endregion
+
+#pragma region Systems
+
+void Systems::UpdateTransforms(World& world)
+{
+	world.ParallelEachChunk<TransformComponent, WorldMatrixComponent>(
+		[](size_t count, Entity*, TransformComponent* transforms, WorldMatrixComponent* matrices)
+		{
+			for (size_t i = 0; i < count; i++)
+				matrices[i].world = ComposeTRS(transforms[i].position, transforms[i].orientation, transforms[i].scale);
+		});
+}
+
+void Systems::UpdateBounds(World& world)
+{
+	world.ParallelEachChunk<WorldMatrixComponent, BoundsComponent>(
+		[](size_t count, Entity*, WorldMatrixComponent* matrices, BoundsComponent* bounds)
+		{
+			for (size_t i = 0; i < count; i++)
+				bounds[i].world = bounds[i].local.GetTransformed(matrices[i].world);
+		});
+}
+
+void Systems::UpdateVisibility(World& world, const Frustum& frustum)
+{
+	world.ParallelEachChunk<BoundsComponent, VisibilityComponent>(
+		[&frustum](size_t count, Entity*, BoundsComponent* bounds, VisibilityComponent* visibility)
+		{
+			for (size_t i = 0; i < count; i++)
+				visibility[i].visible = frustum.Intersects(bounds[i].world);
+		});
+}
+
+void Systems::UpdateAnimations(World& world)
+{
+	world.ParallelEachChunk<AnimatorComponent>(
+		[](size_t count, Entity*, AnimatorComponent* animators)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				if (animators[i].instance) animators[i].instance->Update();
+				else if (animators[i].model) animators[i].model->UpdateAnim();
+			}
+		});
+}
+
+AnimationLODStats Systems::UpdateAnimations(World& world, const AnimationLODSettings& settings)
+{
+	std::atomic<uint32_t> fullRate = 0, reducedRate = 0, culled = 0, evaluatedBones = 0;
+	world.ParallelEachChunk<AnimatorComponent, BoundsComponent, VisibilityComponent>(
+		[&](size_t count, Entity*, AnimatorComponent* animators, BoundsComponent* bounds, VisibilityComponent* visibility)
+		{
+			AnimationLODStats chunk;
+			for (size_t i = 0; i < count; i++)
+			{
+				uint32_t interval = 0;
+				if (visibility[i].visible)
+				{
+					const float radius = glm::length(bounds[i].world.GetHalfSize());
+					const float distance = std::max(glm::distance(bounds[i].world.GetCenter(), settings.cameraPosition), 0.001f);
+					const float screenSize = radius * settings.projectionScale / distance;
+					interval = screenSize >= settings.fullRateScreenSize ? 1 : (screenSize >= settings.halfRateScreenSize ? 2 : 4);
+				}
+				(interval == 0 ? chunk.culled : (interval == 1 ? chunk.fullRate : chunk.reducedRate))++;
+
+				if (animators[i].instance)
+					chunk.evaluatedBones += animators[i].instance->Update(interval);
+				else if (animators[i].model && interval > 0)
+				{
+					// a Model plays on its own clock, skipped frames need no catch-up
+					animators[i].model->UpdateAnim();
+					chunk.evaluatedBones += static_cast<uint32_t>(animators[i].model->GetBoneCount());
+				}
+			}
+			fullRate += chunk.fullRate;
+			reducedRate += chunk.reducedRate;
+			culled += chunk.culled;
+			evaluatedBones += chunk.evaluatedBones;
+		});
+	return { fullRate, reducedRate, culled, evaluatedBones };
+}
+
+void Systems::UpdateAnimatedBounds(World& world)
+{
+	world.ParallelEachChunk<AnimatorComponent, BoundsComponent>(
+		[](size_t count, Entity*, AnimatorComponent* animators, BoundsComponent* bounds)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				if (animators[i].instance) bounds[i].local = animators[i].instance->GetBounding();
+				else if (animators[i].model) bounds[i].local = animators[i].model->GetAnimatedBounding();
+			}
+		});
+}
+
+void Systems::SubmitDraws(World& world, std::vector<DrawItem>& drawList)
+{
+	size_t capacity = 0;
+	world.EachChunk<WorldMatrixComponent, RenderComponent, VisibilityComponent>(
+		[&capacity](size_t count, Entity*, WorldMatrixComponent*, RenderComponent*, VisibilityComponent*) { capacity += count; });
+	drawList.resize(capacity);
+
+	std::atomic<size_t> drawCount = 0;
+	world.ParallelEachChunk<WorldMatrixComponent, RenderComponent, VisibilityComponent>(
+		[&](size_t count, Entity*, WorldMatrixComponent* matrices, RenderComponent* renders, VisibilityComponent* visibility)
+		{
+			// one atomic add per chunk reserves a contiguous range of the draw list
+			size_t visibleCount = 0;
+			for (size_t i = 0; i < count; i++)
+				visibleCount += (visibility[i].visible && renders[i].model) ? 1 : 0;
+
+			size_t index = drawCount.fetch_add(visibleCount, std::memory_order_relaxed);
+			for (size_t i = 0; i < count; i++)
+			{
+				if (!visibility[i].visible || !renders[i].model)
+					continue;
+				const ModelInstance* instance = renders[i].instance;
+				drawList[index++] = {
+					renders[i].model, matrices[i].world,
+					instance ? instance->GetPalette() : renders[i].model->GetPalette(),
+					instance ? instance->GetPreviousPalette() : renders[i].model->GetPreviousPalette(),
+					instance ? instance->GetMorphWeights() : renders[i].model->GetMorphWeights() };
+			}
+		});
+	drawList.resize(drawCount);
+
+	std::sort(drawList.begin(), drawList.end(), [](const DrawItem& a, const DrawItem& b) { return std::less<Model*>()(a.model, b.model); });
+}
+
+void Systems::SwitchVertexAnimations(World& world, const VertexAnimationSwitchSettings& settings)
+{
+	// structural changes are not allowed inside a query, the switches are applied afterwards
+	std::vector<Entity> switches;
+	const float bakeDistance = settings.distance * (1.0f + settings.hysteresis);
+	const float skeletalDistance = settings.distance * (1.0f - settings.hysteresis);
+	world.Each<WorldMatrixComponent, VertexAnimationComponent>(
+		[&](Entity entity, WorldMatrixComponent& matrix, VertexAnimationComponent& component)
+		{
+			if (!component.animation || !component.animation->IsValid() || !component.instance)
+				return;
+			const float distance = glm::distance(glm::vec3(matrix.world[3]), settings.cameraPosition);
+			if (component.baked ? distance < skeletalDistance : distance > bakeDistance)
+				switches.push_back(entity);
+		});
+
+	for (const Entity entity : switches)
+	{
+		// a copy, adding and removing components moves the entity
+		VertexAnimationComponent component = *world.Get<VertexAnimationComponent>(entity);
+		ModelInstance& instance = *component.instance;
+		const VertexAnimation& animation = *component.animation;
+
+		// the baked clip continues from the clip time of the instance and the other way round, both loop
+		const Animation* clip = instance.GetAnimation().get();
+		const uint32_t bakedClip = clip ? animation.FindClip(clip) : VertexAnimation::InvalidClip;
+		if (!component.baked)
+		{
+			if (bakedClip != VertexAnimation::InvalidClip)
+			{
+				component.clip = bakedClip;
+				component.timeOffset = instance.GetAnimationTime() / clip->GetTPS() - settings.time * component.speed;
+			}
+			world.Remove<RenderComponent>(entity);
+			world.Remove<AnimatorComponent>(entity);
+			// baked playback is not evaluated on the CPU, the bounds cover the whole clip
+			if (BoundsComponent* bounds = world.Get<BoundsComponent>(entity))
+				bounds->local = animation.GetClipBounding(component.clip);
+		}
+		else
+		{
+			if (bakedClip == component.clip)
+			{
+				const float duration = animation.GetClipDuration(component.clip);
+				const float time = std::fmod(settings.time * component.speed + component.timeOffset, duration);
+				instance.SetAnimationTime((time < 0.0f ? time + duration : time) * clip->GetTPS());
+			}
+			world.Add(entity, RenderComponent{ &instance.GetModel(), &instance });
+			world.Add(entity, AnimatorComponent{ &instance.GetModel(), &instance });
+		}
+		component.baked = !component.baked;
+		*world.Get<VertexAnimationComponent>(entity) = component;
+	}
+}
+
+void Systems::SubmitVertexAnimations(World& world, std::vector<VertexAnimationItem>& drawList)
+{
+	drawList.clear();
+	world.EachChunk<WorldMatrixComponent, VertexAnimationComponent, VisibilityComponent>(
+		[&drawList](size_t count, Entity*, WorldMatrixComponent* matrices, VertexAnimationComponent* animations, VisibilityComponent* visibility)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				if (animations[i].baked && visibility[i].visible)
+					drawList.push_back({ animations[i].animation, matrices[i].world, animations[i].clip, animations[i].timeOffset, animations[i].speed });
+			}
+		});
+
+	std::sort(drawList.begin(), drawList.end(),
+		[](const VertexAnimationItem& a, const VertexAnimationItem& b) { return std::less<const VertexAnimation*>()(a.animation, b.animation); });
+}
+
+void AnimationWorld::Add(ModelInstance& instance, const glm::mat4& world)
+{
+	if (m_indices.contains(&instance))
+	{
+		Warning("AnimationWorld: instance already added");
+		return;
+	}
+	m_indices[&instance] = m_entries.size();
+	m_entries.push_back({ &instance, world, 1 });
+	m_sorted = false;
+}
+
+void AnimationWorld::Remove(ModelInstance& instance)
+{
+	auto it = m_indices.find(&instance);
+	if (it == m_indices.end())
+		return;
+
+	const size_t index = it->second;
+	m_indices.erase(it);
+	if (index + 1 != m_entries.size())
+	{
+		m_entries[index] = m_entries.back();
+		m_indices[m_entries[index].instance] = index;
+		m_sorted = false;
+	}
+	m_entries.pop_back();
+}
+
+void AnimationWorld::Clear()
+{
+	m_entries.clear();
+	m_indices.clear();
+	m_drawItems.clear();
+	m_sorted = true;
+}
+
+void AnimationWorld::SetTransform(ModelInstance& instance, const glm::mat4& world)
+{
+	if (Entry* entry = find(instance)) entry->world = world;
+}
+
+void AnimationWorld::SetInterval(ModelInstance& instance, uint32_t interval)
+{
+	if (Entry* entry = find(instance)) entry->interval = interval;
+}
+
+void AnimationWorld::SetGrainSize(size_t grainSize)
+{
+	m_grainSize = std::max<size_t>(grainSize, 1);
+}
+
+void AnimationWorld::SetPoseStage(std::function<void(std::span<const IKCharacter>)> stage)
+{
+	m_poseStage = std::move(stage);
+}
+
+AnimationLODStats AnimationWorld::Update()
+{
+	return Update(m_clock.Restart().AsSeconds());
+}
+
+AnimationLODStats AnimationWorld::Update(float deltaSeconds)
+{
+	if (!m_sorted)
+	{
+		std::sort(m_entries.begin(), m_entries.end(), [](const Entry& a, const Entry& b) { return std::less<Model*>()(&a.instance->GetModel(), &b.instance->GetModel()); });
+		for (size_t i = 0; i < m_entries.size(); i++)
+			m_indices[m_entries[i].instance] = i;
+		m_sorted = true;
+	}
+
+	// with a pose stage the instances are sampled first and evaluated after the stage, otherwise in one pass
+	if (m_poseStage)
+	{
+		JobSystem::ParallelFor(m_entries.size(), m_grainSize, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+					m_entries[i].instance->Advance(deltaSeconds, m_entries[i].interval);
+			});
+		m_posed.clear();
+		for (const Entry& entry : m_entries)
+		{
+			if (entry.interval != 0)
+				m_posed.push_back({ entry.instance, entry.world, 1.0f });
+		}
+		m_poseStage(m_posed);
+	}
+
+	// every instance writes only its own draw item, culled ones leave a null model that is removed afterwards
+	m_drawItems.resize(m_entries.size());
+	std::atomic<uint32_t> fullRate = 0, reducedRate = 0, culled = 0, evaluatedBones = 0;
+	const bool advanced = static_cast<bool>(m_poseStage);
+	JobSystem::ParallelFor(m_entries.size(), m_grainSize, [&](size_t begin, size_t end)
+		{
+			AnimationLODStats range;
+			for (size_t i = begin; i < end; i++)
+			{
+				const Entry& entry = m_entries[i];
+				ModelInstance& instance = *entry.instance;
+				if (!advanced)
+					range.evaluatedBones += instance.Update(deltaSeconds, entry.interval);
+				else if (entry.interval != 0)
+					range.evaluatedBones += instance.Evaluate();
+				(entry.interval == 0 ? range.culled : (entry.interval == 1 ? range.fullRate : range.reducedRate))++;
+				m_drawItems[i] = entry.interval == 0
+					? DrawItem{}
+					: DrawItem{ &instance.GetModel(), entry.world, instance.GetPalette(), instance.GetPreviousPalette(), instance.GetMorphWeights() };
+			}
+			fullRate += range.fullRate;
+			reducedRate += range.reducedRate;
+			culled += range.culled;
+			evaluatedBones += range.evaluatedBones;
+		});
+	if (culled > 0)
+		std::erase_if(m_drawItems, [](const DrawItem& item) { return item.model == nullptr; });
+
+	return { fullRate, reducedRate, culled, evaluatedBones };
+}
+
+std::span<const DrawItem> AnimationWorld::GetDrawItems() const
+{
+	return m_drawItems;
+}
+
+size_t AnimationWorld::GetInstanceCount() const
+{
+	return m_entries.size();
+}
+
+AnimationWorld::Entry* AnimationWorld::find(const ModelInstance& instance)
+{
+	auto it = m_indices.find(&instance);
+	return it != m_indices.end() ? &m_entries[it->second] : nullptr;
+}
+
+// std430 layouts of DrawInstance, SkinnedVertex and VertexAnimationRenderer::Clip
+constexpr const char* DrawInstanceShaderSource = R"(
+struct DrawInstance
+{
+	mat4 world;
+	uint paletteBase;
+	uint boneCount;
+	uint previousPaletteBase;
+	uint skinnedBase;
+	uint skin;
+	uint vertexAnimationClip;
+	float vertexAnimationTime;
+	float vertexAnimationSpeed;
+};
+struct SkinnedVertex
+{
+	vec4 position;
+	vec4 previousPosition;
+	vec4 normal;
+	vec4 tangent;
+};
+struct VertexAnimationClip
+{
+	uint firstRow;
+	uint frameCount;
+	float framesPerSecond;
+	float padding;
+};
+)";
+
+// The buffers of DrawBatcher and VertexAnimationRenderer as seen by a vertex shader, after DrawInstanceShaderSource.
+// Needs the ids and weights vertex inputs.
+constexpr const char* DrawInstanceVertexShaderSource = R"(
+layout (std430, binding = 2) readonly buffer SkinnedVertices
+{
+	SkinnedVertex skinned[];
+};
+uniform uint uMeshVertexOffset;
+layout (std430, binding = 1) readonly buffer DrawInstances
+{
+	DrawInstance instances[];
+};
+// skinning matrices of all instances, each starts at its paletteBase
+layout (std430, binding = 0) readonly buffer BonePalettes
+{
+	mat4 pose[];
+};
+
+// baked playback instead of skinning, see VertexAnimationRenderer: 1 skinned vertices, 2 skinning matrices
+uniform int uVertexAnimation;
+uniform float uVertexAnimationTime;
+uniform uint uVertexAnimationRowsPerFrame;
+layout (std430, binding = 3) readonly buffer VertexAnimationClips
+{
+	VertexAnimationClip clips[];
+};
+layout (binding = 8) uniform sampler2D VertexAnimationData;
+layout (binding = 9) uniform sampler2D VertexAnimationNormals;
+
+vec4 vertexAnimationTexel(sampler2D data, uint index, uint row)
+{
+	const uint width = uint(textureSize(data, 0).x);
+	return texelFetch(data, ivec2(index % width, row + index / width), 0);
+}
+
+mat4 vertexAnimationBone(uint bone, uint row)
+{
+	// three rows of the affine matrix per bone
+	return transpose(mat4(
+		texelFetch(VertexAnimationData, ivec2(bone * 3u, row), 0),
+		texelFetch(VertexAnimationData, ivec2(bone * 3u + 1u, row), 0),
+		texelFetch(VertexAnimationData, ivec2(bone * 3u + 2u, row), 0),
+		vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
+// the vertex at the playback time of the instance, blended between the two nearest baked frames
+void vertexAnimation(DrawInstance instance, inout vec4 pos, inout vec3 normal)
+{
+	const VertexAnimationClip clip = clips[instance.vertexAnimationClip];
+	const float frame = mod((uVertexAnimationTime * instance.vertexAnimationSpeed + instance.vertexAnimationTime) * clip.framesPerSecond, float(clip.frameCount));
+	const uint frame0 = min(uint(frame), clip.frameCount - 1u);
+	const uint row0 = clip.firstRow + frame0 * uVertexAnimationRowsPerFrame;
+	const uint row1 = clip.firstRow + ((frame0 + 1u) % clip.frameCount) * uVertexAnimationRowsPerFrame;
+	const float blend = frame - float(frame0);
+
+	if (uVertexAnimation == 1)
+	{
+		const uint vertex = uMeshVertexOffset + uint(gl_VertexID);
+		pos = mix(vertexAnimationTexel(VertexAnimationData, vertex, row0), vertexAnimationTexel(VertexAnimationData, vertex, row1), blend);
+		normal = mix(vertexAnimationTexel(VertexAnimationNormals, vertex, row0).xyz, vertexAnimationTexel(VertexAnimationNormals, vertex, row1).xyz, blend);
+		return;
+	}
+
+	mat4 transform = mat4(0.0);
+	float totalWeight = 0.0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (weights[i] <= 0.0)
+			continue;
+		transform += mix(vertexAnimationBone(uint(ids[i]), row0), vertexAnimationBone(uint(ids[i]), row1), blend) * weights[i];
+		totalWeight += weights[i];
+	}
+	if (totalWeight > 0.0)
+	{
+		pos = transform * pos;
+		normal = mat3(transform) * normal;
+	}
 }
 
-void Model::processMatProperties(const aiMesh* mesh, const aiScene* scene, MaterialProperties& meshMatProperties)
+// the blended skinning matrix of the vertex, identity when it has no weights
+mat4 paletteSkinning(uint paletteBase)
 {
-	aiMaterial* pAiMat = scene->mMaterials[mesh->mMaterialIndex];
-	aiColor3D AmbientColor, DiffuseColor, SpecularColor;
-	float Shininess = 0.0f, Refracti = 0.0f;
-	pAiMat->Get(AI_MATKEY_COLOR_AMBIENT, AmbientColor);
-	pAiMat->Get(AI_MATKEY_COLOR_DIFFUSE, DiffuseColor);
-	pAiMat->Get(AI_MATKEY_COLOR_SPECULAR, SpecularColor);
-	pAiMat->Get(AI_MATKEY_SHININESS, Shininess);
-	pAiMat->Get(AI_MATKEY_REFRACTI, Refracti);
-	meshMatProperties.diffuseColor = { DiffuseColor.r, DiffuseColor.g, DiffuseColor.b };
-	meshMatProperties.ambientColor = { AmbientColor.r, AmbientColor.g, AmbientColor.b };
-	meshMatProperties.specularColor = { SpecularColor.r, SpecularColor.g, SpecularColor.b };
-	meshMatProperties.shininess = Shininess;
-	meshMatProperties.refracti = Refracti;
+	mat4 transform = mat4(0.0);
+	float totalWeight = 0.0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (weights[i] <= 0.0)
+			continue;
+		transform += pose[paletteBase + uint(ids[i])] * weights[i];
+		totalWeight += weights[i];
+	}
+	return totalWeight > 0.0 ? transform : mat4(1.0);
 }
+)";
 
-void Model::computeAABB()
+std::string_view GetDrawInstanceShaderSource()
 {
-	for (size_t i = 0; i < m_meshes.size(); ++i)
-		m_bounding.Combine(m_meshes[i]->GetBounding());
+	return DrawInstanceShaderSource;
 }
 
-void Model::calculatePose(Bone* bone)
+std::string_view GetDrawInstanceVertexShaderSource()
 {
-	auto it = std::find_if(m_bones.begin(), m_bones.end(), [&](auto b) { return b.get() == bone; });
-	auto it1 = std::find_if(m_bonesChildren.begin(), m_bonesChildren.end(), [&](auto b) { return b.get() == bone; });
-	if (it == m_bones.end() && it1 == m_bonesChildren.end())
-		return;
-
-	Transform tmp = m_transform;
-	m_transform = Transform{};
-
-	auto finalTransform = Node::GetFinalTransform(bone) * bone->GetTransform();
+	static const std::string source = std::string(DrawInstanceShaderSource) + DrawInstanceVertexShaderSource;
+	return source;
+}
 
-	glm::mat4 finaltr(1.0);
-	finaltr = glm::translate(finaltr, finalTransform.GetPosition());
-	finaltr = finaltr * glm::toMat4(finalTransform.GetOrientation());
-	finaltr = glm::scale(finaltr, bone->GetSize());
+// Reads MeshVertex as floats, the offsets are prepended as defines. Runs over (vertex, instance of the run) for one mesh.
+// With MORPH_TARGETS it runs over (moved vertex, instance of the run) instead and skins the morphed vertex again.
+constexpr const char* SkinningShaderSource = R"(
+layout (local_size_x = 64) in;
 
-	m_pose[bone->GetID()] = finaltr * bone->GetOffset();
+layout (std430, binding = 0) readonly buffer BonePalettes { mat4 pose[]; };
+layout (std430, binding = 1) readonly buffer DrawInstances { DrawInstance instances[]; };
+layout (std430, binding = 2) writeonly buffer SkinnedVertices { SkinnedVertex skinned[]; };
+layout (std430, binding = 3) readonly buffer SourceVertices { float source[]; };
 
-	for (auto child : bone->GetChildren())
-		calculatePose(dynamic_cast<Bone*>(child));
+layout (location = 0) uniform uint uFirstInstance;
+layout (location = 1) uniform uint uVertexCount;
+layout (location = 2) uniform uint uMeshVertexOffset;
 
-	m_transform = tmp;
+vec3 readVec3(uint offset)
+{
+	return vec3(source[offset], source[offset + 1], source[offset + 2]);
 }
 
-#pragma endregion
+void skinVertex(DrawInstance instance, uint vertex, vec3 sourcePosition, vec3 sourceNormal)
+{
+	const uint base = vertex * VERTEX_STRIDE;
+	mat4 current = mat4(0.0);
+	mat4 previous = mat4(0.0);
+	float totalWeight = 0.0;
+	for (uint i = 0u; i < BONES_PER_VERTEX; i++)
+	{
+		const float weight = source[base + WEIGHTS_OFFSET + i];
+		if (weight <= 0.0)
+			continue;
+		const uint bone = floatBitsToUint(source[base + BONE_IDS_OFFSET + i]);
+		current += pose[instance.paletteBase + bone] * weight;
+		previous += pose[instance.previousPaletteBase + bone] * weight;
+		totalWeight += weight;
+	}
+	if (totalWeight <= 0.0)
+	{
+		current = mat4(1.0);
+		previous = mat4(1.0);
+	}
 
-#pragma endregion
+	const vec4 position = vec4(sourcePosition, 1.0);
+	SkinnedVertex result;
+	result.position = current * position;
+	result.previousPosition = previous * position;
+	result.normal = vec4(normalize(mat3(current) * sourceNormal), 0.0);
+	result.tangent = vec4(mat3(current) * readVec3(base + TANGENT_OFFSET), 0.0);
+	skinned[instance.skinnedBase + uMeshVertexOffset + vertex] = result;
+}
 
-//==============================================================================
-// Scene
-//==============================================================================
-#pragma region Scene
+#if defined(MORPH_TARGETS)
+struct MorphVertex
+{
+	uint vertex;
+	uint firstDelta;
+	uint deltaCount;
+};
+struct MorphDelta
+{
+	vec3 position;
+	uint target;
+	vec3 normal;
+	float padding;
+};
 
-#pragma region QuadShape
+layout (std430, binding = 4) readonly buffer MorphData { uint morphData[]; };
+layout (std430, binding = 5) readonly buffer MorphVertices { MorphVertex morphVertices[]; };
+layout (std430, binding = 6) readonly buffer MorphDeltas { MorphDelta morphDeltas[]; };
 
-QuadShape::QuadShape()
+// uVertexCount is the number of moved vertices of the mesh
+void main()
 {
-	m_vao = std::make_shared<GLVertexArray>(getData(), GetMeshVertexFormat());
-}
+	if (gl_GlobalInvocationID.x >= uVertexCount)
+		return;
+	const uint instanceIndex = uFirstInstance + gl_GlobalInvocationID.y;
+	const uint weightBase = morphData[instanceIndex];
+	if (weightBase == NOT_MORPHED)
+		return;
 
-void QuadShape::Draw()
+	const MorphVertex morph = morphVertices[gl_GlobalInvocationID.x];
+	const uint base = morph.vertex * VERTEX_STRIDE;
+	vec3 position = readVec3(base + POSITION_OFFSET);
+	vec3 normal = readVec3(base + NORMAL_OFFSET);
+	for (uint i = 0u; i < morph.deltaCount; i++)
+	{
+		const MorphDelta delta = morphDeltas[morph.firstDelta + i];
+		const float weight = uintBitsToFloat(morphData[weightBase + delta.target]);
+		if (weight == 0.0)
+			continue;
+		position += delta.position * weight;
+		normal += delta.normal * weight;
+	}
+	skinVertex(instances[instanceIndex], morph.vertex, position, normal);
+}
+#else
+void main()
 {
-	m_vao->DrawTriangles();
+	const uint vertex = gl_GlobalInvocationID.x;
+	if (vertex >= uVertexCount)
+		return;
+	const DrawInstance instance = instances[uFirstInstance + gl_GlobalInvocationID.y];
+	if (instance.skin == 0u)
+		return;
+	const uint base = vertex * VERTEX_STRIDE;
+	skinVertex(instance, vertex, readVec3(base + POSITION_OFFSET), readVec3(base + NORMAL_OFFSET));
 }
+#endif
+)";
 
-std::vector<MeshVertex> QuadShape::getData()
+DrawBatcher::DrawBatcher(uint32_t instanceCapacity, uint32_t paletteCapacity, uint32_t skinnedVertexCapacity)
 {
-	// TODO: указать правильный Tangent
-	return
-	{
-		// Positions            // Color            // Normals          // Texcoords  // Tangent
-		{ {1.0f,  0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
-		{ {-1.0f, 0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
-		{ {-1.0f, 0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 1.0f}, {0.0f, 0.0f, 0.0f} },
-		{ {1.0f,  0.0f,  1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 0.0f, 0.0f} },
-		{ {-1.0f, 0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 1.0f}, {0.0f, 0.0f, 0.0f} },
-		{ {1.0f,  0.0f, -1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 0.0f, 0.0f} }
-	};
-}
+	reserve(std::max(instanceCapacity, 1u), std::max(paletteCapacity, 1u));
 
-#pragma endregion
+	m_skinnedCapacity = std::max(skinnedVertexCapacity, 1u);
+	m_skinnedVertices = std::make_unique<GPUBuffer>(m_skinnedCapacity * sizeof(SkinnedVertex), BufferStorageFlag::NONE, "SkinnedVertices");
 
-#pragma region CubeShape
+	auto floatOffset = [](size_t bytes) { return std::to_string(bytes / sizeof(float)); };
+	const std::string source = "#version 460 core\n"
+		"#define VERTEX_STRIDE " + floatOffset(sizeof(MeshVertex)) + "u\n"
+		"#define POSITION_OFFSET " + floatOffset(offsetof(MeshVertex, position)) + "u\n"
+		"#define NORMAL_OFFSET " + floatOffset(offsetof(MeshVertex, normal)) + "u\n"
+		"#define TANGENT_OFFSET " + floatOffset(offsetof(MeshVertex, tangent)) + "u\n"
+		"#define BONE_IDS_OFFSET " + floatOffset(offsetof(MeshVertex, boneIDs)) + "u\n"
+		"#define WEIGHTS_OFFSET " + floatOffset(offsetof(MeshVertex, weights)) + "u\n"
+		"#define BONES_PER_VERTEX " + std::to_string(MAX_NUM_BONES_PER_VERTEX) + "u\n" + DrawInstanceShaderSource;
+	m_skinningProgram = std::make_shared<GLProgramPipeline>(source + SkinningShaderSource);
+	m_morphProgram = std::make_shared<GLProgramPipeline>(source + "#define MORPH_TARGETS\n"
+		"#define NOT_MORPHED " + std::to_string(NotMorphed) + "u\n" + SkinningShaderSource);
+}
 
-CubeShape::CubeShape()
+void DrawBatcher::SetPreSkinning(bool enabled)
 {
-	m_vao = std::make_shared<GLVertexArray>(getData(), GetMeshVertexFormat());
+	m_preSkinning = enabled;
 }
 
-void CubeShape::Draw()
+void DrawBatcher::BeginFrame()
 {
-	m_vao->DrawTriangles();
+	m_skinnedSlots.clear();
+	m_skinnedCount = 0;
+	if (m_skinnedRequired > m_skinnedCapacity)
+	{
+		// the old buffer is released by the driver once the GPU is done with it
+		m_skinnedCapacity = m_skinnedRequired + m_skinnedRequired / 2;
+		m_skinnedVertices = std::make_unique<GPUBuffer>(m_skinnedCapacity * sizeof(SkinnedVertex), BufferStorageFlag::NONE, "SkinnedVertices");
+	}
+	m_skinnedRequired = 0;
 }
 
-std::vector<MeshVertex> CubeShape::getData()
+void DrawBatcher::Prepare(std::span<const DrawItem> items)
 {
+	m_runs.clear();
+	m_paletteBases.resize(items.size());
+	m_skinnedBases.resize(items.size());
+	m_skinFlags.resize(items.size());
+	m_morphBases.resize(items.size());
+	m_instanceCount = static_cast<uint32_t>(items.size());
+	m_drawCallCount = 0;
+
+	uint32_t paletteSize = 0;
+	// the weights follow the per instance words
+	uint32_t morphSize = m_instanceCount;
+	bool morphs = false;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		const DrawItem& item = items[i];
+		m_paletteBases[i] = paletteSize;
+		paletteSize += static_cast<uint32_t>(item.palette.size() + item.previousPalette.size());
+
+		if (m_runs.empty() || m_runs.back().model != item.model)
+			m_runs.push_back({ item.model, static_cast<uint32_t>(i), 0, false });
+		m_runs.back().count++;
+
+		// every character is skinned by the first list of the frame it appears in
+		m_skinnedBases[i] = DrawInstance::NotSkinned;
+		m_skinFlags[i] = 0;
+		m_morphBases[i] = NotMorphed;
+		// all weights zero is the base shape, which needs no morph pass
+		const bool morphed = !item.morphWeights.empty() && item.morphWeights.size() == item.model->GetMorphTargetCount()
+			&& std::any_of(item.morphWeights.begin(), item.morphWeights.end(), [](float weight) { return weight != 0.0f; });
+		if (!m_preSkinning || (item.palette.empty() && !morphed))
+			continue;
+		const void* key = !item.palette.empty() ? static_cast<const void*>(item.palette.data()) : item.morphWeights.data();
+		auto [slot, inserted] = m_skinnedSlots.try_emplace(key, DrawInstance::NotSkinned);
+		if (inserted)
+		{
+			const uint32_t vertexCount = static_cast<uint32_t>(item.model->GetVertexCount());
+			m_skinnedRequired += vertexCount;
+			if (m_skinnedCount + vertexCount <= m_skinnedCapacity)
+			{
+				slot->second = m_skinnedCount;
+				m_skinnedCount += vertexCount;
+				m_skinFlags[i] = 1;
+				m_runs.back().skin = true;
+				if (morphed)
+				{
+					m_morphBases[i] = morphSize;
+					morphSize += static_cast<uint32_t>(item.morphWeights.size());
+					m_runs.back().morph = morphs = true;
+				}
+			}
+		}
+		m_skinnedBases[i] = slot->second;
+	}
+	if (m_instanceCount > m_instanceCapacity || paletteSize > m_paletteCapacity)
+		reserve(std::max(m_instanceCount, m_instanceCapacity * 2), std::max(paletteSize, m_paletteCapacity * 2));
+	if (morphs && morphSize > m_morphCapacity)
+	{
+		// the old buffer is released by the driver once the GPU is done with it
+		m_morphCapacity = std::max(morphSize, m_morphCapacity * 2);
+		m_morphs = std::make_unique<GPURingBuffer>(m_morphCapacity * sizeof(uint32_t), RegionCount, "MorphWeights");
+	}
 
+	DrawInstance* instances = static_cast<DrawInstance*>(m_instances->NextRegion());
+	glm::mat4* palettes = static_cast<glm::mat4*>(m_palettes->NextRegion());
+	uint32_t* morphData = morphs ? static_cast<uint32_t*>(m_morphs->NextRegion()) : nullptr;
+	JobSystem::ParallelFor(items.size(), 64, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const DrawItem& item = items[i];
+				DrawInstance instance;
+				instance.world = item.world;
+				instance.paletteBase = m_paletteBases[i];
+				instance.boneCount = static_cast<uint32_t>(item.palette.size());
+				// without a previous palette the previous positions are the current ones
+				instance.previousPaletteBase = item.previousPalette.size() == item.palette.size()
+					? m_paletteBases[i] + instance.boneCount : m_paletteBases[i];
+				instance.skinnedBase = m_skinnedBases[i];
+				instance.skin = m_skinFlags[i];
+				instances[i] = instance;
+
+				glm::mat4* destination = std::copy(item.palette.begin(), item.palette.end(), palettes + m_paletteBases[i]);
+				if (item.previousPalette.size() == item.palette.size())
+					std::copy(item.previousPalette.begin(), item.previousPalette.end(), destination);
+
+				if (morphData)
+				{
+					morphData[i] = m_morphBases[i];
+					if (m_morphBases[i] != NotMorphed)
+						std::memcpy(morphData + m_morphBases[i], item.morphWeights.data(), item.morphWeights.size_bytes());
+				}
+			}
+		});
 
+	skin();
+}
 
+void DrawBatcher::Draw(const GLProgramPipelineRef& program, const std::function<void(const Model&)>& setup)
+{
+	if (m_runs.empty())
+		return;
 
-	// TODO: указать правильный Tangent
-	return
+	// Prepare may have bound the skinning pipeline
+	program->Bind();
+	m_instances->BindRange(GL_SHADER_STORAGE_BUFFER, DRAW_INSTANCE_BINDING);
+	m_palettes->BindRange(GL_SHADER_STORAGE_BUFFER, BONE_PALETTE_BINDING);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SKINNED_VERTEX_BINDING, *m_skinnedVertices);
+	const GLint meshVertexOffsetLocation = program->GetVertexUniform("uMeshVertexOffset");
+	for (const Run& run : m_runs)
 	{
-		// Positions              // Color            // Normals              // Texcoords   // Tangent
-		// Back face
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 0.0f} }, // bottom-left
-		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 1.0f} }, // top-right
-		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 0.0f} }, // bottom-right
-		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {1.0f, 1.0f} }, // top-right
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 0.0f} }, // bottom-left
-		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f, -1.0f,}, {0.0f, 1.0f} }, // top-left
-		// Front face
-		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 0.0f} }, // bottom-left
-		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 0.0f} }, // bottom-right
-		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 1.0f} }, // top-right
-		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {1.0f, 1.0f} }, // top-right
-		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 1.0f} }, // top-left
-		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  0.0f,  1.0f,}, {0.0f, 0.0f} }, // bottom-left
-		// Left face
-		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-right
-		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 1.0f} }, // top-left
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-left
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-left
-		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-right
-		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, {-1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-right
-		// Right face
-		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-left
-		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-right
-		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 1.0f} }, // top-right
-		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 1.0f} }, // bottom-right
-		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {1.0f, 0.0f} }, // top-left
-		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 1.0f,  0.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-left
-		// Bottom face
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-right
-		{ { 1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 1.0f} }, // top-left
-		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-left
-		{ { 1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-left
-		{ {-1.0f, -1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 0.0f} }, // bottom-right
-		{ {-1.0f, -1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f, -1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-right
-		// Top face
-		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-left
-		{ { 1.0f,  1.0f , 1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-right
-		{ { 1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 1.0f} }, // top-right
-		{ { 1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {1.0f, 0.0f} }, // bottom-right
-		{ {-1.0f,  1.0f, -1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 1.0f} }, // top-left
-		{ {-1.0f,  1.0f,  1.0f,}, {1.0f, 1.0f, 1.0f}, { 0.0f,  1.0f,  0.0f,}, {0.0f, 0.0f} }  // bottom-left
-	};
+		if (setup) setup(*run.model);
+		run.model->DrawInstanced(program, static_cast<GLsizei>(run.count), run.first, meshVertexOffsetLocation);
+		m_drawCallCount += static_cast<uint32_t>(run.model->GetMeshCount());
+	}
 }
 
-#pragma endregion
+uint32_t DrawBatcher::GetInstanceCount() const
+{
+	return m_instanceCount;
+}
 
-#pragma region SphereShape
+uint32_t DrawBatcher::GetDrawCallCount() const
+{
+	return m_drawCallCount;
+}
 
-SphereShape::SphereShape()
+uint32_t DrawBatcher::GetSkinnedVertexCount() const
 {
-	std::vector<MeshVertex> vertices;
-	std::vector<uint16_t> indices;
+	return m_skinnedCount;
+}
 
-	constexpr unsigned int X_SEGMENTS = 64;
-	constexpr unsigned int Y_SEGMENTS = 64;
-	const float PI = glm::pi<float>();
-	for (unsigned int x = 0; x <= X_SEGMENTS; ++x)
+void DrawBatcher::skin()
+{
+	bool pending = false;
+	for (const Run& run : m_runs)
+		pending |= run.skin;
+	if (!pending)
+		return;
+
+	m_skinningProgram->Bind();
+	m_instances->BindRange(GL_SHADER_STORAGE_BUFFER, DRAW_INSTANCE_BINDING);
+	m_palettes->BindRange(GL_SHADER_STORAGE_BUFFER, BONE_PALETTE_BINDING);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SKINNED_VERTEX_BINDING, *m_skinnedVertices);
+
+	// one dispatch per mesh covers all instances of the run, instances skinned by an earlier list return at once
+	constexpr GLuint sourceVertexBinding = 3;
+	for (const Run& run : m_runs)
 	{
-		for (unsigned int y = 0; y <= Y_SEGMENTS; ++y)
+		if (!run.skin)
+			continue;
+		m_skinningProgram->SetComputeUniform(0, run.first);
+		uint32_t vertexOffset = 0;
+		for (size_t i = 0; i < run.model->GetMeshCount(); i++)
 		{
-			float xSegment = (float)x / (float)X_SEGMENTS;
-			float ySegment = (float)y / (float)Y_SEGMENTS;
-			float xPos = std::cos(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
-			float yPos = std::cos(ySegment * PI);
-			float zPos = std::sin(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
-
-			MeshVertex vertex;
-			vertex.position = glm::vec3(xPos, yPos, zPos);
-			vertex.color = glm::vec3(1.0f, 1.0f, 1.0f);
-			vertex.normal = glm::vec3(xPos, yPos, zPos);
-			vertex.texCoords = glm::vec2(xSegment, ySegment);
-			vertex.tangent = glm::vec3(0.0f); // TODO: исправить правильный tangent
-			vertices.emplace_back(vertex);
+			const MeshRef mesh = (*run.model)[i];
+			const uint32_t vertexCount = static_cast<uint32_t>(mesh->GetVertexCount());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sourceVertexBinding, *mesh->GetVAO()->GetVertexBuffer());
+			m_skinningProgram->SetComputeUniform(1, vertexCount);
+			m_skinningProgram->SetComputeUniform(2, vertexOffset);
+			glDispatchCompute((vertexCount + 63) / 64, run.count, 1);
+			vertexOffset += vertexCount;
 		}
 	}
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-	bool oddRow = false;
-	for (unsigned int y = 0; y < Y_SEGMENTS; ++y)
+	// the moved vertices are skinned again over the base shape, the cost follows the moved vertices of the morphed instances
+	bool morphs = false;
+	for (const Run& run : m_runs)
+		morphs |= run.morph;
+	if (!morphs)
+		return;
+
+	constexpr GLuint morphDataBinding = 4;
+	constexpr GLuint morphVertexBinding = 5;
+	constexpr GLuint morphDeltaBinding = 6;
+	m_morphProgram->Bind();
+	m_morphs->BindRange(GL_SHADER_STORAGE_BUFFER, morphDataBinding);
+	for (const Run& run : m_runs)
 	{
-		if (!oddRow) // even rows: y == 0, y == 2; and so on
-		{
-			for (unsigned int x = 0; x <= X_SEGMENTS; ++x)
-			{
-				indices.push_back(y * (X_SEGMENTS + 1) + x);
-				indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
-			}
-		}
-		else
+		if (!run.morph)
+			continue;
+		m_morphProgram->SetComputeUniform(0, run.first);
+		uint32_t vertexOffset = 0;
+		for (size_t i = 0; i < run.model->GetMeshCount(); i++)
 		{
-			for (int x = X_SEGMENTS; x >= 0; --x)
+			const MeshRef mesh = (*run.model)[i];
+			if (mesh->BindMorphTargets(morphVertexBinding, morphDeltaBinding))
 			{
-				indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
-				indices.push_back(y * (X_SEGMENTS + 1) + x);
+				glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sourceVertexBinding, *mesh->GetVAO()->GetVertexBuffer());
+				m_morphProgram->SetComputeUniform(1, mesh->GetMorphVertexCount());
+				m_morphProgram->SetComputeUniform(2, vertexOffset);
+				glDispatchCompute((mesh->GetMorphVertexCount() + 63) / 64, run.count, 1);
 			}
+			vertexOffset += static_cast<uint32_t>(mesh->GetVertexCount());
 		}
-		oddRow = !oddRow;
 	}
-
-	m_vao = std::make_shared<GLVertexArray>(vertices, indices, GetMeshVertexFormat());
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
-void SphereShape::Draw()
+void DrawBatcher::reserve(uint32_t instanceCount, uint32_t paletteSize)
 {
-	m_vao->DrawTriangles();
+	// the old buffers are released by the driver once the GPU is done with them
+	m_instanceCapacity = instanceCount;
+	m_paletteCapacity = paletteSize;
+	m_instances = std::make_unique<GPURingBuffer>(m_instanceCapacity * sizeof(DrawInstance), RegionCount, "DrawInstances");
+	m_palettes = std::make_unique<GPURingBuffer>(m_paletteCapacity * sizeof(glm::mat4), RegionCount, "BonePalettes");
 }
 
-#pragma endregion
-
-#pragma region Camera
-
-void Camera::Set(glm::vec3 Position, glm::vec3 Up, float Yaw, float Pitch)
+VertexAnimationRenderer::VertexAnimationRenderer(uint32_t instanceCapacity)
 {
-	position = Position;
-	front = CAMERA_FRONT;
-	up = CAMERA_UP;
-	right = CAMERA_RIGHT;
-	worldUp = Up;
-	yaw = Yaw;
-	pitch = Pitch;
-	update();
+	m_instanceCapacity = std::max(instanceCapacity, 1u);
+	m_instances = std::make_unique<GPURingBuffer>(m_instanceCapacity * sizeof(DrawInstance), RegionCount, "VertexAnimationInstances");
 }
 
-void Camera::Move(MovementDir direction, float deltaTime)
+void VertexAnimationRenderer::Prepare(std::span<const VertexAnimationItem> items)
 {
-	const float velocity = movementSpeed * deltaTime;
-	if (direction == Forward) position += front * velocity;
-	else if (direction == Backward) position -= front * velocity;
-	else if (direction == Left) position -= right * velocity;
-	else if (direction == Right) position += right * velocity;
-	update();
+	m_runs.clear();
+	m_instanceCount = static_cast<uint32_t>(items.size());
+	m_drawCallCount = 0;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (m_runs.empty() || m_runs.back().animation != items[i].animation)
+			m_runs.push_back({ items[i].animation, static_cast<uint32_t>(i), 0 });
+		m_runs.back().count++;
+	}
+	if (m_instanceCount > m_instanceCapacity)
+	{
+		// the old buffer is released by the driver once the GPU is done with it
+		m_instanceCapacity = std::max(m_instanceCount, m_instanceCapacity * 2);
+		m_instances = std::make_unique<GPURingBuffer>(m_instanceCapacity * sizeof(DrawInstance), RegionCount, "VertexAnimationInstances");
+	}
+
+	DrawInstance* instances = static_cast<DrawInstance*>(m_instances->NextRegion());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		DrawInstance instance;
+		instance.world = items[i].world;
+		instance.vertexAnimationClip = items[i].clip;
+		instance.vertexAnimationTime = items[i].timeOffset;
+		instance.vertexAnimationSpeed = items[i].speed;
+		instances[i] = instance;
+	}
 }
 
-void Camera::Rotate(float xOffset, float yOffset)
+void VertexAnimationRenderer::Draw(const GLProgramPipelineRef& program, float time, const std::function<void(const Model&)>& setup)
 {
-	xOffset *= mouseSensitivity;
-	yOffset *= mouseSensitivity;
-
-	yaw += xOffset;
-	pitch += yOffset;
+	if (m_runs.empty())
+		return;
 
-	if (pitch > 89.0f) pitch = 89.0f;
-	else if (pitch < -89.0f) pitch = -89.0f;
-	update();
+	program->Bind();
+	m_instances->BindRange(GL_SHADER_STORAGE_BUFFER, DRAW_INSTANCE_BINDING);
+	const GLint meshVertexOffsetLocation = program->GetVertexUniform("uMeshVertexOffset");
+	const GLint modeLocation = program->GetVertexUniform("uVertexAnimation");
+	const GLint rowsPerFrameLocation = program->GetVertexUniform("uVertexAnimationRowsPerFrame");
+	program->SetVertexUniform(program->GetVertexUniform("uVertexAnimationTime"), time);
+	for (const Run& run : m_runs)
+	{
+		if (!run.animation || !run.animation->IsValid())
+			continue;
+		run.animation->Bind();
+		program->SetVertexUniform(modeLocation, run.animation->GetFormat() == VertexAnimation::Format::Vertices ? 1 : 2);
+		program->SetVertexUniform(rowsPerFrameLocation, run.animation->GetRowsPerFrame());
+
+		Model& model = run.animation->GetModel();
+		if (setup) setup(model);
+		model.DrawInstanced(program, static_cast<GLsizei>(run.count), run.first, meshVertexOffsetLocation);
+		m_drawCallCount += static_cast<uint32_t>(model.GetMeshCount());
+	}
+	// later lists drawn with the same program are not baked
+	program->SetVertexUniform(modeLocation, 0);
 }
 
-const glm::mat4& Camera::GetViewMatrix() const
+uint32_t VertexAnimationRenderer::GetInstanceCount() const
 {
-	return m_view;
+	return m_instanceCount;
 }
 
-void Camera::update()
+uint32_t VertexAnimationRenderer::GetDrawCallCount() const
 {
-	front = glm::normalize(
-		glm::vec3
-		(
-			cos(glm::radians(yaw)) * cos(glm::radians(pitch)), // x
-			sin(glm::radians(pitch)), // y
-			sin(glm::radians(yaw)) * cos(glm::radians(pitch)) // z
-		)
-	);
-
-	right = glm::normalize(glm::cross(front, worldUp));
-	up = glm::normalize(glm::cross(right, front));
-
-	m_view = glm::lookAt(position, position + front, up);
+	return m_drawCallCount;
 }
 
 #pragma endregion
@@ -2402,6 +8694,7 @@ static void mouseCallback([[maybe_unused]] GLFWwindow* window, double xPosIn, do
 
 bool Window::Create(const WindowCreateInfo& createInfo)
 {
+	NANO_PROFILE_THREAD("Main");
 	if (!glfwInit())
 	{
 		Fatal("Failed to initialize GLFW");
@@ -2463,6 +8756,7 @@ bool Window::Create(const WindowCreateInfo& createInfo)
 		Fatal("Failed to initialize OpenGL");
 		return false;
 	}
+	GLStats::Install();
 
 	MouseState.lastPosition = MouseState.position = Mouse::GetPosition();
 
@@ -2482,6 +8776,10 @@ bool Window::ShouldClose()
 
 void Window::Update()
 {
+	NANO_PROFILE_FRAME();
+	GLStats::NextFrame();
+	FlightRecorder::NextFrame();
+	NANO_PROFILE_ZONE("Poll events");
 	Engine.IsResize = false;
 	glfwPollEvents();
 
@@ -2491,6 +8789,7 @@ void Window::Update()
 
 void Window::Swap()
 {
+	NANO_PROFILE_ZONE("Swap");
 	glfwSwapBuffers(Engine.window);
 }
 
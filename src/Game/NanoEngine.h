@@ -25,13 +25,21 @@
 #include <cstring>
 #include <cmath>
 #include <string>
+#include <charconv>
 #include <random>
 #include <ratio>
 #include <algorithm>
+#include <numeric>
 #include <filesystem>
 #include <chrono>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <bit>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <future>
 #include <optional>
 #include <fstream>
 #include <sstream>
@@ -52,8 +60,6 @@
 #include <imgui/imgui_impl_glfw.h>
 #include <imgui/imgui_impl_opengl3.h>
 
-#include <Profiler.h>
-
 /*
 Left handed
 	Y   Z
@@ -77,6 +83,28 @@ Left handed
 #include <glm/gtx/matrix_decompose.hpp>
 #include <glm/gtx/normal.hpp>
 
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#	define NANO_SSE 1
+#	include <xmmintrin.h>
+#else
+#	define NANO_SSE 0
+#endif
+
+// CPU profiler zones (see CPUProfiler) are on in debug builds, define NANO_PROFILER=1 to keep them in release
+#if !defined(NANO_PROFILER)
+#	if defined(NDEBUG)
+#		define NANO_PROFILER 0
+#	else
+#		define NANO_PROFILER 1
+#	endif
+#endif
+
+// GL call counters (see GLStats), on in every build: a counted call costs one more indirect call and a few adds.
+// Define NANO_GL_STATS=0 to call the driver directly
+#if !defined(NANO_GL_STATS)
+#	define NANO_GL_STATS 1
+#endif
+
 #include <assimp/BaseImporter.h>
 #include <assimp/Importer.hpp>
 #include <assimp/mesh.h>
@@ -237,6 +265,76 @@ private:
 	ClockImpl::time_point m_stopPoint;
 };
 
+namespace JobSystem
+{
+	// threadCount = 0 starts one worker per hardware thread except the calling one
+	void Init(uint32_t threadCount = 0);
+	void Close();
+
+	[[nodiscard]] uint32_t GetThreadCount();
+
+	// Splits [0, count) into ranges of grainSize items and runs func(begin, end) on the workers and on the calling thread. Returns when every range is done.
+	void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& func);
+}
+
+// Hierarchical CPU zones of every thread on one timeline. Each thread writes into its own ring so recording takes no lock; the oldest events are overwritten.
+namespace CPUProfiler
+{
+	constexpr uint32_t EventsPerThread = 1 << 14;
+	constexpr uint32_t FrameHistory = 256;
+
+	struct Event final
+	{
+		const char* name = nullptr; // must outlive the profiler, string literals or __func__
+		uint64_t begin = 0;         // ns since the profiler started
+		uint64_t end = 0;
+		uint32_t depth = 0;
+	};
+
+	[[nodiscard]] uint64_t Now();
+
+	// names the calling thread in the flame view and the trace, threads without a name show up as "Thread N"
+	void SetThreadName(std::string_view name);
+	// marks the start of a new frame, call from the main loop only
+	void MarkFrame();
+
+	[[nodiscard]] uint32_t BeginZone();
+	void EndZone(const char* name, uint64_t begin, uint32_t depth);
+
+	// writes the events still held by the rings in Chrome trace event format, opens in chrome://tracing and ui.perfetto.dev
+	bool ExportChromeTrace(const std::filesystem::path& path);
+	// flame view of the last complete frame, one lane per thread
+	void DrawImGui(const char* title = "CPU profiler");
+
+	class Zone final
+	{
+	public:
+		explicit Zone(const char* name) : m_name(name), m_depth(BeginZone()), m_begin(Now()) {}
+		~Zone() { EndZone(m_name, m_begin, m_depth); }
+		Zone(const Zone&) = delete;
+		Zone& operator=(const Zone&) = delete;
+
+	private:
+		const char* m_name;
+		uint32_t m_depth;
+		uint64_t m_begin;
+	};
+}
+
+#if NANO_PROFILER
+#	define NANO_PROFILE_CONCAT_IMPL(a, b) a##b
+#	define NANO_PROFILE_CONCAT(a, b) NANO_PROFILE_CONCAT_IMPL(a, b)
+#	define NANO_PROFILE_ZONE(name) const CPUProfiler::Zone NANO_PROFILE_CONCAT(profileZone, __LINE__)(name)
+#	define NANO_PROFILE_FUNCTION() NANO_PROFILE_ZONE(__func__)
+#	define NANO_PROFILE_FRAME() CPUProfiler::MarkFrame()
+#	define NANO_PROFILE_THREAD(name) CPUProfiler::SetThreadName(name)
+#else
+#	define NANO_PROFILE_ZONE(name) ((void)0)
+#	define NANO_PROFILE_FUNCTION() ((void)0)
+#	define NANO_PROFILE_FRAME() ((void)0)
+#	define NANO_PROFILE_THREAD(name) ((void)0)
+#endif
+
 #pragma endregion
 
 //==============================================================================
@@ -269,6 +367,68 @@ void Fatal(const std::string& text);
 	return glm::transpose(glm::make_mat4(&m.a1));
 }
 
+// translate * rotate * scale without the intermediate matrix products
+[[nodiscard]] inline glm::mat4 ComposeTRS(const glm::vec3& position, const glm::quat& orientation, const glm::vec3& scale)
+{
+	glm::mat4 m = glm::toMat4(orientation);
+	m[0] *= scale.x;
+	m[1] *= scale.y;
+	m[2] *= scale.z;
+	m[3] = glm::vec4(position, 1.0f);
+	return m;
+}
+
+// out = a * b, out may alias a or b
+inline void MatrixMultiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+{
+#if NANO_SSE
+	const float* pa = glm::value_ptr(a);
+	const float* pb = glm::value_ptr(b);
+	const __m128 a0 = _mm_loadu_ps(pa);
+	const __m128 a1 = _mm_loadu_ps(pa + 4);
+	const __m128 a2 = _mm_loadu_ps(pa + 8);
+	const __m128 a3 = _mm_loadu_ps(pa + 12);
+	__m128 columns[4];
+	for (int i = 0; i < 4; i++)
+	{
+		const float* column = pb + i * 4;
+		__m128 r = _mm_mul_ps(a0, _mm_set1_ps(column[0]));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(column[1])));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(column[2])));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(column[3])));
+		columns[i] = r;
+	}
+	float* po = glm::value_ptr(out);
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_ps(po + i * 4, columns[i]);
+#else
+	out = a * b;
+#endif
+}
+
+// normalized lerp along the shortest arc, for blend weights it is close enough to slerp
+[[nodiscard]] inline glm::quat NLerp(const glm::quat& a, const glm::quat& b, float t)
+{
+#if NANO_SSE
+	const __m128 qa = _mm_loadu_ps(&a.x);
+	__m128 qb = _mm_loadu_ps(&b.x);
+	__m128 dot = _mm_mul_ps(qa, qb);
+	dot = _mm_add_ps(dot, _mm_shuffle_ps(dot, dot, _MM_SHUFFLE(2, 3, 0, 1)));
+	dot = _mm_add_ps(dot, _mm_shuffle_ps(dot, dot, _MM_SHUFFLE(1, 0, 3, 2)));
+	qb = _mm_xor_ps(qb, _mm_and_ps(_mm_cmplt_ps(dot, _mm_setzero_ps()), _mm_set1_ps(-0.0f)));
+	const __m128 r = _mm_add_ps(qa, _mm_mul_ps(_mm_sub_ps(qb, qa), _mm_set1_ps(t)));
+	__m128 lengthSq = _mm_mul_ps(r, r);
+	lengthSq = _mm_add_ps(lengthSq, _mm_shuffle_ps(lengthSq, lengthSq, _MM_SHUFFLE(2, 3, 0, 1)));
+	lengthSq = _mm_add_ps(lengthSq, _mm_shuffle_ps(lengthSq, lengthSq, _MM_SHUFFLE(1, 0, 3, 2)));
+	glm::quat out;
+	_mm_storeu_ps(&out.x, _mm_div_ps(r, _mm_sqrt_ps(lengthSq)));
+	return out;
+#else
+	const glm::quat target = glm::dot(a, b) < 0.0f ? -b : b;
+	return glm::normalize(a + (target - a) * t);
+#endif
+}
+
 class AABB final
 {
 public:
@@ -289,6 +449,8 @@ public:
 	[[nodiscard]] bool Overlaps(const AABB& anotherAABB);
 	[[nodiscard]] bool Inside(const glm::vec3& point);		
 
+	[[nodiscard]] AABB GetTransformed(const glm::mat4& transform) const;
+
 	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
 	glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
 };
@@ -312,9 +474,27 @@ public:
 class Frustum final
 {
 public:
+	Frustum() = default;
+	// extracts normalized planes from a projection * view matrix, normals point inside
+	explicit Frustum(const glm::mat4& viewProjection);
+
+	[[nodiscard]] bool Intersects(const AABB& aabb) const;
+
 	Plane planes[6] = {};
 };
 
+// bind space box of the vertices influenced by one skinning matrix
+struct BoneBounds final
+{
+	glm::vec4 center = glm::vec4(0.0f);
+	glm::vec4 halfSize = glm::vec4(0.0f);
+	uint32_t paletteIndex = 0;
+};
+
+// Bounds of skinned geometry without touching its vertices: the union of the bone boxes transformed by palette[paletteIndex] and the
+// unskinned box. Conservative, a vertex blended from several bones stays inside the union of their transformed boxes
+[[nodiscard]] AABB ComputeSkinnedBounds(std::span<const glm::mat4> palette, std::span<const BoneBounds> bones, const AABB& unskinned = {});
+
 class Sphere final
 {
 public:
@@ -410,7 +590,12 @@ constexpr inline AttribFormat CreateAttribFormat(GLuint attribIndex, GLuint rela
 
 const std::pair<GLenum, GLenum> STBImageToOpenGLFormat(int comp);
 
+// Resolves #include "file" relative to the including file. Every file is read once and cached until it changes on disk, a file included
+// twice into one source is skipped the second time. #line directives map the lines back to the files, a comment at the end of the source
+// names the file of every source string number
 std::string LoadShaderTextFile(const std::filesystem::path& path);
+// the file and everything it includes, as of the last load
+[[nodiscard]] std::vector<std::filesystem::path> GetShaderDependencies(const std::filesystem::path& path);
 
 #pragma endregion
 
@@ -460,29 +645,170 @@ private:
 };
 using GPUBufferRef = std::shared_ptr<GPUBuffer>;
 
+// Persistently mapped buffer split into regions that are written one per frame. The CPU fills the next region while the GPU still reads the previous ones, a fence per region keeps it from overwriting data in flight.
+class GPURingBuffer final
+{
+public:
+	GPURingBuffer() = delete;
+	explicit GPURingBuffer(size_t regionSizeBytes, uint32_t regionCount = 3, std::string_view name = "");
+	GPURingBuffer(const GPURingBuffer&) = delete;
+	~GPURingBuffer();
+
+	GPURingBuffer& operator=(const GPURingBuffer&) = delete;
+
+	// Fences the current region, then waits until the next one is no longer used by the GPU and returns its mapped memory
+	[[nodiscard]] void* NextRegion();
+	[[nodiscard]] void* GetRegion(uint32_t region);
+
+	// Binds the current region to an indexed buffer target (GL_SHADER_STORAGE_BUFFER, GL_UNIFORM_BUFFER)
+	void BindRange(GLenum target, GLuint index) const;
+
+	[[nodiscard]] size_t GetRegionSize() const noexcept { return m_regionSize; }
+	[[nodiscard]] size_t GetRegionOffset() const noexcept { return m_current * m_regionStride; }
+	[[nodiscard]] uint32_t GetCurrentRegion() const noexcept { return m_current; }
+	[[nodiscard]] const GPUBuffer& GetBuffer() const noexcept { return m_buffer; }
+
+private:
+	size_t m_regionSize = 0;
+	size_t m_regionStride = 0;
+	uint32_t m_current = 0;
+	std::vector<GLsync> m_fences;
+	GPUBuffer m_buffer;
+};
+using GPURingBufferRef = std::shared_ptr<GPURingBuffer>;
+
+// On-disk cache of linked separable programs. A program whose source, stage and driver (vendor, renderer and version) were seen before
+// is restored with glProgramBinary instead of being compiled, a binary the driver rejects is compiled again and replaced.
+namespace ShaderCache
+{
+	struct Stats final
+	{
+		uint32_t loaded = 0;
+		uint32_t compiled = 0;
+		uint32_t rejected = 0;
+	};
+
+	// "ShaderCache" in the working directory by default, an empty path turns the cache off
+	void SetDirectory(const std::filesystem::path& directory);
+	[[nodiscard]] const std::filesystem::path& GetDirectory();
+	[[nodiscard]] const Stats& GetStats();
+}
+
+// Name of a uniform for the reflection table of GLSeparableShaderProgram. String literals are hashed at compile time, so a lookup
+// like GetFragmentUniform("uLight.color") costs a probe of the table, one string compare and no call into the driver.
+// Only refers to the name, which has to outlive the lookup
+class UniformName final
+{
+public:
+	template <size_t N>
+	consteval UniformName(const char(&name)[N]) noexcept : m_name(name, N - 1), m_hash(Hash(m_name)) {}
+	UniformName(const std::string& name) noexcept : m_name(name), m_hash(Hash(name)) {}
+	explicit UniformName(std::string_view name) noexcept : m_name(name), m_hash(Hash(name)) {}
+
+	[[nodiscard]] constexpr std::string_view GetName() const noexcept { return m_name; }
+	[[nodiscard]] constexpr uint32_t GetHash() const noexcept { return m_hash; }
+
+	// FNV-1a
+	[[nodiscard]] static constexpr uint32_t Hash(std::string_view name) noexcept
+	{
+		uint32_t hash = 2166136261u;
+		for (const char c : name)
+		{
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+private:
+	std::string_view m_name;
+	uint32_t m_hash = 0;
+};
+
+struct UniformInfo final
+{
+	std::string name;
+	GLint location = -1;
+	GLenum type = 0;
+	// elements of an array follow the location of the first one
+	GLint arraySize = 1;
+	// a member of a uniform block has no location but the index of the block and the byte offset in it
+	GLint blockIndex = -1;
+	GLint offset = -1;
+};
+
+// A specialization constant of a SPIR-V module, layout(constant_id = id). value holds the bits of a bool, int, uint or float (std::bit_cast)
+struct SpecializationConstant final
+{
+	GLuint id = 0;
+	GLuint value = 0;
+};
+
 // ref ARB_separate_shader_objects 
 class GLSeparableShaderProgram final
 {
 public:
 	GLSeparableShaderProgram() = delete;
-	GLSeparableShaderProgram(GLenum shaderType, std::string_view sourceCode);	
+	// deferred leaves compile and link to the driver threads, the program is finished by IsReady or Wait
+	GLSeparableShaderProgram(GLenum shaderType, std::string_view sourceCode, bool deferred = false);
+	// a SPIR-V module (ARB_gl_spirv) from the offline compile step, the driver only specializes and links it
+	GLSeparableShaderProgram(GLenum shaderType, std::span<const uint32_t> spirv, std::span<const SpecializationConstant> constants = {}, const char* entryPoint = "main");
 	~GLSeparableShaderProgram();
 
 	[[nodiscard]] operator GLuint() const noexcept { return m_handle; }
 	[[nodiscard]] bool IsValid() const noexcept { return m_handle != 0; }
 
+	// false while the driver still builds a deferred program (GL_KHR_parallel_shader_compile), the handle is 0 after a failed build
+	[[nodiscard]] bool IsReady();
+	void Wait();
+
 	template <typename T>
 	void SetUniform(GLint location, const T& value);
 
+	// active uniforms reflected after the link, empty for a SPIR-V module and while a deferred program is not finished. An array answers to "name" and "name[0]"
+	[[nodiscard]] const UniformInfo* FindUniform(UniformName name) const noexcept;
+	// -1 for a uniform that does not exist or was optimized away, which glProgramUniform ignores. "name[i]" is the location of element i
+	[[nodiscard]] GLint GetUniformLocation(UniformName name) const noexcept;
+	[[nodiscard]] const std::vector<UniformInfo>& GetUniforms() const noexcept { return m_uniforms; }
+
 private:
-	void createHandle(GLenum shaderType, std::string_view sourceCode);
+	void createHandle(GLenum shaderType, std::string_view sourceCode, bool deferred);
+	void createHandle(GLenum shaderType, std::span<const uint32_t> spirv, std::span<const SpecializationConstant> constants, const char* entryPoint);
+	// issues compile and link, finish checks the results
+	void compile(GLenum shaderType, std::string_view sourceCode);
+	void finish();
 	void destroyHandle();
-	void validate(std::string_view sourceCode);
+	void validate(std::string_view sourceCode, std::string_view compileLog);
+	[[nodiscard]] bool loadBinary(const std::filesystem::path& path);
+	void storeBinary(const std::filesystem::path& path) const;
+	void reflect();
+	void insertUniform(std::string_view name, uint32_t index);
 
 	GLuint m_handle = 0;
+	// kept while the program is being built
+	GLuint m_shader = 0;
+	std::string m_source;
+	std::filesystem::path m_cachePath;
+	bool m_pending = false;
+
+	// open addressing with linear probing, at most half full. The key is the first nameLength characters of the name of the uniform
+	struct UniformSlot final
+	{
+		uint32_t hash = 0;
+		int32_t index = -1;
+		uint32_t nameLength = 0;
+	};
+	std::vector<UniformInfo> m_uniforms;
+	std::vector<UniformSlot> m_uniformTable;
 };
 using GLSeparableShaderProgramRef = std::shared_ptr<GLSeparableShaderProgram>;
 
+// an empty vector if the file does not exist or is not a SPIR-V module
+[[nodiscard]] std::vector<uint32_t> LoadShaderSpirvFile(const std::filesystem::path& path);
+// "<path>.spv" from the offline compile step (see the CustomBuild items of Game.vcxproj) if it is not older than the GLSL file,
+// LoadShaderTextFile(path) otherwise. The GLSL text gets the constants as #define SPECIALIZATION_CONSTANT_<id> <value bits>
+[[nodiscard]] GLSeparableShaderProgramRef LoadShaderProgram(GLenum shaderType, const std::filesystem::path& path, std::span<const SpecializationConstant> constants = {});
+
 class GLProgramPipeline final
 {
 public:
@@ -514,10 +840,10 @@ public:
 	template <typename T>
 	void SetComputeUniform(GLint location, const T& value);
 
-	[[nodiscard]] GLint GetVertexUniform(const std::string& name) const;
-	[[nodiscard]] GLint GetGeometryUniform(const std::string& name) const;
-	[[nodiscard]] GLint GetFragmentUniform(const std::string& name) const;
-	[[nodiscard]] GLint GetComputeUniform(const std::string& name) const;
+	[[nodiscard]] GLint GetVertexUniform(UniformName name) const noexcept;
+	[[nodiscard]] GLint GetGeometryUniform(UniformName name) const noexcept;
+	[[nodiscard]] GLint GetFragmentUniform(UniformName name) const noexcept;
+	[[nodiscard]] GLint GetComputeUniform(UniformName name) const noexcept;
 
 	void Bind();
 
@@ -535,6 +861,81 @@ private:
 };
 using GLProgramPipelineRef = std::shared_ptr<GLProgramPipeline>;
 
+// Builds a program pipeline without stalling the caller: compile and link of all stages go to the driver threads at once and IsReady
+// polls them, so a loading screen keeps drawing while many programs build. Without GL_KHR_parallel_shader_compile the program is
+// finished by the first poll. Programs restored from ShaderCache are ready at once.
+class ShaderBuild final
+{
+public:
+	ShaderBuild(std::string_view vertexShaderCode, std::string_view fragmentShaderCode);
+	explicit ShaderBuild(std::string_view computeShaderCode);
+
+	// sources from LoadShaderTextFile, the files and their includes are watched by IsOutdated
+	[[nodiscard]] static std::shared_ptr<ShaderBuild> FromFiles(const std::filesystem::path& vertexPath, const std::filesystem::path& fragmentPath);
+
+	[[nodiscard]] bool IsReady();
+	// waits for the driver, nullptr after a failed build
+	GLProgramPipelineRef Wait();
+	// nullptr until ready and after a failed build
+	[[nodiscard]] GLProgramPipelineRef GetProgram() const;
+	// a source file or one of its includes changed since the build
+	[[nodiscard]] bool IsOutdated() const;
+
+private:
+	void watch(const std::filesystem::path& path);
+
+	std::vector<GLSeparableShaderProgramRef> m_stages;
+	GLProgramPipelineRef m_program;
+	bool m_finished = false;
+	std::vector<std::pair<std::filesystem::path, std::filesystem::file_time_type>> m_dependencies;
+};
+using ShaderBuildRef = std::shared_ptr<ShaderBuild>;
+
+// Keywords of the shader permutations, bit i is the keyword i of ShaderPermutations
+enum class ShaderFeature : uint32_t
+{
+	NONE = 0,
+	// skinned with the bone palette
+	SKINNED = BITMASK_POW2(0),
+	// the material has a normal map (texture unit 1)
+	NORMAL_MAP = BITMASK_POW2(1),
+	// the diffuse texture has transparent texels that are discarded
+	ALPHA_TEST = BITMASK_POW2(2),
+	// debug: the fragment stage counts itself into the OverdrawView image
+	OVERDRAW = BITMASK_POW2(3),
+};
+DECLARE_FLAG_TYPE(ShaderFeatures, ShaderFeature, uint32_t)
+
+// Variants of a vertex and fragment program instead of runtime branches. A stage declares the keywords it knows with
+// "#pragma features SKINNED NORMAL_MAP ..." and a variant is the source with a #define for each of them it is built with.
+// The stages are built once per bitmask, features a stage does not declare are dropped so they do not add variants.
+class ShaderPermutations final
+{
+public:
+	ShaderPermutations(std::string_view vertexShaderCode, std::string_view fragmentShaderCode);
+
+	[[nodiscard]] static std::string_view GetKeyword(ShaderFeature feature);
+	// the keywords declared by either stage
+	[[nodiscard]] ShaderFeatures GetFeatures() const noexcept;
+
+	// starts a deferred build of the variant, e.g. for the meshes of a model while it loads
+	void Prepare(ShaderFeatures features);
+	// the variant, built on first use. nullptr if it failed to build
+	[[nodiscard]] GLProgramPipelineRef Get(ShaderFeatures features);
+	[[nodiscard]] size_t GetVariantCount() const noexcept;
+
+private:
+	[[nodiscard]] const GLSeparableShaderProgramRef& stage(std::unordered_map<uint32_t, GLSeparableShaderProgramRef>& stages, GLenum shaderType, ShaderFeatures features, bool deferred);
+
+	std::string m_vertexSource;
+	std::string m_fragmentSource;
+	ShaderFeatures m_vertexFeatures;
+	ShaderFeatures m_fragmentFeatures;
+	std::unordered_map<uint32_t, GLSeparableShaderProgramRef> m_vertexStages;
+	std::unordered_map<uint32_t, GLSeparableShaderProgramRef> m_fragmentStages;
+	std::unordered_map<uint32_t, GLProgramPipelineRef> m_variants;
+};
+
 // это Storage Buffer. возможно сделать возможность создания простого или такого буффера
 // https://steps3d.narod.ru/tutorials/buffer-storage-tutorial.html
 class GLBuffer final
@@ -594,6 +995,10 @@ public:
 	void Bind();
 
 	void DrawTriangles();
+	// the vertex shader sees gl_BaseInstance = baseInstance
+	void DrawTrianglesInstanced(GLsizei instanceCount, GLuint baseInstance = 0);
+
+	[[nodiscard]] GLBufferRef GetVertexBuffer() const noexcept { return m_vbo; }
 
 private:
 	void createHandle();
@@ -651,6 +1056,9 @@ public:
 	void Bind(GLuint slot);
 	void BindImage(uint32_t index, uint32_t level = 0, bool write = false, std::optional<int> layer = std::nullopt);
 
+	// a texture loaded from a file with texels that are not opaque
+	[[nodiscard]] bool HasTransparency() const noexcept { return m_transparent; }
+
 private:
 	void createHandle();
 	void destroyHandle();
@@ -658,6 +1066,7 @@ private:
 
 	GLuint m_handle = 0;
 	GLenum m_internalFormat = 0;
+	bool m_transparent = false;
 };
 using GLTexture2DRef = std::shared_ptr<GLTexture2D>;
 
@@ -843,8 +1252,9 @@ namespace Renderer
 
 	struct DeviceFeatures final
 	{
-		bool bindlessTextures{}; // GL_ARB_bindless_texture
-		bool shaderSubgroup{};   // GL_KHR_shader_subgroup
+		bool bindlessTextures{};       // GL_ARB_bindless_texture
+		bool shaderSubgroup{};         // GL_KHR_shader_subgroup
+		bool parallelShaderCompile{};  // GL_KHR_parallel_shader_compile
 	};
 
 	struct DeviceProperties final
@@ -873,6 +1283,197 @@ namespace Renderer
 	void SetScissor(GLint x, GLint y, GLsizei width, GLsizei height);
 }
 
+// GPU time of the passes of a frame. A scope writes a GL_TIMESTAMP query at its begin and at its end, so scopes nest, and it is also
+// a debug group (glPushDebugGroup) for RenderDoc or Nsight. The queries of a frame are read back when its slot of the ring comes
+// around again, FrameLatency frames later, and only if the GPU has finished them: the CPU never waits for a result.
+namespace GPUProfiler
+{
+	constexpr uint32_t FrameLatency = 4;
+	// frames the averages and percentiles are taken over
+	constexpr uint32_t HistorySize = 240;
+
+	// ARB_pipeline_statistics_query counters of a pass, the nested passes included
+	struct PipelineStatistics final
+	{
+		uint64_t verticesSubmitted = 0;
+		uint64_t primitivesSubmitted = 0;
+		uint64_t vertexShaderInvocations = 0;
+		uint64_t clippingOutputPrimitives = 0;
+		uint64_t fragmentShaderInvocations = 0;
+		uint64_t computeShaderInvocations = 0;
+	};
+
+	struct PassStats final
+	{
+		std::string name;
+		// 0 for the whole frame, the scopes inside are 1 and deeper
+		uint32_t depth = 0;
+		float lastMs = 0.0f;
+		float averageMs = 0.0f;
+		float medianMs = 0.0f;
+		float p95Ms = 0.0f;
+		float p99Ms = 0.0f;
+		float maxMs = 0.0f;
+		// of the last frame read back while the statistics were enabled
+		PipelineStatistics statistics;
+	};
+
+	// enabled by default, the debug groups are pushed either way
+	void SetEnabled(bool enabled);
+	[[nodiscard]] bool IsEnabled();
+
+	// off by default, a change takes effect at the next BeginFrame. Statistics queries do not nest, so a pass measures the stretches
+	// between its children and their counts are added to it when the frame is read back
+	void SetPipelineStatisticsEnabled(bool enabled);
+	[[nodiscard]] bool IsPipelineStatisticsEnabled();
+
+	// around all the work of a frame, before Window::Swap
+	void BeginFrame();
+	void EndFrame();
+
+	void BeginScope(std::string_view name);
+	void EndScope();
+
+	// in the order the passes were first seen, so a pass follows its parent
+	[[nodiscard]] std::vector<PassStats> GetStats();
+	// frames whose queries were not finished when their slot was needed again
+	[[nodiscard]] uint64_t GetDroppedFrames();
+	// the pass breakdown, between IMGUI::Update and IMGUI::Draw
+	void DrawImGui(const char* title = "GPU passes");
+
+	class Scope final
+	{
+	public:
+		explicit Scope(std::string_view name) { BeginScope(name); }
+		~Scope() { EndScope(); }
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+}
+
+// Submission cost of a frame. With NANO_GL_STATS the glad function pointers of draws, dispatches, binds, glProgramUniform* and uploads
+// are swapped for counting wrappers when the window is created. Counts are kept for the frame and for every debug group open at the call,
+// so GPUProfiler scopes get their own rows. Writes through mapped buffers and the calls of the ImGui backend, which has its own loader, are not seen.
+namespace GLStats
+{
+	struct Counters final
+	{
+		uint32_t drawCalls = 0;
+		uint32_t dispatchCalls = 0;
+		uint32_t programBinds = 0;      // glUseProgram, glBindProgramPipeline, glUseProgramStages
+		uint32_t vertexArrayBinds = 0;
+		uint32_t bufferBinds = 0;
+		uint32_t textureBinds = 0;
+		uint32_t imageBinds = 0;
+		uint32_t samplerBinds = 0;
+		uint32_t uniformUpdates = 0;
+		uint32_t framebufferSwitches = 0; // binds that change the draw framebuffer
+		uint64_t bufferBytes = 0;
+		uint64_t textureBytes = 0;
+
+		[[nodiscard]] uint32_t GetBindCount() const noexcept { return programBinds + vertexArrayBinds + bufferBinds + textureBinds + imageBinds + samplerBinds; }
+	};
+
+	struct GroupStats final
+	{
+		std::string name;
+		uint32_t parent = static_cast<uint32_t>(-1);
+		uint32_t depth = 0;
+		Counters counters; // includes the nested groups
+	};
+
+	struct FrameStats final
+	{
+		Counters total;
+		// in the order the groups were first pushed, so a group follows its parent
+		std::vector<GroupStats> groups;
+	};
+
+	// false when built without NANO_GL_STATS
+	[[nodiscard]] bool IsAvailable();
+	// called by Window::Create after the GL functions are loaded
+	void Install();
+
+	void SetEnabled(bool enabled);
+	[[nodiscard]] bool IsEnabled();
+
+	// called by Window::Update, the counts of the frame that just ended become GetLastFrame
+	void NextFrame();
+	[[nodiscard]] const FrameStats& GetLastFrame();
+
+	// between IMGUI::Update and IMGUI::Draw
+	void DrawImGui(const char* title = "GL stats");
+}
+
+// Always-on record of the last HistorySize frames: their CPU time, the GPUProfiler pass times and the GLStats counters. A frame over
+// the budget writes the frames before it to a Chrome trace with the CPU zones still held by CPUProfiler; zones of a frame over the
+// budget taking a quarter of the budget or more are drawn red. GPU pass times join the frame they were measured in when GPUProfiler
+// reads them back, so the last FrameLatency frames of a trace have none. The frame thread only copies the record, which counts toward
+// the next frame, and the file is written on a thread of its own. Release builds have no CPU zones unless built with NANO_PROFILER=1, their traces hold the frames, GPU passes
+// and GL counters.
+namespace FlightRecorder
+{
+	constexpr uint32_t HistorySize = 300;
+
+	struct Settings final
+	{
+		bool enabled = true;
+		float budgetMs = 33.3f;
+		// frames written before the one over the budget, at most HistorySize - 1
+		uint32_t framesBefore = 120;
+		// frames after a dump without another one, a loading burst would otherwise write a trace per frame
+		uint32_t cooldownFrames = 120;
+		std::filesystem::path directory = "Hitches";
+	};
+
+	void SetSettings(const Settings& settings);
+	[[nodiscard]] const Settings& GetSettings();
+
+	// called by Window::Update, ends the frame that started with the previous call
+	void NextFrame();
+
+	// frames over the budget, dumped or not
+	[[nodiscard]] uint64_t GetHitchCount();
+	// empty until a trace was written
+	[[nodiscard]] const std::filesystem::path& GetLastDump();
+	// writes every recorded frame
+	bool Dump(const std::filesystem::path& path);
+
+	// between IMGUI::Update and IMGUI::Draw
+	void DrawImGui(const char* title = "Flight recorder");
+}
+
+// Debug view of how many fragments each pixel shades. Fragment stages built with ShaderFeature::OVERDRAW add one to their pixel of an
+// r32ui image bound at ImageUnit. The image atomic turns off early depth tests in them, so fragments the depth test rejects count too.
+class OverdrawView final
+{
+public:
+	static constexpr GLuint ImageUnit = 7;
+
+	OverdrawView() = delete;
+	OverdrawView(int width, int height);
+	OverdrawView(const OverdrawView&) = delete;
+	OverdrawView& operator=(const OverdrawView&) = delete;
+
+	void Resize(int width, int height);
+
+	// clears the counts and binds the image, before the draws of the pass to measure
+	void Begin();
+	// makes the counts visible to Draw
+	void End();
+	// the counts as a heatmap over the bound framebuffer, from blue for one fragment to white for maxCount and more
+	void Draw(uint32_t maxCount = 16);
+
+	[[nodiscard]] const GLTexture2DRef& GetCounts() const noexcept { return m_counts; }
+
+private:
+	GLTexture2DRef m_counts = nullptr;
+	GLProgramPipelineRef m_program = nullptr;
+	GLVertexArrayRef m_vao = nullptr;
+	int m_width = 0;
+	int m_height = 0;
+};
+
 #pragma endregion
 
 //==============================================================================
@@ -880,6 +1481,41 @@ namespace Renderer
 //==============================================================================
 #pragma region Graphics
 
+// Flat transform hierarchy. Nodes are stored parent-before-child, so world transforms are resolved in one linear pass over the dirty range.
+class TransformHierarchy final
+{
+public:
+	static constexpr uint32_t InvalidIndex = static_cast<uint32_t>(-1);
+
+	void Reserve(size_t count);
+	void Clear();
+
+	// parent must be InvalidIndex or an index returned by a previous Add
+	uint32_t Add(uint32_t parent, const glm::mat4& local = glm::mat4(1.0f));
+
+	void SetLocal(uint32_t index, const glm::mat4& local);
+	void SetLocal(uint32_t index, const glm::vec3& position, const glm::quat& orientation, const glm::vec3& scale);
+
+	[[nodiscard]] const glm::mat4& GetLocal(uint32_t index) const;
+	[[nodiscard]] const glm::mat4& GetWorld(uint32_t index) const;
+	[[nodiscard]] uint32_t GetParent(uint32_t index) const;
+	[[nodiscard]] size_t GetSize() const;
+	[[nodiscard]] bool IsDirty() const;
+
+	// returns false if nothing has changed since the previous update
+	bool Update();
+	// the same, onUpdated(index) is called for every node whose world transform was resolved again, parents before children
+	template<typename OnUpdated>
+	bool Update(OnUpdated&& onUpdated);
+
+private:
+	std::vector<uint32_t> m_parents;
+	std::vector<glm::mat4> m_local;
+	std::vector<glm::mat4> m_world;
+	std::vector<uint8_t> m_dirty;
+	uint32_t m_firstDirty = InvalidIndex;
+};
+
 class Node
 {
 public:
@@ -894,7 +1530,7 @@ public:
 	virtual void Draw();
 
 	Node* GetParent();
-	std::vector<Node*> GetChildren();
+	const std::vector<Node*>& GetChildren() const;
 
 	virtual Transform GetTransform() = 0;
 	virtual glm::vec3 GetSize();
@@ -940,6 +1576,23 @@ struct MeshVertex final
 
 constexpr inline std::vector<AttribFormat> GetMeshVertexFormat();
 
+// std430 layouts of the sparse morph targets of a Mesh: every vertex moved by at least one target lists its deltas.
+// target is the model wide index of the morph target, see Model::GetMorphTargetCount
+struct MorphVertex final
+{
+	uint32_t vertex = 0;
+	uint32_t firstDelta = 0;
+	uint32_t deltaCount = 0;
+};
+
+struct MorphDelta final
+{
+	glm::vec3 position = glm::vec3(0.0f);
+	uint32_t target = 0;
+	glm::vec3 normal = glm::vec3(0.0f);
+	float padding = 0.0f;
+};
+
 class Mesh final
 {
 public:
@@ -949,11 +1602,23 @@ public:
 	[[nodiscard]] AABB GetBounding() const;
 	[[nodiscard]] std::vector<glm::vec3> GetTriangle() const;
 	[[nodiscard]] GLVertexArrayRef GetVAO();
+	[[nodiscard]] size_t GetVertexCount() const;
+	[[nodiscard]] std::span<const MeshVertex> GetVertices() const;
+	// the shader variant of the vertex format and material, see ShaderPermutations
+	[[nodiscard]] ShaderFeatures GetShaderFeatures() const;
+
+	// uploads the morph targets, only the moved vertices are stored
+	void SetMorphTargets(std::span<const MorphVertex> vertices, std::span<const MorphDelta> deltas);
+	[[nodiscard]] uint32_t GetMorphVertexCount() const;
+	// binds the MorphVertex and MorphDelta buffers as shader storage, false without morph targets
+	bool BindMorphTargets(GLuint vertexBinding, GLuint deltaBinding) const;
 
 	void Draw(const GLProgramPipelineRef& program);
+	void Draw(const GLProgramPipelineRef& program, GLsizei instanceCount, GLuint baseInstance);
 
 private:
 	void init();
+	void bindMaterial(const GLProgramPipelineRef& program);
 
 	std::vector<MeshVertex> m_vertices;
 	std::vector<MaterialTexture> m_textures;
@@ -961,12 +1626,11 @@ private:
 	AABB m_bounding;
 	MaterialProperties m_materialProp;
 	GLVertexArrayRef m_vao = nullptr;
-	int m_diffuseColorLoc = -1;
-	int m_ambientColorLoc = -1;
-	int m_specularColorLoc = -1;
-	int m_shininessLoc = -1;
-	int m_refractiLoc = -1;
-
+	std::unique_ptr<GPUBuffer> m_morphVertices;
+	std::unique_ptr<GPUBuffer> m_morphDeltas;
+	uint32_t m_morphVertexCount = 0;
+	size_t m_morphDeltaCount = 0;
+	ShaderFeatures m_shaderFeatures;
 };
 using MeshRef = std::shared_ptr<Mesh>;
 
@@ -981,6 +1645,31 @@ struct Keyframe final
 	std::vector<glm::vec3> scales;
 };
 
+struct BonePose final
+{
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::quat orientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::vec3 scale = glm::vec3(1.0f);
+};
+
+// Last used key of every track channel, so forward playback finds its keys without searching. Keep one per playing instance of a clip.
+struct AnimationCursor final
+{
+	std::vector<uint32_t> keys;
+	// key of the shared time base of a compressed clip
+	uint32_t baseKey = 0;
+};
+
+// Error budget of Animation::Compress. Rotation and scale errors are measured at the end of the bone, so the tolerance is in object space units.
+struct AnimationCompressionSettings final
+{
+	float tolerance = 0.001f;
+	// the shortest bone length used for the error, leaf bones still move the vertices skinned around them
+	float virtualVertexDistance = 0.03f;
+	// drop the keyframes after compression, GetKeyframes returns an empty map afterwards
+	bool releaseSource = true;
+};
+
 class Animation final
 {
 public:
@@ -1006,7 +1695,28 @@ public:
 	void Pause();
 	void Stop();
 
-	std::unordered_map<std::string, std::pair<Transform, glm::vec3>> Update();
+	// Builds bone-indexed tracks from the keyframes, channels that do not animate a bone are dropped
+	void Compile(const std::unordered_map<std::string, uint32_t>& boneIndices);
+	// Writes the clip at time (in ticks) into pose[bone] of every animated bone, other bones are left untouched
+	void Sample(float time, std::span<BonePose> pose, AnimationCursor& cursor) const;
+	// Advances the playback clock and samples the current time, does nothing when stopped. Morph weights are sampled at the same time
+	void Update(std::span<BonePose> pose, std::span<float> morphWeights = {});
+
+	// weights of targetCount morph targets from firstTarget (model wide, see Model::GetMorphTargetCount), weights holds targetCount values per key
+	void AddMorphChannel(uint32_t firstTarget, uint32_t targetCount, std::vector<float> times, std::vector<float> weights);
+	[[nodiscard]] bool HasMorphChannels() const;
+	// writes the weights of the animated targets at time (in ticks), the others are left untouched
+	void SampleMorphWeights(float time, std::span<float> weights) const;
+
+	// Call after Compile. Drops constant and linearly interpolable keys within the tolerance and quantizes the rest on a single time base per clip:
+	// rotations as smallest-three (3x15 bits), translations and scales as 16-bit values in the range of the channel.
+	// boneLengths[bone] is the distance from the bone to its furthest descendant joint, see Skeleton::GetBoneLengths
+	bool Compress(const AnimationCompressionSettings& settings, std::span<const float> boneLengths);
+	[[nodiscard]] bool IsCompressed() const;
+	// bytes used by the keys of the clip (source keyframes and compiled or compressed tracks)
+	[[nodiscard]] size_t GetMemoryUsage() const;
+
+	[[nodiscard]] size_t GetTrackCount() const;
 
 	std::unordered_map<std::string, Keyframe>& GetKeyframes();
 	std::string GetName() const;
@@ -1032,9 +1742,154 @@ private:
 	std::unordered_map<std::string, Keyframe> m_keyframes;
 
 	Clock m_time;
+
+	struct Channel final
+	{
+		uint32_t first = 0;
+		uint32_t count = 0;
+	};
+	struct Track final
+	{
+		uint32_t bone = 0;
+		Channel position;
+		Channel rotation;
+		Channel scale;
+	};
+
+	// 3x16 bits: smallest-three rotation or range-quantized vec3
+	using QuantizedKey = std::array<uint16_t, 3>;
+	struct CompressedChannel final
+	{
+		uint32_t first = 0;
+		uint32_t count = 0;
+		// range of the quantized values, unused by rotations
+		glm::vec3 rangeMin = glm::vec3(0.0f);
+		glm::vec3 rangeExtent = glm::vec3(0.0f);
+	};
+	struct CompressedTrack final
+	{
+		uint32_t bone = 0;
+		CompressedChannel position;
+		CompressedChannel rotation;
+		CompressedChannel scale;
+	};
+
+	float advance();
+	void sampleCompressed(float time, std::span<BonePose> pose, AnimationCursor& cursor) const;
+
+	// compiled keys of all tracks stored back to back
+	std::vector<Track> m_tracks;
+	std::vector<float> m_positionTimes;
+	std::vector<glm::vec3> m_positions;
+	std::vector<float> m_rotationTimes;
+	std::vector<glm::quat> m_rotations;
+	std::vector<float> m_scaleTimes;
+	std::vector<glm::vec3> m_scales;
+
+	// compressed keys, m_keyFrames[i] is the index of the time of m_keyValues[i] in m_timeBase
+	bool m_compressed = false;
+	std::vector<CompressedTrack> m_compressedTracks;
+	std::vector<float> m_timeBase;
+	std::vector<uint16_t> m_keyFrames;
+	std::vector<QuantizedKey> m_keyValues;
+
+	struct MorphChannel final
+	{
+		uint32_t firstTarget = 0;
+		uint32_t targetCount = 0;
+		std::vector<float> times;
+		std::vector<float> weights;
+	};
+	std::vector<MorphChannel> m_morphChannels;
+
+	AnimationCursor m_cursor;
 };
 using AnimationRef = std::shared_ptr<Animation>;
 
+// shader storage bindings of the skinning matrices, the per-instance data and the pre-skinned vertices, see DrawBatcher
+constexpr GLuint BONE_PALETTE_BINDING = 0;
+constexpr GLuint DRAW_INSTANCE_BINDING = 1;
+constexpr GLuint SKINNED_VERTEX_BINDING = 2;
+// clip table and textures of baked animations, see VertexAnimation. The normals of Format::Vertices use the next texture unit
+constexpr GLuint VERTEX_ANIMATION_CLIP_BINDING = 3;
+constexpr GLuint VERTEX_ANIMATION_TEXTURE_UNIT = 8;
+
+// Bones sorted parent-before-child with their local pose. Evaluate resolves local -> model -> skinning matrices in one forward pass.
+class Skeleton final
+{
+public:
+	static constexpr uint32_t InvalidIndex = static_cast<uint32_t>(-1);
+
+	void Reserve(size_t count);
+	void Clear();
+
+	// parent must be InvalidIndex or a bone added earlier
+	uint32_t AddBone(uint32_t parent, const glm::mat4& offset, uint32_t paletteIndex, const BonePose& pose = {});
+
+	// write access for animation sampling, call MarkDirty after changing it
+	[[nodiscard]] std::span<BonePose> GetLocalPose();
+	[[nodiscard]] std::span<const BonePose> GetLocalPose() const;
+	[[nodiscard]] const BonePose& GetLocalPose(uint32_t bone) const;
+	void SetLocalPose(uint32_t bone, const BonePose& pose);
+	// every bone, after a whole pose was written
+	void MarkDirty();
+	// one bone, its descendants follow in the next Evaluate
+	void MarkDirty(uint32_t bone);
+	[[nodiscard]] bool IsDirty() const;
+
+	// Writes palette[paletteIndex] = model * scale * offset, the bone scale is not inherited by children. Only the bones marked dirty since
+	// the previous call and their descendants are evaluated again, the others keep what the previous call wrote into the same palette
+	void Evaluate(glm::mat4* palette);
+	// the same for a pose kept outside the skeleton, model receives the model space matrices (at least GetBoneCount). Lets many poses share one skeleton
+	void Evaluate(std::span<const BonePose> localPose, std::span<glm::mat4> model, glm::mat4* palette) const;
+
+	[[nodiscard]] size_t GetBoneCount() const;
+	[[nodiscard]] uint32_t GetParent(uint32_t bone) const;
+	[[nodiscard]] uint32_t GetPaletteSize() const;
+	// model space matrix of the bone from the last Evaluate
+	[[nodiscard]] const glm::mat4& GetModelMatrix(uint32_t bone) const;
+	// model space position and orientation of one bone of a local pose, walks up its parents
+	[[nodiscard]] BonePose GetModelPose(std::span<const BonePose> localPose, uint32_t bone) const;
+	// distance from every bone to its furthest descendant joint in the current local pose
+	[[nodiscard]] std::vector<float> GetBoneLengths() const;
+
+private:
+	// local matrices of the poses without their scale, the world transforms are the model space matrices
+	TransformHierarchy m_hierarchy;
+	std::vector<uint32_t> m_paletteIndices;
+	std::vector<glm::mat4> m_offsets;
+	std::vector<BonePose> m_localPose;
+	uint32_t m_paletteSize = 0;
+	// a different palette gets every bone
+	const glm::mat4* m_evaluatedPalette = nullptr;
+};
+
+// Weight of a blend layer per bone, 0 leaves the bone to the layers below
+class BoneMask final
+{
+public:
+	BoneMask() = default;
+	explicit BoneMask(size_t boneCount, float weight = 0.0f);
+
+	// sets the bone and all its descendants
+	void SetBranch(const Skeleton& skeleton, uint32_t bone, float weight);
+	void SetWeight(uint32_t bone, float weight);
+
+	// an empty mask applies the layer to every bone
+	[[nodiscard]] bool IsEmpty() const;
+	[[nodiscard]] std::span<const float> GetWeights() const;
+
+private:
+	std::vector<float> m_weights;
+};
+
+// out = a + (b - a) * weight * mask[bone], rotations by nlerp. An empty mask blends every bone, out may alias a or b
+void BlendPoses(std::span<const BonePose> a, std::span<const BonePose> b, float weight, std::span<const float> mask, std::span<BonePose> out);
+// out = difference from reference to pose, the input of AddPose. out may alias pose
+void MakeAdditivePose(std::span<const BonePose> pose, std::span<const BonePose> reference, std::span<BonePose> out);
+// applies an additive pose on top of base by weight * mask[bone]
+void AddPose(std::span<BonePose> base, std::span<const BonePose> additive, float weight, std::span<const float> mask);
+
 class Bone final : public Node
 {
 public:
@@ -1064,29 +1919,69 @@ public:
 	Transform GetTransform() override;
 	Transform GetIdle();
 
+	void SetPose(const BonePose& pose);
+	BonePose GetPose() const;
+	BonePose GetIdlePose() const;
+
+	// after attaching, the pose lives in the skeleton and is shared with animation sampling
+	void AttachToSkeleton(Skeleton* skeleton, uint32_t index);
+	uint32_t GetSkeletonIndex() const;
+
 private:
+	BonePose& pose();
+	const BonePose& pose() const;
+	void markDirty();
+
 	int m_id = 0;
 	std::string m_name = "";
-	Transform m_transform;
+	BonePose m_pose;
 	Transform m_idle;
 	glm::mat4 m_offset;
-	glm::vec3 m_size;
+
+	Skeleton* m_skeleton = nullptr;
+	uint32_t m_skeletonIndex = Skeleton::InvalidIndex;
 };
 using BoneRef = std::shared_ptr<Bone>;
 
+class Animator;
+using AnimatorRef = std::shared_ptr<Animator>;
+
 class Model final : public Node
 {
 public:
 	Model() = delete;
-	Model(const std::string& modelPath, bool flipUV = true);
+	// compressAnimations keeps only the compressed tracks of the clips, see Animation::Compress
+	Model(const std::string& modelPath, bool flipUV = true, bool compressAnimations = true);
+	Model(const Model&) = delete;
+	Model& operator=(const Model&) = delete;
 
 	void Draw(const GLProgramPipelineRef& program);
+	// every mesh with the variant of its features. bindVariant sets the uniforms of a variant, it is called after the variant is bound
+	void Draw(ShaderPermutations& permutations, const std::function<void(const GLProgramPipelineRef&)>& bindVariant, ShaderFeatures features = ShaderFeature::NONE);
+	// one instanced call per mesh, see DrawBatcher. meshVertexOffsetLocation receives the index of the first vertex of each mesh in the model
+	void DrawInstanced(const GLProgramPipelineRef& program, GLsizei instanceCount, GLuint baseInstance, GLint meshVertexOffsetLocation = -1);
 
 	[[nodiscard]] AABB GetBounding() const;
+	// bounds of the pose of the last UpdateAnim, the bind pose bounds before the first one
+	[[nodiscard]] AABB GetAnimatedBounding() const;
+	// bounds of the model posed by other skinning matrices (e.g. of a ModelInstance)
+	[[nodiscard]] AABB ComputeBounding(std::span<const glm::mat4> palette) const;
 	[[nodiscard]] std::vector<glm::vec3> GetTriangle() const;
 	std::vector<AnimationRef> GetAnimations() const;
 	std::vector<BoneRef> GetBones() const;
-	std::vector<glm::mat4>& GetPose();
+	[[nodiscard]] const Skeleton& GetSkeleton() const;
+	// skinning matrices written by the last UpdateAnim, empty without bones
+	[[nodiscard]] std::span<const glm::mat4> GetPalette() const;
+	// the matrices before the last change, for motion vectors
+	[[nodiscard]] std::span<const glm::mat4> GetPreviousPalette() const;
+	[[nodiscard]] size_t GetMeshCount() const;
+	// vertices of all meshes
+	[[nodiscard]] size_t GetVertexCount() const;
+	// all bones, in the order of the bone indices used by animation tracks
+	[[nodiscard]] const std::vector<Bone*>& GetOrderedBones() const;
+	[[nodiscard]] size_t GetBoneCount() const;
+	// index in the skeleton and GetOrderedBones, Skeleton::InvalidIndex if there is no such bone
+	[[nodiscard]] uint32_t FindBone(const std::string& name) const;
 
 	[[nodiscard]] MeshRef operator[](size_t idx);
 
@@ -1099,14 +1994,33 @@ public:
 	glm::vec3 GetPosition();
 	glm::quat GetOrientation();
 
+	// selects the clip played by UpdateAnim, -1 disables playback
+	void SetAnimation(int index);
+	[[nodiscard]] AnimationRef GetCurrentAnimation() const;
+	// the animator drives the pose instead of the current animation, nullptr returns to it
+	void SetAnimator(const AnimatorRef& animator);
+	[[nodiscard]] AnimatorRef GetAnimator() const;
+
 	void UpdateAnim(); // TODO: временно пока делаю
 	void DefaultPose();
 
+	// Morph targets of all meshes. The meshes of one node share the targets of the node, so a model wide index addresses
+	// the same target in every mesh of the node
+	static constexpr uint32_t InvalidMorphTarget = static_cast<uint32_t>(-1);
+	[[nodiscard]] size_t GetMorphTargetCount() const;
+	[[nodiscard]] const std::string& GetMorphTargetName(uint32_t target) const;
+	[[nodiscard]] uint32_t FindMorphTarget(const std::string& name) const;
+	// weights for drawing the model itself, ModelInstance keeps its own
+	void SetMorphWeight(uint32_t target, float weight);
+	[[nodiscard]] std::span<const float> GetMorphWeights() const;
+
 private:
 	void loadAssimpModel(const std::string& modelPath, bool flipUV);
 	void loadAnimations(const aiScene* scene);
+	void loadMorphAnimations(const aiScene* scene);
 	void processNode(aiNode* node, const aiScene* scene, const glm::mat4& parentTransform);
-	MeshRef processMesh(const aiMesh* mesh, const aiScene* scene, const glm::mat4& transform);
+	MeshRef processMesh(const aiMesh* mesh, const aiScene* scene, const glm::mat4& transform, uint32_t morphBase);
+	void processMorphTargets(const aiMesh* mesh, const glm::mat4& transform, uint32_t morphBase, Mesh& target);
 	void processVertex(const aiMesh* AiMesh, const glm::mat4& transform, std::vector<MeshVertex>& vertices);
 	void processIndices(const aiMesh* AiMesh, std::vector<uint32_t>& indices);
 	void processBones(const aiMesh* mesh, std::vector<MeshVertex>& vertices);
@@ -1116,21 +2030,36 @@ private:
 	void loadTextureFromMaterial(aiTextureType textureType, const aiMaterial* mat, std::vector<MaterialTexture>& textures);
 	void processMatProperties(const aiMesh* AiMesh, const aiScene* scene, MaterialProperties& meshMatProperties);
 	void computeAABB();
-
-	void calculatePose(Bone* bone);
+	void computeBoneBounds();
+	void buildBoneHierarchy();
 
 	int m_meshCount = -1;
 	std::vector<MaterialTexture> m_loadedTextures;
 	std::vector<MeshRef> m_meshes;
 	// animations data
 	std::unordered_map<std::string, std::pair<int, glm::mat4>> m_bonemap;
-	std::vector<glm::mat4> m_pose; // TODO: вместо вектора массив из 64
 	std::vector<AnimationRef> m_animations;
 	std::vector<BoneRef> m_bones;
 	std::vector<BoneRef> m_bonesChildren;
+	// all bones sorted parent-before-child, indexed the same way as m_skeleton
+	Skeleton m_skeleton;
+	std::vector<Bone*> m_orderedBones;
+	std::vector<glm::mat4> m_palette;
+	std::vector<glm::mat4> m_previousPalette;
+	AnimationRef m_currentAnimation;
+	AnimatorRef m_animator;
+	bool m_compressAnimations = true;
+	std::vector<std::string> m_morphTargetNames;
+	std::vector<float> m_morphWeights;
+	// first morph target of every node with morph targets, morph animation channels are named after the node
+	std::unordered_map<std::string, uint32_t> m_morphNodes;
 
 	std::string m_directory;
 	AABB m_bounding;
+	AABB m_animatedBounding;
+	// vertices grouped by the skinning matrices that move them, vertices without weights stay in m_unskinnedBounding
+	std::vector<BoneBounds> m_boneBounds;
+	AABB m_unskinnedBounding;
 
 	glm::mat4 m_globalInverseTransform;
 
@@ -1139,6 +2068,449 @@ private:
 };
 using ModelRef = std::shared_ptr<Model>;
 
+// Blends clips of a Model into one pose. Every layer plays a small state machine and crossfades between at most two states, layers are then
+// applied bottom to top: override layers blend over the result by weight and mask, additive layers add their difference to the first frame of the clip.
+// All pose buffers are allocated while the layers and states are set up, Update only samples and blends.
+class Animator final
+{
+public:
+	static constexpr uint32_t AnyState = static_cast<uint32_t>(-1);
+
+	enum class LayerMode
+	{
+		Override,
+		Additive
+	};
+
+	explicit Animator(const Model& model);
+
+	uint32_t AddLayer(LayerMode mode = LayerMode::Override, const BoneMask& mask = {}, float weight = 1.0f);
+	void SetLayerWeight(uint32_t layer, float weight);
+	uint32_t AddState(uint32_t layer, const std::string& name, const AnimationRef& clip, float speed = 1.0f, bool loop = true);
+	// from can be AnyState. Without a trigger the transition starts when a non-looping state reaches its end
+	void AddTransition(uint32_t layer, uint32_t from, uint32_t to, float fadeDuration, const std::string& trigger = {});
+
+	// triggers are consumed by the next Update
+	void SetTrigger(const std::string& trigger);
+	void Play(uint32_t layer, uint32_t state, float fadeDuration = 0.0f);
+
+	// advances by the time since the previous call
+	void Update(std::span<BonePose> pose);
+	void Update(float deltaSeconds, std::span<BonePose> pose);
+
+	// bone and all its descendants, exclude gives the rest of the skeleton (e.g. "Spine" for the upper body and the lower body)
+	[[nodiscard]] BoneMask CreateMask(const std::string& branchRoot, bool exclude = false) const;
+	[[nodiscard]] uint32_t FindState(uint32_t layer, const std::string& name) const;
+	[[nodiscard]] uint32_t GetCurrentState(uint32_t layer) const;
+	[[nodiscard]] size_t GetLayerCount() const;
+
+private:
+	struct State final
+	{
+		std::string name;
+		AnimationRef clip;
+		float speed = 1.0f;
+		bool loop = true;
+		// first frame of the clip, additive layers only
+		std::vector<BonePose> reference;
+	};
+	struct Transition final
+	{
+		uint32_t from = AnyState;
+		uint32_t to = 0;
+		float fadeDuration = 0.0f;
+		std::string trigger;
+	};
+	struct Layer final
+	{
+		LayerMode mode = LayerMode::Override;
+		BoneMask mask;
+		float weight = 1.0f;
+		std::vector<State> states;
+		std::vector<Transition> transitions;
+
+		uint32_t current = AnyState;
+		float currentTime = 0.0f;
+		// AnyState while fading from a frozen pose
+		uint32_t previous = AnyState;
+		float previousTime = 0.0f;
+		float fadeTime = 0.0f;
+		float fadeDuration = 0.0f;
+
+		AnimationCursor currentCursor;
+		AnimationCursor previousCursor;
+		std::vector<BonePose> currentPose;
+		std::vector<BonePose> previousPose;
+		std::vector<BonePose> result;
+	};
+
+	void startTransition(Layer& layer, uint32_t state, float fadeDuration);
+	void advance(const Layer& layer, uint32_t state, float deltaSeconds, float& time) const;
+	bool sampleState(Layer& layer, uint32_t state, float time, AnimationCursor& cursor, std::vector<BonePose>& pose);
+	void updateLayer(Layer& layer, float deltaSeconds);
+
+	const Skeleton& m_skeleton;
+	std::vector<std::string> m_boneNames;
+	std::vector<BonePose> m_restPose;
+	std::vector<Layer> m_layers;
+	std::vector<std::string> m_triggers;
+	Clock m_clock;
+};
+
+// Pose of one character drawn with a shared Model: its own local pose, playback and skinning matrices. Lets many characters use one Model
+// so DrawBatcher draws them with one instanced call per mesh.
+class ModelInstance final
+{
+public:
+	explicit ModelInstance(Model& model);
+
+	// the animator drives the pose instead of the clip set by SetAnimation
+	void SetAnimator(const AnimatorRef& animator);
+	// plays a clip of the model in a loop without blending, -1 keeps the current pose
+	void SetAnimation(int index, float startTime = 0.0f);
+	[[nodiscard]] const AnimationRef& GetAnimation() const;
+	// playback time of the clip in ticks, setting it jumps there with the next Update
+	[[nodiscard]] float GetAnimationTime() const;
+	void SetAnimationTime(float time);
+
+	// Advances by the time since the previous call and returns the number of evaluated bones.
+	// interval > 1 samples the pose interval frames ahead and interpolates towards it in between, 0 (culled) only accumulates the time,
+	// which is caught up with a single sample when the instance is updated again.
+	uint32_t Update(uint32_t interval = 1);
+	uint32_t Update(float deltaSeconds, uint32_t interval = 1);
+	// Update in two steps, for corrections of the local pose in between (IK): Advance samples the pose and returns false when there is
+	// nothing to evaluate, Evaluate builds the skinning matrices
+	bool Advance(float deltaSeconds, uint32_t interval = 1);
+	uint32_t Evaluate();
+
+	[[nodiscard]] Model& GetModel() const;
+	[[nodiscard]] std::span<BonePose> GetLocalPose();
+	[[nodiscard]] std::span<const glm::mat4> GetPalette() const;
+	[[nodiscard]] std::span<const glm::mat4> GetPreviousPalette() const;
+	// model space bounds of the current pose
+	[[nodiscard]] AABB GetBounding() const;
+	// weights of the morph targets of the model, a clip with morph channels overwrites the animated ones
+	void SetMorphWeight(uint32_t target, float weight);
+	[[nodiscard]] std::span<const float> GetMorphWeights() const;
+
+private:
+	// false without an animator or clip
+	bool sample(float deltaSeconds, std::span<BonePose> pose);
+
+	Model* m_model = nullptr;
+	// evaluated with the skeleton of the model
+	std::vector<BonePose> m_localPose;
+	bool m_dirty = true;
+	std::vector<glm::mat4> m_palette;
+	std::vector<glm::mat4> m_previousPalette;
+	AABB m_bounding;
+	std::vector<float> m_morphWeights;
+	AnimatorRef m_animator;
+	AnimationRef m_animation;
+	AnimationCursor m_cursor;
+	float m_time = 0.0f;
+	Clock m_clock;
+
+	// reduced rate: the displayed pose moves from m_fromPose to m_toPose over m_segmentLength frames
+	std::vector<BonePose> m_fromPose;
+	std::vector<BonePose> m_toPose;
+	float m_pendingTime = 0.0f;
+	uint32_t m_interval = 1;
+	uint32_t m_phase = 0;
+	uint32_t m_segmentLength = 0;
+	uint32_t m_segmentStep = 0;
+	bool m_stale = false;
+};
+
+// Clips of a Model baked into textures for crowds too far away for skeletal animation, played back by VertexAnimationRenderer.
+// Format::Vertices stores the skinned position and normal of every vertex per frame: nothing is left to skin, the size grows with the vertex count.
+// Format::Bones stores the skinning matrices as three rows per bone: much smaller, the vertex shader still blends the bones of the vertex.
+// The vertex shader interpolates the two frames around the playback time, clips loop.
+class VertexAnimation final
+{
+public:
+	enum class Format
+	{
+		Vertices,
+		Bones
+	};
+
+	static constexpr uint32_t InvalidClip = static_cast<uint32_t>(-1);
+	// Format::Vertices wraps the vertices of a frame into rows of this width
+	static constexpr uint32_t MaxRowWidth = 4096;
+
+	// clips are indices into Model::GetAnimations, empty bakes all of them
+	VertexAnimation(Model& model, std::span<const int> clips = {}, Format format = Format::Bones, float framesPerSecond = 30.0f);
+
+	// textures and the clip table, see VERTEX_ANIMATION_TEXTURE_UNIT and VERTEX_ANIMATION_CLIP_BINDING
+	void Bind() const;
+
+	[[nodiscard]] bool IsValid() const;
+	[[nodiscard]] Model& GetModel() const;
+	[[nodiscard]] Format GetFormat() const;
+	[[nodiscard]] uint32_t GetRowsPerFrame() const;
+	[[nodiscard]] uint32_t GetClipCount() const;
+	// the baked clip of a model animation or InvalidClip
+	[[nodiscard]] uint32_t FindClip(const Animation* animation) const;
+	[[nodiscard]] const AnimationRef& GetAnimation(uint32_t clip) const;
+	// in seconds
+	[[nodiscard]] float GetClipDuration(uint32_t clip) const;
+	// model space bounds of every frame of the clip
+	[[nodiscard]] AABB GetClipBounding(uint32_t clip) const;
+	// bytes of the textures
+	[[nodiscard]] size_t GetMemoryUsage() const;
+
+private:
+	// std430 layout of one element of the VertexAnimationClips buffer
+	struct Clip final
+	{
+		uint32_t firstRow = 0;
+		uint32_t frameCount = 1;
+		float framesPerSecond = 30.0f;
+		float padding = 0.0f;
+	};
+
+	Model* m_model = nullptr;
+	Format m_format = Format::Bones;
+	uint32_t m_rowsPerFrame = 1;
+	std::vector<Clip> m_clips;
+	std::vector<AnimationRef> m_animations;
+	std::vector<AABB> m_clipBounds;
+	GLTexture2DRef m_data;
+	GLTexture2DRef m_normals;
+	std::unique_ptr<GPUBuffer> m_clipBuffer;
+	size_t m_memoryUsage = 0;
+};
+using VertexAnimationRef = std::shared_ptr<VertexAnimation>;
+
+// Inverse kinematics on local poses (e.g. ModelInstance::GetLocalPose). The solvers take batches of jobs in model space and process
+// four jobs at once, one per SIMD lane, so the jobs of many characters are best solved with one call. The Make functions read a job from
+// a pose, the Apply functions write the solved rotations back into it. Model space poses are rigid, bone scale is not inherited.
+
+// hip, knee and ankle: middle is a child of root, the end bone may hang elsewhere in the hierarchy (e.g. a foot control bone)
+struct TwoBoneIKChain final
+{
+	uint32_t root = Skeleton::InvalidIndex;
+	uint32_t middle = Skeleton::InvalidIndex;
+	uint32_t end = Skeleton::InvalidIndex;
+};
+
+struct TwoBoneIKJob final
+{
+	// model space joints of the pose and the target of the end joint
+	glm::vec3 root = glm::vec3(0.0f);
+	glm::vec3 middle = glm::vec3(0.0f);
+	glm::vec3 end = glm::vec3(0.0f);
+	glm::vec3 target = glm::vec3(0.0f);
+	// the middle joint turns towards the pole by poleWeight, at 0 the limb keeps its bend plane
+	glm::vec3 pole = glm::vec3(0.0f);
+	float poleWeight = 0.0f;
+	float weight = 1.0f;
+	// model space orientations of the bones in the pose
+	glm::quat rootOrientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::quat middleOrientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::quat endOrientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	// result: model space rotations about the root and the middle joint
+	glm::quat rootRotation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::quat middleRotation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+};
+
+struct LookAtIKJob final
+{
+	// model space joint, the direction the bone points along in the pose and the point to look at
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 forward = glm::vec3(0.0f, 0.0f, 1.0f);
+	glm::vec3 target = glm::vec3(0.0f, 0.0f, 1.0f);
+	float weight = 1.0f;
+	// radians
+	float maxAngle = glm::pi<float>();
+	glm::quat orientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	// result: model space rotation about the joint
+	glm::quat rotation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+};
+
+struct FABRIKJob final
+{
+	// model space joints from the root to the end of the chain, replaced by the solved positions. The root joint stays in place
+	std::span<glm::vec3> joints;
+	glm::vec3 target = glm::vec3(0.0f);
+	float weight = 1.0f;
+};
+
+void SolveTwoBoneIK(std::span<TwoBoneIKJob> jobs);
+void SolveLookAtIK(std::span<LookAtIKJob> jobs);
+// consecutive jobs with the same number of joints share the lanes
+void SolveFABRIK(std::span<FABRIKJob> jobs, uint32_t iterations = 8, float tolerance = 0.001f);
+
+[[nodiscard]] TwoBoneIKJob MakeTwoBoneIKJob(const Skeleton& skeleton, std::span<const BonePose> pose, const TwoBoneIKChain& chain, const glm::vec3& target, float weight = 1.0f);
+// rotates root and middle, the end bone follows the middle joint and gets the model space endOrientation (job.endOrientation keeps it)
+void ApplyTwoBoneIK(const Skeleton& skeleton, std::span<BonePose> pose, const TwoBoneIKChain& chain, const TwoBoneIKJob& job, const glm::quat& endOrientation);
+// axis is the bone space direction that should point at the target
+[[nodiscard]] LookAtIKJob MakeLookAtIKJob(const Skeleton& skeleton, std::span<const BonePose> pose, uint32_t bone, const glm::vec3& axis, const glm::vec3& target, float weight = 1.0f, float maxAngle = glm::pi<float>());
+void ApplyLookAtIK(std::span<BonePose> pose, uint32_t bone, const LookAtIKJob& job);
+// model space poses of a chain where every bone is the parent of the next one, joints receives their positions
+void GetChainModelPoses(const Skeleton& skeleton, std::span<const BonePose> pose, std::span<const uint32_t> bones, std::span<BonePose> modelPoses, std::span<glm::vec3> joints);
+// turns every bone of the chain so that the joints move from modelPoses to the solved joints
+void ApplyFABRIK(std::span<BonePose> pose, std::span<const uint32_t> bones, std::span<const BonePose> modelPoses, std::span<const glm::vec3> joints);
+
+struct GroundHit final
+{
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 normal = glm::vec3(0.0f, 1.0f, 0.0f);
+	bool hit = false;
+};
+
+// World space rays straight down: hits[i] receives the first ground below origins[i] within maxDistance. Gets the rays of all characters at once,
+// so that an implementation can batch them (heightfield lookups, a physics batch query).
+using GroundQuery = std::function<void(std::span<const glm::vec3> origins, float maxDistance, std::span<GroundHit> hits)>;
+
+// a posed instance waiting for its skinning matrices, see AnimationWorld::SetPoseStage
+struct IKCharacter final
+{
+	ModelInstance* instance = nullptr;
+	glm::mat4 world = glm::mat4(1.0f);
+	float weight = 1.0f;
+};
+
+struct FootIKSettings final
+{
+	// world units: the rays start above the feet, a foot moves at most maxDrop down and maxRaise up
+	float rayHeight = 0.5f;
+	float maxDrop = 0.5f;
+	float maxRaise = 0.5f;
+	bool alignToGround = true;
+};
+
+// Plants the feet of characters on uneven ground. The animation walks on the plane through the character origin, every foot moves by the height of the
+// ground below it relative to the origin, the pelvis drops for the lower foot and both legs are solved together with SolveTwoBoneIK.
+class FootIK final
+{
+public:
+	// bones by name, the pole bone is optional
+	struct Leg final
+	{
+		std::string upper;
+		std::string lower;
+		std::string foot;
+		std::string pole;
+	};
+
+	FootIK(const Model& model, const std::string& pelvis, const Leg& left, const Leg& right);
+
+	void SetSettings(const FootIKSettings& settings);
+	[[nodiscard]] const FootIKSettings& GetSettings() const;
+	[[nodiscard]] bool IsValid() const;
+
+	// characters of other models are skipped, one query for all feet. Returns the number of solved legs
+	uint32_t Solve(std::span<const IKCharacter> characters, const GroundQuery& query);
+
+private:
+	struct LegBones final
+	{
+		TwoBoneIKChain chain;
+		uint32_t pole = Skeleton::InvalidIndex;
+		// the joints move with the pelvis
+		bool rootFollowsPelvis = false;
+		bool endFollowsPelvis = false;
+		bool poleFollowsPelvis = false;
+	};
+	// model space state of a character between the ray query and the solve
+	struct CharacterState final
+	{
+		TwoBoneIKJob legs[2];
+		glm::mat3 inverseWorld = glm::mat3(1.0f);
+		float weight = 0.0f;
+		size_t character = 0;
+	};
+
+	[[nodiscard]] bool findLeg(const Leg& names, LegBones& leg) const;
+	[[nodiscard]] bool isDescendant(uint32_t bone, uint32_t ancestor) const;
+
+	const Model* m_model = nullptr;
+	uint32_t m_pelvis = Skeleton::InvalidIndex;
+	LegBones m_legs[2];
+	FootIKSettings m_settings;
+	bool m_valid = false;
+	std::vector<CharacterState> m_states;
+	std::vector<glm::vec3> m_origins;
+	std::vector<GroundHit> m_hits;
+};
+
+struct SpringChainSettings final
+{
+	// per step: the pull back towards the animated shape and the part of the velocity that is lost
+	float stiffness = 0.05f;
+	float damping = 0.1f;
+	// world space, units per second squared
+	glm::vec3 gravity = glm::vec3(0.0f, -9.81f, 0.0f);
+	// collision radius of the joints
+	float radius = 0.02f;
+};
+
+// Secondary motion of hair, capes and accessories: the joints of a bone chain are Verlet particles that keep the bone lengths, spring back
+// towards the animated shape and are pushed out of capsules between bones. The root joint follows the animation.
+// Runs after the clips are sampled (see AnimationWorld::SetPoseStage). The state is stored as structure of arrays: one chain of four
+// characters fills the SIMD lanes, so the cost per chain stays the same with one or many chains per character.
+class SpringBones final
+{
+public:
+	explicit SpringBones(const Model& model);
+
+	// bones from the root to the tip, every bone the parent of the next one. Chains may not share bones, a chain hanging below another one is added after it
+	bool AddChain(std::span<const std::string> bones, const SpringChainSettings& settings = {});
+	// capsule from the joint of bone to the joint of end, a sphere when end is empty
+	bool AddCapsule(const std::string& bone, const std::string& end, float radius);
+	[[nodiscard]] size_t GetChainCount() const;
+
+	// characters of other models are skipped, a character that was not simulated in the previous call starts from its animated pose.
+	// Returns the number of simulated chains
+	uint32_t Simulate(std::span<const IKCharacter> characters, float deltaSeconds);
+	// drops the state of a character, e.g. after a teleport or before the instance is destroyed
+	void Reset(const ModelInstance& instance);
+	void Clear();
+
+private:
+	struct Chain final
+	{
+		std::vector<uint32_t> bones;
+		SpringChainSettings settings;
+		// in m_state of a group
+		size_t offset = 0;
+	};
+	struct Capsule final
+	{
+		uint32_t bone = Skeleton::InvalidIndex;
+		uint32_t end = Skeleton::InvalidIndex;
+		float radius = 0.0f;
+	};
+	struct Slot final
+	{
+		uint64_t lastStep = 0;
+		size_t character = 0;
+		bool active = false;
+		bool restart = true;
+	};
+
+	// four slots, one per lane
+	static constexpr size_t LaneCount = 4;
+	// positions and previous positions of a joint: x, y, z, previous x, y, z, each for all lanes
+	static constexpr size_t JointStride = 6 * LaneCount;
+
+	[[nodiscard]] bool overlaps(uint32_t bone) const;
+
+	const Model* m_model = nullptr;
+	std::vector<Chain> m_chains;
+	std::vector<Capsule> m_capsules;
+	size_t m_groupStride = 0;
+	std::vector<float> m_state;
+	std::unordered_map<const ModelInstance*, uint32_t> m_slotIndices;
+	std::vector<Slot> m_slots;
+	std::vector<uint32_t> m_freeSlots;
+	std::vector<uint32_t> m_groups;
+	uint64_t m_step = 0;
+	float m_previousDelta = 0.0f;
+};
+
 #pragma endregion
 
 //==============================================================================
@@ -1236,6 +2608,453 @@ private:
 
 #pragma endregion
 
+//==============================================================================
+// ECS
+//==============================================================================
+#pragma region ECS
+
+constexpr size_t ECS_CHUNK_SIZE = 16 * 1024;
+constexpr uint32_t ECS_MAX_COMPONENT_TYPES = 64;
+
+struct Entity final
+{
+	uint32_t index = static_cast<uint32_t>(-1);
+	uint32_t generation = 0;
+
+	bool operator==(const Entity&) const = default;
+};
+
+using ComponentTypeId = uint32_t;
+using ComponentMask = uint64_t;
+
+struct ComponentTypeInfo final
+{
+	size_t size = 0;
+	size_t alignment = 0;
+};
+
+ComponentTypeId RegisterComponentType(size_t size, size_t alignment);
+[[nodiscard]] const ComponentTypeInfo& GetComponentTypeInfo(ComponentTypeId type);
+
+// Components must be trivially copyable, they are moved between chunks with memcpy
+template<typename T>
+[[nodiscard]] ComponentTypeId GetComponentTypeId();
+template<typename... T>
+[[nodiscard]] ComponentMask MakeComponentMask();
+
+// All entities with the same set of components. Rows are dense across chunks; each chunk holds one SoA array per component.
+class Archetype final
+{
+public:
+	explicit Archetype(ComponentMask mask);
+	Archetype(const Archetype&) = delete;
+	Archetype& operator=(const Archetype&) = delete;
+
+	[[nodiscard]] ComponentMask GetMask() const;
+	[[nodiscard]] uint32_t GetChunkCapacity() const;
+	[[nodiscard]] size_t GetChunkCount() const;
+	[[nodiscard]] uint32_t GetChunkSize(size_t chunk) const;
+	[[nodiscard]] size_t GetEntityCount() const;
+
+	[[nodiscard]] Entity* GetEntities(size_t chunk);
+	[[nodiscard]] void* GetComponents(size_t chunk, ComponentTypeId type);
+	template<typename T>
+	[[nodiscard]] T* GetComponents(size_t chunk);
+
+	// appends a row with uninitialized components and returns {chunk, row}
+	std::pair<uint32_t, uint32_t> Allocate(Entity entity);
+	// moves the last row into the freed one and returns the moved entity (invalid if nothing was moved)
+	Entity Free(uint32_t chunk, uint32_t row);
+
+private:
+	struct alignas(64) ChunkStorage final
+	{
+		std::byte bytes[ECS_CHUNK_SIZE];
+	};
+
+	ComponentMask m_mask = 0;
+	uint32_t m_capacity = 0;
+	std::array<uint32_t, ECS_MAX_COMPONENT_TYPES> m_offsets = {};
+	std::vector<std::unique_ptr<ChunkStorage>> m_chunks;
+	size_t m_entityCount = 0;
+};
+
+class World final
+{
+public:
+	World() = default;
+	World(const World&) = delete;
+	World& operator=(const World&) = delete;
+
+	Entity Create();
+	template<typename... T>
+	Entity Create(const T&... components);
+	void Destroy(Entity entity);
+
+	[[nodiscard]] bool IsAlive(Entity entity) const;
+	[[nodiscard]] size_t GetEntityCount() const;
+
+	template<typename T>
+	void Add(Entity entity, const T& component = {});
+	template<typename T>
+	void Remove(Entity entity);
+	template<typename T>
+	[[nodiscard]] bool Has(Entity entity) const;
+	template<typename T>
+	[[nodiscard]] T* Get(Entity entity);
+
+	// Queries. Entities must not be created, destroyed or change components inside func.
+	// func(size_t count, Entity* entities, T*... components) is called once per chunk
+	template<typename... T, typename Func>
+	void EachChunk(Func&& func);
+	template<typename... T, typename Func>
+	void ParallelEachChunk(Func&& func);
+	// func(Entity entity, T&... components) is called once per entity
+	template<typename... T, typename Func>
+	void Each(Func&& func);
+	template<typename... T, typename Func>
+	void ParallelEach(Func&& func);
+
+private:
+	struct EntityRecord final
+	{
+		Archetype* archetype = nullptr;
+		uint32_t chunk = 0;
+		uint32_t row = 0;
+		uint32_t generation = 0;
+	};
+
+	struct QueryCache final
+	{
+		size_t archetypeCount = 0;
+		std::vector<Archetype*> archetypes;
+	};
+
+	Archetype* getOrCreateArchetype(ComponentMask mask);
+	// moves the entity to the archetype of newMask, added components are left uninitialized
+	void moveEntity(Entity entity, ComponentMask newMask);
+	void* getComponent(Entity entity, ComponentTypeId type);
+	const std::vector<Archetype*>& query(ComponentMask mask);
+
+	std::vector<EntityRecord> m_entities;
+	std::vector<uint32_t> m_freeIndices;
+	std::unordered_map<ComponentMask, std::unique_ptr<Archetype>> m_archetypes;
+	std::vector<Archetype*> m_archetypeList;
+	std::unordered_map<ComponentMask, QueryCache> m_queries;
+	size_t m_aliveCount = 0;
+};
+
+struct TransformComponent final
+{
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::quat orientation = glm::quat::wxyz(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::vec3 scale = glm::vec3(1.0f);
+};
+
+struct WorldMatrixComponent final
+{
+	glm::mat4 world = glm::mat4(1.0f);
+};
+
+struct BoundsComponent final
+{
+	AABB local;
+	AABB world;
+};
+
+struct VisibilityComponent final
+{
+	bool visible = true;
+};
+
+// neither the model nor the instance is owned by the entity. With an instance the skinning matrices come from it instead of the model
+struct RenderComponent final
+{
+	Model* model = nullptr;
+	ModelInstance* instance = nullptr;
+};
+
+// animates the instance if there is one, otherwise the model itself (which then needs one Model per entity). Animators are updated in parallel
+struct AnimatorComponent final
+{
+	Model* model = nullptr;
+	ModelInstance* instance = nullptr;
+};
+
+// A character that switches to baked playback far from the camera, see Systems::SwitchVertexAnimations. While baked the entity has no
+// RenderComponent and AnimatorComponent, they are rebuilt from the instance when it comes back.
+struct VertexAnimationComponent final
+{
+	const VertexAnimation* animation = nullptr;
+	ModelInstance* instance = nullptr;
+	// played when the instance has no baked clip (e.g. it is driven by an Animator)
+	uint32_t clip = 0;
+	// playback time = time * speed + timeOffset, in seconds
+	float timeOffset = 0.0f;
+	float speed = 1.0f;
+	bool baked = false;
+};
+
+struct DrawItem final
+{
+	Model* model = nullptr;
+	glm::mat4 world = glm::mat4(1.0f);
+	// skinning matrices of the instance, empty for static models
+	std::span<const glm::mat4> palette;
+	std::span<const glm::mat4> previousPalette;
+	// see Model::GetMorphTargetCount, empty or all zero draws the base shape
+	std::span<const float> morphWeights;
+};
+
+struct VertexAnimationItem final
+{
+	const VertexAnimation* animation = nullptr;
+	glm::mat4 world = glm::mat4(1.0f);
+	uint32_t clip = 0;
+	float timeOffset = 0.0f;
+	float speed = 1.0f;
+};
+
+// Characters further than distance are drawn from baked clips. The hysteresis (a fraction of the distance) keeps characters near the
+// threshold from switching every frame.
+struct VertexAnimationSwitchSettings final
+{
+	glm::vec3 cameraPosition = glm::vec3(0.0f);
+	float distance = 40.0f;
+	float hysteresis = 0.1f;
+	// playback time of VertexAnimationRenderer::Draw, in seconds
+	float time = 0.0f;
+};
+
+// Update rate of animated characters by the height of their bounds on screen (a fraction of the screen height). Visibility is the one
+// of the last Systems::UpdateVisibility, culled characters are not evaluated at all.
+struct AnimationLODSettings final
+{
+	glm::vec3 cameraPosition = glm::vec3(0.0f);
+	// projection[1][1] of the camera
+	float projectionScale = 1.0f;
+	// every frame above this size, every second frame above halfRateScreenSize, every fourth below
+	float fullRateScreenSize = 0.2f;
+	float halfRateScreenSize = 0.08f;
+};
+
+struct AnimationLODStats final
+{
+	uint32_t fullRate = 0;
+	uint32_t reducedRate = 0;
+	uint32_t culled = 0;
+	uint32_t evaluatedBones = 0;
+};
+
+namespace Systems
+{
+	// TransformComponent -> WorldMatrixComponent
+	void UpdateTransforms(World& world);
+	// WorldMatrixComponent + BoundsComponent local -> BoundsComponent world
+	void UpdateBounds(World& world);
+	// BoundsComponent world -> VisibilityComponent
+	void UpdateVisibility(World& world, const Frustum& frustum);
+	void UpdateAnimations(World& world);
+	// AnimatorComponent + BoundsComponent + VisibilityComponent with an update rate per character, see AnimationLODSettings
+	AnimationLODStats UpdateAnimations(World& world, const AnimationLODSettings& settings);
+	// AnimatorComponent -> BoundsComponent local, from the pose of the last animation update
+	void UpdateAnimatedBounds(World& world);
+	// collects visible WorldMatrixComponent + RenderComponent + VisibilityComponent entities sorted by model
+	void SubmitDraws(World& world, std::vector<DrawItem>& drawList);
+	// moves VertexAnimationComponent entities between skeletal and baked playback by distance, keeping the clip time of the instance
+	void SwitchVertexAnimations(World& world, const VertexAnimationSwitchSettings& settings);
+	// collects visible baked WorldMatrixComponent + VertexAnimationComponent + VisibilityComponent entities sorted by animation
+	void SubmitVertexAnimations(World& world, std::vector<VertexAnimationItem>& drawList);
+}
+
+// ModelInstances that are not entities, updated as one batch: sampling, blending and the skinning matrices of all instances run in
+// parallel on the job system, then GetDrawItems hands the whole batch sorted by model to DrawBatcher::Prepare.
+class AnimationWorld final
+{
+public:
+	// the instance must stay alive while it is in the world
+	void Add(ModelInstance& instance, const glm::mat4& world = glm::mat4(1.0f));
+	void Remove(ModelInstance& instance);
+	void Clear();
+
+	void SetTransform(ModelInstance& instance, const glm::mat4& world);
+	// see ModelInstance::Update, 0 keeps the instance out of the draw items
+	void SetInterval(ModelInstance& instance, uint32_t interval);
+	// instances per job
+	void SetGrainSize(size_t grainSize);
+	// Called by Update with the sampled instances before their skinning matrices are built, e.g. for FootIK::Solve.
+	// Runs on the calling thread, the stage may start its own parallel work.
+	void SetPoseStage(std::function<void(std::span<const IKCharacter>)> stage);
+
+	// advances by the time since the previous call
+	AnimationLODStats Update();
+	AnimationLODStats Update(float deltaSeconds);
+
+	// instances that were updated by the last Update
+	[[nodiscard]] std::span<const DrawItem> GetDrawItems() const;
+	[[nodiscard]] size_t GetInstanceCount() const;
+
+private:
+	struct Entry final
+	{
+		ModelInstance* instance = nullptr;
+		glm::mat4 world = glm::mat4(1.0f);
+		uint32_t interval = 1;
+	};
+
+	[[nodiscard]] Entry* find(const ModelInstance& instance);
+
+	std::vector<Entry> m_entries;
+	std::unordered_map<const ModelInstance*, size_t> m_indices;
+	std::vector<DrawItem> m_drawItems;
+	std::function<void(std::span<const IKCharacter>)> m_poseStage;
+	std::vector<IKCharacter> m_posed;
+	size_t m_grainSize = 16;
+	// entries are sorted by model before the next update
+	bool m_sorted = true;
+	Clock m_clock;
+};
+
+// std430 layout of one element of the DrawInstances buffer
+struct DrawInstance final
+{
+	static constexpr uint32_t NotSkinned = static_cast<uint32_t>(-1);
+
+	glm::mat4 world = glm::mat4(1.0f);
+	uint32_t paletteBase = 0;
+	// 0 for static models
+	uint32_t boneCount = 0;
+	uint32_t previousPaletteBase = 0;
+	// first vertex in SkinnedVertices, NotSkinned makes the vertex shader skin the instance itself
+	uint32_t skinnedBase = NotSkinned;
+	// the skinning pass writes the vertices of this instance in this list
+	uint32_t skin = 0;
+	// playback of a baked clip, see VertexAnimationRenderer
+	uint32_t vertexAnimationClip = 0;
+	float vertexAnimationTime = 0.0f;
+	float vertexAnimationSpeed = 1.0f;
+};
+
+// std430 layout of one element of the SkinnedVertices buffer, in model space
+struct SkinnedVertex final
+{
+	glm::vec4 position;
+	glm::vec4 previousPosition;
+	glm::vec4 normal;
+	glm::vec4 tangent;
+};
+
+// GLSL of DrawInstance, SkinnedVertex and the clips of VertexAnimationRenderer, goes after #version
+[[nodiscard]] std::string_view GetDrawInstanceShaderSource();
+// GLSL of the DrawBatcher and VertexAnimationRenderer inputs of a vertex shader, includes GetDrawInstanceShaderSource: the buffers,
+// vertexAnimation(instance, pos, normal) and paletteSkinning(paletteBase). Goes after the ids and weights vertex inputs
+[[nodiscard]] std::string_view GetDrawInstanceVertexShaderSource();
+
+// Writes the instance data and skinning matrices of a sorted draw list into two shared storage buffers, then draws every run of the same model
+// with one instanced call per mesh. Vertex shaders read instances[gl_BaseInstance + gl_InstanceID] (DRAW_INSTANCE_BINDING) and
+// pose[paletteBase + bone] (BONE_PALETTE_BINDING), so there is no limit on bones per character and no upload per draw.
+// With pre-skinning a compute pass skins every visible character once per frame into SkinnedVertices (SKINNED_VERTEX_BINDING), together with
+// the positions of the previous palette for motion vectors. Later lists of the same frame reuse the vertices, so shadow and depth passes draw
+// characters like static geometry: skinned[skinnedBase + uMeshVertexOffset + gl_VertexID].
+class DrawBatcher final
+{
+public:
+	DrawBatcher(uint32_t instanceCapacity = 1024, uint32_t paletteCapacity = 16384, uint32_t skinnedVertexCapacity = 65536);
+
+	void SetPreSkinning(bool enabled);
+	// starts a new frame of pre-skinned vertices, call before the first Prepare of a frame
+	void BeginFrame();
+	// once per draw list, the list must be sorted by model (see Systems::SubmitDraws). The buffers grow when the list does not fit,
+	// characters that do not fit into the skinned vertices this frame fall back to skinning in the vertex shader
+	void Prepare(std::span<const DrawItem> items);
+	// draws the list given to the last Prepare, setup is called before the draws of every model
+	void Draw(const GLProgramPipelineRef& program, const std::function<void(const Model&)>& setup = {});
+
+	[[nodiscard]] uint32_t GetInstanceCount() const;
+	[[nodiscard]] uint32_t GetDrawCallCount() const;
+	[[nodiscard]] uint32_t GetSkinnedVertexCount() const;
+
+private:
+	struct Run final
+	{
+		Model* model = nullptr;
+		uint32_t first = 0;
+		uint32_t count = 0;
+		bool skin = false;
+		bool morph = false;
+	};
+
+	void reserve(uint32_t instanceCount, uint32_t paletteSize);
+	void skin();
+
+	static constexpr uint32_t NotMorphed = static_cast<uint32_t>(-1);
+
+	// two passes per frame with three frames in flight
+	static constexpr uint32_t RegionCount = 6;
+
+	std::unique_ptr<GPURingBuffer> m_instances;
+	std::unique_ptr<GPURingBuffer> m_palettes;
+	uint32_t m_instanceCapacity = 0;
+	uint32_t m_paletteCapacity = 0;
+	std::vector<Run> m_runs;
+	std::vector<uint32_t> m_paletteBases;
+	std::vector<uint32_t> m_skinnedBases;
+	std::vector<uint8_t> m_skinFlags;
+	uint32_t m_instanceCount = 0;
+	uint32_t m_drawCallCount = 0;
+
+	bool m_preSkinning = true;
+	GLProgramPipelineRef m_skinningProgram;
+	std::unique_ptr<GPUBuffer> m_skinnedVertices;
+	uint32_t m_skinnedCapacity = 0;
+	uint32_t m_skinnedCount = 0;
+	uint32_t m_skinnedRequired = 0;
+	// the palette storage of a Model or ModelInstance identifies the character within a frame, the weights storage a model without bones
+	std::unordered_map<const void*, uint32_t> m_skinnedSlots;
+
+	// per instance the first weight of the instance (NotMorphed without active morph targets), then the weights as float bits
+	GLProgramPipelineRef m_morphProgram;
+	std::unique_ptr<GPURingBuffer> m_morphs;
+	uint32_t m_morphCapacity = 0;
+	std::vector<uint32_t> m_morphBases;
+};
+
+// Draws baked clips (VertexAnimation) instanced like DrawBatcher, with no animation work on the CPU: an instance only carries its clip,
+// time offset and speed. The vertex shader takes the same DrawInstances buffer, uVertexAnimation selects the baked path
+// (0 off, 1 Format::Vertices, 2 Format::Bones) and uVertexAnimationTime is the time of the whole list.
+class VertexAnimationRenderer final
+{
+public:
+	explicit VertexAnimationRenderer(uint32_t instanceCapacity = 1024);
+
+	// once per list, the list must be sorted by animation (see Systems::SubmitVertexAnimations)
+	void Prepare(std::span<const VertexAnimationItem> items);
+	// draws the list given to the last Prepare at time in seconds, setup is called before the draws of every model
+	void Draw(const GLProgramPipelineRef& program, float time, const std::function<void(const Model&)>& setup = {});
+
+	[[nodiscard]] uint32_t GetInstanceCount() const;
+	[[nodiscard]] uint32_t GetDrawCallCount() const;
+
+private:
+	struct Run final
+	{
+		const VertexAnimation* animation = nullptr;
+		uint32_t first = 0;
+		uint32_t count = 0;
+	};
+
+	// two passes per frame with three frames in flight
+	static constexpr uint32_t RegionCount = 6;
+
+	std::unique_ptr<GPURingBuffer> m_instances;
+	uint32_t m_instanceCapacity = 0;
+	std::vector<Run> m_runs;
+	uint32_t m_instanceCount = 0;
+	uint32_t m_drawCallCount = 0;
+};
+
+#pragma endregion
+
 //==============================================================================
 // Window
 //==============================================================================
@@ -112,6 +112,17 @@ inline bool AABB::Inside(const glm::vec3& point)
 		&& max.z > point.z && min.z < point.x;
 }
 
+inline AABB AABB::GetTransformed(const glm::mat4& transform) const
+{
+	const glm::vec3 center = glm::vec3(transform * glm::vec4(GetCenter(), 1.0f));
+	const glm::vec3 halfSize = GetHalfSize();
+	const glm::vec3 extent =
+		glm::abs(glm::vec3(transform[0])) * halfSize.x +
+		glm::abs(glm::vec3(transform[1])) * halfSize.y +
+		glm::abs(glm::vec3(transform[2])) * halfSize.z;
+	return AABB(center - extent, center + extent);
+}
+
 #pragma endregion
 
 #pragma region Sphere
@@ -425,6 +436,57 @@ inline void GLTextureCube::createTexture(GLenum internalFormat, GLenum format, G
 //==============================================================================
 #pragma region Graphics
 
+inline const glm::mat4& TransformHierarchy::GetLocal(uint32_t index) const
+{
+	return m_local[index];
+}
+
+inline const glm::mat4& TransformHierarchy::GetWorld(uint32_t index) const
+{
+	return m_world[index];
+}
+
+inline uint32_t TransformHierarchy::GetParent(uint32_t index) const
+{
+	return m_parents[index];
+}
+
+inline size_t TransformHierarchy::GetSize() const
+{
+	return m_parents.size();
+}
+
+inline bool TransformHierarchy::IsDirty() const
+{
+	return m_firstDirty != InvalidIndex;
+}
+
+template<typename OnUpdated>
+inline bool TransformHierarchy::Update(OnUpdated&& onUpdated)
+{
+	if (m_firstDirty == InvalidIndex)
+		return false;
+
+	// parents always precede children, so a parent's dirty flag and world matrix are final when its child is visited
+	const uint32_t count = static_cast<uint32_t>(m_parents.size());
+	for (uint32_t i = m_firstDirty; i < count; i++)
+	{
+		const uint32_t parent = m_parents[i];
+		if (parent != InvalidIndex)
+			m_dirty[i] |= m_dirty[parent];
+		if (m_dirty[i])
+		{
+			if (parent != InvalidIndex) MatrixMultiply(m_world[parent], m_local[i], m_world[i]);
+			else m_world[i] = m_local[i];
+			onUpdated(i);
+		}
+	}
+
+	std::fill(m_dirty.begin() + m_firstDirty, m_dirty.end(), uint8_t(0));
+	m_firstDirty = InvalidIndex;
+	return true;
+}
+
 inline constexpr std::vector<AttribFormat> GetMeshVertexFormat()
 {
 	return
@@ -440,4 +502,157 @@ inline constexpr std::vector<AttribFormat> GetMeshVertexFormat()
 	};
 }
 
-#pragma endregion
\ No newline at end of file
+#pragma endregion
+
+//==============================================================================
+// ECS
+//==============================================================================
+#pragma region ECS
+
+template<typename T>
+inline ComponentTypeId GetComponentTypeId()
+{
+	static_assert(std::is_trivially_copyable_v<T>, "components are moved between chunks with memcpy");
+	static const ComponentTypeId id = RegisterComponentType(sizeof(T), alignof(T));
+	return id;
+}
+
+template<typename... T>
+inline ComponentMask MakeComponentMask()
+{
+	return (ComponentMask(0) | ... | (ComponentMask(1) << GetComponentTypeId<T>()));
+}
+
+inline ComponentMask Archetype::GetMask() const
+{
+	return m_mask;
+}
+
+inline uint32_t Archetype::GetChunkCapacity() const
+{
+	return m_capacity;
+}
+
+inline size_t Archetype::GetChunkCount() const
+{
+	return (m_entityCount + m_capacity - 1) / m_capacity;
+}
+
+inline uint32_t Archetype::GetChunkSize(size_t chunk) const
+{
+	const size_t begin = chunk * m_capacity;
+	return static_cast<uint32_t>(std::min<size_t>(m_entityCount - begin, m_capacity));
+}
+
+inline size_t Archetype::GetEntityCount() const
+{
+	return m_entityCount;
+}
+
+inline Entity* Archetype::GetEntities(size_t chunk)
+{
+	return reinterpret_cast<Entity*>(m_chunks[chunk]->bytes);
+}
+
+inline void* Archetype::GetComponents(size_t chunk, ComponentTypeId type)
+{
+	assert(m_mask & (ComponentMask(1) << type));
+	return m_chunks[chunk]->bytes + m_offsets[type];
+}
+
+template<typename T>
+inline T* Archetype::GetComponents(size_t chunk)
+{
+	return static_cast<T*>(GetComponents(chunk, GetComponentTypeId<T>()));
+}
+
+template<typename... T>
+inline Entity World::Create(const T&... components)
+{
+	Entity entity = Create();
+	moveEntity(entity, MakeComponentMask<T...>());
+	((*Get<T>(entity) = components), ...);
+	return entity;
+}
+
+template<typename T>
+inline void World::Add(Entity entity, const T& component)
+{
+	if (!IsAlive(entity)) return;
+	if (!Has<T>(entity))
+		moveEntity(entity, m_entities[entity.index].archetype->GetMask() | MakeComponentMask<T>());
+	*Get<T>(entity) = component;
+}
+
+template<typename T>
+inline void World::Remove(Entity entity)
+{
+	if (!Has<T>(entity)) return;
+	moveEntity(entity, m_entities[entity.index].archetype->GetMask() & ~MakeComponentMask<T>());
+}
+
+template<typename T>
+inline bool World::Has(Entity entity) const
+{
+	return IsAlive(entity) && (m_entities[entity.index].archetype->GetMask() & MakeComponentMask<T>()) != 0;
+}
+
+template<typename T>
+inline T* World::Get(Entity entity)
+{
+	return static_cast<T*>(getComponent(entity, GetComponentTypeId<T>()));
+}
+
+template<typename... T, typename Func>
+inline void World::EachChunk(Func&& func)
+{
+	for (Archetype* archetype : query(MakeComponentMask<T...>()))
+	{
+		const size_t chunkCount = archetype->GetChunkCount();
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+			func(static_cast<size_t>(archetype->GetChunkSize(chunk)), archetype->GetEntities(chunk), archetype->template GetComponents<T>(chunk)...);
+	}
+}
+
+template<typename... T, typename Func>
+inline void World::ParallelEachChunk(Func&& func)
+{
+	std::vector<std::pair<Archetype*, size_t>> chunks;
+	for (Archetype* archetype : query(MakeComponentMask<T...>()))
+	{
+		const size_t chunkCount = archetype->GetChunkCount();
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+			chunks.emplace_back(archetype, chunk);
+	}
+
+	JobSystem::ParallelFor(chunks.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				auto [archetype, chunk] = chunks[i];
+				func(static_cast<size_t>(archetype->GetChunkSize(chunk)), archetype->GetEntities(chunk), archetype->template GetComponents<T>(chunk)...);
+			}
+		});
+}
+
+template<typename... T, typename Func>
+inline void World::Each(Func&& func)
+{
+	EachChunk<T...>([&](size_t count, Entity* entities, T*... components)
+		{
+			for (size_t i = 0; i < count; i++)
+				func(entities[i], components[i]...);
+		});
+}
+
+template<typename... T, typename Func>
+inline void World::ParallelEach(Func&& func)
+{
+	ParallelEachChunk<T...>([&](size_t count, Entity* entities, T*... components)
+		{
+			for (size_t i = 0; i < count; i++)
+				func(entities[i], components[i]...);
+		});
+}
+
+#pragma endregion
@@ -363,9 +363,19 @@ void RaycastGame()
 	glDisable(GL_DEPTH_TEST);
 	GLVertexArrayRef VAOEmpty{ new GLVertexArray };
 
-	auto raycasterComputeProgram = std::make_shared<GLProgramPipeline>(LoadShaderTextFile("RaycastData/Shader/RaycasterShader.comp"));
-	auto spritecasterComputeProgram = std::make_shared<GLProgramPipeline>(LoadShaderTextFile("RaycastData/Shader/SpritecasterShader.comp"));
-	auto raycasterDrawProgram = std::make_shared<GLProgramPipeline>(LoadShaderTextFile("RaycastData/Shader/MainVertexShader.vert"), LoadShaderTextFile("RaycastData/Shader/DrawerShader.frag"));
+	// the work group and texture size of the raycaster are specialization constants of its SPIR-V module
+	constexpr GLuint raycasterGroupSize = 64;
+	constexpr std::array<SpecializationConstant, 3> raycasterConstants = { { { 0, raycasterGroupSize }, { 1, 64 }, { 2, 64 } } };
+	auto raycasterComputeProgram = std::make_shared<GLProgramPipeline>(LoadShaderProgram(GL_COMPUTE_SHADER, "RaycastData/Shader/RaycasterShader.comp", raycasterConstants));
+	auto spritecasterComputeProgram = std::make_shared<GLProgramPipeline>(LoadShaderProgram(GL_COMPUTE_SHADER, "RaycastData/Shader/SpritecasterShader.comp"));
+	// the size the program was built with, the GLSL text without a SPIR-V module gets the same constants as defines
+	GLint raycasterWorkGroup[3] = { 1, 1, 1 };
+	if (raycasterComputeProgram->GetComputeShader()->IsValid())
+		glGetProgramiv(*raycasterComputeProgram->GetComputeShader(), GL_COMPUTE_WORK_GROUP_SIZE, raycasterWorkGroup);
+	// the draw shaders are rebuilt when they change on disk, the old program draws until the new one is ready
+	auto raycasterDrawBuild = ShaderBuild::FromFiles("RaycastData/Shader/MainVertexShader.vert", "RaycastData/Shader/DrawerShader.frag");
+	GLProgramPipelineRef raycasterDrawProgram = raycasterDrawBuild->Wait();
+	ShaderBuildRef raycasterDrawReload;
 
 	auto currentMap = raycast::Map::Load();
 
@@ -425,6 +435,16 @@ void RaycastGame()
 	{
 		Window::Update();
 
+		if (!raycasterDrawReload && raycasterDrawBuild->IsOutdated())
+			raycasterDrawReload = ShaderBuild::FromFiles("RaycastData/Shader/MainVertexShader.vert", "RaycastData/Shader/DrawerShader.frag");
+		if (raycasterDrawReload && raycasterDrawReload->IsReady())
+		{
+			// a failed build keeps the last program, the error is in the log
+			if (raycasterDrawReload->GetProgram())
+				raycasterDrawProgram = raycasterDrawReload->GetProgram();
+			raycasterDrawBuild = std::move(raycasterDrawReload);
+		}
+
 		if (Window::IsResize())
 		{
 			glViewport(0, 0, Window::GetWidth(), Window::GetHeight());
@@ -436,8 +456,11 @@ void RaycastGame()
 		}
 
 #pragma region render
+		GPUProfiler::BeginFrame();
 		// старт рейкастинга на вычислительном шейдере
 		{
+			GPUProfiler::Scope gpuScope("Raycast");
+			NANO_PROFILE_ZONE("Raycast");
 			/*
 			* вычислительный шейдер работает по столбцам (ширина игрового экрана), каждый экземпляр вычисляет значения одного столбца
 			* на входе он получает текстуру карты в виде uimage2D (для того чтобы можно было обращаться к xy а не uv)
@@ -456,11 +479,13 @@ void RaycastGame()
 			raycasterComputeProgram->SetComputeUniform(4, frameSize.x);
 			raycasterComputeProgram->SetComputeUniform(5, frameSize.y);
 			raycasterComputeProgram->SetComputeUniform(6, currentMap->size);
-			glDispatchCompute(frameSize.x, 1, 1);
+			glDispatchCompute((frameSize.x + raycasterWorkGroup[0] - 1) / raycasterWorkGroup[0], 1, 1);
 		}
 
 		// старт рендера спрайтов на вычислительном шейдере
 		{
+			GPUProfiler::Scope gpuScope("Spritecast");
+			NANO_PROFILE_ZONE("Spritecast");
 			spritecastInputBuffer->BindBase(1);
 			spritecastResultBuffer->BindBase(2);
 
@@ -481,19 +506,24 @@ void RaycastGame()
 
 		// отрисовка результата на экран через пиксельный шейдер
 		{
-			raycasterDrawProgram->Bind();
-			textures->BindImage(1, 0, false, 0);
-			raycastResultBuffer->BindBase(2);
-			spritecastResultBuffer->BindBase(3);
-
-			raycasterDrawProgram->SetFragmentUniform(1, frameSize); // TODO: only resize window events
-			raycasterDrawProgram->SetFragmentUniform(2, pos);
-			raycasterDrawProgram->SetFragmentUniform(3, sortedSprites.size());
-			raycasterDrawProgram->SetFragmentUniform(4, glm::vec4(0.f, 0.f, 0.f, 3.0f));
-			raycasterDrawProgram->SetFragmentUniform(5, glm::vec4(0.f, 0.f, 0.f, 3.0f));
-
-			VAOEmpty->Bind();
-			glDrawArrays(GL_TRIANGLES, 0, 6);
+			GPUProfiler::Scope gpuScope("Draw");
+			NANO_PROFILE_ZONE("Draw");
+			if (raycasterDrawProgram)
+			{
+				raycasterDrawProgram->Bind();
+				textures->BindImage(1, 0, false, 0);
+				raycastResultBuffer->BindBase(2);
+				spritecastResultBuffer->BindBase(3);
+
+				raycasterDrawProgram->SetFragmentUniform(1, frameSize); // TODO: only resize window events
+				raycasterDrawProgram->SetFragmentUniform(2, pos);
+				raycasterDrawProgram->SetFragmentUniform(3, sortedSprites.size());
+				raycasterDrawProgram->SetFragmentUniform(4, glm::vec4(0.f, 0.f, 0.f, 3.0f));
+				raycasterDrawProgram->SetFragmentUniform(5, glm::vec4(0.f, 0.f, 0.f, 3.0f));
+
+				VAOEmpty->Bind();
+				glDrawArrays(GL_TRIANGLES, 0, 6);
+			}
 		}
 
 #pragma region imgui
@@ -503,10 +533,17 @@ void RaycastGame()
 			ImGui::Text((const char*)u8"Test/Тест/%s", u8"тест 2");
 			ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0 / double(ImGui::GetIO().Framerate), double(ImGui::GetIO().Framerate));
 			ImGui::End();
+			GPUProfiler::DrawImGui();
+			CPUProfiler::DrawImGui();
+			GLStats::DrawImGui();
+			FlightRecorder::DrawImGui();
+			GPUProfiler::Scope gpuScope("ImGui");
+			NANO_PROFILE_ZONE("ImGui");
 			IMGUI::Draw();
 		}
 #pragma endregion
 
+		GPUProfiler::EndFrame();
 		Window::Swap();
 #pragma endregion
 
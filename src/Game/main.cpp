@@ -6,6 +6,7 @@
 #include "Current.h"
 #include "RaycastGame.h"
 #include "InfinityTerrain.h"
+#include "AnimationBenchmark.h"
 
 using namespace physx;
 
@@ -130,6 +131,7 @@ int main(
 	//Example00X();
 	//RaycastGame();
 	//InfinityTerrain();
+	//AnimationBenchmark();
 
 	return 0;
 
@@ -160,10 +162,6 @@ int main(
 	float deltaTimeArr[DELTA_TIME_ARR_SIZE] = { };
 #pragma endregion
 
-	PL::ImguiProfiler renderDurationProfiler("Render duration (ms) (avg over one sec)", 0, 30);
-	PL::ImguiProfiler renderDurationProfilerFine("Render duration (ms) ", 0, 30);
-	PL::ImguiProfiler imguiRenderDuration("Imgui render duration (ms) ", 0, 30);
-	PL::ImguiProfiler swapBuffersDuration("Swap buffers duration (ms) ", 0, 30);
 
 	const std::vector<MeshVertex> verticesQuad =
 	{
@@ -345,10 +343,6 @@ void main()
 				//	}
 				//	profileAverageArr[ProfilerAverage_ARR_SIZE - 1] = renderProfiler.getAverageAndResetData().timeSeconds * 1000;
 				//}
-
-				renderDurationProfiler.updateValue(1000);
-				imguiRenderDuration.updateValue(1000);
-				swapBuffersDuration.updateValue(1000);
 			}
 
 			if (recordPosDeltaTime < DELTA_TIME_ARR_SIZE)
@@ -379,8 +373,6 @@ void main()
 			//	profileeArr[Profiler_ARR_SIZE - 1] = lastProfilerRezult.timeSeconds;
 			//}
 
-			renderDurationProfilerFine.updateValue(1000);
-
 		}
 #pragma endregion
 
@@ -404,8 +396,7 @@ void main()
 #pragma endregion
 
 #pragma region render
-		renderDurationProfiler.start();
-		renderDurationProfilerFine.start();
+		NANO_PROFILE_ZONE("Render");
 
 		glViewport(0, 0, Window::GetWidth(), Window::GetHeight());
 		glClearColor(0.0f, 0.2f, 0.4f, 1.0f);
@@ -422,9 +413,6 @@ void main()
 		IMGUI::Draw();
 
 		Window::Swap();
-
-		renderDurationProfiler.end();
-		renderDurationProfilerFine.end();
 #pragma endregion
 	}
 